@@ -2,6 +2,7 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <ngx_md5.h>
 #include "ngx_http_upstream_check_handler.h"
 
 
@@ -36,14 +37,175 @@ static ngx_int_t ngx_http_check_ajp_init(ngx_http_check_peer_t *peer);
 static ngx_int_t ngx_http_check_ajp_parse(ngx_http_check_peer_t *peer);
 static void ngx_http_check_ajp_reinit(ngx_http_check_peer_t *peer);
 
+static void ngx_http_check_shm_lock(ngx_atomic_t *lock);
+static ngx_msec_t ngx_http_check_event_lag(ngx_event_t *event);
+
 static void ngx_http_check_status_update(ngx_http_check_peer_t *peer,
-        ngx_int_t result);
+        ngx_uint_t rc);
+static ngx_msec_t ngx_http_check_timing_update(ngx_http_check_peer_t *peer);
+static void ngx_http_check_journal_add(ngx_http_check_peer_t *peer,
+        ngx_uint_t from, ngx_uint_t to, ngx_uint_t reason, ngx_msec_t latency);
+static void ngx_http_check_phase_add(ngx_http_check_phase_t *phase,
+        ngx_msec_t t);
 
 static void ngx_http_check_clean_event(ngx_http_check_peer_t *peer);
 
+static ngx_int_t ngx_http_check_connect(ngx_http_check_peer_t *peer);
+static ssize_t ngx_http_check_peek(ngx_connection_t *c);
+static ssize_t ngx_http_check_send(ngx_connection_t *c, u_char *buf,
+        size_t size);
+static ssize_t ngx_http_check_recv(ngx_connection_t *c, u_char *buf,
+        size_t size);
+static void ngx_http_check_close(ngx_http_check_peer_t *peer);
+
+static uint64_t ngx_http_check_now(void);
+
+static u_char *ngx_http_check_timing_status(u_char *p, u_char *last,
+        ngx_http_check_timing_t *timing, ngx_uint_t with_max);
+static ngx_int_t ngx_http_check_journal_handler(ngx_http_request_t *r,
+        ngx_str_t *since);
+static ngx_int_t ngx_http_check_control_dynamic(ngx_http_request_t *r,
+        ngx_http_check_peers_t *peers);
+static ngx_int_t ngx_http_check_control_index(ngx_http_check_peers_t *peers,
+        ngx_str_t *value);
+static ngx_int_t ngx_http_check_parse_addr(ngx_pool_t *pool, ngx_str_t *text,
+        ngx_addr_t *addr);
+static ngx_int_t ngx_http_check_arg_unescape(ngx_pool_t *pool,
+        ngx_str_t *value, ngx_str_t *dst);
+static ngx_int_t ngx_http_check_control_reply(ngx_http_request_t *r,
+        ngx_buf_t *b);
+
+static ngx_uint_t ngx_http_check_feed_own(ngx_http_check_feed_shm_t *feed,
+    ngx_msec_t interval);
+static ngx_int_t ngx_http_check_feed_next(ngx_http_check_feed_shm_t *feed,
+    ngx_http_check_journal_entry_t *entry);
+
+static ngx_int_t ngx_http_check_notify_init(ngx_cycle_t *cycle);
+static void ngx_http_check_notify_handler(ngx_event_t *event);
+static ngx_int_t ngx_http_check_notify_post(ngx_http_check_notify_t *notify,
+    ngx_http_check_notify_conf_t *nc, u_char *body, size_t len);
+static ngx_int_t ngx_http_check_notify_exec(ngx_http_check_notify_t *notify,
+    ngx_http_check_notify_conf_t *nc, u_char *body, size_t len);
+static void ngx_http_check_notify_spawn(ngx_http_check_notify_conf_t *nc,
+    char **env, int fd);
+static void ngx_http_check_notify_exit_handler(ngx_event_t *event);
+static void ngx_http_check_notify_send_handler(ngx_event_t *event);
+static void ngx_http_check_notify_recv_handler(ngx_event_t *event);
+static void ngx_http_check_notify_timeout_handler(ngx_event_t *event);
+static void ngx_http_check_notify_done(ngx_http_check_notify_t *notify,
+    ngx_uint_t ok);
+
+static ngx_int_t ngx_http_check_statsd_init(ngx_cycle_t *cycle);
+static void ngx_http_check_statsd_handler(ngx_event_t *event);
+static void ngx_http_check_statsd_add(ngx_http_check_statsd_t *statsd,
+    ngx_str_t *upstream, char *metric, ngx_uint_t value, char *type);
+static void ngx_http_check_statsd_flush(ngx_http_check_statsd_t *statsd);
+
+static ngx_socket_t ngx_http_check_udp_socket(ngx_log_t *log, ngx_url_t *u);
+
+static ngx_int_t ngx_http_check_syslog_init(ngx_cycle_t *cycle);
+static void ngx_http_check_syslog_handler(ngx_event_t *event);
+static void ngx_http_check_syslog_send(ngx_http_check_syslog_t *syslog,
+    ngx_uint_t upstream, ngx_uint_t state,
+    ngx_http_check_syslog_group_t *group);
+
+static void ngx_http_check_shared_init(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_check_shared_join(ngx_http_check_shared_t *shared);
+static ngx_http_check_shared_slot_t *ngx_http_check_shared_slot(
+    ngx_http_check_shared_t *shared, ngx_http_check_peer_t *peer);
+static void ngx_http_check_shared_sweep(ngx_http_check_shared_t *shared,
+    uint32_t user, u_char *mine);
+static ngx_uint_t ngx_http_check_shared_probe(ngx_http_check_peer_t *peer);
+static void ngx_http_check_shared_follow(ngx_http_check_peer_t *peer);
+static void ngx_http_check_shared_publish(ngx_http_check_peer_t *peer);
+
+static uint32_t ngx_http_check_peer_key(ngx_http_check_peer_t *peer);
+
+static ngx_int_t ngx_http_check_gossip_init(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_check_gossip_bind(ngx_http_check_gossip_t *gossip,
+    ngx_log_t *log);
+static void ngx_http_check_gossip_handler(ngx_event_t *event);
+static void ngx_http_check_gossip_send(ngx_http_check_gossip_t *gossip,
+    ngx_uint_t n);
+static void ngx_http_check_gossip_recv_handler(ngx_event_t *event);
+static void ngx_http_check_gossip_digest(ngx_http_check_gossip_t *gossip,
+    struct sockaddr *sa, u_char *buf, size_t len);
+static void ngx_http_check_gossip_mac(u_char *buf, size_t len, u_char *mac);
+static ngx_uint_t ngx_http_check_gossip_mine(ngx_http_check_peer_t *peer);
+static ngx_uint_t ngx_http_check_gossip_probe(ngx_http_check_peer_t *peer);
+static int ngx_libc_cdecl ngx_http_check_gossip_cmp_keys(const void *one,
+    const void *two);
+
+static ngx_uint_t ngx_http_check_host_probe(ngx_http_check_peer_t *peer);
+static void ngx_http_check_host_update(ngx_http_check_peer_t *peer,
+    ngx_uint_t rc);
+
+static ngx_int_t ngx_http_check_agent_init(ngx_cycle_t *cycle,
+    ngx_http_check_peer_t *peer);
+static void ngx_http_check_agent_begin_handler(ngx_event_t *event);
+static void ngx_http_check_agent_connect(ngx_http_check_peer_t *peer);
+static void ngx_http_check_agent_send_handler(ngx_event_t *event);
+static void ngx_http_check_agent_recv_handler(ngx_event_t *event);
+static void ngx_http_check_agent_timeout_handler(ngx_event_t *event);
+static void ngx_http_check_agent_parse(ngx_http_check_peer_t *peer);
+static void ngx_http_check_agent_done(ngx_http_check_peer_t *peer,
+    ngx_uint_t ok);
+
+static void ngx_http_check_begin_entry(ngx_event_t *event);
+static void ngx_http_check_timeout_entry(ngx_event_t *event);
+static void ngx_http_check_io_entry(ngx_event_t *event);
+static void ngx_http_check_run(ngx_http_check_peer_t *peer,
+    ngx_event_handler_pt handler, ngx_event_t *event);
+static uint64_t ngx_http_check_cpu_time(void);
+
+static ngx_msec_t ngx_http_check_peer_interval(ngx_http_check_peer_t *peer);
+static void ngx_http_check_schedule_handler(ngx_event_t *event);
+
+static void ngx_http_check_mark_up(ngx_http_check_peer_t *peer,
+    ngx_uint_t rc, ngx_msec_t latency);
+static ngx_int_t ngx_http_check_warmup_init(ngx_cycle_t *cycle,
+    ngx_http_check_peer_t *peer);
+static ngx_int_t ngx_http_check_warmup_begin(ngx_http_check_peer_t *peer);
+static ngx_uint_t ngx_http_check_warmup_owned(ngx_http_check_peer_t *peer);
+static void ngx_http_check_warmup_step_handler(ngx_event_t *event);
+static void ngx_http_check_warmup_send_handler(ngx_event_t *event);
+static void ngx_http_check_warmup_recv_handler(ngx_event_t *event);
+static void ngx_http_check_warmup_timeout_handler(ngx_event_t *event);
+static void ngx_http_check_warmup_done(ngx_http_check_peer_t *peer,
+    ngx_uint_t ok);
+
+static void ngx_http_check_verdict(ngx_http_check_peers_shm_t *peers_shm,
+    ngx_uint_t i);
+static void ngx_http_check_verdict_update(ngx_http_check_peer_t *peer);
+static void ngx_http_check_failover_count(
+    ngx_http_check_peers_shm_t *peers_shm, ngx_http_check_peer_shm_t *peer_shm,
+    ngx_uint_t old, ngx_uint_t verdict);
+static void ngx_http_check_failover_state(ngx_http_check_upstream_shm_t *u);
+static void ngx_http_check_failover_init(ngx_http_check_peers_t *peers,
+    ngx_http_check_peers_shm_t *peers_shm, ngx_uint_t fresh);
+static void ngx_http_check_zone_init(ngx_http_check_peers_t *peers,
+    ngx_http_check_peers_shm_t *peers_shm);
+static ngx_uint_t ngx_http_check_verdict_stale(ngx_uint_t verdict,
+    ngx_uint_t index);
+static ngx_http_check_peer_t *ngx_http_check_index_peer(ngx_uint_t index,
+    ngx_uint_t *stale);
+static void ngx_http_check_dynamic_fill(ngx_http_check_peer_t *peer,
+    ngx_addr_t *addr);
+static ngx_int_t ngx_http_check_dynamic_sync(ngx_http_check_peer_t *peer);
+static ngx_uint_t ngx_http_check_next_gen(ngx_uint_t gen);
+
 static void ngx_http_check_timeout_handler(ngx_event_t *event);
 static void ngx_http_check_finish_handler(ngx_event_t *event);
 
+static ngx_int_t ngx_http_check_resolve_init(ngx_cycle_t *cycle);
+static void ngx_http_check_resolve_handler(ngx_event_t *event);
+static void ngx_http_check_resolve_done(ngx_resolver_ctx_t *ctx);
+static void ngx_http_check_resolve_apply(ngx_http_check_resolve_conf_t *rc,
+    in_addr_t *addrs, ngx_uint_t naddrs);
+static ngx_uint_t ngx_http_check_resolve_taken(
+    ngx_http_check_resolve_conf_t *rc, in_addr_t addr);
+static void ngx_http_check_resolve_sync(ngx_http_check_peer_t *peer);
+
 static ngx_int_t ngx_http_check_need_exit();
 static void ngx_http_check_clear_all_events();
 
@@ -56,6 +218,9 @@ static ngx_shm_zone_t * ngx_shared_memory_find(ngx_cycle_t *cycle,
         ngx_str_t *name, void *tag);
 static ngx_http_check_peer_shm_t * ngx_http_check_find_shm_peer(
         ngx_http_check_peers_shm_t *peers_shm, ngx_addr_t *addr);
+static ngx_int_t ngx_http_check_init_slot(ngx_slab_pool_t *shpool,
+        ngx_http_check_peer_shm_t *peer_shm, ngx_http_check_peer_t *peer,
+        ngx_http_check_peers_shm_t *opeers_shm, ngx_uint_t *from);
 static void ngx_http_check_set_shm_peer(ngx_http_check_peer_shm_t *peer_shm,
         ngx_http_check_peer_shm_t *opeer_shm, ngx_uint_t init_down);
 static ngx_int_t ngx_http_upstream_check_init_shm_zone(
@@ -169,1506 +334,7763 @@ check_conf_t  ngx_check_types[] = {
     { 0, "", ngx_null_string, 0, NULL, NULL, NULL, NULL, NULL, 0 }
 };
 
+/* a negative size if the counters by check type are too few */
+typedef char ngx_http_check_types_fit[
+    sizeof(ngx_check_types) / sizeof(check_conf_t) <= NGX_HTTP_CHECK_TYPE_N
+    ? 1 : -1];
+
+
+/* indexed by NGX_HTTP_CHECK_OK and NGX_HTTP_CHECK_ERR_* */
+static char *ngx_http_check_err_names[] = {
+    "ok",
+    "connect",
+    "timeout",
+    "protocol",
+    "parse"
+};
+
+
+static char *ngx_http_check_peer_state_names[] = {
+    "up",
+    "down"
+};
+
 
 static ngx_uint_t ngx_http_check_shm_generation = 0;
 static ngx_http_check_peers_t *check_peers_ctx = NULL;
+static ngx_http_check_notify_t  ngx_http_check_notify;
+static ngx_http_check_statsd_t  ngx_http_check_statsd;
+static ngx_http_check_syslog_t  ngx_http_check_syslog;
+static ngx_http_check_gossip_t  ngx_http_check_gossip;
+static ngx_http_check_resolve_t  ngx_http_check_resolve;
+static ngx_event_t               ngx_http_check_schedule_ev;
+
+/* the socket calls of the probes in this worker, see ngx_http_check_run() */
+static ngx_uint_t  ngx_http_check_syscalls;
+
+/* the verdicts of the shared memory, for the balancers */
+static ngx_atomic_t  *ngx_http_check_verdicts;
+static ngx_uint_t     ngx_http_check_nverdicts;
 
+/* the master pid of this instance, tells the instances apart */
+static ngx_pid_t  ngx_http_check_instance;
 
+
+/*
+ * The balancers ask for every peer they try, the answer takes one load
+ * from the verdicts, where the neighbouring peers are as well.
+ */
 ngx_uint_t
 ngx_http_check_peer_down(ngx_uint_t index)
 {
-    ngx_http_check_peer_t     *peer;
+    ngx_uint_t                 slot, verdict;
+
+    slot = index & NGX_HTTP_CHECK_SLOT_MASK;
 
-    if (check_peers_ctx == NULL || index >= check_peers_ctx->peers.nelts) {
+    if (slot >= ngx_http_check_nverdicts) {
         return 0;
     }
 
-    peer = check_peers_ctx->peers.elts;
+    verdict = ngx_http_check_verdicts[slot];
+
+    if (ngx_http_check_verdict_stale(verdict, index)) {
+        return 1;
+    }
 
-    return (peer[index].shm->down);
+    return (verdict & NGX_HTTP_CHECK_VERDICT_DOWN) ? 1 : 0;
 }
 
 
-void
-ngx_http_check_get_peer(ngx_uint_t index)
+/*
+ * A draining peer is not down: the balancers keep its sessions, only the
+ * new ones go elsewhere.
+ */
+ngx_uint_t
+ngx_http_check_peer_drain(ngx_uint_t index)
 {
-    ngx_http_check_peer_t     *peer;
+    ngx_uint_t                 slot, verdict;
 
-    if (check_peers_ctx == NULL || index >= check_peers_ctx->peers.nelts) {
-        return;
-    }
+    slot = index & NGX_HTTP_CHECK_SLOT_MASK;
 
-    peer = check_peers_ctx->peers.elts;
+    if (slot >= ngx_http_check_nverdicts) {
+        return 0;
+    }
 
-    ngx_spinlock(&peer[index].shm->lock, ngx_pid, 1024);
+    verdict = ngx_http_check_verdicts[slot];
 
-    peer[index].shm->busyness++;
-    peer[index].shm->access_count++;
+    if (ngx_http_check_verdict_stale(verdict, index)) {
+        return 0;
+    }
 
-    ngx_spinlock_unlock(&peer[index].shm->lock);
+    return (verdict & NGX_HTTP_CHECK_VERDICT_DRAIN) ? 1 : 0;
 }
 
 
-void
-ngx_http_check_free_peer(ngx_uint_t index)
+/*
+ * The weight of a peer scaled by the percentage its agent reports, 0 if
+ * the peer is down or drains, otherwise at least 1.  The round robin asks
+ * once for every peer it weighs, so this takes the one load of
+ * ngx_http_check_peer_down() as well.
+ */
+ngx_int_t
+ngx_http_check_peer_weight(ngx_uint_t index, ngx_int_t weight)
 {
-    ngx_http_check_peer_t     *peer;
-
-    if (check_peers_ctx == NULL || index >= check_peers_ctx->peers.nelts) {
-        return;
-    }
+    ngx_int_t                  w;
+    ngx_uint_t                 slot, verdict, percent;
 
-    peer = check_peers_ctx->peers.elts;
-
-    ngx_spinlock(&peer[index].shm->lock, ngx_pid, 1024);
+    slot = index & NGX_HTTP_CHECK_SLOT_MASK;
 
-    if (peer[index].shm->busyness > 0) {
-        peer[index].shm->busyness--;
+    if (slot >= ngx_http_check_nverdicts) {
+        return weight;
     }
 
-    ngx_spinlock_unlock(&peer[index].shm->lock);
-}
+    verdict = ngx_http_check_verdicts[slot];
 
+    if (ngx_http_check_verdict_stale(verdict, index)
+        || (verdict & (NGX_HTTP_CHECK_VERDICT_DOWN
+                       |NGX_HTTP_CHECK_VERDICT_DRAIN)))
+    {
+        return 0;
+    }
 
-ngx_int_t
-ngx_http_check_add_timers(ngx_cycle_t *cycle)
-{
-    ngx_uint_t                          i;
-    ngx_msec_t                          t, delay;
-    check_conf_t                       *cf;
-    ngx_http_check_peer_t              *peer;
-    ngx_http_check_peers_t             *peers;
-    ngx_http_check_peer_shm_t          *peer_shm;
-    ngx_http_check_peers_shm_t         *peers_shm;
-    ngx_http_upstream_check_srv_conf_t *ucscf;
+    percent = (verdict >> NGX_HTTP_CHECK_VERDICT_WEIGHT_SHIFT)
+              & NGX_HTTP_CHECK_VERDICT_WEIGHT_MASK;
 
-    peers = check_peers_ctx;
-    if (peers == NULL) {
-        return NGX_OK;
+    if (percent == 100) {
+        return weight;
     }
 
-    peers_shm = peers->peers_shm;
-    if (peers_shm == NULL) {
-        return NGX_OK;
+    if (percent == 0) {
+        return 0;
     }
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
-                   "http check upstream init_process, shm_name: %V, "
-                   "peer number: %ud",
-                   &peers->check_shm_name,
-                   peers->peers.nelts);
+    w = weight * (ngx_int_t) percent / 100;
 
-    srandom(ngx_pid);
+    return w > 0 ? w : 1;
+}
 
-    peer = peers->peers.elts;
-    peer_shm = peers_shm->peers;
 
-    for (i = 0; i < peers->peers.nelts; i++) {
-        peer[i].shm = &peer_shm[i];
+/*
+ * Whether the upstream of the peer sends its requests to the backup
+ * servers, the balancers then skip the primary ones without trying them.
+ * The fail back happens here, once the primary servers have been up for
+ * the delay of check_failback.
+ */
+ngx_uint_t
+ngx_http_check_use_backup(ngx_uint_t index)
+{
+    uint64_t                         now;
+    ngx_uint_t                       slot;
+    ngx_http_check_peer_t           *peer;
+    ngx_http_check_upstream_shm_t   *u;
 
-        peer[i].check_ev.handler = ngx_http_check_begin_handler;
-        peer[i].check_ev.log = cycle->log;
-        peer[i].check_ev.data = &peer[i];
-        peer[i].check_ev.timer_set = 0;
+    slot = index & NGX_HTTP_CHECK_SLOT_MASK;
 
-        peer[i].check_timeout_ev.handler = ngx_http_check_timeout_handler;
-        peer[i].check_timeout_ev.log = cycle->log;
-        peer[i].check_timeout_ev.data = &peer[i];
-        peer[i].check_timeout_ev.timer_set = 0;
+    if (slot >= ngx_http_check_nverdicts) {
+        return 0;
+    }
 
-        ucscf = peer[i].conf;
-        cf = ucscf->check_type_conf;
+    peer = check_peers_ctx->peers.elts;
+    u = &check_peers_ctx->peers_shm->upstreams[peer[slot].upstream_index];
 
-        if (cf->need_pool) {
-            peer[i].pool = ngx_create_pool(ngx_pagesize, cycle->log);
-            if (peer[i].pool == NULL) {
-                return NGX_ERROR;
-            }
-        }
+    if (!u->failover) {
+        return 0;
+    }
 
-        peer[i].send_handler = cf->send_handler;
-        peer[i].recv_handler = cf->recv_handler;
+    now = ngx_http_check_now();
 
-        peer[i].init = cf->init;
-        peer[i].parse = cf->parse;
-        peer[i].reinit = cf->reinit;
+    if (u->recovered == 0 || now < u->recovered + u->delay) {
+        return 1;
+    }
 
-        /*
-         * I added a random start time. I don't want to trigger the check
-         * event too close at the beginning.
-         * */
-        delay = ucscf->check_interval > 1000 ? ucscf->check_interval : 1000;
-        t = ngx_random() % delay;
+    ngx_http_check_shm_lock(&u->lock);
 
-        ngx_add_timer(&peer[i].check_ev, t);
+    if (u->failover && u->recovered && now >= u->recovered + u->delay) {
+        u->failover = 0;
+        u->recovered = 0;
+        u->last_change = now;
+
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "upstream \"%V\" fails back to its primary servers",
+                      peer[slot].upstream_name);
     }
 
-    return NGX_OK;
+    ngx_spinlock_unlock(&u->lock);
+
+    return u->failover;
 }
 
 
-static void
-ngx_http_check_begin_handler(ngx_event_t *event)
+/*
+ * Whether a request to the upstream of the peer keeps to the servers of
+ * the local zone. It always does while the share of them which is up is
+ * the healthy one of check_local_zone, and less often the fewer are up.
+ */
+ngx_uint_t
+ngx_http_check_zone_local(ngx_uint_t index)
 {
-    ngx_msec_t                          interval;
-    ngx_http_check_peer_t              *peer;
-    ngx_http_check_peers_t             *peers;
-    ngx_http_check_peers_shm_t         *peers_shm;
-    ngx_http_upstream_check_srv_conf_t *ucscf;
+    ngx_uint_t                       slot, share;
+    ngx_http_check_peer_t           *peer;
+    ngx_http_check_peers_t          *peers;
+    ngx_http_check_zone_shm_t       *z;
 
-    if (ngx_http_check_need_exit()) {
-        return;
+    slot = index & NGX_HTTP_CHECK_SLOT_MASK;
+    peers = check_peers_ctx;
+
+    if (slot >= ngx_http_check_nverdicts
+        || peers->local_zone == NGX_HTTP_CHECK_NO_ZONE)
+    {
+        return 0;
     }
 
-    peers = check_peers_ctx;
-    if (peers == NULL) {
-        return;
+    peer = peers->peers.elts;
+    z = &peers->peers_shm->zones[peer[slot].upstream_index * peers->nzones
+                                 + peers->local_zone];
+
+    if (z->up == 0 || z->total == 0) {
+        return 0;
     }
 
-    peers_shm = peers->peers_shm;
-    if (peers_shm == NULL) {
-        return;
+    /* in per mille of the healthy share */
+    share = z->up * 100000 / (z->total * peers->local_healthy);
+
+    if (share >= 1000) {
+        return 1;
     }
 
-    peer = event->data;
-    ucscf = peer->conf;
+    return (ngx_uint_t) ngx_random() % 1000 < share;
+}
 
-    ngx_add_timer(event, ucscf->check_interval/2);
 
-    /* This process is processing this peer now. */
-    if ((peer->shm->owner == ngx_pid) ||
-        (peer->pc.connection != NULL) ||
-        (peer->check_timeout_ev.timer_set)) {
+/* one load like ngx_http_check_peer_down() */
+ngx_uint_t
+ngx_http_check_peer_remote(ngx_uint_t index)
+{
+    ngx_uint_t                 slot;
 
-        return;
+    slot = index & NGX_HTTP_CHECK_SLOT_MASK;
+
+    if (slot >= ngx_http_check_nverdicts) {
+        return 0;
     }
 
-    interval = ngx_current_msec - peer->shm->access_time;
-    ngx_log_debug5(NGX_LOG_DEBUG_HTTP, event->log, 0,
-                   "http check begin handler index: %ud, owner: %P, "
-                   "ngx_pid: %P, interval: %M, check_interval: %M",
-                   peer->index, peer->shm->owner,
-                   ngx_pid, interval,
-                   ucscf->check_interval);
+    return (ngx_http_check_verdicts[slot] & NGX_HTTP_CHECK_VERDICT_REMOTE)
+           ? 1 : 0;
+}
 
-    ngx_spinlock(&peer->shm->lock, ngx_pid, 1024);
 
-    if (peers_shm->generation != ngx_http_check_shm_generation) {
-        ngx_spinlock_unlock(&peer->shm->lock);
+void
+ngx_http_check_get_peer(ngx_uint_t index)
+{
+    ngx_uint_t                 stale;
+    ngx_http_check_peer_t     *peer;
+
+    peer = ngx_http_check_index_peer(index, &stale);
+    if (peer == NULL) {
         return;
     }
 
-    if ((interval >= ucscf->check_interval)
-            && peer->shm->owner == NGX_INVALID_PID)
-    {
-        peer->shm->owner = ngx_pid;
-    }
-    else if (interval >= (ucscf->check_interval << 4)) {
-        /* If the check peer has been untouched for 4 times of
-         * the check interval, activates current timer.
-         * The checking process may be disappeared
-         * in some circumstance, and the clean event will never
-         * be triggered. */
-        peer->shm->owner = ngx_pid;
-        peer->shm->access_time = ngx_current_msec;
-    }
+    ngx_http_check_shm_lock(&peer->shm->lock);
 
-    ngx_spinlock_unlock(&peer->shm->lock);
+    peer->shm->busyness++;
+    peer->shm->access_count++;
 
-    if (peer->shm->owner == ngx_pid) {
-        ngx_http_check_connect_handler(event);
-    }
+    ngx_spinlock_unlock(&peer->shm->lock);
 }
 
 
-static void
-ngx_http_check_connect_handler(ngx_event_t *event)
+void
+ngx_http_check_free_peer(ngx_uint_t index)
 {
-    ngx_int_t                            rc;
-    ngx_connection_t                    *c;
-    ngx_http_check_peer_t               *peer;
-    ngx_http_upstream_check_srv_conf_t  *ucscf;
+    ngx_uint_t                 stale;
+    ngx_http_check_peer_t     *peer;
 
-    if (ngx_http_check_need_exit()) {
+    peer = ngx_http_check_index_peer(index, &stale);
+    if (peer == NULL) {
         return;
     }
 
-    peer = event->data;
-    ucscf = peer->conf;
+    ngx_http_check_shm_lock(&peer->shm->lock);
 
-    ngx_memzero(&peer->pc, sizeof(ngx_peer_connection_t));
+    if (peer->shm->busyness > 0) {
+        peer->shm->busyness--;
+    }
 
-    peer->pc.sockaddr = peer->peer_addr->sockaddr;
-    peer->pc.socklen = peer->peer_addr->socklen;
-    peer->pc.name = &peer->peer_addr->name;
+    ngx_spinlock_unlock(&peer->shm->lock);
+}
 
-    peer->pc.get = ngx_event_get_peer;
-    peer->pc.log = event->log;
-    peer->pc.log_error = NGX_ERROR_ERR;
 
-    peer->pc.cached = 0;
-    peer->pc.connection = NULL;
+/*
+ * Packs the state of the peer into its verdict. The caller holds the
+ * lock of the peer, or runs alone, so the last writer has seen all the
+ * fields written before.
+ */
+static void
+ngx_http_check_verdict(ngx_http_check_peers_shm_t *peers_shm, ngx_uint_t i)
+{
+    ngx_uint_t                    verdict, old;
+    ngx_http_check_peer_shm_t    *peer_shm;
 
-    rc = ngx_event_connect_peer(&peer->pc);
+    peer_shm = &peers_shm->peers[i];
 
-    if (rc == NGX_ERROR || rc == NGX_DECLINED) {
-        ngx_http_check_status_update(peer, 0);
-        return;
+    verdict = peer_shm->slot_gen << NGX_HTTP_CHECK_VERDICT_GEN_SHIFT;
+
+    if (peer_shm->slot == NGX_HTTP_CHECK_SLOT_FREE) {
+        verdict |= NGX_HTTP_CHECK_VERDICT_FREE;
     }
 
-    /* NGX_OK or NGX_AGAIN */
-    c = peer->pc.connection;
-    c->data = peer;
-    c->log = peer->pc.log;
-    c->sendfile = 0;
-    c->read->log = c->log;
-    c->write->log = c->log;
-    c->pool = peer->pool;
+    if (peer_shm->down || peer_shm->agent_down) {
+        verdict |= NGX_HTTP_CHECK_VERDICT_DOWN;
+    }
 
-    peer->state = NGX_HTTP_CHECK_CONNECT_DONE;
+    if (peer_shm->drain || peer_shm->agent_drain) {
+        verdict |= NGX_HTTP_CHECK_VERDICT_DRAIN;
+    }
 
-    c->write->handler = peer->send_handler;
-    c->read->handler = peer->recv_handler;
+    verdict |= (peer_shm->agent_weight & NGX_HTTP_CHECK_VERDICT_WEIGHT_MASK)
+               << NGX_HTTP_CHECK_VERDICT_WEIGHT_SHIFT;
 
-    ngx_add_timer(&peer->check_timeout_ev, ucscf->check_timeout);
+    if (peer_shm->zone != NGX_HTTP_CHECK_NO_ZONE
+        && peers_shm->local_zone != NGX_HTTP_CHECK_NO_ZONE
+        && peer_shm->zone != peers_shm->local_zone)
+    {
+        verdict |= NGX_HTTP_CHECK_VERDICT_REMOTE;
+    }
 
-    if (rc == NGX_OK) {
-        c->write->handler(c->write);
+    old = peers_shm->verdicts[i];
+    peers_shm->verdicts[i] = verdict;
+
+    if (!peer_shm->backup) {
+        ngx_http_check_failover_count(peers_shm, peer_shm, old, verdict);
+    }
+
+    if (peer_shm->zone != NGX_HTTP_CHECK_NO_ZONE
+        && !(old & NGX_HTTP_CHECK_VERDICT_OUT)
+           != !(verdict & NGX_HTTP_CHECK_VERDICT_OUT)
+        && peer_shm->upstream_index < peers_shm->nupstreams)
+    {
+        ngx_atomic_fetch_add(&peers_shm->zones[peer_shm->upstream_index
+                                               * peers_shm->nzones
+                                               + peer_shm->zone].up,
+                             (verdict & NGX_HTTP_CHECK_VERDICT_OUT) ? -1 : 1);
     }
 }
 
 
+/* follows a primary server coming up or going away */
 static void
-ngx_http_check_peek_handler(ngx_event_t *event)
+ngx_http_check_failover_count(ngx_http_check_peers_shm_t *peers_shm,
+    ngx_http_check_peer_shm_t *peer_shm, ngx_uint_t old, ngx_uint_t verdict)
 {
-    char                           buf[1];
-    ngx_int_t                      n;
-    ngx_err_t                      err;
-    ngx_connection_t              *c;
-    ngx_http_check_peer_t         *peer;
+    ngx_uint_t                       was, is;
+    ngx_http_check_upstream_shm_t   *u;
 
-    if (ngx_http_check_need_exit()) {
+    was = (old & NGX_HTTP_CHECK_VERDICT_OUT) ? 0 : 1;
+    is = (verdict & NGX_HTTP_CHECK_VERDICT_OUT) ? 0 : 1;
+
+    if (was == is || peer_shm->upstream_index >= peers_shm->nupstreams) {
         return;
     }
 
-    c = event->data;
-    peer = c->data;
-
-    n = recv(c->fd, buf, 1, MSG_PEEK);
-
-    err = ngx_socket_errno;
+    u = &peers_shm->upstreams[peer_shm->upstream_index];
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, err,
-                   "http check upstream recv(): %i, fd: %d",
-                   n, c->fd);
+    ngx_http_check_shm_lock(&u->lock);
 
-    if (n >= 0 || err == NGX_EAGAIN) {
-        ngx_http_check_status_update(peer, 1);
+    if (is) {
+        u->up++;
 
-    } else {
-        c->error = 1;
-        ngx_http_check_status_update(peer, 0);
+    } else if (u->up > 0) {
+        u->up--;
     }
 
-    ngx_http_check_clean_event(peer);
+    ngx_http_check_failover_state(u);
 
-    ngx_http_check_finish_handler(event);
+    ngx_spinlock_unlock(&u->lock);
 }
 
 
+/*
+ * The upstream fails over as soon as none of its primary servers is left
+ * and fails back only after enough of them stayed up for the delay, the
+ * caller holds the lock of the upstream.
+ */
 static void
-ngx_http_check_send_handler(ngx_event_t *event)
+ngx_http_check_failover_state(ngx_http_check_upstream_shm_t *u)
 {
-    ssize_t                         size;
-    ngx_connection_t               *c;
-    ngx_http_check_ctx             *ctx;
-    ngx_http_check_peer_t          *peer;
-
-    if (ngx_http_check_need_exit()) {
+    if (u->backups == 0) {
+        u->failover = 0;
+        u->recovered = 0;
         return;
     }
 
-    c = event->data;
-    peer = c->data;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http check send.");
+    if (u->up == 0) {
+        if (!u->failover) {
+            u->failover = 1;
+            u->last_change = ngx_http_check_now();
+        }
 
-    if (c->pool == NULL) {
-        ngx_log_error(NGX_LOG_ERR, event->log, 0,
-                      "check pool NULL with peer: %V ", &peer->peer_addr->name);
+        u->recovered = 0;
+        return;
+    }
 
-        goto check_send_fail;
+    if (!u->failover) {
+        return;
     }
 
-    if (peer->state != NGX_HTTP_CHECK_CONNECT_DONE) {
-        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+    if (u->up < u->need) {
+        u->recovered = 0;
 
-            ngx_log_error(NGX_LOG_ERR, event->log, 0,
-                          "check handle write event error with peer: %V ",
-                          &peer->peer_addr->name);
+    } else if (u->recovered == 0) {
+        u->recovered = ngx_http_check_now();
+    }
+}
 
-            goto check_send_fail;
-        }
 
-        return;
+/* counts the primary servers again, the verdicts were just written */
+static void
+ngx_http_check_failover_init(ngx_http_check_peers_t *peers,
+    ngx_http_check_peers_shm_t *peers_shm, ngx_uint_t fresh)
+{
+    ngx_uint_t                       i;
+    ngx_http_check_peer_t           *peer;
+    ngx_http_check_peer_shm_t       *peer_shm;
+    ngx_http_check_upstream_shm_t   *u;
+
+    for (i = 0; i < peers_shm->nupstreams; i++) {
+        u = &peers_shm->upstreams[i];
+
+        u->lock = 0;
+        u->up = 0;
+        u->backups = 0;
+
+        if (fresh) {
+            u->failover = 0;
+            u->recovered = 0;
+            u->last_change = ngx_http_check_now();
+        }
     }
 
-    if (peer->check_data == NULL) {
+    peer = peers->peers.elts;
 
-        peer->check_data = ngx_pcalloc(peer->pool, sizeof(ngx_http_check_ctx));
-        if (peer->check_data == NULL) {
-            goto check_send_fail;
-        }
+    for (i = 0; i < peers->peers.nelts; i++) {
+        peer_shm = &peers_shm->peers[i];
+        u = &peers_shm->upstreams[peer[i].upstream_index];
 
-        if (peer->init == NULL || peer->init(peer) != NGX_OK) {
+        u->need = peer[i].conf->failback_up;
+        u->delay = peer[i].conf->failback;
 
-            ngx_log_error(NGX_LOG_ERR, event->log, 0,
-                          "check init error with peer: %V ",
-                          &peer->peer_addr->name);
+        if (peer_shm->backup) {
+            u->backups++;
 
-            goto check_send_fail;
+        } else if (!(peers_shm->verdicts[i] & NGX_HTTP_CHECK_VERDICT_OUT)) {
+            u->up++;
         }
     }
 
-    ctx = peer->check_data;
+    for (i = 0; i < peers_shm->nupstreams; i++) {
+        u = &peers_shm->upstreams[i];
 
-    while (ctx->send.pos < ctx->send.last) {
+        /* the delay starts again with the new workers */
+        u->recovered = 0;
 
-        size = c->send(c, ctx->send.pos, ctx->send.last - ctx->send.pos);
+        ngx_http_check_failover_state(u);
+    }
+}
 
-#if (NGX_DEBUG)
-        ngx_err_t                       err;
-        err = (size >= 0) ? 0 : ngx_socket_errno;
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, err,
-                       "http check send size: %z, total: %z",
-                       size, ctx->send.last - ctx->send.pos);
-#endif
 
-        if (size > 0) {
-            ctx->send.pos += size;
+/* counts the servers of each upstream in each zone again */
+static void
+ngx_http_check_zone_init(ngx_http_check_peers_t *peers,
+    ngx_http_check_peers_shm_t *peers_shm)
+{
+    ngx_uint_t                       i;
+    ngx_http_check_peer_shm_t       *peer_shm;
+    ngx_http_check_zone_shm_t       *z;
 
-        } else if (size == 0 || size == NGX_AGAIN) {
-            return;
+    if (peers_shm->zones == NULL) {
+        return;
+    }
 
-        } else {
-            c->error = 1;
-            goto check_send_fail;
+    ngx_memzero(peers_shm->zones, peers_shm->nupstreams * peers_shm->nzones
+                                  * sizeof(ngx_http_check_zone_shm_t));
+
+    for (i = 0; i < peers->peers.nelts; i++) {
+        peer_shm = &peers_shm->peers[i];
+
+        if (peer_shm->zone == NGX_HTTP_CHECK_NO_ZONE) {
+            continue;
         }
-    }
 
-    if (ctx->send.pos == ctx->send.last) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http check send done.");
-        peer->state = NGX_HTTP_CHECK_SEND_DONE;
-    }
+        z = &peers_shm->zones[peer_shm->upstream_index * peers_shm->nzones
+                              + peer_shm->zone];
 
-    return;
+        z->total++;
 
-check_send_fail:
-    ngx_http_check_status_update(peer, 0);
-    ngx_http_check_clean_event(peer);
-    return;
+        if (!(peers_shm->verdicts[i] & NGX_HTTP_CHECK_VERDICT_OUT)) {
+            z->up++;
+        }
+    }
 }
 
 
 static void
-ngx_http_check_recv_handler(ngx_event_t *event)
+ngx_http_check_verdict_update(ngx_http_check_peer_t *peer)
 {
-    u_char                         *new_buf;
-    ssize_t                         size, n;
-    ngx_int_t                       rc;
-    ngx_connection_t               *c;
-    ngx_http_check_ctx             *ctx;
-    ngx_http_check_peer_t          *peer;
+    ngx_http_check_shm_lock(&peer->shm->lock);
 
-    if (ngx_http_check_need_exit()) {
-        return;
-    }
+    ngx_http_check_verdict(check_peers_ctx->peers_shm, peer->index);
 
-    c = event->data;
-    peer = c->data;
+    ngx_spinlock_unlock(&peer->shm->lock);
+}
 
-    if (peer->state != NGX_HTTP_CHECK_SEND_DONE) {
 
-        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
-            goto check_recv_fail;
-        }
+/* the index was taken before its dynamic slot changed hands */
+static ngx_uint_t
+ngx_http_check_verdict_stale(ngx_uint_t verdict, ngx_uint_t index)
+{
+    return (verdict & NGX_HTTP_CHECK_VERDICT_FREE)
+           || (verdict >> NGX_HTTP_CHECK_VERDICT_GEN_SHIFT)
+              != (index >> NGX_HTTP_CHECK_SLOT_BITS);
+}
 
-        return;
-    }
 
-    ctx = peer->check_data;
+/*
+ * The peer of a check_index, NULL if there is no such peer.  The stale
+ * flag is set if the index names a dynamic slot that has been freed or
+ * given to another server since.
+ */
+static ngx_http_check_peer_t *
+ngx_http_check_index_peer(ngx_uint_t index, ngx_uint_t *stale)
+{
+    ngx_uint_t                 slot;
+    ngx_http_check_peer_t     *peer;
 
-    if (ctx->recv.start == NULL) {
-        /* 2048, is it enough? */
-        ctx->recv.start = ngx_palloc(c->pool, ngx_pagesize/2);
-        if (ctx->recv.start == NULL) {
-            goto check_recv_fail;
-        }
+    *stale = 0;
+    slot = index & NGX_HTTP_CHECK_SLOT_MASK;
 
-        ctx->recv.last = ctx->recv.pos = ctx->recv.start;
-        ctx->recv.end = ctx->recv.start + ngx_pagesize/2;
+    if (check_peers_ctx == NULL || slot >= check_peers_ctx->peers.nelts) {
+        return NULL;
     }
 
-    while (1) {
-        n = ctx->recv.end - ctx->recv.last;
-        /* Not enough buffer? Enlarge twice */
-        if (n == 0) {
-            size = ctx->recv.end - ctx->recv.start;
-            new_buf = ngx_palloc(c->pool, size * 2);
-            if (new_buf == NULL) {
-                goto check_recv_fail;
-            }
+    peer = check_peers_ctx->peers.elts;
+    peer = &peer[slot];
 
-            ngx_memcpy(new_buf, ctx->recv.start, size);
+    if ((index >> NGX_HTTP_CHECK_SLOT_BITS) != peer->shm->slot_gen
+        || peer->shm->slot == NGX_HTTP_CHECK_SLOT_FREE)
+    {
+        *stale = 1;
+        return NULL;
+    }
 
-            ctx->recv.pos = ctx->recv.start = new_buf;
-            ctx->recv.last = new_buf + size;
-            ctx->recv.end = new_buf + size * 2;
+    return peer;
+}
 
-            n = ctx->recv.end - ctx->recv.last;
-        }
 
-        size = c->recv(c, ctx->recv.last, n);
+/*
+ * Puts a server into a free slot of check_dynamic of the upstream and
+ * returns its check_index, the one it already has if it is there.
+ * NGX_DECLINED if the upstream has no free slot.
+ */
+ngx_int_t
+ngx_http_check_add_dynamic_peer(ngx_str_t *upstream_name, ngx_addr_t *addr)
+{
+    ngx_int_t                     index;
+    ngx_uint_t                    i;
+    ngx_http_check_peer_t        *peer, *found;
+    ngx_http_check_peers_t       *peers;
+    ngx_http_check_peer_shm_t    *peer_shm;
 
-#if (NGX_DEBUG)
-        ngx_err_t                       err;
-        err = (size >= 0) ? 0 : ngx_socket_errno;
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, err,
-                       "http check recv size: %z, peer: %V",
-                       size, &peer->peer_addr->name);
-#endif
+    peers = check_peers_ctx;
+    if (peers == NULL || peers->peers_shm == NULL
+        || addr->socklen > NGX_SOCKADDRLEN)
+    {
+        return NGX_ERROR;
+    }
 
-        if (size > 0) {
-            ctx->recv.last += size;
+    peer = peers->peers.elts;
+    found = NULL;
+
+    ngx_http_check_shm_lock(&peers->peers_shm->dynamic_lock);
+
+    for (i = 0; i < peers->peers.nelts; i++) {
+
+        if (!peer[i].dynamic
+            || peer[i].upstream_name->len != upstream_name->len
+            || ngx_strncmp(peer[i].upstream_name->data, upstream_name->data,
+                           upstream_name->len) != 0)
+        {
             continue;
-        } else if (size == 0 || size == NGX_AGAIN) {
-            break;
-        }
-        else {
-            c->error = 1;
-            goto check_recv_fail;
         }
-    }
 
-    rc = peer->parse(peer);
+        peer_shm = peer[i].shm;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http check parse rc: %i, peer: %V",
-                   rc, &peer->peer_addr->name);
+        if (peer_shm->slot == NGX_HTTP_CHECK_SLOT_USED) {
 
-    switch (rc) {
+            if (peer_shm->socklen == addr->socklen
+                && ngx_memcmp(peer_shm->sockaddr, addr->sockaddr,
+                              addr->socklen) == 0)
+            {
+                found = &peer[i];
+                goto done;
+            }
 
-    case NGX_AGAIN:
-        /* The peer has closed its half side of the connection. */
-        if (size == 0) {
-            ngx_http_check_status_update(peer, 0);
-            break;
+            continue;
         }
 
-        return;
+        if (found == NULL) {
+            found = &peer[i];
+        }
+    }
 
-    case NGX_ERROR:
-        ngx_log_error(NGX_LOG_ERR, event->log, 0,
-                      "check protocol %s error with peer: %V ",
-                      peer->conf->check_type_conf->name,
-                      &peer->peer_addr->name);
+    if (found == NULL) {
+        ngx_spinlock_unlock(&peers->peers_shm->dynamic_lock);
+        return NGX_DECLINED;
+    }
 
-        ngx_http_check_status_update(peer, 0);
-        break;
+    ngx_http_check_dynamic_fill(found, addr);
 
-    case NGX_OK:
+done:
 
-    default:
-        ngx_http_check_status_update(peer, 1);
-    }
+    index = found->index
+            | (found->shm->slot_gen << NGX_HTTP_CHECK_SLOT_BITS);
 
-    peer->state = NGX_HTTP_CHECK_RECV_DONE;
-    ngx_http_check_clean_event(peer);
-    return;
+    ngx_spinlock_unlock(&peers->peers_shm->dynamic_lock);
 
-check_recv_fail:
-    ngx_http_check_status_update(peer, 0);
-    ngx_http_check_clean_event(peer);
-    return;
+    return index;
 }
 
 
-static ngx_int_t
-ngx_http_check_http_init(ngx_http_check_peer_t *peer)
+/* gives the slot a new address and returns the new check_index */
+ngx_int_t
+ngx_http_check_update_dynamic_peer(ngx_uint_t index, ngx_addr_t *addr)
 {
-    ngx_http_check_ctx                  *ctx;
-    ngx_http_upstream_check_srv_conf_t  *ucscf;
+    ngx_int_t                     rc;
+    ngx_uint_t                    stale;
+    ngx_http_check_peer_t        *peer;
 
-    ctx = peer->check_data;
-    ucscf = peer->conf;
+    peer = ngx_http_check_index_peer(index, &stale);
+    if (peer == NULL || !peer->dynamic) {
+        return NGX_DECLINED;
+    }
 
-    ctx->send.start = ctx->send.pos = (u_char *)ucscf->send.data;
-    ctx->send.end = ctx->send.last = ctx->send.start + ucscf->send.len;
+    if (addr->socklen > NGX_SOCKADDRLEN) {
+        return NGX_ERROR;
+    }
 
-    ctx->recv.start = ctx->recv.pos = NULL;
-    ctx->recv.end = ctx->recv.last = NULL;
+    ngx_http_check_shm_lock(&check_peers_ctx->peers_shm->dynamic_lock);
 
-    ctx->state = 0;
+    if ((index >> NGX_HTTP_CHECK_SLOT_BITS) != peer->shm->slot_gen) {
+        /* another worker was faster */
+        rc = NGX_DECLINED;
 
-    ngx_memzero(&ctx->status, sizeof(ngx_http_status_t));
+    } else {
+        ngx_http_check_dynamic_fill(peer, addr);
 
-    return NGX_OK;
+        rc = peer->index | (peer->shm->slot_gen << NGX_HTTP_CHECK_SLOT_BITS);
+    }
+
+    ngx_spinlock_unlock(&check_peers_ctx->peers_shm->dynamic_lock);
+
+    return rc;
 }
 
 
-static ngx_int_t
-ngx_http_check_http_parse(ngx_http_check_peer_t *peer)
+ngx_int_t
+ngx_http_check_remove_dynamic_peer(ngx_uint_t index)
 {
-    ngx_int_t                            rc, code, code_n;
-    ngx_http_check_ctx                  *ctx;
-    ngx_http_upstream_check_srv_conf_t  *ucscf;
+    ngx_int_t                     rc;
+    ngx_uint_t                    stale;
+    ngx_http_check_peer_t        *peer;
+    ngx_http_check_peer_shm_t    *peer_shm;
 
-    ucscf = peer->conf;
-    ctx = peer->check_data;
+    peer = ngx_http_check_index_peer(index, &stale);
+    if (peer == NULL || !peer->dynamic) {
+        return NGX_DECLINED;
+    }
 
-    if ((ctx->recv.last - ctx->recv.pos) > 0) {
+    peer_shm = peer->shm;
 
-        rc = ngx_http_check_parse_status_line(ctx, &ctx->recv, &ctx->status);
+    ngx_http_check_shm_lock(&check_peers_ctx->peers_shm->dynamic_lock);
 
-        if (rc == NGX_AGAIN) {
-            return rc;
-        }
+    if ((index >> NGX_HTTP_CHECK_SLOT_BITS) != peer_shm->slot_gen) {
+        rc = NGX_DECLINED;
 
-        if (rc == NGX_ERROR) {
-            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                          "http parse error with peer: %V, recv data: %s",
-                          &peer->peer_addr->name, ctx->recv.start);
-            return rc;
-        }
+    } else {
+        ngx_http_check_shm_lock(&peer_shm->lock);
 
-        code = ctx->status.code;
+        peer_shm->down = 1;
+        peer_shm->slot = NGX_HTTP_CHECK_SLOT_FREE;
 
-        if (code >= 200 && code < 300) {
-            code_n = NGX_CHECK_HTTP_2XX;
+        ngx_memory_barrier();
 
-        } else if (code >= 300 && code < 400) {
-            code_n = NGX_CHECK_HTTP_3XX;
+        peer_shm->slot_gen = ngx_http_check_next_gen(peer_shm->slot_gen);
 
-        } else if (code >= 400 && code < 500) {
-            code_n = NGX_CHECK_HTTP_4XX;
+        ngx_http_check_verdict(check_peers_ctx->peers_shm, peer->index);
 
-        } else if (code >= 500 && code < 600) {
-            code_n = NGX_CHECK_HTTP_5XX;
+        ngx_spinlock_unlock(&peer_shm->lock);
 
-        } else {
-            code_n = NGX_CHECK_HTTP_ERR;
-        }
+        rc = NGX_OK;
+    }
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http_parse: code_n: %i, conf: %ui",
-                       code_n, ucscf->code.status_alive);
+    ngx_spinlock_unlock(&check_peers_ctx->peers_shm->dynamic_lock);
 
-        if (code_n & ucscf->code.status_alive) {
-            return NGX_OK;
+    return rc;
+}
 
-        } else {
-            return NGX_ERROR;
-        }
 
-    } else {
-        return NGX_AGAIN;
+/*
+ * Writes the server into the slot under dynamic_lock.  The generation
+ * changes last, so a worker seeing the new one reads the new address.
+ */
+static void
+ngx_http_check_dynamic_fill(ngx_http_check_peer_t *peer, ngx_addr_t *addr)
+{
+    ngx_http_check_peer_shm_t    *peer_shm;
+
+    peer_shm = peer->shm;
+
+    ngx_http_check_shm_lock(&peer_shm->lock);
+
+    ngx_memcpy(peer_shm->sockaddr, addr->sockaddr, addr->socklen);
+    peer_shm->socklen = addr->socklen;
+
+    peer_shm->name.len = ngx_min(addr->name.len, NGX_SOCKADDR_STRLEN);
+    ngx_memcpy(peer_shm->name.data, addr->name.data, peer_shm->name.len);
+
+    ngx_http_check_set_shm_peer(peer_shm, NULL, peer->conf->default_down);
+
+    peer_shm->owner = NGX_INVALID_PID;
+    peer_shm->slot = NGX_HTTP_CHECK_SLOT_USED;
+
+    ngx_memory_barrier();
+
+    peer_shm->slot_gen = ngx_http_check_next_gen(peer_shm->slot_gen);
+
+    ngx_http_check_verdict(check_peers_ctx->peers_shm, peer->index);
+
+    ngx_spinlock_unlock(&peer_shm->lock);
+}
+
+
+/*
+ * Follows the changes of a dynamic slot made in any worker, NGX_DECLINED
+ * while the slot is free.
+ */
+static ngx_int_t
+ngx_http_check_dynamic_sync(ngx_http_check_peer_t *peer)
+{
+    ngx_uint_t                    gen;
+    ngx_http_check_peer_shm_t    *peer_shm;
+
+    peer_shm = peer->shm;
+
+    /* a change under way is seen the next time */
+    gen = peer_shm->slot_gen;
+
+    ngx_memory_barrier();
+
+    if (peer_shm->slot != NGX_HTTP_CHECK_SLOT_USED) {
+        peer->slot_gen = gen;
+        return NGX_DECLINED;
+    }
+
+    if (gen != peer->slot_gen) {
+        peer->peer_addr->sockaddr = peer_shm->sockaddr;
+        peer->peer_addr->socklen = peer_shm->socklen;
+        peer->peer_addr->name = peer_shm->name;
+
+        peer->slot_gen = gen;
     }
 
     return NGX_OK;
 }
 
 
-/* This function copied from ngx_http_parse.c */
-static ngx_int_t
-ngx_http_check_parse_status_line(ngx_http_check_ctx *ctx, ngx_buf_t *b,
-    ngx_http_status_t *status)
+/* the generations of a slot go from 1 to NGX_HTTP_CHECK_GEN_MAX */
+static ngx_uint_t
+ngx_http_check_next_gen(ngx_uint_t gen)
 {
-    u_char   ch;
-    u_char  *p;
-    enum {
-        sw_start = 0,
-        sw_H,
-        sw_HT,
-        sw_HTT,
-        sw_HTTP,
-        sw_first_major_digit,
-        sw_major_digit,
-        sw_first_minor_digit,
-        sw_minor_digit,
-        sw_status,
-        sw_space_after_status,
-        sw_status_text,
-        sw_almost_done
-    } state;
+    return gen % NGX_HTTP_CHECK_GEN_MAX + 1;
+}
 
-    state = ctx->state;
 
-    for (p = b->pos; p < b->last; p++) {
-        ch = *p;
+ngx_int_t
+ngx_http_check_add_timers(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                          i;
+    ngx_msec_t                          t, delay;
+    check_conf_t                       *cf;
+    ngx_http_check_peer_t              *peer;
+    ngx_http_check_peers_t             *peers;
+    ngx_http_check_peer_shm_t          *peer_shm;
+    ngx_http_check_peers_shm_t         *peers_shm;
+    ngx_http_upstream_check_srv_conf_t *ucscf;
 
-        switch (state) {
+    peers = check_peers_ctx;
+    if (peers == NULL) {
+        return NGX_OK;
+    }
 
-        /* "HTTP/" */
-        case sw_start:
-            switch (ch) {
-            case 'H':
-                state = sw_H;
-                break;
-            default:
-                return NGX_ERROR;
-            }
-            break;
+    peers_shm = peers->peers_shm;
+    if (peers_shm == NULL) {
+        return NGX_OK;
+    }
 
-        case sw_H:
-            switch (ch) {
-            case 'T':
-                state = sw_HT;
-                break;
-            default:
-                return NGX_ERROR;
-            }
-            break;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
+                   "http check upstream init_process, shm_name: %V, "
+                   "peer number: %ud",
+                   &peers->check_shm_name,
+                   peers->peers.nelts);
 
-        case sw_HT:
-            switch (ch) {
-            case 'T':
-                state = sw_HTT;
-                break;
-            default:
-                return NGX_ERROR;
-            }
-            break;
+    srandom(ngx_pid);
 
-        case sw_HTT:
-            switch (ch) {
-            case 'P':
-                state = sw_HTTP;
-                break;
-            default:
+    ngx_http_check_verdicts = peers_shm->verdicts;
+    ngx_http_check_nverdicts = peers->peers.nelts;
+
+    peer = peers->peers.elts;
+    peer_shm = peers_shm->peers;
+
+    for (i = 0; i < peers->peers.nelts; i++) {
+        peer[i].shm = &peer_shm[i];
+
+        peer[i].check_ev.handler = ngx_http_check_begin_entry;
+        peer[i].check_ev.log = cycle->log;
+        peer[i].check_ev.data = &peer[i];
+        peer[i].check_ev.timer_set = 0;
+
+        peer[i].check_timeout_ev.handler = ngx_http_check_timeout_entry;
+        peer[i].check_timeout_ev.log = cycle->log;
+        peer[i].check_timeout_ev.data = &peer[i];
+        peer[i].check_timeout_ev.timer_set = 0;
+
+        ucscf = peer[i].conf;
+        cf = ucscf->check_type_conf;
+
+        if (cf->need_pool) {
+            peer[i].pool = ngx_create_pool(ngx_pagesize, cycle->log);
+            if (peer[i].pool == NULL) {
                 return NGX_ERROR;
             }
-            break;
+        }
 
-        case sw_HTTP:
-            switch (ch) {
-            case '/':
-                state = sw_first_major_digit;
-                break;
-            default:
+        peer[i].send_handler = cf->send_handler;
+        peer[i].recv_handler = cf->recv_handler;
+
+        peer[i].init = cf->init;
+        peer[i].parse = cf->parse;
+        peer[i].reinit = cf->reinit;
+
+        /* the address of a dynamic slot is taken on its first event */
+        peer[i].slot_gen = peer[i].dynamic ? (ngx_uint_t) -1 : 0;
+
+        if (peer[i].resolve) {
+            /* room for any address check_resolve may move the peer to */
+            peer[i].peer_addr->name.data = ngx_pnalloc(cycle->pool,
+                                                       NGX_SOCKADDR_STRLEN);
+            if (peer[i].peer_addr->name.data == NULL) {
                 return NGX_ERROR;
             }
-            break;
 
-        /* the first digit of major HTTP version */
-        case sw_first_major_digit:
-            if (ch < '1' || ch > '9') {
-                return NGX_ERROR;
-            }
+            ngx_http_check_resolve_sync(&peer[i]);
+        }
+
+        /*
+         * I added a random start time. I don't want to trigger the check
+         * event too close at the beginning.
+         * */
+        delay = ucscf->check_interval > 1000 ? ucscf->check_interval : 1000;
+        t = ngx_random() % delay;
+
+        ngx_add_timer(&peer[i].check_ev, t);
+
+        if (ucscf->agent && !peer[i].dynamic
+            && ngx_http_check_agent_init(cycle, &peer[i]) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (ucscf->warmup && !peer[i].dynamic
+            && ngx_http_check_warmup_init(cycle, &peer[i]) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if (peers->shared_file.len) {
+        ngx_http_check_shared_init(cycle);
+    }
+
+    if (peers->gossip && ngx_http_check_gossip_init(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (peers->resolves.nelts
+        && ngx_http_check_resolve_init(cycle) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (peers->budget) {
+        ngx_http_check_schedule_ev.handler = ngx_http_check_schedule_handler;
+        ngx_http_check_schedule_ev.log = cycle->log;
+        ngx_http_check_schedule_ev.data = peers;
+        ngx_http_check_schedule_ev.timer_set = 0;
+
+        ngx_add_timer(&ngx_http_check_schedule_ev,
+                      NGX_HTTP_CHECK_SCHEDULE_TICK);
+    }
+
+    if (peers->notify && ngx_http_check_notify_init(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (peers->statsd && ngx_http_check_statsd_init(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (peers->syslog && ngx_http_check_syslog_init(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_check_begin_handler(ngx_event_t *event)
+{
+    ngx_msec_t                          interval, check_interval, lag;
+    ngx_http_check_peer_t              *peer;
+    ngx_http_check_peers_t             *peers;
+    ngx_http_check_peers_shm_t         *peers_shm;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    peers = check_peers_ctx;
+    if (peers == NULL) {
+        return;
+    }
+
+    peers_shm = peers->peers_shm;
+    if (peers_shm == NULL) {
+        return;
+    }
+
+    peer = event->data;
+
+    lag = ngx_http_check_event_lag(event);
+
+    check_interval = ngx_http_check_peer_interval(peer);
+
+    ngx_add_timer(event, check_interval/2);
+
+    if (peer->dynamic && ngx_http_check_dynamic_sync(peer) != NGX_OK) {
+        /* a free slot of check_dynamic */
+        return;
+    }
+
+    if (peer->resolve && peer->addr_gen != peer->shm->addr_gen) {
+        ngx_http_check_resolve_sync(peer);
+    }
+
+    /* This process is processing this peer now. */
+    if ((peer->shm->owner == ngx_pid) ||
+        (peer->pc.connection != NULL) ||
+        (peer->check_timeout_ev.timer_set)) {
+
+        return;
+    }
+
+    /*
+     * This worker is too busy to time a probe fairly, leave the peer
+     * to another worker or to the next round.
+     */
+    if (peers->max_lag && lag > peers->max_lag) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, event->log, 0,
+                       "http check defer index: %ui, lag: %M",
+                       peer->index, lag);
+
+        (void) ngx_atomic_fetch_add(&peers_shm->counters.deferred, 1);
+        return;
+    }
+
+    interval = ngx_current_msec - peer->shm->access_time;
+    ngx_log_debug5(NGX_LOG_DEBUG_HTTP, event->log, 0,
+                   "http check begin handler index: %ud, owner: %P, "
+                   "ngx_pid: %P, interval: %M, check_interval: %M",
+                   peer->index, peer->shm->owner,
+                   ngx_pid, interval,
+                   check_interval);
+
+    ngx_http_check_shm_lock(&peer->shm->lock);
+
+    if (peers_shm->generation != ngx_http_check_shm_generation) {
+        ngx_spinlock_unlock(&peer->shm->lock);
+        return;
+    }
+
+    if ((interval >= check_interval)
+            && peer->shm->owner == NGX_INVALID_PID)
+    {
+        peer->shm->owner = ngx_pid;
+    }
+    else if (interval >= (check_interval << 4)) {
+        /* If the check peer has been untouched for 4 times of
+         * the check interval, activates current timer.
+         * The checking process may be disappeared
+         * in some circumstance, and the clean event will never
+         * be triggered. */
+        peer->shm->owner = ngx_pid;
+        peer->shm->access_time = ngx_current_msec;
+    }
+
+    ngx_spinlock_unlock(&peer->shm->lock);
+
+    if (peer->shm->owner == ngx_pid) {
+
+        if (peer->shared && !ngx_http_check_shared_probe(peer)) {
+            /* another instance on this host probes the peer */
+            ngx_http_check_shared_follow(peer);
+            peer->shm->owner = NGX_INVALID_PID;
+            return;
+        }
+
+        if (peers->gossip && !peer->dynamic
+            && !ngx_http_check_gossip_probe(peer))
+        {
+            /* another node probes the peer */
+            peer->shm->owner = NGX_INVALID_PID;
+            return;
+        }
+
+        if (peers->suspect && !ngx_http_check_host_probe(peer)) {
+            /* the host looks dead, do not wait for another timeout */
+            (void) ngx_atomic_fetch_add(&peers_shm->counters.fast_failed, 1);
+
+            peer->start_time = 0;
+            peer->code = 0;
+
+            ngx_http_check_status_update(peer, NGX_HTTP_CHECK_ERR_CONNECT);
+            peer->shm->owner = NGX_INVALID_PID;
+            return;
+        }
+
+        ngx_http_check_connect_handler(event);
+
+    } else if (peer->shm->owner != NGX_INVALID_PID) {
+        /* another worker is checking this peer */
+        (void) ngx_atomic_fetch_add(&peers_shm->counters.skipped, 1);
+    }
+}
+
+
+static ngx_msec_t
+ngx_http_check_event_lag(ngx_event_t *event)
+{
+    ngx_msec_int_t                lag;
+    ngx_atomic_uint_t             max;
+    ngx_http_check_counters_t    *counters;
+
+    /* the key keeps the time at which the expired timer was due */
+    lag = (ngx_msec_int_t) (ngx_current_msec - event->timer.key);
+    if (lag < 0) {
+        lag = 0;
+    }
+
+    counters = &check_peers_ctx->peers_shm->counters;
+
+    counters->lag_last = lag;
+
+    for ( ;; ) {
+        max = counters->lag_max;
+
+        if ((ngx_atomic_uint_t) lag <= max
+            || ngx_atomic_cmp_set(&counters->lag_max, max, lag))
+        {
+            break;
+        }
+    }
+
+    return (ngx_msec_t) lag;
+}
+
+
+static void
+ngx_http_check_shm_lock(ngx_atomic_t *lock)
+{
+    ngx_uint_t                    i, n, spins;
+    ngx_http_check_peers_shm_t   *peers_shm;
+
+    spins = 0;
+
+    for ( ;; ) {
+
+        if (*lock == 0 && ngx_atomic_cmp_set(lock, 0, ngx_pid)) {
+            break;
+        }
+
+        spins++;
+
+        if (ngx_ncpu > 1) {
+
+            for (n = 1; n < 1024; n <<= 1) {
+
+                for (i = 0; i < n; i++) {
+                    ngx_cpu_pause();
+                }
+
+                if (*lock == 0 && ngx_atomic_cmp_set(lock, 0, ngx_pid)) {
+                    goto locked;
+                }
+
+                spins++;
+            }
+        }
+
+        ngx_sched_yield();
+    }
+
+locked:
+
+    peers_shm = check_peers_ctx->peers_shm;
+
+    (void) ngx_atomic_fetch_add(&peers_shm->counters.locks, 1);
+
+    if (spins) {
+        (void) ngx_atomic_fetch_add(&peers_shm->counters.lock_spins, spins);
+    }
+}
+
+
+static void
+ngx_http_check_connect_handler(ngx_event_t *event)
+{
+    ngx_int_t                            rc;
+    ngx_connection_t                    *c;
+    ngx_http_check_peer_t               *peer;
+    ngx_http_check_counters_t           *counters;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    peer = event->data;
+    ucscf = peer->conf;
+
+    ngx_memzero(&peer->pc, sizeof(ngx_peer_connection_t));
+
+    peer->pc.sockaddr = peer->peer_addr->sockaddr;
+    peer->pc.socklen = peer->peer_addr->socklen;
+    peer->pc.name = &peer->peer_addr->name;
+
+    peer->pc.get = ngx_event_get_peer;
+    peer->pc.log = event->log;
+    peer->pc.log_error = check_peers_ctx->probe_log_error;
+
+    peer->pc.cached = 0;
+    peer->pc.connection = NULL;
+
+    peer->start_time = ngx_current_msec;
+    peer->connect_time = 0;
+    peer->send_time = 0;
+    peer->first_byte_time = 0;
+    peer->code = 0;
+
+    counters = &check_peers_ctx->peers_shm->counters;
+
+    (void) ngx_atomic_fetch_add(&counters->started, 1);
+    (void) ngx_atomic_fetch_add(&counters->in_flight, 1);
+
+    rc = ngx_http_check_connect(peer);
+
+    if (rc == NGX_ERROR || rc == NGX_DECLINED) {
+        ngx_http_check_status_update(peer, NGX_HTTP_CHECK_ERR_CONNECT);
+        ngx_http_check_clean_event(peer);
+        return;
+    }
+
+    /* NGX_OK or NGX_AGAIN */
+    c = peer->pc.connection;
+    c->data = peer;
+    c->log = peer->pc.log;
+    c->sendfile = 0;
+    c->read->log = c->log;
+    c->write->log = c->log;
+    c->pool = peer->pool;
+
+    peer->state = NGX_HTTP_CHECK_CONNECT_DONE;
+
+    c->write->handler = ngx_http_check_io_entry;
+    c->read->handler = ngx_http_check_io_entry;
+
+    ngx_add_timer(&peer->check_timeout_ev, ucscf->check_timeout);
+
+    /* already accounted to the begin handler */
+    if (rc == NGX_OK) {
+        peer->send_handler(c->write);
+    }
+}
+
+
+static void
+ngx_http_check_peek_handler(ngx_event_t *event)
+{
+    ngx_int_t                      n;
+    ngx_err_t                      err;
+    ngx_connection_t              *c;
+    ngx_http_check_peer_t         *peer;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    c = event->data;
+    peer = c->data;
+
+    peer->connect_time = ngx_current_msec;
+
+    n = ngx_http_check_peek(c);
+
+    err = ngx_socket_errno;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, err,
+                   "http check upstream recv(): %i, fd: %d",
+                   n, c->fd);
+
+    if (n >= 0 || err == NGX_EAGAIN) {
+        ngx_http_check_status_update(peer, NGX_HTTP_CHECK_OK);
+
+    } else {
+        c->error = 1;
+        ngx_http_check_status_update(peer, NGX_HTTP_CHECK_ERR_CONNECT);
+    }
+
+    ngx_http_check_clean_event(peer);
+
+    ngx_http_check_finish_handler(event);
+}
+
+
+static void
+ngx_http_check_send_handler(ngx_event_t *event)
+{
+    ssize_t                         size;
+    ngx_uint_t                      reason;
+    ngx_connection_t               *c;
+    ngx_http_check_ctx             *ctx;
+    ngx_http_check_peer_t          *peer;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    c = event->data;
+    peer = c->data;
+
+    reason = NGX_HTTP_CHECK_ERR_PROTOCOL;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http check send.");
+
+    if (c->pool == NULL) {
+        ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                      "check pool NULL with peer: %V ", &peer->peer_addr->name);
+
+        goto check_send_fail;
+    }
+
+    if (peer->state != NGX_HTTP_CHECK_CONNECT_DONE) {
+        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+
+            ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                          "check handle write event error with peer: %V ",
+                          &peer->peer_addr->name);
+
+            goto check_send_fail;
+        }
+
+        return;
+    }
+
+    if (peer->connect_time == 0) {
+        peer->connect_time = ngx_current_msec;
+    }
+
+    if (peer->check_data == NULL) {
+
+        peer->check_data = ngx_pcalloc(peer->pool, sizeof(ngx_http_check_ctx));
+        if (peer->check_data == NULL) {
+            goto check_send_fail;
+        }
+
+        if (peer->init == NULL || peer->init(peer) != NGX_OK) {
+
+            ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                          "check init error with peer: %V ",
+                          &peer->peer_addr->name);
+
+            goto check_send_fail;
+        }
+    }
+
+    ctx = peer->check_data;
+
+    while (ctx->send.pos < ctx->send.last) {
+
+        size = c->send(c, ctx->send.pos, ctx->send.last - ctx->send.pos);
+
+#if (NGX_DEBUG)
+        ngx_err_t                       err;
+        err = (size >= 0) ? 0 : ngx_socket_errno;
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, err,
+                       "http check send size: %z, total: %z",
+                       size, ctx->send.last - ctx->send.pos);
+#endif
+
+        if (size > 0) {
+            ctx->send.pos += size;
+
+        } else if (size == 0 || size == NGX_AGAIN) {
+            return;
+
+        } else {
+            c->error = 1;
+
+            /* nothing is sent, the connection has not been established */
+            if (ctx->send.pos == ctx->send.start) {
+                reason = NGX_HTTP_CHECK_ERR_CONNECT;
+            }
+
+            goto check_send_fail;
+        }
+    }
+
+    if (ctx->send.pos == ctx->send.last) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http check send done.");
+        peer->state = NGX_HTTP_CHECK_SEND_DONE;
+        peer->send_time = ngx_current_msec;
+    }
+
+    return;
+
+check_send_fail:
+    ngx_http_check_status_update(peer, reason);
+    ngx_http_check_clean_event(peer);
+    return;
+}
+
+
+static void
+ngx_http_check_recv_handler(ngx_event_t *event)
+{
+    u_char                         *new_buf;
+    ssize_t                         size, n;
+    ngx_int_t                       rc;
+    ngx_connection_t               *c;
+    ngx_http_check_ctx             *ctx;
+    ngx_http_check_peer_t          *peer;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    c = event->data;
+    peer = c->data;
+
+    if (peer->state != NGX_HTTP_CHECK_SEND_DONE) {
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            goto check_recv_fail;
+        }
+
+        return;
+    }
+
+    ctx = peer->check_data;
+
+    if (ctx->recv.start == NULL) {
+        /* 2048, is it enough? */
+        ctx->recv.start = ngx_palloc(c->pool, ngx_pagesize/2);
+        if (ctx->recv.start == NULL) {
+            goto check_recv_fail;
+        }
+
+        ctx->recv.last = ctx->recv.pos = ctx->recv.start;
+        ctx->recv.end = ctx->recv.start + ngx_pagesize/2;
+    }
+
+    while (1) {
+        n = ctx->recv.end - ctx->recv.last;
+        /* Not enough buffer? Enlarge twice */
+        if (n == 0) {
+            size = ctx->recv.end - ctx->recv.start;
+            new_buf = ngx_palloc(c->pool, size * 2);
+            if (new_buf == NULL) {
+                goto check_recv_fail;
+            }
+
+            ngx_memcpy(new_buf, ctx->recv.start, size);
+
+            ctx->recv.pos = ctx->recv.start = new_buf;
+            ctx->recv.last = new_buf + size;
+            ctx->recv.end = new_buf + size * 2;
+
+            n = ctx->recv.end - ctx->recv.last;
+        }
+
+        size = c->recv(c, ctx->recv.last, n);
+
+#if (NGX_DEBUG)
+        ngx_err_t                       err;
+        err = (size >= 0) ? 0 : ngx_socket_errno;
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, err,
+                       "http check recv size: %z, peer: %V",
+                       size, &peer->peer_addr->name);
+#endif
+
+        if (size > 0) {
+            if (peer->first_byte_time == 0) {
+                peer->first_byte_time = ngx_current_msec;
+            }
+
+            ctx->recv.last += size;
+            continue;
+        } else if (size == 0 || size == NGX_AGAIN) {
+            break;
+        }
+        else {
+            c->error = 1;
+            goto check_recv_fail;
+        }
+    }
+
+    rc = peer->parse(peer);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http check parse rc: %i, peer: %V",
+                   rc, &peer->peer_addr->name);
+
+    switch (rc) {
+
+    case NGX_AGAIN:
+        /* The peer has closed its half side of the connection. */
+        if (size == 0) {
+            ngx_http_check_status_update(peer, NGX_HTTP_CHECK_ERR_PROTOCOL);
+            break;
+        }
+
+        return;
+
+    case NGX_ERROR:
+        ngx_log_error(check_peers_ctx->probe_log_level, event->log, 0,
+                      "check protocol %s error with peer: %V ",
+                      peer->conf->check_type_conf->name,
+                      &peer->peer_addr->name);
+
+        ngx_http_check_status_update(peer, NGX_HTTP_CHECK_ERR_PARSE);
+        break;
+
+    case NGX_OK:
+
+    default:
+        ngx_http_check_status_update(peer, NGX_HTTP_CHECK_OK);
+    }
+
+    peer->state = NGX_HTTP_CHECK_RECV_DONE;
+    ngx_http_check_clean_event(peer);
+    return;
+
+check_recv_fail:
+    ngx_http_check_status_update(peer, NGX_HTTP_CHECK_ERR_PROTOCOL);
+    ngx_http_check_clean_event(peer);
+    return;
+}
+
+
+static ngx_int_t
+ngx_http_check_http_init(ngx_http_check_peer_t *peer)
+{
+    ngx_http_check_ctx                  *ctx;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    ctx = peer->check_data;
+    ucscf = peer->conf;
+
+    ctx->send.start = ctx->send.pos = (u_char *)ucscf->send.data;
+    ctx->send.end = ctx->send.last = ctx->send.start + ucscf->send.len;
+
+    ctx->recv.start = ctx->recv.pos = NULL;
+    ctx->recv.end = ctx->recv.last = NULL;
+
+    ctx->state = 0;
+
+    ngx_memzero(&ctx->status, sizeof(ngx_http_status_t));
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_check_http_parse(ngx_http_check_peer_t *peer)
+{
+    ngx_int_t                            rc, code, code_n;
+    ngx_http_check_ctx                  *ctx;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    ucscf = peer->conf;
+    ctx = peer->check_data;
+
+    if ((ctx->recv.last - ctx->recv.pos) > 0) {
+
+        rc = ngx_http_check_parse_status_line(ctx, &ctx->recv, &ctx->status);
+
+        if (rc == NGX_AGAIN) {
+            return rc;
+        }
+
+        if (rc == NGX_ERROR) {
+            ngx_log_error(check_peers_ctx->probe_log_level, ngx_cycle->log, 0,
+                          "http parse error with peer: %V, recv data: %s",
+                          &peer->peer_addr->name, ctx->recv.start);
+            return rc;
+        }
+
+        code = ctx->status.code;
+        peer->code = code;
+
+        if (code >= 200 && code < 300) {
+            code_n = NGX_CHECK_HTTP_2XX;
+
+        } else if (code >= 300 && code < 400) {
+            code_n = NGX_CHECK_HTTP_3XX;
+
+        } else if (code >= 400 && code < 500) {
+            code_n = NGX_CHECK_HTTP_4XX;
+
+        } else if (code >= 500 && code < 600) {
+            code_n = NGX_CHECK_HTTP_5XX;
+
+        } else {
+            code_n = NGX_CHECK_HTTP_ERR;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http_parse: code_n: %i, conf: %ui",
+                       code_n, ucscf->code.status_alive);
+
+        if (code_n & ucscf->code.status_alive) {
+            return NGX_OK;
+
+        } else {
+            return NGX_ERROR;
+        }
+
+    } else {
+        return NGX_AGAIN;
+    }
+
+    return NGX_OK;
+}
+
+
+/* This function copied from ngx_http_parse.c */
+static ngx_int_t
+ngx_http_check_parse_status_line(ngx_http_check_ctx *ctx, ngx_buf_t *b,
+    ngx_http_status_t *status)
+{
+    u_char   ch;
+    u_char  *p;
+    enum {
+        sw_start = 0,
+        sw_H,
+        sw_HT,
+        sw_HTT,
+        sw_HTTP,
+        sw_first_major_digit,
+        sw_major_digit,
+        sw_first_minor_digit,
+        sw_minor_digit,
+        sw_status,
+        sw_space_after_status,
+        sw_status_text,
+        sw_almost_done
+    } state;
+
+    state = ctx->state;
+
+    for (p = b->pos; p < b->last; p++) {
+        ch = *p;
+
+        switch (state) {
+
+        /* "HTTP/" */
+        case sw_start:
+            switch (ch) {
+            case 'H':
+                state = sw_H;
+                break;
+            default:
+                return NGX_ERROR;
+            }
+            break;
+
+        case sw_H:
+            switch (ch) {
+            case 'T':
+                state = sw_HT;
+                break;
+            default:
+                return NGX_ERROR;
+            }
+            break;
+
+        case sw_HT:
+            switch (ch) {
+            case 'T':
+                state = sw_HTT;
+                break;
+            default:
+                return NGX_ERROR;
+            }
+            break;
+
+        case sw_HTT:
+            switch (ch) {
+            case 'P':
+                state = sw_HTTP;
+                break;
+            default:
+                return NGX_ERROR;
+            }
+            break;
+
+        case sw_HTTP:
+            switch (ch) {
+            case '/':
+                state = sw_first_major_digit;
+                break;
+            default:
+                return NGX_ERROR;
+            }
+            break;
+
+        /* the first digit of major HTTP version */
+        case sw_first_major_digit:
+            if (ch < '1' || ch > '9') {
+                return NGX_ERROR;
+            }
+
+            state = sw_major_digit;
+            break;
+
+        /* the major HTTP version or dot */
+        case sw_major_digit:
+            if (ch == '.') {
+                state = sw_first_minor_digit;
+                break;
+            }
+
+            if (ch < '0' || ch > '9') {
+                return NGX_ERROR;
+            }
+
+            break;
+
+        /* the first digit of minor HTTP version */
+        case sw_first_minor_digit:
+            if (ch < '0' || ch > '9') {
+                return NGX_ERROR;
+            }
+
+            state = sw_minor_digit;
+            break;
+
+        /* the minor HTTP version or the end of the request line */
+        case sw_minor_digit:
+            if (ch == ' ') {
+                state = sw_status;
+                break;
+            }
+
+            if (ch < '0' || ch > '9') {
+                return NGX_ERROR;
+            }
+
+            break;
+
+        /* HTTP status code */
+        case sw_status:
+            if (ch == ' ') {
+                break;
+            }
+
+            if (ch < '0' || ch > '9') {
+                return NGX_ERROR;
+            }
+
+            status->code = status->code * 10 + ch - '0';
+
+            if (++status->count == 3) {
+                state = sw_space_after_status;
+                status->start = p - 2;
+            }
+
+            break;
+
+        /* space or end of line */
+        case sw_space_after_status:
+            switch (ch) {
+            case ' ':
+                state = sw_status_text;
+                break;
+            case '.':                    /* IIS may send 403.1, 403.2, etc */
+                state = sw_status_text;
+                break;
+            case CR:
+                state = sw_almost_done;
+                break;
+            case LF:
+                goto done;
+            default:
+                return NGX_ERROR;
+            }
+            break;
+
+        /* any text until end of line */
+        case sw_status_text:
+            switch (ch) {
+            case CR:
+                state = sw_almost_done;
+
+                break;
+            case LF:
+                goto done;
+            }
+            break;
+
+        /* end of status line */
+        case sw_almost_done:
+            status->end = p - 1;
+            switch (ch) {
+            case LF:
+                goto done;
+            default:
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    b->pos = p;
+    ctx->state = state;
+
+    return NGX_AGAIN;
+
+done:
+
+    b->pos = p + 1;
+
+    if (status->end == NULL) {
+        status->end = p;
+    }
+
+    ctx->state = sw_start;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_check_http_reinit(ngx_http_check_peer_t *peer)
+{
+    ngx_http_check_ctx *ctx;
+
+    ctx = peer->check_data;
+
+    ctx->send.pos = ctx->send.start;
+    ctx->send.last = ctx->send.end;
+
+    ctx->recv.pos = ctx->recv.last = ctx->recv.start;
+
+    ctx->state = 0;
+
+    ngx_memzero(&ctx->status, sizeof(ngx_http_status_t));
+}
+
+
+static ngx_int_t
+ngx_http_check_ssl_hello_init(ngx_http_check_peer_t *peer)
+{
+    ngx_http_check_ctx                  *ctx;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    ctx = peer->check_data;
+    ucscf = peer->conf;
+
+    ctx->send.start = ctx->send.pos = (u_char *)ucscf->send.data;
+    ctx->send.end = ctx->send.last = ctx->send.start + ucscf->send.len;
+
+    ctx->recv.start = ctx->recv.pos = NULL;
+    ctx->recv.end = ctx->recv.last = NULL;
+
+    return NGX_OK;
+}
+
+
+/* a rough check of server ssl_hello responses */
+static ngx_int_t
+ngx_http_check_ssl_hello_parse(ngx_http_check_peer_t *peer)
+{
+    size_t                        size;
+    server_ssl_hello_t           *resp;
+    ngx_http_check_ctx           *ctx;
+
+    ctx = peer->check_data;
+
+    size = ctx->recv.last - ctx->recv.pos;
+    if (size < sizeof(server_ssl_hello_t)) {
+        return NGX_AGAIN;
+    }
+
+    resp = (server_ssl_hello_t *) ctx->recv.pos;
+
+    ngx_log_debug7(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http check ssl_parse, type: %ud, version: %ud.%ud, "
+                   "length: %ud, handshanke_type: %ud, hello_version: %ud.%ud",
+                   resp->msg_type, resp->version.major, resp->version.minor,
+                   ntohs(resp->length), resp->handshake_type,
+                   resp->hello_version.major, resp->hello_version.minor);
+
+    peer->code = resp->handshake_type;
+
+    if (resp->msg_type != HANDSHAKE) {
+        return NGX_ERROR;
+    }
+
+    if (resp->handshake_type != SERVER_HELLO) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_check_ssl_hello_reinit(ngx_http_check_peer_t *peer)
+{
+    ngx_http_check_ctx *ctx;
+
+    ctx = peer->check_data;
+
+    ctx->send.pos = ctx->send.start;
+    ctx->send.last = ctx->send.end;
+
+    ctx->recv.pos = ctx->recv.last = ctx->recv.start;
+}
+
+
+static ngx_int_t
+ngx_http_check_mysql_init(ngx_http_check_peer_t *peer)
+{
+    ngx_http_check_ctx                  *ctx;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    ctx = peer->check_data;
+    ucscf = peer->conf;
+
+    ctx->send.start = ctx->send.pos = (u_char *)ucscf->send.data;
+    ctx->send.end = ctx->send.last = ctx->send.start + ucscf->send.len;
+
+    ctx->recv.start = ctx->recv.pos = NULL;
+    ctx->recv.end = ctx->recv.last = NULL;
+
+    return NGX_OK;
+}
+
+
+/* a rough check of mysql greeting responses */
+static ngx_int_t
+ngx_http_check_mysql_parse(ngx_http_check_peer_t *peer)
+{
+    size_t                         size;
+    ngx_http_check_ctx            *ctx;
+    mysql_handshake_init_t        *handshake;
+
+    ctx = peer->check_data;
+
+    size = ctx->recv.last - ctx->recv.pos;
+    if (size < sizeof(mysql_handshake_init_t)) {
+        return NGX_AGAIN;
+    }
+
+    handshake = (mysql_handshake_init_t *) ctx->recv.pos;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "mysql_parse: packet_number=%ud, protocol=%ud",
+                   handshake->packet_number, handshake->protocol_version);
+
+    peer->code = handshake->protocol_version;
+
+    /* The mysql greeting packet's serial number always begins with 0. */
+    if (handshake->packet_number != 0x00) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_check_mysql_reinit(ngx_http_check_peer_t *peer)
+{
+    ngx_http_check_ctx *ctx;
+
+    ctx = peer->check_data;
+
+    ctx->send.pos = ctx->send.start;
+    ctx->send.last = ctx->send.end;
+
+    ctx->recv.pos = ctx->recv.last = ctx->recv.start;
+}
+
+
+static ngx_int_t
+ngx_http_check_ajp_init(ngx_http_check_peer_t *peer)
+{
+    ngx_http_check_ctx                  *ctx;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    ctx = peer->check_data;
+    ucscf = peer->conf;
+
+    ctx->send.start = ctx->send.pos = (u_char *)ucscf->send.data;
+    ctx->send.end = ctx->send.last = ctx->send.start + ucscf->send.len;
+
+    ctx->recv.start = ctx->recv.pos = NULL;
+    ctx->recv.end = ctx->recv.last = NULL;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_check_ajp_parse(ngx_http_check_peer_t *peer)
+{
+    u_char                        *p;
+    ngx_http_check_ctx            *ctx;
+
+    ctx = peer->check_data;
+
+    if ((size_t)(ctx->recv.last - ctx->recv.pos) < sizeof(ajp_cpong_packet)) {
+        return NGX_AGAIN;
+    }
+
+    p = ctx->recv.pos;
+
+#if (NGX_DEBUG)
+    ajp_raw_packet_t              *ajp;
+
+    ajp = (ajp_raw_packet_t *)p;
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "ajp_parse: preamble=0x%xd, length=0x%xd, type=0x%xd",
+                   ntohs(ajp->preamble), ntohs(ajp->length), ajp->type);
+#endif
+
+    peer->code = ((ajp_raw_packet_t *) p)->type;
+
+    if (ngx_memcmp(ajp_cpong_packet, p, sizeof(ajp_cpong_packet)) == 0) {
+        return NGX_OK;
+
+    } else {
+        return NGX_ERROR;
+    }
+}
+
+
+static void
+ngx_http_check_ajp_reinit(ngx_http_check_peer_t *peer)
+{
+    ngx_http_check_ctx *ctx;
+
+    ctx = peer->check_data;
+
+    ctx->send.pos = ctx->send.start;
+    ctx->send.last = ctx->send.end;
+
+    ctx->recv.pos = ctx->recv.last = ctx->recv.start;
+}
+
+
+static void
+ngx_http_check_status_update(ngx_http_check_peer_t *peer, ngx_uint_t rc)
+{
+    ngx_uint_t                            probed;
+    ngx_msec_t                            latency;
+    ngx_http_check_counters_t            *counters;
+    ngx_http_upstream_check_srv_conf_t   *ucscf;
+
+    ucscf = peer->conf;
+    counters = &check_peers_ctx->peers_shm->counters;
+
+    /* not a probe but a verdict on its host, see check_host_suspect */
+    probed = (peer->start_time != 0);
+
+    /* the dynamic slot has changed hands while the probe ran */
+    if (peer->slot_gen != peer->shm->slot_gen) {
+        if (probed && counters->in_flight > 0) {
+            (void) ngx_atomic_fetch_add(&counters->in_flight, -1);
+        }
+
+        return;
+    }
+
+    if (probed && check_peers_ctx->suspect) {
+        ngx_http_check_host_update(peer, rc);
+    }
+
+    latency = ngx_http_check_timing_update(peer);
+
+    peer->shm->last_reason = (uint16_t) rc;
+    peer->shm->last_code = (uint16_t) peer->code;
+    peer->shm->last_rtt = (uint32_t) latency;
+
+    peer->shm->history = (peer->shm->history << 1)
+                         | (rc == NGX_HTTP_CHECK_OK);
+
+    if (peer->shm->history_len < 64) {
+        peer->shm->history_len++;
+    }
+
+    if (probed && counters->in_flight > 0) {
+        (void) ngx_atomic_fetch_add(&counters->in_flight, -1);
+    }
+
+    if (rc == NGX_HTTP_CHECK_OK) {
+        (void) ngx_atomic_fetch_add(&counters->succeeded, 1);
+        (void) ngx_atomic_fetch_add(
+                   &peer->shm->rtt_hist[ngx_http_check_rtt_bucket(latency)],
+                   1);
+
+        peer->shm->rise_count++;
+        peer->shm->fall_count = 0;
+        if (peer->shm->down && peer->shm->rise_count >= ucscf->rise_count
+            && (ucscf->flap_threshold == 0
+                || ngx_http_check_flap_score(peer->shm)
+                   < ucscf->flap_threshold))
+        {
+            if (peer->warmup == NULL
+                || ngx_http_check_warmup_begin(peer) == NGX_OK)
+            {
+                ngx_http_check_mark_up(peer, rc, latency);
+            }
+        }
+
+    } else {
+        (void) ngx_atomic_fetch_add(&counters->failed[rc], 1);
+
+        if (peer->warmup) {
+            /* the requests are replayed again once the peer passes */
+            peer->shm->warmup = NGX_HTTP_CHECK_WARMUP_NONE;
+        }
+
+        peer->shm->rise_count = 0;
+        peer->shm->fall_count++;
+        if (!peer->shm->down && peer->shm->fall_count >= ucscf->fall_count) {
+            peer->shm->down = 1;
+            peer->shm->last_change = ngx_http_check_now();
+            (void) ngx_atomic_fetch_add(&counters->transitions, 1);
+
+            ngx_http_check_verdict_update(peer);
+
+            ngx_http_check_journal_add(peer, NGX_HTTP_CHECK_PEER_UP,
+                                       NGX_HTTP_CHECK_PEER_DOWN, rc, latency);
+        }
+    }
+
+    peer->shm->access_time = ngx_current_msec;
+
+    if (check_peers_ctx->gossip) {
+        peer->shm->override = (rc == NGX_HTTP_CHECK_ERR_CONNECT);
+    }
+
+    if (peer->shared) {
+        ngx_http_check_shared_publish(peer);
+    }
+}
+
+
+static void
+ngx_http_check_begin_entry(ngx_event_t *event)
+{
+    ngx_http_check_run(event->data, ngx_http_check_begin_handler, event);
+}
+
+
+static void
+ngx_http_check_timeout_entry(ngx_event_t *event)
+{
+    ngx_http_check_run(event->data, ngx_http_check_timeout_handler, event);
+}
+
+
+static void
+ngx_http_check_io_entry(ngx_event_t *event)
+{
+    ngx_connection_t       *c;
+    ngx_http_check_peer_t  *peer;
+
+    c = event->data;
+    peer = c->data;
+
+    ngx_http_check_run(peer, event->write ? peer->send_handler
+                                          : peer->recv_handler,
+                       event);
+}
+
+
+/*
+ * Runs a handler of a probe, and adds the CPU time it took and the socket
+ * calls it made to the upstream and to the check type of the peer.  The
+ * connection may be closed by the handler, the peer stays.
+ */
+static void
+ngx_http_check_run(ngx_http_check_peer_t *peer, ngx_event_handler_pt handler,
+    ngx_event_t *event)
+{
+    uint64_t                     start, end, ns;
+    ngx_uint_t                   syscalls, type;
+    ngx_http_check_usage_t      *usage;
+    ngx_http_check_peers_shm_t  *peers_shm;
+
+    start = ngx_http_check_cpu_time();
+    syscalls = ngx_http_check_syscalls;
+
+    handler(event);
+
+    end = ngx_http_check_cpu_time();
+    syscalls = ngx_http_check_syscalls - syscalls;
+
+    if (check_peers_ctx == NULL || check_peers_ctx->peers_shm == NULL) {
+        return;
+    }
+
+    peers_shm = check_peers_ctx->peers_shm;
+
+    ns = peer->cpu_ns;
+
+    if (start && end > start) {
+        ns += end - start;
+    }
+
+    peer->cpu_ns = (ngx_uint_t) (ns % 1000);
+
+    type = peer->conf->check_type_conf - ngx_check_types;
+    usage = &peers_shm->type_usage[type];
+
+    (void) ngx_atomic_fetch_add(&usage->cpu, ns / 1000);
+    (void) ngx_atomic_fetch_add(&usage->syscalls, syscalls);
+    (void) ngx_atomic_fetch_add(&usage->runs, 1);
+
+    if (peer->upstream_index >= peers_shm->nupstreams) {
+        return;
+    }
+
+    usage = &peers_shm->upstreams[peer->upstream_index].usage;
+
+    (void) ngx_atomic_fetch_add(&usage->cpu, ns / 1000);
+    (void) ngx_atomic_fetch_add(&usage->syscalls, syscalls);
+    (void) ngx_atomic_fetch_add(&usage->runs, 1);
+}
+
+
+/* the CPU time of this worker in nanoseconds, 0 if it can not be read */
+static uint64_t
+ngx_http_check_cpu_time(void)
+{
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec  ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+        return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+#endif
+
+    return 0;
+}
+
+
+static ngx_msec_t
+ngx_http_check_peer_interval(ngx_http_check_peer_t *peer)
+{
+    if (check_peers_ctx->budget && peer->shm->interval) {
+        return peer->shm->interval;
+    }
+
+    return peer->conf->check_interval;
+}
+
+
+/*
+ * One worker shares the probes of check_probe_budget out among the peers
+ * once a tick.  Each peer has a floor of one probe in the longest
+ * interval, the rest of the budget goes to the peers in proportion to
+ * the requests the balancers gave them, smoothed over a few ticks.  The
+ * budget is spread evenly while there is no traffic at all.
+ */
+static void
+ngx_http_check_schedule_handler(ngx_event_t *event)
+{
+    uint64_t                        floor, spare, rate, total;
+    ngx_uint_t                      i, n, count;
+    ngx_msec_t                      elapsed, interval, max;
+    ngx_http_check_peers_t         *peers;
+    ngx_http_check_peer_shm_t      *peer_shm;
+    ngx_http_check_peers_shm_t     *peers_shm;
+    ngx_http_check_budget_conf_t   *bc;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    peers = event->data;
+    peers_shm = peers->peers_shm;
+
+    if (peers_shm == NULL) {
+        return;
+    }
+
+    ngx_add_timer(event, NGX_HTTP_CHECK_SCHEDULE_TICK);
+
+    if (!ngx_http_check_feed_own(&peers_shm->schedule,
+                                 NGX_HTTP_CHECK_SCHEDULE_TICK))
+    {
+        return;
+    }
+
+    bc = peers->budget;
+
+    elapsed = ngx_current_msec - peers_shm->schedule_time;
+    peers_shm->schedule_time = ngx_current_msec;
+
+    if (elapsed == 0) {
+        return;
+    }
+
+    n = 0;
+    total = 0;
+
+    for (i = 0; i < peers_shm->number; i++) {
+        peer_shm = &peers_shm->peers[i];
+
+        if (peer_shm->slot == NGX_HTTP_CHECK_SLOT_FREE) {
+            continue;
+        }
+
+        count = peer_shm->access_count;
+
+        /* in requests per 1000 seconds */
+        rate = (uint64_t) (count - peer_shm->traffic_count) * 1000000
+               / elapsed;
+
+        peer_shm->traffic_count = count;
+        peer_shm->traffic = (peer_shm->traffic * 3 + (ngx_uint_t) rate) / 4;
+
+        total += peer_shm->traffic;
+        n++;
+    }
+
+    if (n == 0) {
+        return;
+    }
+
+    /* in probes per 1000 seconds */
+    floor = 1000000 / bc->max;
+    rate = (uint64_t) bc->rate * 1000;
+    max = bc->max;
+
+    /*
+     * Too many servers for one probe each in the max interval: the rate
+     * is shared out evenly, and the intervals grow past max.
+     */
+    if (floor * n > rate) {
+        floor = ngx_max(rate / n, 1);
+        max = (ngx_msec_t) (1000000 / floor);
+    }
+
+    spare = rate > floor * n ? rate - floor * n : 0;
+
+    for (i = 0; i < peers_shm->number; i++) {
+        peer_shm = &peers_shm->peers[i];
+
+        if (peer_shm->slot == NGX_HTTP_CHECK_SLOT_FREE) {
+            continue;
+        }
+
+        rate = floor + (total ? spare * peer_shm->traffic / total
+                              : spare / n);
+
+        interval = rate ? (ngx_msec_t) (1000000 / rate) : max;
+
+        if (interval < bc->min) {
+            interval = bc->min;
+        }
+
+        if (interval > max) {
+            interval = max;
+        }
+
+        peer_shm->interval = interval;
+    }
+}
+
+
+static void
+ngx_http_check_mark_up(ngx_http_check_peer_t *peer, ngx_uint_t rc,
+    ngx_msec_t latency)
+{
+    ngx_http_check_counters_t  *counters;
+
+    counters = &check_peers_ctx->peers_shm->counters;
+
+    peer->shm->down = 0;
+    peer->shm->last_change = ngx_http_check_now();
+    (void) ngx_atomic_fetch_add(&counters->transitions, 1);
+
+    ngx_http_check_verdict_update(peer);
+
+    ngx_http_check_journal_add(peer, NGX_HTTP_CHECK_PEER_DOWN,
+                               NGX_HTTP_CHECK_PEER_UP, rc, latency);
+}
+
+
+static ngx_msec_t
+ngx_http_check_timing_update(ngx_http_check_peer_t *peer)
+{
+    ngx_msec_t                    t[NGX_HTTP_CHECK_PHASE_N];
+    ngx_uint_t                    i, type;
+    ngx_http_check_timing_t      *timing, *type_timing;
+
+    if (peer->start_time == 0) {
+        return 0;
+    }
+
+    ngx_memzero(t, sizeof(t));
+
+    if (peer->connect_time) {
+        t[NGX_HTTP_CHECK_PHASE_CONNECT] = peer->connect_time - peer->start_time;
+    }
+
+    if (peer->send_time && peer->connect_time) {
+        t[NGX_HTTP_CHECK_PHASE_SEND] = peer->send_time - peer->connect_time;
+    }
+
+    if (peer->first_byte_time && peer->send_time) {
+        t[NGX_HTTP_CHECK_PHASE_FIRST_BYTE] =
+            peer->first_byte_time - peer->send_time;
+    }
+
+    t[NGX_HTTP_CHECK_PHASE_VERDICT] = ngx_current_msec - peer->start_time;
+
+    ngx_log_debug5(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http check timing index: %ui, connect: %M, send: %M, "
+                   "first byte: %M, verdict: %M",
+                   peer->index, t[NGX_HTTP_CHECK_PHASE_CONNECT],
+                   t[NGX_HTTP_CHECK_PHASE_SEND],
+                   t[NGX_HTTP_CHECK_PHASE_FIRST_BYTE],
+                   t[NGX_HTTP_CHECK_PHASE_VERDICT]);
+
+    timing = &peer->shm->timing;
+
+    type = peer->conf->check_type_conf - ngx_check_types;
+    type_timing = &check_peers_ctx->peers_shm->type_timing[type];
+
+    for (i = 0; i < NGX_HTTP_CHECK_PHASE_N; i++) {
+
+        /* a phase which has not been reached is not counted */
+        if (i == NGX_HTTP_CHECK_PHASE_CONNECT && peer->connect_time == 0) {
+            continue;
+        }
+
+        if (i == NGX_HTTP_CHECK_PHASE_SEND && peer->send_time == 0) {
+            continue;
+        }
+
+        if (i == NGX_HTTP_CHECK_PHASE_FIRST_BYTE
+            && peer->first_byte_time == 0)
+        {
+            continue;
+        }
+
+        ngx_http_check_phase_add(&timing->phase[i], t[i]);
+        ngx_http_check_phase_add(&type_timing->phase[i], t[i]);
+    }
+
+    peer->start_time = 0;
+
+    return t[NGX_HTTP_CHECK_PHASE_VERDICT];
+}
+
+
+static void
+ngx_http_check_journal_add(ngx_http_check_peer_t *peer, ngx_uint_t from,
+    ngx_uint_t to, ngx_uint_t reason, ngx_msec_t latency)
+{
+    ngx_uint_t                        seq;
+    ngx_time_t                       *tp;
+    ngx_http_check_journal_t         *journal;
+    ngx_http_check_journal_entry_t   *e;
+
+    journal = check_peers_ctx->peers_shm->journal;
+    if (journal == NULL) {
+        return;
+    }
+
+    seq = ngx_atomic_fetch_add(&journal->next, 1);
+    e = &journal->entries[seq % journal->size];
+
+    e->seq = 0;
+    ngx_memory_barrier();
+
+    tp = ngx_timeofday();
+
+    e->sec = tp->sec;
+    e->msec = tp->msec;
+    e->index = peer->index;
+    e->from = from;
+    e->to = to;
+    e->reason = reason;
+    e->latency = latency;
+
+    ngx_memory_barrier();
+    e->seq = seq;
+}
+
+
+static void
+ngx_http_check_phase_add(ngx_http_check_phase_t *phase, ngx_msec_t t)
+{
+    ngx_atomic_uint_t  max;
+
+    (void) ngx_atomic_fetch_add(&phase->count, 1);
+    (void) ngx_atomic_fetch_add(&phase->total, t);
+
+    for ( ;; ) {
+        max = phase->max;
+
+        if (t <= max || ngx_atomic_cmp_set(&phase->max, max, t)) {
+            break;
+        }
+    }
+}
+
+
+/*
+ * The number of flips between success and failure among the latest
+ * results. A flapping peer stays down until the flips shift out.
+ */
+ngx_uint_t
+ngx_http_check_flap_score(ngx_http_check_peer_shm_t *peer_shm)
+{
+    uint64_t    flips;
+    ngx_uint_t  n;
+
+    if (peer_shm->history_len < 2) {
+        return 0;
+    }
+
+    flips = peer_shm->history ^ (peer_shm->history >> 1);
+
+    if (peer_shm->history_len < 64) {
+        flips &= ((uint64_t) 1 << (peer_shm->history_len - 1)) - 1;
+
+    } else {
+        flips &= ~((uint64_t) 1 << 63);
+    }
+
+    for (n = 0; flips; n++) {
+        flips &= flips - 1;
+    }
+
+    return n;
+}
+
+
+ngx_uint_t
+ngx_http_check_rtt_bucket(ngx_msec_t ms)
+{
+    ngx_uint_t  n;
+
+    for (n = 0; ms && n < NGX_HTTP_CHECK_RTT_BUCKETS - 1; n++) {
+        ms >>= 1;
+    }
+
+    return n;
+}
+
+
+/* the wall clock time in milliseconds */
+static uint64_t
+ngx_http_check_now(void)
+{
+    ngx_time_t  *tp;
+
+    tp = ngx_timeofday();
+
+    return (uint64_t) tp->sec * 1000 + tp->msec;
+}
+
+
+static void
+ngx_http_check_clean_event(ngx_http_check_peer_t *peer)
+{
+    ngx_connection_t             *c;
+
+    c = peer->pc.connection;
+
+    if (c) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                "http check clean event: index:%ui, fd: %d",
+                peer->index, c->fd);
+
+        ngx_http_check_close(peer);
+    }
+
+    if (peer->check_timeout_ev.timer_set) {
+        ngx_del_timer(&peer->check_timeout_ev);
+    }
+
+    peer->state = NGX_HTTP_CHECK_ALL_DONE;
+
+    if (peer->check_data != NULL && peer->reinit) {
+        peer->reinit(peer);
+    }
+
+    peer->shm->owner = NGX_INVALID_PID;
+}
+
+
+/*
+ * The socket calls of a probe go through the functions below, which count
+ * them for ngx_http_check_run().  The connect stands for all the calls
+ * ngx_event_connect_peer() makes.
+ */
+static ngx_int_t
+ngx_http_check_connect(ngx_http_check_peer_t *peer)
+{
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    ngx_http_check_syscalls++;
+
+    rc = ngx_event_connect_peer(&peer->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_DECLINED) {
+        return rc;
+    }
+
+    c = peer->pc.connection;
+
+    c->send = ngx_http_check_send;
+    c->recv = ngx_http_check_recv;
+
+    return rc;
+}
+
+
+static ssize_t
+ngx_http_check_peek(ngx_connection_t *c)
+{
+    char  buf[1];
+
+    ngx_http_check_syscalls++;
+
+    return recv(c->fd, buf, 1, MSG_PEEK);
+}
+
+
+static ssize_t
+ngx_http_check_send(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ngx_http_check_syscalls++;
+
+    return ngx_send(c, buf, size);
+}
+
+
+static ssize_t
+ngx_http_check_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ngx_http_check_syscalls++;
+
+    return ngx_recv(c, buf, size);
+}
+
+
+static void
+ngx_http_check_close(ngx_http_check_peer_t *peer)
+{
+    ngx_http_check_syscalls++;
+
+    ngx_close_connection(peer->pc.connection);
+    peer->pc.connection = NULL;
+}
+
+
+/*
+ * While the host of the peer is suspect, only the canary probes it, and
+ * the probes of the other peers on the host fail at once.
+ */
+static ngx_uint_t
+ngx_http_check_host_probe(ngx_http_check_peer_t *peer)
+{
+    uint64_t                        now;
+    ngx_uint_t                      probe;
+    ngx_http_check_host_shm_t      *host;
+    ngx_http_check_suspect_conf_t  *sc;
+
+    if (peer->host_index == NGX_HTTP_CHECK_NO_HOST
+        || check_peers_ctx->peers_shm->hosts == NULL)
+    {
+        return 1;
+    }
+
+    host = &check_peers_ctx->peers_shm->hosts[peer->host_index];
+    sc = check_peers_ctx->suspect;
+    now = ngx_http_check_now();
+
+    if (host->suspect_until <= now) {
+        return 1;
+    }
+
+    probe = 0;
+
+    ngx_http_check_shm_lock(&host->lock);
+
+    if ((host->canary == 0 && now - host->canary_time >= sc->window)
+        || now - host->canary_time >= sc->hold)
+    {
+        /* the canary of a dead worker is replaced after the hold */
+        host->canary = peer->index + 1;
+        host->canary_time = now;
+        probe = 1;
+    }
+
+    ngx_spinlock_unlock(&host->lock);
+
+    return probe;
+}
+
+
+/*
+ * A connect to any peer clears the host. Several failed connects within
+ * the window make the host suspect for the hold time, which each failure
+ * while suspect extends.
+ */
+static void
+ngx_http_check_host_update(ngx_http_check_peer_t *peer, ngx_uint_t rc)
+{
+    uint64_t                        now;
+    ngx_http_check_host_shm_t      *host;
+    ngx_http_check_suspect_conf_t  *sc;
+
+    if (peer->host_index == NGX_HTTP_CHECK_NO_HOST
+        || check_peers_ctx->peers_shm->hosts == NULL)
+    {
+        return;
+    }
+
+    host = &check_peers_ctx->peers_shm->hosts[peer->host_index];
+    sc = check_peers_ctx->suspect;
+    now = ngx_http_check_now();
+
+    ngx_http_check_shm_lock(&host->lock);
+
+    if (host->canary == peer->index + 1) {
+        host->canary = 0;
+        host->canary_time = now;
+    }
+
+    if (rc != NGX_HTTP_CHECK_ERR_CONNECT
+        && (rc != NGX_HTTP_CHECK_ERR_TIMEOUT || peer->connect_time))
+    {
+        if (host->suspect_until > now) {
+            ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                          "check host of peer: %V is no longer suspect",
+                          &peer->peer_addr->name);
+        }
+
+        host->failures = 0;
+        host->suspect_until = 0;
+
+        ngx_spinlock_unlock(&host->lock);
+        return;
+    }
+
+    if (now - host->window_start > sc->window) {
+        host->window_start = now;
+        host->failures = 0;
+    }
+
+    host->failures++;
+
+    if (host->failures >= sc->failures || host->suspect_until > now) {
+
+        if (host->suspect_until <= now) {
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                          "check host of peer: %V is suspect after %ui "
+                          "failed connects in %M ms",
+                          &peer->peer_addr->name, host->failures, sc->window);
+
+            (void) ngx_atomic_fetch_add(
+                       &check_peers_ctx->peers_shm->counters.suspected, 1);
+
+            /* the first canary may start at once */
+            host->canary_time = 0;
+        }
+
+        host->suspect_until = now + sc->hold;
+    }
+
+    ngx_spinlock_unlock(&host->lock);
+}
+
+
+static ngx_int_t
+ngx_http_check_agent_init(ngx_cycle_t *cycle, ngx_http_check_peer_t *peer)
+{
+    ngx_peer_addr_t              *addr;
+    ngx_http_check_agent_t       *agent;
+    ngx_http_check_agent_conf_t  *ac;
+
+    addr = peer->peer_addr;
+    ac = peer->conf->agent;
+
+    switch (addr->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+#endif
+    case AF_INET:
+        break;
+
+    default:
+        /* an agent port makes no sense for a unix socket */
+        return NGX_OK;
+    }
+
+    agent = ngx_pcalloc(cycle->pool, sizeof(ngx_http_check_agent_t));
+    if (agent == NULL) {
+        return NGX_ERROR;
+    }
+
+    agent->sockaddr = ngx_palloc(cycle->pool, addr->socklen);
+    if (agent->sockaddr == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(agent->sockaddr, addr->sockaddr, addr->socklen);
+    agent->socklen = addr->socklen;
+
+    switch (agent->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        ((struct sockaddr_in6 *) agent->sockaddr)->sin6_port = htons(ac->port);
+        break;
+#endif
+
+    default: /* AF_INET */
+        ((struct sockaddr_in *) agent->sockaddr)->sin_port = htons(ac->port);
+    }
+
+    agent->check_ev.handler = ngx_http_check_agent_begin_handler;
+    agent->check_ev.log = cycle->log;
+    agent->check_ev.data = peer;
+
+    agent->timeout_ev.handler = ngx_http_check_agent_timeout_handler;
+    agent->timeout_ev.log = cycle->log;
+    agent->timeout_ev.data = peer;
+
+    peer->agent = agent;
+
+    ngx_add_timer(&agent->check_ev, ngx_random() % ac->interval);
+
+    return NGX_OK;
+}
+
+
+/*
+ * The agent is asked by one worker once an interval, elected like the
+ * worker which checks the peer.
+ */
+static void
+ngx_http_check_agent_begin_handler(ngx_event_t *event)
+{
+    ngx_msec_t                     interval;
+    ngx_http_check_peer_t         *peer;
+    ngx_http_check_peers_shm_t    *peers_shm;
+    ngx_http_check_agent_conf_t   *ac;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    if (check_peers_ctx == NULL || check_peers_ctx->peers_shm == NULL) {
+        return;
+    }
+
+    peers_shm = check_peers_ctx->peers_shm;
+
+    peer = event->data;
+    ac = peer->conf->agent;
+
+    ngx_add_timer(event, ac->interval / 2);
+
+    if (peer->shm->agent_owner == ngx_pid
+        || peer->agent->pc.connection != NULL)
+    {
+        return;
+    }
+
+    interval = ngx_current_msec - peer->shm->agent_access;
+
+    ngx_http_check_shm_lock(&peer->shm->lock);
+
+    if (peers_shm->generation != ngx_http_check_shm_generation) {
+        ngx_spinlock_unlock(&peer->shm->lock);
+        return;
+    }
+
+    if ((interval >= ac->interval
+         && peer->shm->agent_owner == NGX_INVALID_PID)
+        || interval >= (ac->interval << 4))
+    {
+        peer->shm->agent_owner = ngx_pid;
+        peer->shm->agent_access = ngx_current_msec;
+    }
+
+    ngx_spinlock_unlock(&peer->shm->lock);
+
+    if (peer->shm->agent_owner == ngx_pid) {
+        ngx_http_check_agent_connect(peer);
+    }
+}
+
+
+static void
+ngx_http_check_agent_connect(ngx_http_check_peer_t *peer)
+{
+    ngx_int_t                  rc;
+    ngx_connection_t          *c;
+    ngx_http_check_agent_t    *agent;
+
+    agent = peer->agent;
+
+    ngx_memzero(&agent->pc, sizeof(ngx_peer_connection_t));
+
+    agent->pc.sockaddr = agent->sockaddr;
+    agent->pc.socklen = agent->socklen;
+    agent->pc.name = &peer->peer_addr->name;
+
+    agent->pc.get = ngx_event_get_peer;
+    agent->pc.log = agent->check_ev.log;
+    agent->pc.log_error = check_peers_ctx->probe_log_error;
+
+    agent->sent = 0;
+    agent->len = 0;
+
+    rc = ngx_event_connect_peer(&agent->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_DECLINED) {
+        ngx_http_check_agent_done(peer, 0);
+        return;
+    }
+
+    /* NGX_OK or NGX_AGAIN */
+    c = agent->pc.connection;
+    c->data = peer;
+    c->log = agent->pc.log;
+    c->sendfile = 0;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    c->write->handler = ngx_http_check_agent_send_handler;
+    c->read->handler = ngx_http_check_agent_recv_handler;
+
+    ngx_add_timer(&agent->timeout_ev, peer->conf->check_timeout);
+
+    if (rc == NGX_OK) {
+        c->write->handler(c->write);
+    }
+}
+
+
+static void
+ngx_http_check_agent_send_handler(ngx_event_t *event)
+{
+    ssize_t                    size;
+    ngx_str_t                 *send;
+    ngx_connection_t          *c;
+    ngx_http_check_peer_t     *peer;
+    ngx_http_check_agent_t    *agent;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    c = event->data;
+    peer = c->data;
+    agent = peer->agent;
+    send = &peer->conf->agent->send;
+
+    while (agent->sent < send->len) {
+
+        size = c->send(c, send->data + agent->sent, send->len - agent->sent);
+
+        if (size > 0) {
+            agent->sent += size;
+            continue;
+        }
+
+        if (size == 0 || size == NGX_AGAIN) {
+            return;
+        }
+
+        c->error = 1;
+        ngx_http_check_agent_done(peer, 0);
+        return;
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        ngx_http_check_agent_done(peer, 0);
+    }
+}
+
+
+/* the agent answers with one line, and may close the connection after it */
+static void
+ngx_http_check_agent_recv_handler(ngx_event_t *event)
+{
+    u_char                    *p;
+    ssize_t                    size;
+    ngx_connection_t          *c;
+    ngx_http_check_peer_t     *peer;
+    ngx_http_check_agent_t    *agent;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    c = event->data;
+    peer = c->data;
+    agent = peer->agent;
+
+    while (agent->len < NGX_HTTP_CHECK_AGENT_LINE) {
+
+        size = c->recv(c, agent->line + agent->len,
+                       NGX_HTTP_CHECK_AGENT_LINE - agent->len);
+
+        if (size > 0) {
+            p = ngx_strlchr(agent->line + agent->len,
+                            agent->line + agent->len + size, LF);
+
+            agent->len += size;
+
+            if (p) {
+                agent->len = p - agent->line;
+                break;
+            }
+
+            continue;
+        }
+
+        if (size == NGX_AGAIN) {
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                ngx_http_check_agent_done(peer, 0);
+            }
+
+            return;
+        }
+
+        if (size == 0) {
+            break;
+        }
+
+        c->error = 1;
+        ngx_http_check_agent_done(peer, 0);
+        return;
+    }
+
+    if (agent->len == 0) {
+        ngx_http_check_agent_done(peer, 0);
+        return;
+    }
+
+    ngx_http_check_agent_parse(peer);
+    ngx_http_check_agent_done(peer, 1);
+}
+
+
+/*
+ * The agent is not a health check: when it can not be reached, the state
+ * it reported last is kept and the failure is only counted.
+ */
+static void
+ngx_http_check_agent_timeout_handler(ngx_event_t *event)
+{
+    ngx_http_check_peer_t  *peer;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    peer = event->data;
+
+    ngx_log_error(check_peers_ctx->probe_log_level, event->log, 0,
+                  "check agent time out with peer: %V ",
+                  &peer->peer_addr->name);
+
+    ngx_http_check_agent_done(peer, 0);
+}
+
+
+/*
+ * The reply is a list of words separated by spaces, tabs or commas, as
+ * the HAProxy agents send:
+ *
+ *     "up", "ready"                  cancel "down" and "drain"
+ *     "down", "fail", "stopped",
+ *     "maint"                        take the peer out of the balancing
+ *     "drain"                        give the peer no new requests
+ *     "75%"                          scale the weight of the peer
+ *
+ * The words not known and the text after "#" are ignored.
+ */
+static void
+ngx_http_check_agent_parse(ngx_http_check_peer_t *peer)
+{
+    u_char                      *p, *last, *word;
+    size_t                       len;
+    ngx_int_t                    n;
+    ngx_uint_t                   down, drain, weight;
+    ngx_http_check_agent_t      *agent;
+    ngx_http_check_peer_shm_t   *shm;
+
+    agent = peer->agent;
+    shm = peer->shm;
+
+    down = shm->agent_down;
+    drain = shm->agent_drain;
+    weight = shm->agent_weight;
+
+    p = agent->line;
+    last = agent->line + agent->len;
+
+    while (p < last) {
+
+        if (*p == ' ' || *p == '\t' || *p == ',' || *p == CR) {
+            p++;
+            continue;
+        }
+
+        if (*p == '#') {
+            break;
+        }
+
+        word = p;
+
+        while (p < last && *p != ' ' && *p != '\t' && *p != ','
+               && *p != CR && *p != '#')
+        {
+            p++;
+        }
+
+        len = p - word;
+
+        if (word[len - 1] == '%') {
+            n = ngx_atoi(word, len - 1);
+            if (n != NGX_ERROR) {
+                weight = ngx_min((ngx_uint_t) n,
+                                 NGX_HTTP_CHECK_AGENT_MAX_WEIGHT);
+            }
+
+            continue;
+        }
+
+        if ((len == 2 && ngx_strncasecmp(word, (u_char *) "up", 2) == 0)
+            || (len == 5 && ngx_strncasecmp(word, (u_char *) "ready", 5) == 0))
+        {
+            down = 0;
+            drain = 0;
+
+        } else if ((len == 4
+                    && (ngx_strncasecmp(word, (u_char *) "down", 4) == 0
+                        || ngx_strncasecmp(word, (u_char *) "fail", 4) == 0))
+                   || (len == 5
+                       && ngx_strncasecmp(word, (u_char *) "maint", 5) == 0)
+                   || (len == 7
+                       && ngx_strncasecmp(word, (u_char *) "stopped", 7) == 0))
+        {
+            down = 1;
+
+        } else if (len == 5
+                   && ngx_strncasecmp(word, (u_char *) "drain", 5) == 0)
+        {
+            drain = 1;
+        }
+    }
+
+    if (down != shm->agent_down || drain != shm->agent_drain) {
+        ngx_log_error(NGX_LOG_NOTICE, agent->check_ev.log, 0,
+                      "check agent of peer: %V reports \"%*s\"",
+                      &peer->peer_addr->name, agent->len, agent->line);
+    }
+
+    if (shm->agent_down != down || shm->agent_drain != drain
+        || shm->agent_weight != weight)
+    {
+        shm->agent_down = down;
+        shm->agent_drain = drain;
+        shm->agent_weight = weight;
+
+        ngx_http_check_verdict_update(peer);
+    }
+}
+
+
+static void
+ngx_http_check_agent_done(ngx_http_check_peer_t *peer, ngx_uint_t ok)
+{
+    ngx_http_check_agent_t  *agent;
+
+    agent = peer->agent;
+
+    if (agent->pc.connection) {
+        ngx_close_connection(agent->pc.connection);
+        agent->pc.connection = NULL;
+    }
+
+    if (agent->timeout_ev.timer_set) {
+        ngx_del_timer(&agent->timeout_ev);
+    }
+
+    if (!ok) {
+        (void) ngx_atomic_fetch_add(&peer->shm->agent_fails, 1);
+    }
+
+    peer->shm->agent_access = ngx_current_msec;
+    peer->shm->agent_owner = NGX_INVALID_PID;
+}
+
+
+static ngx_int_t
+ngx_http_check_warmup_init(ngx_cycle_t *cycle, ngx_http_check_peer_t *peer)
+{
+    ngx_http_check_warmup_t  *warmup;
+
+    warmup = ngx_pcalloc(cycle->pool, sizeof(ngx_http_check_warmup_t));
+    if (warmup == NULL) {
+        return NGX_ERROR;
+    }
+
+    warmup->step_ev.handler = ngx_http_check_warmup_step_handler;
+    warmup->step_ev.log = cycle->log;
+    warmup->step_ev.data = peer;
+
+    warmup->timeout_ev.handler = ngx_http_check_warmup_timeout_handler;
+    warmup->timeout_ev.log = cycle->log;
+    warmup->timeout_ev.data = peer;
+
+    peer->warmup = warmup;
+
+    return NGX_OK;
+}
+
+
+/*
+ * A peer which passes its checks is marked up only after the requests of
+ * check_warmup have been sent to it, by the worker which saw it pass
+ * first.  NGX_OK is returned once they all have been sent.  The replay of
+ * a worker which has gone away is taken over after twice the time a
+ * request may take.
+ */
+static ngx_int_t
+ngx_http_check_warmup_begin(ngx_http_check_peer_t *peer)
+{
+    ngx_msec_t                      interval;
+    ngx_uint_t                      begin;
+    ngx_http_check_peer_shm_t      *shm;
+    ngx_http_check_warmup_conf_t   *wc;
+
+    shm = peer->shm;
+    wc = peer->conf->warmup;
+
+    if (shm->warmup == NGX_HTTP_CHECK_WARMUP_DONE) {
+        return NGX_OK;
+    }
+
+    interval = ngx_current_msec - shm->warmup_access;
+    begin = 0;
+
+    ngx_http_check_shm_lock(&shm->lock);
+
+    if (shm->warmup == NGX_HTTP_CHECK_WARMUP_NONE
+        || shm->warmup_owner == NGX_INVALID_PID
+        || interval >= ((wc->timeout + wc->interval) << 1))
+    {
+        shm->warmup = NGX_HTTP_CHECK_WARMUP_RUNNING;
+        shm->warmup_owner = ngx_pid;
+        shm->warmup_access = ngx_current_msec;
+        shm->warmup_sent = 0;
+
+        begin = 1;
+    }
+
+    ngx_spinlock_unlock(&shm->lock);
+
+    if (!begin) {
+        return NGX_AGAIN;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "check warmup of peer: %V begins with %ui requests",
+                  &peer->peer_addr->name, wc->count);
+
+    peer->warmup->sent = 0;
+
+    /* a request of an aborted replay is still counted in this one */
+    if (!peer->warmup->step_ev.timer_set
+        && peer->warmup->pc.connection == NULL)
+    {
+        ngx_add_timer(&peer->warmup->step_ev, 0);
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_uint_t
+ngx_http_check_warmup_owned(ngx_http_check_peer_t *peer)
+{
+    return peer->shm->warmup == NGX_HTTP_CHECK_WARMUP_RUNNING
+           && peer->shm->warmup_owner == ngx_pid
+           && peer->slot_gen == peer->shm->slot_gen;
+}
+
+
+static void
+ngx_http_check_warmup_step_handler(ngx_event_t *event)
+{
+    ngx_int_t                  rc;
+    ngx_connection_t          *c;
+    ngx_http_check_peer_t     *peer;
+    ngx_http_check_warmup_t   *warmup;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    peer = event->data;
+    warmup = peer->warmup;
+
+    if (!ngx_http_check_warmup_owned(peer)) {
+        return;
+    }
+
+    ngx_memzero(&warmup->pc, sizeof(ngx_peer_connection_t));
+
+    warmup->pc.sockaddr = peer->peer_addr->sockaddr;
+    warmup->pc.socklen = peer->peer_addr->socklen;
+    warmup->pc.name = &peer->peer_addr->name;
+
+    warmup->pc.get = ngx_event_get_peer;
+    warmup->pc.log = event->log;
+    warmup->pc.log_error = check_peers_ctx->probe_log_error;
+
+    warmup->pos = 0;
+
+    rc = ngx_event_connect_peer(&warmup->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_DECLINED) {
+        ngx_http_check_warmup_done(peer, 0);
+        return;
+    }
+
+    /* NGX_OK or NGX_AGAIN */
+    c = warmup->pc.connection;
+    c->data = peer;
+    c->log = warmup->pc.log;
+    c->sendfile = 0;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    c->write->handler = ngx_http_check_warmup_send_handler;
+    c->read->handler = ngx_http_check_warmup_recv_handler;
+
+    ngx_add_timer(&warmup->timeout_ev, peer->conf->warmup->timeout);
+
+    if (rc == NGX_OK) {
+        c->write->handler(c->write);
+    }
+}
+
+
+static void
+ngx_http_check_warmup_send_handler(ngx_event_t *event)
+{
+    ssize_t                         size;
+    ngx_str_t                      *request;
+    ngx_connection_t               *c;
+    ngx_http_check_peer_t          *peer;
+    ngx_http_check_warmup_t        *warmup;
+    ngx_http_check_warmup_conf_t   *wc;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    c = event->data;
+    peer = c->data;
+    warmup = peer->warmup;
+    wc = peer->conf->warmup;
+
+    request = wc->requests.elts;
+    request = &request[warmup->sent % wc->requests.nelts];
+
+    while (warmup->pos < request->len) {
+
+        size = c->send(c, request->data + warmup->pos,
+                       request->len - warmup->pos);
+
+        if (size > 0) {
+            warmup->pos += size;
+            continue;
+        }
+
+        if (size == 0 || size == NGX_AGAIN) {
+            return;
+        }
+
+        c->error = 1;
+        ngx_http_check_warmup_done(peer, 0);
+        return;
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        ngx_http_check_warmup_done(peer, 0);
+    }
+}
+
+
+/* the response is not looked at, the peer closes the connection after it */
+static void
+ngx_http_check_warmup_recv_handler(ngx_event_t *event)
+{
+    u_char                     buf[1024];
+    ssize_t                    size;
+    ngx_connection_t          *c;
+    ngx_http_check_peer_t     *peer;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    c = event->data;
+    peer = c->data;
+
+    for ( ;; ) {
+
+        size = c->recv(c, buf, sizeof(buf));
+
+        if (size > 0) {
+            continue;
+        }
+
+        if (size == NGX_AGAIN) {
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                ngx_http_check_warmup_done(peer, 0);
+            }
+
+            return;
+        }
+
+        break;
+    }
+
+    if (size != 0) {
+        c->error = 1;
+    }
+
+    ngx_http_check_warmup_done(peer, size == 0);
+}
+
+
+static void
+ngx_http_check_warmup_timeout_handler(ngx_event_t *event)
+{
+    ngx_http_check_peer_t  *peer;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    peer = event->data;
+
+    ngx_log_error(check_peers_ctx->probe_log_level, event->log, 0,
+                  "check warmup time out with peer: %V ",
+                  &peer->peer_addr->name);
+
+    ngx_http_check_warmup_done(peer, 0);
+}
+
+
+/*
+ * A request which fails is counted all the same: the checks, not the
+ * replay, tell whether the peer works.
+ */
+static void
+ngx_http_check_warmup_done(ngx_http_check_peer_t *peer, ngx_uint_t ok)
+{
+    ngx_uint_t                            up;
+    ngx_http_check_warmup_t              *warmup;
+    ngx_http_check_peer_shm_t            *shm;
+    ngx_http_upstream_check_srv_conf_t   *ucscf;
+
+    warmup = peer->warmup;
+    shm = peer->shm;
+    ucscf = peer->conf;
+
+    if (warmup->pc.connection) {
+        ngx_close_connection(warmup->pc.connection);
+        warmup->pc.connection = NULL;
+    }
+
+    if (warmup->timeout_ev.timer_set) {
+        ngx_del_timer(&warmup->timeout_ev);
+    }
+
+    if (!ngx_http_check_warmup_owned(peer)) {
+        return;
+    }
+
+    if (!ok) {
+        ngx_log_error(check_peers_ctx->probe_log_level, ngx_cycle->log, 0,
+                      "check warmup request %ui failed with peer: %V",
+                      warmup->sent, &peer->peer_addr->name);
+    }
+
+    warmup->sent++;
+
+    shm->warmup_sent = warmup->sent;
+    shm->warmup_access = ngx_current_msec;
+
+    if (warmup->sent < ucscf->warmup->count) {
+        ngx_add_timer(&warmup->step_ev, ucscf->warmup->interval);
+        return;
+    }
+
+    up = 0;
+
+    ngx_http_check_shm_lock(&shm->lock);
+
+    if (ngx_http_check_warmup_owned(peer)) {
+        shm->warmup = NGX_HTTP_CHECK_WARMUP_DONE;
+        shm->warmup_owner = NGX_INVALID_PID;
+
+        up = shm->down && shm->rise_count >= ucscf->rise_count;
+    }
+
+    ngx_spinlock_unlock(&shm->lock);
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "check warmup of peer: %V done", &peer->peer_addr->name);
+
+    if (up) {
+        ngx_http_check_mark_up(peer, NGX_HTTP_CHECK_OK, 0);
+    }
+}
+
+
+static void
+ngx_http_check_timeout_handler(ngx_event_t *event)
+{
+    ngx_msec_t                      lag;
+    ngx_http_check_peer_t          *peer;
+    ngx_http_check_counters_t      *counters;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    peer = event->data;
+
+    lag = ngx_http_check_event_lag(event);
+
+    if (check_peers_ctx->max_lag && lag > check_peers_ctx->max_lag) {
+        /*
+         * The time was spent in this worker, not waiting for the peer.
+         * A busy worker ignores many timeouts, so they are only counted.
+         */
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, event->log, 0,
+                       "http check time out with peer: %V ignored, "
+                       "the timer was %M ms late",
+                       &peer->peer_addr->name, lag);
+
+        counters = &check_peers_ctx->peers_shm->counters;
+
+        (void) ngx_atomic_fetch_add(&counters->discounted, 1);
+
+        if (counters->in_flight > 0) {
+            (void) ngx_atomic_fetch_add(&counters->in_flight, -1);
+        }
+
+        peer->start_time = 0;
+        ngx_http_check_clean_event(peer);
+        return;
+    }
+
+    ngx_log_error(check_peers_ctx->probe_log_level, event->log, 0,
+                  "check time out with peer: %V ", &peer->peer_addr->name);
+
+    ngx_http_check_status_update(peer, NGX_HTTP_CHECK_ERR_TIMEOUT);
+    ngx_http_check_clean_event(peer);
+}
+
+
+static void
+ngx_http_check_finish_handler(ngx_event_t *event)
+{
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+}
+
+
+/*
+ * Only one worker runs a feed. It keeps the feed as long as it ticks,
+ * another worker takes it over once it has been silent for 4 intervals.
+ */
+static ngx_uint_t
+ngx_http_check_feed_own(ngx_http_check_feed_shm_t *feed,
+    ngx_msec_t interval)
+{
+    ngx_http_check_peers_shm_t  *peers_shm;
+
+    peers_shm = check_peers_ctx->peers_shm;
+
+    ngx_http_check_shm_lock(&feed->lock);
+
+    if (peers_shm->generation == ngx_http_check_shm_generation
+        && (feed->owner == NGX_INVALID_PID || feed->owner == ngx_pid
+            || ngx_current_msec - feed->access_time >= interval << 2))
+    {
+        feed->owner = ngx_pid;
+        feed->access_time = ngx_current_msec;
+    }
+
+    ngx_spinlock_unlock(&feed->lock);
+
+    return feed->owner == ngx_pid;
+}
+
+
+/*
+ * Fetch the next entry of the journal for the feed. The entries which
+ * have been overwritten before the feed got to them are counted as
+ * dropped.
+ */
+static ngx_int_t
+ngx_http_check_feed_next(ngx_http_check_feed_shm_t *feed,
+    ngx_http_check_journal_entry_t *entry)
+{
+    ngx_uint_t                        seq, next, slot;
+    ngx_http_check_journal_t         *journal;
+    ngx_http_check_journal_entry_t   *e;
+
+    journal = check_peers_ctx->peers_shm->journal;
+    if (journal == NULL) {
+        return NGX_DONE;
+    }
+
+    for ( ;; ) {
+        next = journal->next;
+        seq = feed->cursor;
+
+        if (seq >= next) {
+            return NGX_DONE;
+        }
+
+        if (next - seq > journal->size) {
+            (void) ngx_atomic_fetch_add(&feed->dropped,
+                                        next - journal->size - seq);
+            feed->cursor = next - journal->size;
+            continue;
+        }
+
+        e = &journal->entries[seq % journal->size];
+
+        *entry = *e;
+        ngx_memory_barrier();
+        slot = e->seq;
+
+        if (slot == 0 || slot < seq) {
+            /* not published yet, try it the next time */
+            return NGX_DONE;
+        }
+
+        feed->cursor = seq + 1;
+
+        if (slot != seq || entry->seq != seq) {
+            (void) ngx_atomic_fetch_add(&feed->dropped, 1);
+            continue;
+        }
+
+        if (entry->index >= check_peers_ctx->peers.nelts
+            || entry->from > NGX_HTTP_CHECK_PEER_DOWN
+            || entry->to > NGX_HTTP_CHECK_PEER_DOWN
+            || entry->reason >= NGX_HTTP_CHECK_ERR_N)
+        {
+            continue;
+        }
+
+        return NGX_OK;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_check_notify_init(ngx_cycle_t *cycle)
+{
+    size_t                          len, size;
+    ngx_uint_t                      i;
+    ngx_http_check_peer_t          *peer;
+    ngx_http_check_peers_t         *peers;
+    ngx_http_check_notify_t        *notify;
+    ngx_http_check_notify_conf_t   *nc;
+
+    peers = check_peers_ctx;
+    nc = peers->notify;
+    notify = &ngx_http_check_notify;
+
+    len = 0;
+    peer = peers->peers.elts;
+
+    for (i = 0; i < peers->peers.nelts; i++) {
+        if (peer[i].upstream_name->len > len) {
+            len = peer[i].upstream_name->len;
+        }
+    }
+
+    notify->entry_len = 128 + 3 * NGX_INT_T_LEN + NGX_TIME_T_LEN + len
+                        + NGX_SOCKADDR_STRLEN;
+
+    if (nc->command.len) {
+        notify->prefix = sizeof("NGX_CHECK_EVENTS=") - 1;
+
+    } else {
+        notify->prefix = sizeof("POST  HTTP/1.0" CRLF "Host: " CRLF
+                                "Content-Type: application/json" CRLF
+                                "Content-Length: " CRLF CRLF) - 1
+                         + nc->url.uri.len + nc->url.host.len
+                         + NGX_SIZE_T_LEN;
+    }
+
+    size = notify->prefix + sizeof("{\"events\":[]}")
+           + nc->batch * notify->entry_len;
+
+    notify->buf.start = ngx_palloc(cycle->pool, size);
+    if (notify->buf.start == NULL) {
+        return NGX_ERROR;
+    }
+
+    notify->buf.pos = notify->buf.start;
+    notify->buf.last = notify->buf.start;
+    notify->buf.end = notify->buf.start + size;
+
+    notify->tick_ev.handler = ngx_http_check_notify_handler;
+    notify->tick_ev.log = cycle->log;
+    notify->tick_ev.data = notify;
+    notify->tick_ev.timer_set = 0;
+
+    notify->timeout_ev.handler = ngx_http_check_notify_timeout_handler;
+    notify->timeout_ev.log = cycle->log;
+    notify->timeout_ev.data = notify;
+    notify->timeout_ev.timer_set = 0;
+
+    ngx_add_timer(&notify->tick_ev, nc->interval);
+
+    return NGX_OK;
+}
+
+
+/*
+ * Once an interval, the worker owning the notify feed sends at most
+ * "batch" transitions from the journal in one request or one command.
+ * The transitions left in the journal go with the next ones.  A batch
+ * which failed is sent again, up to "retries" times, before new ones.
+ */
+static void
+ngx_http_check_notify_handler(ngx_event_t *event)
+{
+    u_char                          *p, *body;
+    ngx_int_t                        rc;
+    ngx_uint_t                       n;
+    ngx_http_check_peer_t           *peer;
+    ngx_http_check_peers_t          *peers;
+    ngx_http_check_notify_t         *notify;
+    ngx_http_check_feed_shm_t       *feed;
+    ngx_http_check_notify_conf_t    *nc;
+    ngx_http_check_journal_entry_t   entry;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    peers = check_peers_ctx;
+    if (peers == NULL || peers->peers_shm == NULL) {
+        return;
+    }
+
+    notify = event->data;
+    nc = peers->notify;
+    feed = &peers->peers_shm->notify;
+
+    ngx_add_timer(event, nc->interval);
+
+    if (!ngx_http_check_feed_own(feed, nc->interval)) {
+        return;
+    }
+
+    /* the last batch is still on its way */
+    if (notify->pc.connection != NULL) {
+        return;
+    }
+
+    body = notify->buf.start + notify->prefix;
+
+    if (notify->events) {
+        /* a POST has moved the body right behind its request header */
+        ngx_memmove(body, notify->body, notify->body_len);
+        p = body + notify->body_len;
+        goto send;
+    }
+
+    peer = peers->peers.elts;
+
+    p = ngx_cpymem(body, "{\"events\":[", sizeof("{\"events\":[") - 1);
+
+    for (n = 0; n < nc->batch; n++) {
+
+        if (ngx_http_check_feed_next(feed, &entry) != NGX_OK) {
+            break;
+        }
+
+        p = ngx_slprintf(p, notify->buf.end,
+                "%s{\"seq\":%ui,\"time\":%T.%03ui,\"upstream\":\"%V\","
+                "\"server\":\"%V\",\"from\":\"%s\",\"to\":\"%s\","
+                "\"reason\":\"%s\",\"latency\":%M}",
+                n ? "," : "", entry.seq, entry.sec, entry.msec,
+                peer[entry.index].upstream_name,
+                &peer[entry.index].peer_addr->name,
+                ngx_http_check_peer_state_names[entry.from],
+                ngx_http_check_peer_state_names[entry.to],
+                ngx_http_check_err_names[entry.reason],
+                entry.latency);
+    }
+
+    if (n == 0) {
+        return;
+    }
+
+    p = ngx_cpymem(p, "]}", sizeof("]}") - 1);
+
+    notify->events = n;
+    notify->tries = 0;
+
+send:
+
+    notify->body = body;
+    notify->body_len = p - body;
+    notify->tries++;
+
+    if (nc->command.len) {
+        rc = ngx_http_check_notify_exec(notify, nc, body, p - body);
+
+    } else {
+        rc = ngx_http_check_notify_post(notify, nc, body, p - body);
+    }
+
+    if (rc != NGX_AGAIN) {
+        ngx_http_check_notify_done(notify, rc == NGX_OK);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_check_notify_post(ngx_http_check_notify_t *notify,
+    ngx_http_check_notify_conf_t *nc, u_char *body, size_t len)
+{
+    u_char            *p;
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    p = ngx_sprintf(notify->buf.start,
+                    "POST %V HTTP/1.0" CRLF
+                    "Host: %V" CRLF
+                    "Content-Type: application/json" CRLF
+                    "Content-Length: %uz" CRLF CRLF,
+                    &nc->url.uri, &nc->url.host, len);
+
+    ngx_memmove(p, body, len);
+    notify->body = p;
+
+    notify->buf.pos = notify->buf.start;
+    notify->buf.last = p + len;
+    notify->status_len = 0;
+
+    ngx_memzero(&notify->pc, sizeof(ngx_peer_connection_t));
+
+    notify->pc.sockaddr = nc->url.addrs[0].sockaddr;
+    notify->pc.socklen = nc->url.addrs[0].socklen;
+    notify->pc.name = &nc->url.addrs[0].name;
+
+    notify->pc.get = ngx_event_get_peer;
+    notify->pc.log = notify->tick_ev.log;
+    notify->pc.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&notify->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_ERR, notify->pc.log, 0,
+                      "check notify can not connect to %V",
+                      &nc->url.url);
+        return NGX_ERROR;
+    }
+
+    /* NGX_OK or NGX_AGAIN */
+    c = notify->pc.connection;
+    c->data = notify;
+    c->log = notify->pc.log;
+    c->sendfile = 0;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    c->write->handler = ngx_http_check_notify_send_handler;
+    c->read->handler = ngx_http_check_notify_recv_handler;
+
+    ngx_add_timer(&notify->timeout_ev, nc->interval);
+
+    if (rc == NGX_OK) {
+        c->write->handler(c->write);
+    }
+
+    return NGX_AGAIN;
+}
+
+
+/*
+ * The command is run by /bin/sh with the batch in the environment
+ * variable NGX_CHECK_EVENTS.  The worker forks a child which forks again
+ * and exits at once, so that it is reaped here with SIGCHLD blocked and
+ * the nginx SIGCHLD handler never sees a process it does not know.  The
+ * grandchild runs the command, waits for it and writes its exit status
+ * to a pipe read by the worker.
+ */
+static ngx_int_t
+ngx_http_check_notify_exec(ngx_http_check_notify_t *notify,
+    ngx_http_check_notify_conf_t *nc, u_char *body, size_t len)
+{
+    int                fd[2], status, signo;
+    char              *env[2];
+    sigset_t           set, old, pending;
+    ngx_pid_t          pid;
+    ngx_connection_t  *c;
+
+    ngx_memcpy(notify->buf.start, "NGX_CHECK_EVENTS=", notify->prefix);
+    body[len] = '\0';
+
+    env[0] = (char *) notify->buf.start;
+    env[1] = NULL;
+
+    if (pipe(fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, notify->tick_ev.log, ngx_errno,
+                      "pipe() failed while running check notify \"%V\"",
+                      &nc->command);
+        return NGX_ERROR;
+    }
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+
+    if (sigprocmask(SIG_BLOCK, &set, &old) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, notify->tick_ev.log, ngx_errno,
+                      "sigprocmask() failed while running check notify");
+        goto failed;
+    }
+
+    pid = fork();
+
+    switch (pid) {
+
+    case -1:
+        ngx_log_error(NGX_LOG_ALERT, notify->tick_ev.log, ngx_errno,
+                      "fork() failed while running check notify \"%V\"",
+                      &nc->command);
+
+        (void) sigprocmask(SIG_SETMASK, &old, NULL);
+        goto failed;
+
+    case 0:
+        ngx_http_check_notify_spawn(nc, env, fd[1]);
+        _exit(1);
+
+    default:
+        break;
+    }
+
+    while (waitpid(pid, &status, 0) == -1) {
+        if (ngx_errno != NGX_EINTR) {
+            status = -1;
+            break;
+        }
+    }
+
+    /* the child has been reaped, its SIGCHLD is not needed */
+    if (sigpending(&pending) == 0 && sigismember(&pending, SIGCHLD)) {
+        (void) sigwait(&set, &signo);
+    }
+
+    (void) sigprocmask(SIG_SETMASK, &old, NULL);
+
+    if (status != 0) {
+        ngx_log_error(NGX_LOG_ALERT, notify->tick_ev.log, 0,
+                      "check notify \"%V\" could not be started",
+                      &nc->command);
+        goto failed;
+    }
+
+    (void) close(fd[1]);
+
+    if (ngx_nonblocking(fd[0]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, notify->tick_ev.log, ngx_socket_errno,
+                      ngx_nonblocking_n " failed");
+        (void) close(fd[0]);
+        return NGX_ERROR;
+    }
+
+    c = ngx_get_connection(fd[0], notify->tick_ev.log);
+    if (c == NULL) {
+        (void) close(fd[0]);
+        return NGX_ERROR;
+    }
+
+    c->data = notify;
+    c->read->handler = ngx_http_check_notify_exit_handler;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    notify->pc.connection = c;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_add_timer(&notify->timeout_ev, nc->interval);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, notify->tick_ev.log, 0,
+                   "http check notify exec events: %ui", notify->events);
+
+    return NGX_AGAIN;
+
+failed:
+
+    (void) close(fd[0]);
+    (void) close(fd[1]);
+
+    return NGX_ERROR;
+}
+
+
+/* runs in the child of the worker and never returns */
+static void
+ngx_http_check_notify_spawn(ngx_http_check_notify_conf_t *nc, char **env,
+    int fd)
+{
+    int        status;
+    long       n, i;
+    u_char     code;
+    sigset_t   set;
+    ngx_pid_t  pid;
+
+    pid = fork();
+
+    if (pid != 0) {
+        _exit(pid == -1);
+    }
+
+    /* the grandchild keeps the standard streams and the pipe only */
+    n = sysconf(_SC_OPEN_MAX);
+
+    for (i = 3; i < n; i++) {
+        if (i != fd) {
+            (void) close((int) i);
+        }
+    }
+
+    pid = fork();
+
+    if (pid == 0) {
+        (void) close(fd);
+
+        sigemptyset(&set);
+        (void) sigprocmask(SIG_SETMASK, &set, NULL);
+        (void) signal(SIGPIPE, SIG_DFL);
+
+        execle("/bin/sh", "sh", "-c", (char *) nc->command.data,
+               (char *) NULL, env);
+
+        _exit(127);
+    }
+
+    code = 255;
+
+    /* SIGCHLD is still blocked, so the nginx handler does not reap it */
+    while (pid != -1 && waitpid(pid, &status, 0) == -1) {
+        if (ngx_errno != NGX_EINTR) {
+            pid = -1;
+        }
+    }
+
+    if (pid != -1 && WIFEXITED(status)) {
+        code = (u_char) WEXITSTATUS(status);
+    }
+
+    (void) ngx_write_fd(fd, &code, 1);
+
+    _exit(0);
+}
+
+
+static void
+ngx_http_check_notify_exit_handler(ngx_event_t *event)
+{
+    u_char                          code;
+    ssize_t                         n;
+    ngx_connection_t               *c;
+    ngx_http_check_notify_t        *notify;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    c = event->data;
+    notify = c->data;
+
+    n = read(c->fd, &code, 1);
+
+    if (n == -1 && ngx_errno == NGX_EAGAIN) {
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            ngx_http_check_notify_done(notify, 0);
+        }
+
+        return;
+    }
+
+    if (n != 1 || code != 0) {
+        ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                      "check notify \"%V\" exited with %d",
+                      &check_peers_ctx->notify->command,
+                      n == 1 ? (int) code : -1);
+
+        ngx_http_check_notify_done(notify, 0);
+        return;
+    }
+
+    ngx_http_check_notify_done(notify, 1);
+}
+
+
+static void
+ngx_http_check_notify_send_handler(ngx_event_t *event)
+{
+    ssize_t                     size;
+    ngx_connection_t           *c;
+    ngx_http_check_notify_t    *notify;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    c = event->data;
+    notify = c->data;
+
+    while (notify->buf.pos < notify->buf.last) {
+
+        size = c->send(c, notify->buf.pos,
+                       notify->buf.last - notify->buf.pos);
+
+        if (size > 0) {
+            notify->buf.pos += size;
+
+        } else if (size == 0 || size == NGX_AGAIN) {
+
+            if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                goto notify_send_fail;
+            }
+
+            return;
+
+        } else {
+            c->error = 1;
+            goto notify_send_fail;
+        }
+    }
+
+    return;
+
+notify_send_fail:
+    ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                  "check notify send error with %V",
+                  &check_peers_ctx->notify->url.url);
+
+    ngx_http_check_notify_done(notify, 0);
+}
+
+
+static void
+ngx_http_check_notify_recv_handler(ngx_event_t *event)
+{
+    ssize_t                     size;
+    ngx_connection_t           *c;
+    ngx_http_check_notify_t    *notify;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    c = event->data;
+    notify = c->data;
+
+    while (notify->status_len < sizeof(notify->status)) {
+
+        size = c->recv(c, notify->status + notify->status_len,
+                       sizeof(notify->status) - notify->status_len);
+
+        if (size > 0) {
+            notify->status_len += size;
+
+        } else if (size == NGX_AGAIN) {
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                goto notify_recv_fail;
+            }
+
+            return;
+
+        } else {
+            goto notify_recv_fail;
+        }
+    }
+
+    /* "HTTP/1.x 2xx" */
+    if (ngx_strncmp(notify->status, "HTTP/1.", 7) == 0
+        && notify->status[9] == '2')
+    {
+        ngx_http_check_notify_done(notify, 1);
+        return;
+    }
+
+notify_recv_fail:
+    ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                  "check notify to %V was not accepted",
+                  &check_peers_ctx->notify->url.url);
+
+    ngx_http_check_notify_done(notify, 0);
+}
+
+
+static void
+ngx_http_check_notify_timeout_handler(ngx_event_t *event)
+{
+    ngx_http_check_notify_t        *notify;
+    ngx_http_check_notify_conf_t   *nc;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    notify = event->data;
+    nc = check_peers_ctx->notify;
+
+    ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                  "check notify to %V timed out",
+                  nc->command.len ? &nc->command : &nc->url.url);
+
+    ngx_http_check_notify_done(notify, 0);
+}
+
+
+/* a failed batch is kept for the next interval until it runs out of tries */
+static void
+ngx_http_check_notify_done(ngx_http_check_notify_t *notify, ngx_uint_t ok)
+{
+    ngx_http_check_feed_shm_t  *feed;
+
+    feed = &check_peers_ctx->peers_shm->notify;
+
+    if (ok || notify->tries > check_peers_ctx->notify->retries) {
+        (void) ngx_atomic_fetch_add(ok ? &feed->sent : &feed->failed,
+                                    notify->events);
+
+        notify->events = 0;
+    }
+
+    if (notify->pc.connection) {
+        ngx_close_connection(notify->pc.connection);
+        notify->pc.connection = NULL;
+    }
+
+    if (notify->timeout_ev.timer_set) {
+        ngx_del_timer(&notify->timeout_ev);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_check_statsd_init(ngx_cycle_t *cycle)
+{
+    u_char                             *p, ch;
+    ngx_str_t                          *name;
+    ngx_uint_t                          i, j;
+    ngx_http_check_peers_t             *peers;
+    ngx_http_check_statsd_t            *statsd;
+    ngx_http_check_upstream_t          *upstream;
+    ngx_http_check_statsd_conf_t       *sc;
+    ngx_http_check_statsd_upstream_t   *su;
+
+    peers = check_peers_ctx;
+    sc = peers->statsd;
+    statsd = &ngx_http_check_statsd;
+
+    statsd->fd = -1;
+
+    statsd->start = ngx_palloc(cycle->pool, sc->size);
+    if (statsd->start == NULL) {
+        return NGX_ERROR;
+    }
+
+    statsd->last = statsd->start;
+    statsd->end = statsd->start + sc->size;
+
+    statsd->upstreams = ngx_pcalloc(cycle->pool,
+                                    peers->upstreams.nelts
+                                    * sizeof(ngx_http_check_statsd_upstream_t));
+    if (statsd->upstreams == NULL) {
+        return NGX_ERROR;
+    }
+
+    upstream = peers->upstreams.elts;
+
+    for (i = 0; i < peers->upstreams.nelts; i++) {
+        name = upstream[i].name;
+        su = &statsd->upstreams[i];
+
+        su->name.data = ngx_pnalloc(cycle->pool, name->len);
+        if (su->name.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        su->name.len = name->len;
+
+        /* the dots and colons have a meaning in the metric lines */
+        p = su->name.data;
+
+        for (j = 0; j < name->len; j++) {
+            ch = name->data[j];
+
+            if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z')
+                || (ch >= '0' && ch <= '9') || ch == '-')
+            {
+                *p++ = ch;
+
+            } else {
+                *p++ = '_';
+            }
+        }
+    }
+
+    statsd->fd = ngx_http_check_udp_socket(cycle->log, &sc->url);
+    if (statsd->fd == -1) {
+        return NGX_ERROR;
+    }
+
+    statsd->tick_ev.handler = ngx_http_check_statsd_handler;
+    statsd->tick_ev.log = cycle->log;
+    statsd->tick_ev.data = statsd;
+    statsd->tick_ev.timer_set = 0;
+
+    ngx_add_timer(&statsd->tick_ev, sc->interval);
+
+    return NGX_OK;
+}
+
+
+/* indexed by NGX_HTTP_CHECK_ERR_* */
+static char *ngx_http_check_statsd_failed[] = {
+    "",
+    "failed.connect",
+    "failed.timeout",
+    "failed.protocol",
+    "failed.parse"
+};
+
+
+/*
+ * Once an interval, the worker owning the statsd feed sends the states
+ * of the servers and the latency percentiles of each upstream, and the
+ * changes of the counters and of the work of the probes, packed into as
+ * few datagrams as possible.
+ */
+static void
+ngx_http_check_statsd_handler(ngx_event_t *event)
+{
+    u_char                              metric[64];
+    ngx_uint_t                          i, j, n, total, target, q;
+    ngx_atomic_uint_t                   d[NGX_HTTP_CHECK_RTT_BUCKETS];
+    check_conf_t                       *cf;
+    ngx_http_check_peer_t              *peer;
+    ngx_http_check_usage_t             *usage;
+    ngx_http_check_peers_shm_t         *peers_shm;
+    ngx_http_check_peers_t             *peers;
+    ngx_http_check_statsd_t            *statsd;
+    ngx_http_check_counters_t          *counters, *last;
+    ngx_http_check_statsd_conf_t       *sc;
+    ngx_http_check_statsd_upstream_t   *su;
+
+    static ngx_uint_t  percentiles[] = { 50, 90, 99 };
+    static char       *metrics[] = { "rtt.p50", "rtt.p90", "rtt.p99" };
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    peers = check_peers_ctx;
+    if (peers == NULL || peers->peers_shm == NULL) {
+        return;
+    }
+
+    statsd = event->data;
+    sc = peers->statsd;
+
+    ngx_add_timer(event, sc->interval);
+
+    if (!ngx_http_check_feed_own(&peers->peers_shm->statsd, sc->interval)) {
+        statsd->owner = 0;
+        return;
+    }
+
+    for (i = 0; i < peers->upstreams.nelts; i++) {
+        su = &statsd->upstreams[i];
+
+        su->up = 0;
+        su->down = 0;
+        ngx_memzero(su->cur, sizeof(su->cur));
+    }
+
+    peer = peers->peers.elts;
+
+    for (i = 0; i < peers->peers.nelts; i++) {
+        su = &statsd->upstreams[peer[i].upstream_index];
+
+        if (peer[i].shm->slot == NGX_HTTP_CHECK_SLOT_FREE) {
+            continue;
+        }
+
+        if (peer[i].shm->down) {
+            su->down++;
+
+        } else {
+            su->up++;
+        }
+
+        for (j = 0; j < NGX_HTTP_CHECK_RTT_BUCKETS; j++) {
+            su->cur[j] += peer[i].shm->rtt_hist[j];
+        }
+    }
+
+    peers_shm = peers->peers_shm;
+    counters = &peers_shm->counters;
+    last = &statsd->counters;
+
+    if (!statsd->owner) {
+        /* the changes since another worker pushed are not known here */
+        for (i = 0; i < peers->upstreams.nelts; i++) {
+            su = &statsd->upstreams[i];
+            ngx_memcpy(su->last, su->cur, sizeof(su->cur));
+
+            if (i < peers_shm->nupstreams) {
+                su->usage = peers_shm->upstreams[i].usage;
+            }
+        }
+
+        ngx_memcpy(statsd->type_usage, peers_shm->type_usage,
+                   sizeof(statsd->type_usage));
+
+        *last = *counters;
+        statsd->owner = 1;
+
+        return;
+    }
+
+    for (i = 0; i < peers->upstreams.nelts; i++) {
+        su = &statsd->upstreams[i];
+
+        ngx_http_check_statsd_add(statsd, &su->name, "up", su->up, "g");
+        ngx_http_check_statsd_add(statsd, &su->name, "down", su->down, "g");
+
+        if (i < peers_shm->nupstreams) {
+            usage = &peers_shm->upstreams[i].usage;
+
+            ngx_http_check_statsd_add(statsd, &su->name, "cpu_us",
+                                      usage->cpu - su->usage.cpu, "c");
+            ngx_http_check_statsd_add(statsd, &su->name, "syscalls",
+                                      usage->syscalls - su->usage.syscalls,
+                                      "c");
+
+            su->usage = *usage;
+        }
+
+        total = 0;
+
+        for (j = 0; j < NGX_HTTP_CHECK_RTT_BUCKETS; j++) {
+            d[j] = su->cur[j] - su->last[j];
+            total += d[j];
+        }
+
+        ngx_memcpy(su->last, su->cur, sizeof(su->cur));
+
+        if (total == 0) {
+            continue;
+        }
+
+        ngx_http_check_statsd_add(statsd, &su->name, "probes", total, "c");
+
+        /* the upper bound of the bucket the percentile falls into */
+        for (q = 0; q < sizeof(percentiles) / sizeof(ngx_uint_t); q++) {
+            target = (total * percentiles[q] + 99) / 100;
+
+            for (n = 0, j = 0; j < NGX_HTTP_CHECK_RTT_BUCKETS - 1; j++) {
+                n += d[j];
+                if (n >= target) {
+                    break;
+                }
+            }
+
+            ngx_http_check_statsd_add(statsd, &su->name, metrics[q],
+                                      ((ngx_uint_t) 1 << j) - 1, "g");
+        }
+    }
+
+    ngx_http_check_statsd_add(statsd, NULL, "started",
+                              counters->started - last->started, "c");
+    ngx_http_check_statsd_add(statsd, NULL, "succeeded",
+                              counters->succeeded - last->succeeded, "c");
+
+    for (i = NGX_HTTP_CHECK_ERR_CONNECT; i < NGX_HTTP_CHECK_ERR_N; i++) {
+        ngx_http_check_statsd_add(statsd, NULL,
+                                  ngx_http_check_statsd_failed[i],
+                                  counters->failed[i] - last->failed[i], "c");
+    }
+
+    ngx_http_check_statsd_add(statsd, NULL, "transitions",
+                              counters->transitions - last->transitions, "c");
+    ngx_http_check_statsd_add(statsd, NULL, "in_flight",
+                              counters->in_flight, "g");
+    ngx_http_check_statsd_add(statsd, NULL, "lag",
+                              counters->lag_last, "g");
+
+    for (cf = ngx_check_types; cf->type != 0; cf++) {
+        i = cf - ngx_check_types;
+        usage = &peers_shm->type_usage[i];
+
+        if (usage->runs == statsd->type_usage[i].runs) {
+            continue;
+        }
+
+        *ngx_snprintf(metric, sizeof(metric) - 1, "type.%s.cpu_us",
+                      cf->name) = '\0';
+        ngx_http_check_statsd_add(statsd, NULL, (char *) metric,
+                                  usage->cpu - statsd->type_usage[i].cpu,
+                                  "c");
+
+        *ngx_snprintf(metric, sizeof(metric) - 1, "type.%s.syscalls",
+                      cf->name) = '\0';
+        ngx_http_check_statsd_add(statsd, NULL, (char *) metric,
+                                  usage->syscalls
+                                  - statsd->type_usage[i].syscalls,
+                                  "c");
+
+        statsd->type_usage[i] = *usage;
+    }
+
+    *last = *counters;
+
+    ngx_http_check_statsd_flush(statsd);
+}
+
+
+/* the line goes into the datagram, the full datagram is sent first */
+static void
+ngx_http_check_statsd_add(ngx_http_check_statsd_t *statsd,
+    ngx_str_t *upstream, char *metric, ngx_uint_t value, char *type)
+{
+    u_char                        *p, *line;
+    ngx_http_check_statsd_conf_t  *sc;
+
+    sc = check_peers_ctx->statsd;
+
+    for ( ;; ) {
+        line = statsd->last;
+
+        if (upstream == NULL) {
+            p = ngx_slprintf(line, statsd->end, "%V.%s:%ui|%s\n",
+                             &sc->prefix, metric, value, type);
+
+        } else if (sc->dogstatsd) {
+            p = ngx_slprintf(line, statsd->end, "%V.%s:%ui|%s|#upstream:%V\n",
+                             &sc->prefix, metric, value, type, upstream);
+
+        } else {
+            p = ngx_slprintf(line, statsd->end, "%V.%V.%s:%ui|%s\n",
+                             &sc->prefix, upstream, metric, value, type);
+        }
+
+        if (p < statsd->end) {
+            statsd->last = p;
+            return;
+        }
+
+        if (line == statsd->start) {
+            /* the line alone does not fit into a datagram */
+            return;
+        }
+
+        statsd->last = line;
+        ngx_http_check_statsd_flush(statsd);
+    }
+}
+
+
+static void
+ngx_http_check_statsd_flush(ngx_http_check_statsd_t *statsd)
+{
+    ssize_t                      n;
+    ngx_http_check_feed_shm_t   *feed;
+
+    if (statsd->last == statsd->start) {
+        return;
+    }
+
+    feed = &check_peers_ctx->peers_shm->statsd;
+
+    n = send(statsd->fd, statsd->start, statsd->last - statsd->start, 0);
+
+    if (n == -1) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, statsd->tick_ev.log,
+                       ngx_socket_errno,
+                       "http check statsd send() failed, fd: %d",
+                       statsd->fd);
+
+        (void) ngx_atomic_fetch_add(&feed->failed, 1);
+
+    } else {
+        (void) ngx_atomic_fetch_add(&feed->sent, 1);
+    }
+
+    statsd->last = statsd->start;
+}
+
+
+/* a connected nonblocking datagram socket, it is never waited on */
+static ngx_socket_t
+ngx_http_check_udp_socket(ngx_log_t *log, ngx_url_t *u)
+{
+    ngx_socket_t  s;
+
+    s = ngx_socket(u->addrs[0].sockaddr->sa_family, SOCK_DGRAM, 0);
+    if (s == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      "check socket() for %V failed", &u->url);
+        return -1;
+    }
+
+    if (ngx_nonblocking(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      "check nonblocking for %V failed", &u->url);
+        goto failed;
+    }
+
+    if (connect(s, u->addrs[0].sockaddr, u->addrs[0].socklen) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      "check connect() to %V failed", &u->url);
+        goto failed;
+    }
+
+    return s;
+
+failed:
+
+    ngx_close_socket(s);
+
+    return -1;
+}
+
+
+static ngx_int_t
+ngx_http_check_syslog_init(ngx_cycle_t *cycle)
+{
+    size_t                          len, size;
+    ngx_uint_t                      i;
+    ngx_http_check_peer_t          *peer;
+    ngx_http_check_peers_t         *peers;
+    ngx_http_check_syslog_t        *syslog;
+    ngx_http_check_syslog_conf_t   *sc;
+
+    peers = check_peers_ctx;
+    sc = peers->syslog;
+    syslog = &ngx_http_check_syslog;
+
+    syslog->fd = -1;
+
+    len = 0;
+    peer = peers->peers.elts;
+
+    for (i = 0; i < peers->peers.nelts; i++) {
+        if (peer[i].upstream_name->len > len) {
+            len = peer[i].upstream_name->len;
+        }
+    }
+
+    size = 256 + cycle->hostname.len + sc->tag.len + 2 * len
+           + 2 * NGX_SOCKADDR_STRLEN + 2 * NGX_INT_T_LEN;
+
+    syslog->start = ngx_palloc(cycle->pool, size);
+    if (syslog->start == NULL) {
+        return NGX_ERROR;
+    }
+
+    syslog->end = syslog->start + size;
+
+    syslog->groups = ngx_palloc(cycle->pool, 2 * peers->upstreams.nelts
+                                    * sizeof(ngx_http_check_syslog_group_t));
+    if (syslog->groups == NULL) {
+        return NGX_ERROR;
+    }
+
+    syslog->fd = ngx_http_check_udp_socket(cycle->log, &sc->url);
+    if (syslog->fd == -1) {
+        return NGX_ERROR;
+    }
+
+    syslog->tick_ev.handler = ngx_http_check_syslog_handler;
+    syslog->tick_ev.log = cycle->log;
+    syslog->tick_ev.data = syslog;
+    syslog->tick_ev.timer_set = 0;
+
+    ngx_add_timer(&syslog->tick_ev, sc->interval);
+
+    return NGX_OK;
+}
+
+
+/*
+ * Once an interval, the worker owning the syslog feed sends one message
+ * for each upstream and new state among the transitions of the journal,
+ * however many servers have changed to that state.
+ */
+static void
+ngx_http_check_syslog_handler(ngx_event_t *event)
+{
+    ngx_uint_t                        i, n;
+    ngx_http_check_peer_t            *peer;
+    ngx_http_check_peers_t           *peers;
+    ngx_http_check_syslog_t          *syslog;
+    ngx_http_check_feed_shm_t        *feed;
+    ngx_http_check_syslog_conf_t     *sc;
+    ngx_http_check_syslog_group_t    *group;
+    ngx_http_check_journal_entry_t    entry;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    peers = check_peers_ctx;
+    if (peers == NULL || peers->peers_shm == NULL) {
+        return;
+    }
+
+    syslog = event->data;
+    sc = peers->syslog;
+    feed = &peers->peers_shm->syslog;
+
+    ngx_add_timer(event, sc->interval);
+
+    if (!ngx_http_check_feed_own(feed, sc->interval)) {
+        return;
+    }
+
+    n = 2 * peers->upstreams.nelts;
+
+    ngx_memzero(syslog->groups, n * sizeof(ngx_http_check_syslog_group_t));
+
+    peer = peers->peers.elts;
+
+    while (ngx_http_check_feed_next(feed, &entry) == NGX_OK) {
+        group = &syslog->groups[2 * peer[entry.index].upstream_index
+                                + entry.to];
+
+        group->count++;
+        group->index = entry.index;
+        group->reason = entry.reason;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (syslog->groups[i].count) {
+            ngx_http_check_syslog_send(syslog, i / 2, i % 2,
+                                       &syslog->groups[i]);
+        }
+    }
+}
+
+
+/*
+ * An RFC 5424 message, for example:
+ *
+ * <164>1 2012-10-09T10:00:01.318Z web1 nginx 1234 check
+ * [check@32473 upstream="cluster" state="down" peers="37" reason="timeout"]
+ * 37 peers of upstream cluster down
+ */
+static void
+ngx_http_check_syslog_send(ngx_http_check_syslog_t *syslog,
+    ngx_uint_t upstream, ngx_uint_t state,
+    ngx_http_check_syslog_group_t *group)
+{
+    u_char                         *p;
+    ssize_t                         n;
+    ngx_tm_t                        tm;
+    ngx_str_t                      *name, *server;
+    ngx_time_t                     *tp;
+    ngx_http_check_peer_t          *peer;
+    ngx_http_check_upstream_t      *u;
+    ngx_http_check_feed_shm_t      *feed;
+    ngx_http_check_syslog_conf_t   *sc;
+
+    sc = check_peers_ctx->syslog;
+    feed = &check_peers_ctx->peers_shm->syslog;
+
+    u = check_peers_ctx->upstreams.elts;
+    name = u[upstream].name;
+
+    peer = check_peers_ctx->peers.elts;
+    server = &peer[group->index].peer_addr->name;
+
+    tp = ngx_timeofday();
+    ngx_gmtime(tp->sec, &tm);
+
+    p = ngx_slprintf(syslog->start, syslog->end,
+                     "<%ui>1 %4d-%02d-%02dT%02d:%02d:%02d.%03uiZ %V %V %P "
+                     "check [check@32473 upstream=\"%V\" state=\"%s\" "
+                     "peers=\"%ui\" reason=\"%s\"",
+                     sc->facility * 8 + sc->severity,
+                     tm.ngx_tm_year, tm.ngx_tm_mon, tm.ngx_tm_mday,
+                     tm.ngx_tm_hour, tm.ngx_tm_min, tm.ngx_tm_sec, tp->msec,
+                     &ngx_cycle->hostname, &sc->tag, ngx_pid,
+                     name, ngx_http_check_peer_state_names[state],
+                     group->count, ngx_http_check_err_names[group->reason]);
+
+    if (group->count == 1) {
+        p = ngx_slprintf(p, syslog->end,
+                         " server=\"%V\"] peer %V of upstream %V %s",
+                         server, server, name,
+                         ngx_http_check_peer_state_names[state]);
+
+    } else {
+        p = ngx_slprintf(p, syslog->end,
+                         "] %ui peers of upstream %V %s",
+                         group->count, name,
+                         ngx_http_check_peer_state_names[state]);
+    }
+
+    n = send(syslog->fd, syslog->start, p - syslog->start, 0);
+
+    if (n == -1) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, syslog->tick_ev.log,
+                       ngx_socket_errno,
+                       "http check syslog send() failed, fd: %d",
+                       syslog->fd);
+
+        (void) ngx_atomic_fetch_add(&feed->failed, group->count);
+
+        /* a datagram unix socket has to be connected again after restart */
+        (void) connect(syslog->fd, sc->url.addrs[0].sockaddr,
+                       sc->url.addrs[0].socklen);
+        return;
+    }
+
+    (void) ngx_atomic_fetch_add(&feed->sent, group->count);
+}
+
+
+/*
+ * Map the file shared with the other instances and find the slots of the
+ * peers. It is not fatal, the peers are just checked by this instance
+ * alone if anything goes wrong.
+ */
+static void
+ngx_http_check_shared_init(ngx_cycle_t *cycle)
+{
+    u_char                          *mine;
+    size_t                           size;
+    uint32_t                         user;
+    ngx_fd_t                         fd;
+    ngx_int_t                        index;
+    ngx_uint_t                       i;
+    ngx_file_info_t                  fi;
+    ngx_http_check_peer_t           *peer;
+    ngx_http_check_peers_t          *peers;
+    ngx_http_check_shared_t         *shared;
+
+    peers = check_peers_ctx;
+
+    ngx_http_check_instance = (ngx_process == NGX_PROCESS_WORKER)
+                              ? getppid() : ngx_pid;
+
+    size = sizeof(ngx_http_check_shared_t)
+           + (peers->shared_slots - 1) * sizeof(ngx_http_check_shared_slot_t);
+
+    fd = ngx_open_file(peers->shared_file.data, NGX_FILE_RDWR,
+                       NGX_FILE_CREATE_OR_OPEN, NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%V\" failed", &peers->shared_file);
+        return;
+    }
+
+    /* the instances set up the file and claim the slots one by one */
+    if (ngx_lock_fd(fd) != 0) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      ngx_lock_fd_n " \"%V\" failed", &peers->shared_file);
+        goto done;
+    }
+
+    if (ngx_fd_info(fd, &fi) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      ngx_fd_info_n " \"%V\" failed", &peers->shared_file);
+        goto unlock;
+    }
+
+    if ((size_t) ngx_file_size(&fi) < size
+        && ftruncate(fd, size) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "ftruncate() \"%V\" failed", &peers->shared_file);
+        goto unlock;
+    }
+
+    shared = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (shared == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "mmap(\"%V\") failed", &peers->shared_file);
+        goto unlock;
+    }
+
+    if (shared->magic == 0) {
+        shared->nslots = peers->shared_slots;
+        shared->magic = NGX_HTTP_CHECK_SHARED_MAGIC;
+    }
+
+    if (shared->magic != NGX_HTTP_CHECK_SHARED_MAGIC
+        || shared->nslots != peers->shared_slots)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                      "\"%V\" is not a check file of %ui slots, "
+                      "the servers are checked by this instance alone",
+                      &peers->shared_file, peers->shared_slots);
+
+        (void) munmap((void *) shared, size);
+        goto unlock;
+    }
+
+    mine = ngx_alloc(shared->nslots, cycle->log);
+    if (mine == NULL) {
+        (void) munmap((void *) shared, size);
+        goto unlock;
+    }
+
+    index = ngx_http_check_shared_join(shared);
+
+    if (index == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                      "\"%V\" is used by %d instances already, "
+                      "the servers are checked by this instance alone",
+                      &peers->shared_file, NGX_HTTP_CHECK_SHARED_INSTANCES);
+
+        ngx_free(mine);
+        (void) munmap((void *) shared, size);
+        goto unlock;
+    }
+
+    /* the slots of the instances gone can be claimed again right now */
+    ngx_http_check_shared_sweep(shared, 0, NULL);
+
+    user = (uint32_t) 1 << index;
+    ngx_memzero(mine, shared->nslots);
+
+    peer = peers->peers.elts;
+
+    for (i = 0; i < peers->peers.nelts; i++) {
+
+        /* the address of a dynamic slot is not known to the others */
+        if (peer[i].dynamic) {
+            continue;
+        }
+
+        peer[i].shared = ngx_http_check_shared_slot(shared, &peer[i]);
+
+        if (peer[i].shared == NULL) {
+            ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                          "no free slot for %V in \"%V\", "
+                          "it is checked by this instance alone",
+                          &peer[i].peer_addr->name, &peers->shared_file);
+            continue;
+        }
+
+        peer[i].shared->users |= user;
+        mine[peer[i].shared - shared->slots] = 1;
+    }
+
+    ngx_http_check_shared_sweep(shared, user, mine);
+
+    ngx_free(mine);
+
+unlock:
+
+    (void) ngx_unlock_fd(fd);
+
+done:
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &peers->shared_file);
+    }
+}
+
+
+/* the same peer checked the same way has the same key everywhere */
+static uint32_t
+ngx_http_check_peer_key(ngx_http_check_peer_t *peer)
+{
+    ngx_str_t  *name;
+
+    name = &peer->peer_addr->name;
+
+    return ngx_murmur_hash2(name->data, name->len)
+           ^ ngx_murmur_hash2(peer->conf->send.data, peer->conf->send.len)
+           ^ (uint32_t) peer->conf->check_type_conf->type;
+}
+
+
+/*
+ * Take the entry of this instance in the file.  The entries of the
+ * instances which have gone without a word are released on the way,
+ * with their share of the slots.
+ */
+static ngx_int_t
+ngx_http_check_shared_join(ngx_http_check_shared_t *shared)
+{
+    uint32_t    user;
+    ngx_int_t   index;
+    ngx_pid_t   pid;
+    ngx_uint_t  i, k;
+
+    index = NGX_ERROR;
+
+    for (k = 0; k < NGX_HTTP_CHECK_SHARED_INSTANCES; k++) {
+        pid = (ngx_pid_t) shared->instances[k];
+
+        if (pid == ngx_http_check_instance) {
+            index = k;
+            continue;
+        }
+
+        if (pid == 0 || kill(pid, 0) == 0 || ngx_errno != NGX_ESRCH) {
+            continue;
+        }
+
+        user = (uint32_t) 1 << k;
+
+        for (i = 0; i < shared->nslots; i++) {
+            shared->slots[i].users &= ~user;
+        }
+
+        shared->instances[k] = 0;
+    }
+
+    if (index != NGX_ERROR) {
+        return index;
+    }
+
+    for (k = 0; k < NGX_HTTP_CHECK_SHARED_INSTANCES; k++) {
+        if (shared->instances[k] == 0) {
+            shared->instances[k] = ngx_http_check_instance;
+            return k;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+
+/*
+ * The slots are found by open addressing. The instances share a peer
+ * only if they check it the same way.
+ */
+static ngx_http_check_shared_slot_t *
+ngx_http_check_shared_slot(ngx_http_check_shared_t *shared,
+    ngx_http_check_peer_t *peer)
+{
+    uint32_t                        hash;
+    ngx_str_t                      *name;
+    ngx_uint_t                      i, n;
+    ngx_http_check_shared_slot_t   *slot, *freed;
+
+    name = &peer->peer_addr->name;
+
+    if (name->len >= NGX_SOCKADDR_STRLEN) {
+        return NULL;
+    }
+
+    hash = ngx_http_check_peer_key(peer);
+
+    slot = NULL;
+    freed = NULL;
+
+    for (n = 0; n < shared->nslots; n++) {
+        i = (hash + n) % shared->nslots;
+        slot = &shared->slots[i];
+
+        if (slot->name[0] == '\0') {
+
+            /* never used, the name is not further */
+            if (slot->hash == 0) {
+                break;
+            }
+
+            if (freed == NULL) {
+                freed = slot;
+            }
+
+            continue;
+        }
+
+        if (slot->hash == hash
+            && ngx_strncmp(slot->name, name->data, name->len) == 0
+            && slot->name[name->len] == '\0')
+        {
+            return slot;
+        }
+    }
+
+    if (freed == NULL) {
+        if (n == shared->nslots) {
+            return NULL;
+        }
+
+        freed = slot;
+    }
+
+    freed->hash = hash;
+    ngx_memcpy(freed->name, name->data, name->len);
+    freed->name[name->len] = '\0';
+
+    return freed;
+}
+
+
+/*
+ * The slots left without a user are freed.  Given the slots it has just
+ * claimed, this instance first leaves the others, those of the servers
+ * it does not check anymore after a reload.
+ */
+static void
+ngx_http_check_shared_sweep(ngx_http_check_shared_t *shared, uint32_t user,
+    u_char *mine)
+{
+    ngx_uint_t                      i;
+    ngx_http_check_shared_slot_t   *slot;
+
+    for (i = 0; i < shared->nslots; i++) {
+        slot = &shared->slots[i];
+
+        if (mine && !mine[i]) {
+            slot->users &= ~user;
+        }
+
+        if (slot->name[0] == '\0' || slot->users) {
+            continue;
+        }
+
+        ngx_memzero(slot, sizeof(ngx_http_check_shared_slot_t));
+
+        /* an empty name with a hash marks the slot freed */
+        slot->hash = 1;
+    }
+}
+
+
+/* the peer is probed here unless another live instance probes it */
+static ngx_uint_t
+ngx_http_check_shared_probe(ngx_http_check_peer_t *peer)
+{
+    uint64_t                        now, stale;
+    ngx_atomic_uint_t               prober;
+    ngx_http_check_shared_slot_t   *slot;
+
+    slot = peer->shared;
+    prober = slot->prober;
+
+    if ((ngx_pid_t) prober == ngx_http_check_instance) {
+        return 1;
+    }
+
+    now = ngx_http_check_now();
+    stale = 3 * peer->conf->check_interval + peer->conf->check_timeout;
+
+    if (prober != 0 && now - slot->heartbeat < stale) {
+        return 0;
+    }
+
+    /* the prober has gone, take it over */
+    if (!ngx_atomic_cmp_set(&slot->prober, prober, ngx_http_check_instance)) {
+        return 0;
+    }
+
+    slot->heartbeat = now;
+
+    ngx_log_error(NGX_LOG_NOTICE, peer->check_ev.log, 0,
+                  "check of %V taken over from instance %P",
+                  &peer->peer_addr->name, (ngx_pid_t) prober);
+
+    return 1;
+}
+
+
+/* copy the result of the probing instance as if it was probed here */
+static void
+ngx_http_check_shared_follow(ngx_http_check_peer_t *peer)
+{
+    ngx_uint_t                      n, from, to;
+    ngx_atomic_uint_t               seq;
+    ngx_http_check_shared_slot_t   *slot, copy;
+
+    slot = peer->shared;
+
+    for (n = 0; n < 4; n++) {
+        seq = slot->seq;
+        ngx_memory_barrier();
+
+        copy = *slot;
+
+        ngx_memory_barrier();
+        if (!(seq & 1) && seq == slot->seq) {
+            break;
+        }
+    }
+
+    if (n == 4 || copy.heartbeat == 0) {
+        return;
+    }
+
+    peer->shm->last_reason = copy.last_reason;
+    peer->shm->last_code = copy.last_code;
+    peer->shm->last_rtt = copy.last_rtt;
+    peer->shm->access_time = ngx_current_msec;
+
+    if ((ngx_uint_t) peer->shm->down == copy.down) {
+        return;
+    }
+
+    from = peer->shm->down ? NGX_HTTP_CHECK_PEER_DOWN : NGX_HTTP_CHECK_PEER_UP;
+    to = copy.down ? NGX_HTTP_CHECK_PEER_DOWN : NGX_HTTP_CHECK_PEER_UP;
+
+    peer->shm->down = copy.down;
+    peer->shm->last_change = ngx_http_check_now();
+
+    ngx_http_check_verdict_update(peer);
+
+    (void) ngx_atomic_fetch_add(
+               &check_peers_ctx->peers_shm->counters.transitions, 1);
+
+    ngx_http_check_journal_add(peer, from, to,
+                               copy.last_reason < NGX_HTTP_CHECK_ERR_N
+                               ? copy.last_reason : NGX_HTTP_CHECK_OK,
+                               copy.last_rtt);
+}
+
+
+static void
+ngx_http_check_shared_publish(ngx_http_check_peer_t *peer)
+{
+    ngx_http_check_shared_slot_t   *slot;
+
+    slot = peer->shared;
+
+    if ((ngx_pid_t) slot->prober != ngx_http_check_instance) {
+        return;
+    }
+
+    (void) ngx_atomic_fetch_add(&slot->seq, 1);
+    ngx_memory_barrier();
+
+    slot->down = peer->shm->down ? 1 : 0;
+    slot->last_reason = peer->shm->last_reason;
+    slot->last_code = peer->shm->last_code;
+    slot->last_rtt = peer->shm->last_rtt;
+    slot->heartbeat = ngx_http_check_now();
+
+    ngx_memory_barrier();
+    (void) ngx_atomic_fetch_add(&slot->seq, 1);
+}
+
+
+static ngx_int_t
+ngx_http_check_gossip_init(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                      i;
+    ngx_http_check_peer_t          *peer;
+    ngx_http_check_peers_t         *peers;
+    ngx_http_check_gossip_t        *gossip;
+    ngx_http_check_gossip_conf_t   *gc;
+
+    peers = check_peers_ctx;
+    gc = peers->gossip;
+    gossip = &ngx_http_check_gossip;
+
+    gossip->buf = ngx_palloc(cycle->pool, NGX_HTTP_CHECK_GOSSIP_SIZE);
+    if (gossip->buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    gossip->live = ngx_palloc(cycle->pool, gc->nnodes * sizeof(ngx_uint_t));
+    if (gossip->live == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the other nodes are taken for dead until they speak */
+    gossip->live[0] = gc->self;
+    gossip->nlive = 1;
+
+    gossip->keys = ngx_palloc(cycle->pool, peers->peers.nelts
+                                           * sizeof(ngx_http_check_peer_t *));
+    if (gossip->keys == NULL) {
+        return NGX_ERROR;
+    }
+
+    peer = peers->peers.elts;
+
+    for (i = 0; i < peers->peers.nelts; i++) {
+        peer[i].gossip_key = ngx_http_check_peer_key(&peer[i]);
+        gossip->keys[i] = &peer[i];
+    }
+
+    ngx_qsort(gossip->keys, peers->peers.nelts,
+              sizeof(ngx_http_check_peer_t *),
+              ngx_http_check_gossip_cmp_keys);
+
+    gossip->tick_ev.handler = ngx_http_check_gossip_handler;
+    gossip->tick_ev.log = cycle->log;
+    gossip->tick_ev.data = gossip;
+    gossip->tick_ev.timer_set = 0;
+
+    ngx_add_timer(&gossip->tick_ev, gc->interval);
+
+    return NGX_OK;
+}
+
+
+/*
+ * Only the worker owning the gossip feed binds the address of the node,
+ * and without SO_REUSEADDR, with which a UDP address may be bound twice.
+ * While a worker of the old cycle still holds it after a reload, the
+ * bind fails and is tried again on the next ticks.
+ */
+static ngx_int_t
+ngx_http_check_gossip_bind(ngx_http_check_gossip_t *gossip, ngx_log_t *log)
+{
+    ngx_addr_t                     *self;
+    ngx_socket_t                    s;
+    ngx_connection_t               *c;
+    ngx_http_check_gossip_conf_t   *gc;
+
+    gc = check_peers_ctx->gossip;
+    self = &gc->nodes[gc->self];
+
+    s = ngx_socket(self->sockaddr->sa_family, SOCK_DGRAM, 0);
+    if (s == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      "check gossip socket() failed");
+        return NGX_ERROR;
+    }
+
+    if (ngx_nonblocking(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      "check gossip nonblocking failed");
+        goto failed;
+    }
+
+    if (bind(s, self->sockaddr, self->socklen) == -1) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, ngx_socket_errno,
+                       "http check gossip bind() to %V failed",
+                       &self->name);
+        ngx_close_socket(s);
+        return NGX_DECLINED;
+    }
+
+    c = ngx_get_connection(s, log);
+    if (c == NULL) {
+        goto failed;
+    }
+
+    c->data = gossip;
+    c->log = log;
+    c->read->log = log;
+    c->write->log = log;
+    c->read->handler = ngx_http_check_gossip_recv_handler;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_close_connection(c);
+        return NGX_ERROR;
+    }
+
+    gossip->connection = c;
+
+    return NGX_OK;
+
+failed:
+
+    ngx_close_socket(s);
+
+    return NGX_ERROR;
+}
+
+
+/*
+ * Once an interval every worker works out which nodes are alive, and the
+ * worker owning the gossip feed receives the digests of the other nodes
+ * and sends them the digest of the peers this node probes.  A worker
+ * which has lost the feed closes its socket.
+ */
+static void
+ngx_http_check_gossip_handler(ngx_event_t *event)
+{
+    uint64_t                         now, *seen;
+    ngx_uint_t                       i, n, sent, max;
+    ngx_http_check_peer_t           *peer;
+    ngx_http_check_peers_t          *peers;
+    ngx_http_check_gossip_t         *gossip;
+    ngx_http_check_gossip_conf_t    *gc;
+    ngx_http_check_gossip_entry_t   *e;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    peers = check_peers_ctx;
+    if (peers == NULL || peers->peers_shm == NULL) {
+        return;
+    }
+
+    gossip = event->data;
+    gc = peers->gossip;
+
+    ngx_add_timer(event, gc->interval);
+
+    now = ngx_http_check_now();
+    seen = peers->peers_shm->gossip_seen;
+
+    gossip->nlive = 0;
+
+    for (i = 0; i < gc->nnodes; i++) {
+        if (i == gc->self
+            || (seen[i] && now - seen[i] < 3 * (uint64_t) gc->interval))
+        {
+            gossip->live[gossip->nlive++] = i;
+        }
+    }
+
+    if (!ngx_http_check_feed_own(&peers->peers_shm->gossip, gc->interval)) {
+
+        if (gossip->connection) {
+            ngx_close_connection(gossip->connection);
+            gossip->connection = NULL;
+        }
+
+        return;
+    }
+
+    if (gossip->connection == NULL
+        && ngx_http_check_gossip_bind(gossip, event->log) != NGX_OK)
+    {
+        return;
+    }
+
+    max = (NGX_HTTP_CHECK_GOSSIP_SIZE - sizeof(ngx_http_check_gossip_header_t)
+           - NGX_HTTP_CHECK_GOSSIP_MAC_LEN)
+          / sizeof(ngx_http_check_gossip_entry_t);
+
+    e = (ngx_http_check_gossip_entry_t *)
+            (gossip->buf + sizeof(ngx_http_check_gossip_header_t));
+
+    peer = peers->peers.elts;
+    sent = 0;
+    n = 0;
+
+    for (i = 0; i < peers->peers.nelts; i++) {
+
+        if (peer[i].dynamic || !ngx_http_check_gossip_mine(&peer[i])) {
+            continue;
+        }
+
+        e[n].key = htonl(peer[i].gossip_key);
+        e[n].state = htons((peer[i].shm->down ? NGX_HTTP_CHECK_GOSSIP_DOWN : 0)
+                           | peer[i].shm->last_reason);
+        e[n].rtt = htons(ngx_min(peer[i].shm->last_rtt, 0xffff));
+
+        if (++n == max) {
+            ngx_http_check_gossip_send(gossip, n);
+            sent = 1;
+            n = 0;
+        }
+    }
+
+    /* an empty digest still tells the node is alive */
+    if (n || !sent) {
+        ngx_http_check_gossip_send(gossip, n);
+    }
+}
+
+
+static void
+ngx_http_check_gossip_send(ngx_http_check_gossip_t *gossip, ngx_uint_t n)
+{
+    size_t                            len;
+    ngx_uint_t                        i;
+    ngx_http_check_feed_shm_t        *feed;
+    ngx_http_check_gossip_conf_t     *gc;
+    ngx_http_check_gossip_header_t   *h;
+
+    gc = check_peers_ctx->gossip;
+    feed = &check_peers_ctx->peers_shm->gossip;
+
+    h = (ngx_http_check_gossip_header_t *) gossip->buf;
+    h->magic = htonl(NGX_HTTP_CHECK_GOSSIP_MAGIC);
+    h->count = htonl((uint32_t) n);
+
+    len = sizeof(ngx_http_check_gossip_header_t)
+          + n * sizeof(ngx_http_check_gossip_entry_t);
+
+    ngx_http_check_gossip_mac(gossip->buf, len, gossip->buf + len);
+    len += NGX_HTTP_CHECK_GOSSIP_MAC_LEN;
+
+    for (i = 0; i < gc->nnodes; i++) {
+
+        if (i == gc->self) {
+            continue;
+        }
+
+        if (sendto(gossip->connection->fd, gossip->buf, len, 0,
+                   gc->nodes[i].sockaddr, gc->nodes[i].socklen)
+            == -1)
+        {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, gossip->tick_ev.log,
+                           ngx_socket_errno,
+                           "http check gossip sendto() %V failed",
+                           &gc->nodes[i].name);
+
+            (void) ngx_atomic_fetch_add(&feed->failed, 1);
+            continue;
+        }
+
+        (void) ngx_atomic_fetch_add(&feed->sent, 1);
+    }
+}
+
+
+static void
+ngx_http_check_gossip_recv_handler(ngx_event_t *event)
+{
+    u_char                     sa[NGX_SOCKADDRLEN];
+    ssize_t                    n;
+    ngx_err_t                  err;
+    socklen_t                  socklen;
+    ngx_connection_t          *c;
+    ngx_http_check_gossip_t   *gossip;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    c = event->data;
+    gossip = c->data;
+
+    for ( ;; ) {
+        socklen = NGX_SOCKADDRLEN;
+
+        n = recvfrom(c->fd, gossip->buf, NGX_HTTP_CHECK_GOSSIP_SIZE, 0,
+                     (struct sockaddr *) sa, &socklen);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EAGAIN) {
+                break;
+            }
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            ngx_log_error(NGX_LOG_ERR, event->log, err,
+                          "check gossip recvfrom() failed");
+            break;
+        }
+
+        ngx_http_check_gossip_digest(gossip, (struct sockaddr *) sa,
+                                     gossip->buf, n);
+    }
+
+    if (ngx_handle_read_event(event, 0) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                      "check gossip handle read event failed");
+    }
+}
+
+
+/*
+ * The digests of the nodes not in check_gossip are ignored, and those
+ * without the HMAC of the secret are rejected.
+ */
+static void
+ngx_http_check_gossip_digest(ngx_http_check_gossip_t *gossip,
+    struct sockaddr *sa, u_char *buf, size_t len)
+{
+    u_char                            mac[NGX_HTTP_CHECK_GOSSIP_MAC_LEN];
+    u_char                            diff;
+    uint64_t                          now;
+    uint16_t                          state;
+    uint32_t                          key;
+    ngx_uint_t                        i, node, count, lo, hi, mid;
+    ngx_addr_t                       *addr;
+    ngx_http_check_peer_t            *peer;
+    ngx_http_check_peers_t           *peers;
+    struct sockaddr_in               *sin, *nsin;
+    ngx_http_check_gossip_conf_t     *gc;
+    ngx_http_check_gossip_entry_t    *e;
+    ngx_http_check_gossip_header_t   *h;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6              *sin6, *nsin6;
+#endif
+
+    peers = check_peers_ctx;
+    gc = peers->gossip;
+
+    for (node = 0; node < gc->nnodes; node++) {
+        addr = &gc->nodes[node];
+
+        if (addr->sockaddr->sa_family != sa->sa_family) {
+            continue;
+        }
+
+        switch (sa->sa_family) {
+
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            sin6 = (struct sockaddr_in6 *) sa;
+            nsin6 = (struct sockaddr_in6 *) addr->sockaddr;
+
+            if (sin6->sin6_port == nsin6->sin6_port
+                && ngx_memcmp(&sin6->sin6_addr, &nsin6->sin6_addr, 16) == 0)
+            {
+                goto found;
+            }
+
+            break;
+#endif
+
+        case AF_INET:
+            sin = (struct sockaddr_in *) sa;
+            nsin = (struct sockaddr_in *) addr->sockaddr;
+
+            if (sin->sin_port == nsin->sin_port
+                && sin->sin_addr.s_addr == nsin->sin_addr.s_addr)
+            {
+                goto found;
+            }
+
+            break;
+        }
+    }
+
+    return;
+
+found:
+
+    if (node == gc->self) {
+        return;
+    }
+
+    if (len < sizeof(ngx_http_check_gossip_header_t)
+              + NGX_HTTP_CHECK_GOSSIP_MAC_LEN)
+    {
+        goto rejected;
+    }
+
+    len -= NGX_HTTP_CHECK_GOSSIP_MAC_LEN;
+
+    h = (ngx_http_check_gossip_header_t *) buf;
+    count = ntohl(h->count);
+
+    if (ntohl(h->magic) != NGX_HTTP_CHECK_GOSSIP_MAGIC
+        || len != sizeof(ngx_http_check_gossip_header_t)
+                  + count * sizeof(ngx_http_check_gossip_entry_t))
+    {
+        goto rejected;
+    }
+
+    ngx_http_check_gossip_mac(buf, len, mac);
+
+    /* all the bytes are compared, so the time tells nothing of the MAC */
+    diff = 0;
+
+    for (i = 0; i < NGX_HTTP_CHECK_GOSSIP_MAC_LEN; i++) {
+        diff |= mac[i] ^ buf[len + i];
+    }
+
+    if (diff) {
+        goto rejected;
+    }
+
+    now = ngx_http_check_now();
+
+    peers->peers_shm->gossip_seen[node] = now;
+    (void) ngx_atomic_fetch_add(&peers->peers_shm->gossip_received, 1);
+
+    e = (ngx_http_check_gossip_entry_t *)
+            (buf + sizeof(ngx_http_check_gossip_header_t));
+
+    for (i = 0; i < count; i++) {
+        key = ntohl(e[i].key);
+        state = ntohs(e[i].state);
+
+        /* the first peer with the key */
+        lo = 0;
+        hi = peers->peers.nelts;
+
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+
+            if (gossip->keys[mid]->gossip_key < key) {
+                lo = mid + 1;
+
+            } else {
+                hi = mid;
+            }
+        }
+
+        for ( /* void */ ; lo < peers->peers.nelts; lo++) {
+            peer = gossip->keys[lo];
+
+            if (peer->gossip_key != key) {
+                break;
+            }
+
+            if (peer->dynamic) {
+                continue;
+            }
+
+            peer->shm->remote_down = (state & NGX_HTTP_CHECK_GOSSIP_DOWN)
+                                     ? 1 : 0;
+            peer->shm->remote_reason = state & 0xff;
+            peer->shm->remote_rtt = ntohs(e[i].rtt);
+            peer->shm->remote_time = now;
+        }
+    }
+
+    return;
+
+rejected:
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, gossip->tick_ev.log, 0,
+                   "http check gossip digest from %V rejected",
+                   &gc->nodes[node].name);
+
+    (void) ngx_atomic_fetch_add(&peers->peers_shm->gossip_rejected, 1);
+}
+
+
+/* HMAC-MD5, RFC 2104, with the secret of check_gossip */
+static void
+ngx_http_check_gossip_mac(u_char *buf, size_t len, u_char *mac)
+{
+    u_char      pad[64], inner[16];
+    ngx_uint_t  i;
+    ngx_md5_t   md5;
+
+    for (i = 0; i < 64; i++) {
+        pad[i] = check_peers_ctx->gossip->key[i] ^ 0x36;
+    }
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, pad, 64);
+    ngx_md5_update(&md5, buf, len);
+    ngx_md5_final(inner, &md5);
+
+    for (i = 0; i < 64; i++) {
+        pad[i] = check_peers_ctx->gossip->key[i] ^ 0x5c;
+    }
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, pad, 64);
+    ngx_md5_update(&md5, inner, 16);
+    ngx_md5_final(mac, &md5);
+}
+
+
+/* the peers are split among the live nodes by their keys */
+static ngx_uint_t
+ngx_http_check_gossip_mine(ngx_http_check_peer_t *peer)
+{
+    ngx_http_check_gossip_t  *gossip;
+
+    gossip = &ngx_http_check_gossip;
+
+    return gossip->live[peer->gossip_key % gossip->nlive]
+           == check_peers_ctx->gossip->self;
+}
+
+
+/*
+ * A peer of another node takes the state that node reports, unless the
+ * report is stale, and is probed here once in "local" intervals. If that
+ * probe can not connect, the peer stays down on this node whatever the
+ * report says.
+ */
+static ngx_uint_t
+ngx_http_check_gossip_probe(ngx_http_check_peer_t *peer)
+{
+    uint64_t                        now;
+    ngx_uint_t                      down, from, to, reason;
+    ngx_http_check_peer_shm_t      *shm;
+    ngx_http_check_gossip_conf_t   *gc;
+
+    if (ngx_http_check_gossip_mine(peer)) {
+        return 1;
+    }
+
+    gc = check_peers_ctx->gossip;
+    shm = peer->shm;
+    now = ngx_http_check_now();
+
+    if (shm->remote_time == 0
+        || now - shm->remote_time >= 3 * (uint64_t) gc->interval)
+    {
+        return 1;
+    }
+
+    if (++peer->gossip_skips >= gc->local) {
+        peer->gossip_skips = 0;
+        return 1;
+    }
+
+    reason = shm->remote_reason < NGX_HTTP_CHECK_ERR_N
+             ? shm->remote_reason : NGX_HTTP_CHECK_OK;
+
+    if (shm->override) {
+        down = 1;
+        reason = NGX_HTTP_CHECK_ERR_CONNECT;
+
+    } else {
+        down = shm->remote_down;
+    }
+
+    shm->last_reason = (uint16_t) reason;
+    shm->last_rtt = shm->remote_rtt;
+    shm->access_time = ngx_current_msec;
+
+    if ((ngx_uint_t) shm->down == down) {
+        return 0;
+    }
+
+    from = shm->down ? NGX_HTTP_CHECK_PEER_DOWN : NGX_HTTP_CHECK_PEER_UP;
+    to = down ? NGX_HTTP_CHECK_PEER_DOWN : NGX_HTTP_CHECK_PEER_UP;
+
+    shm->down = down;
+    shm->last_change = now;
+
+    ngx_http_check_verdict_update(peer);
+
+    (void) ngx_atomic_fetch_add(
+               &check_peers_ctx->peers_shm->counters.transitions, 1);
+
+    ngx_http_check_journal_add(peer, from, to, reason, shm->remote_rtt);
+
+    return 0;
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_check_gossip_cmp_keys(const void *one, const void *two)
+{
+    ngx_http_check_peer_t  *first, *second;
+
+    first = *(ngx_http_check_peer_t **) one;
+    second = *(ngx_http_check_peer_t **) two;
+
+    if (first->gossip_key == second->gossip_key) {
+        return 0;
+    }
+
+    return first->gossip_key < second->gossip_key ? -1 : 1;
+}
+
+
+static ngx_int_t
+ngx_http_check_resolve_init(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                      n;
+    ngx_http_check_peers_t         *peers;
+    ngx_http_check_resolve_t       *resolve;
+
+    peers = check_peers_ctx;
+    resolve = &ngx_http_check_resolve;
+
+    n = peers->resolves.nelts;
+
+    resolve->last = ngx_pcalloc(cycle->pool, n * sizeof(ngx_msec_t));
+    if (resolve->last == NULL) {
+        return NGX_ERROR;
+    }
+
+    resolve->ctx = ngx_pcalloc(cycle->pool, n * sizeof(ngx_resolver_ctx_t *));
+    if (resolve->ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    resolve->tick_ev.handler = ngx_http_check_resolve_handler;
+    resolve->tick_ev.log = cycle->log;
+    resolve->tick_ev.data = resolve;
+    resolve->tick_ev.timer_set = 0;
+
+    ngx_add_timer(&resolve->tick_ev, NGX_HTTP_CHECK_RESOLVE_TICK);
+
+    return NGX_OK;
+}
+
+
+/*
+ * One worker asks for the names once in their interval. The resolver
+ * keeps an answer as long as its TTL, or the valid= of the resolver
+ * directive, so a name is only sent out again once its answer expired.
+ */
+static void
+ngx_http_check_resolve_handler(ngx_event_t *event)
+{
+    ngx_uint_t                      i;
+    ngx_resolver_ctx_t             *ctx;
+    ngx_http_check_peers_t         *peers;
+    ngx_http_check_resolve_t       *resolve;
+    ngx_http_check_resolve_conf_t **rcp;
+
+    if (ngx_http_check_need_exit()) {
+        return;
+    }
+
+    peers = check_peers_ctx;
+    if (peers == NULL || peers->peers_shm == NULL) {
+        return;
+    }
+
+    resolve = event->data;
+
+    ngx_add_timer(event, NGX_HTTP_CHECK_RESOLVE_TICK);
+
+    if (!ngx_http_check_feed_own(&peers->peers_shm->resolve,
+                                 NGX_HTTP_CHECK_RESOLVE_TICK))
+    {
+        return;
+    }
+
+    rcp = peers->resolves.elts;
+
+    for (i = 0; i < peers->resolves.nelts; i++) {
+
+        if (resolve->ctx[i] != NULL
+            || (resolve->last[i]
+                && ngx_current_msec - resolve->last[i] < rcp[i]->interval))
+        {
+            continue;
+        }
+
+        resolve->last[i] = ngx_current_msec;
+
+        ctx = ngx_resolve_start(peers->resolver, NULL);
+        if (ctx == NULL || ctx == NGX_NO_RESOLVER) {
+            (void) ngx_atomic_fetch_add(
+                       &peers->peers_shm->counters.resolve_failed, 1);
+            continue;
+        }
+
+        ctx->name = rcp[i]->name;
+        ctx->type = NGX_RESOLVE_A;
+        ctx->handler = ngx_http_check_resolve_done;
+        ctx->data = rcp[i];
+        ctx->timeout = peers->resolver_timeout;
+
+        /* the handler may run before ngx_resolve_name() returns */
+        resolve->ctx[i] = ctx;
+
+        if (ngx_resolve_name(ctx) != NGX_OK) {
+            resolve->ctx[i] = NULL;
+
+            (void) ngx_atomic_fetch_add(
+                       &peers->peers_shm->counters.resolve_failed, 1);
+        }
+    }
+}
+
+
+static void
+ngx_http_check_resolve_done(ngx_resolver_ctx_t *ctx)
+{
+    ngx_http_check_peers_t         *peers;
+    ngx_http_check_resolve_conf_t  *rc;
+
+    peers = check_peers_ctx;
+    rc = ctx->data;
+
+    ngx_http_check_resolve.ctx[rc->index] = NULL;
+
+    if (ctx->state) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "check resolve: %V could not be resolved (%i: %s)",
+                      &ctx->name, ctx->state,
+                      ngx_resolver_strerror(ctx->state));
+
+        (void) ngx_atomic_fetch_add(
+                   &peers->peers_shm->counters.resolve_failed, 1);
+
+    } else {
+        (void) ngx_atomic_fetch_add(&peers->peers_shm->counters.resolved, 1);
+
+        ngx_http_check_resolve_apply(rc, ctx->addrs, ctx->naddrs);
+    }
+
+    ngx_resolve_name_done(ctx);
+}
+
+
+/*
+ * The peers of the name keep their address while the answer holds it,
+ * the others take the new addresses of the answer in turn. A peer left
+ * without one keeps its address and fails its checks.
+ */
+static void
+ngx_http_check_resolve_apply(ngx_http_check_resolve_conf_t *rc,
+    in_addr_t *addrs, ngx_uint_t naddrs)
+{
+    u_char                          text[NGX_SOCKADDR_STRLEN];
+    size_t                          len;
+    ngx_uint_t                      i, j, next;
+    struct sockaddr_in             *sin;
+    ngx_http_check_peer_t          *peer;
+    ngx_http_check_peers_t         *peers;
+    ngx_http_check_peer_shm_t      *peer_shm;
+
+    peers = check_peers_ctx;
+    peer = peers->peers.elts;
+    next = 0;
+
+    for (i = 0; i < peers->peers.nelts; i++) {
+
+        if (peer[i].resolve != rc) {
+            continue;
+        }
+
+        peer_shm = peer[i].shm;
+        sin = (struct sockaddr_in *) peer_shm->sockaddr;
+
+        for (j = 0; j < naddrs; j++) {
+            if (addrs[j] == sin->sin_addr.s_addr) {
+                break;
+            }
+        }
+
+        if (j < naddrs) {
+            continue;
+        }
+
+        /* the next address of the answer which no peer of the name has */
+        for ( /* void */ ; next < naddrs; next++) {
+            if (!ngx_http_check_resolve_taken(rc, addrs[next])) {
+                break;
+            }
+        }
+
+        if (next == naddrs) {
+            return;
+        }
+
+        ngx_http_check_shm_lock(&peer_shm->lock);
+
+        sin->sin_addr.s_addr = addrs[next++];
+
+        ngx_memory_barrier();
+
+        peer_shm->addr_gen++;
+
+        ngx_spinlock_unlock(&peer_shm->lock);
+
+        (void) ngx_atomic_fetch_add(&peers->peers_shm->counters.readdressed,
+                                    1);
+
+        len = ngx_sock_ntop(peer_shm->sockaddr, text, NGX_SOCKADDR_STRLEN, 1);
+
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "check resolve: %V of upstream %V is now at %*s",
+                      &peer[i].peer_addr->name, peer[i].upstream_name,
+                      len, text);
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_check_resolve_taken(ngx_http_check_resolve_conf_t *rc,
+    in_addr_t addr)
+{
+    ngx_uint_t                      i;
+    struct sockaddr_in             *sin;
+    ngx_http_check_peer_t          *peer;
+
+    peer = check_peers_ctx->peers.elts;
+
+    for (i = 0; i < check_peers_ctx->peers.nelts; i++) {
+
+        if (peer[i].resolve != rc) {
+            continue;
+        }
+
+        sin = (struct sockaddr_in *) peer[i].shm->sockaddr;
+
+        if (sin->sin_addr.s_addr == addr) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * The address is written over the one of the configuration, which the
+ * round robin of this worker connects to as well.
+ */
+static void
+ngx_http_check_resolve_sync(ngx_http_check_peer_t *peer)
+{
+    ngx_uint_t                      gen;
+    ngx_peer_addr_t                *addr;
+    ngx_http_check_peer_shm_t      *peer_shm;
+
+    peer_shm = peer->shm;
+    addr = peer->peer_addr;
+
+    gen = peer_shm->addr_gen;
+
+    ngx_memory_barrier();
+
+    ngx_memcpy(addr->sockaddr, peer_shm->sockaddr, addr->socklen);
+
+    addr->name.len = ngx_sock_ntop(addr->sockaddr, addr->name.data,
+                                   NGX_SOCKADDR_STRLEN, 1);
+
+    peer->addr_gen = gen;
+}
+
+
+static ngx_int_t
+ngx_http_check_need_exit()
+{
+    if (ngx_terminate || ngx_exiting || ngx_quit) {
+        ngx_http_check_clear_all_events();
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static ngx_flag_t has_cleared = 0;
+
+static void
+ngx_http_check_clear_all_events()
+{
+    ngx_uint_t                      i;
+    ngx_http_check_peer_t          *peer;
+    ngx_http_check_peers_t         *peers;
+
+    if (has_cleared || check_peers_ctx == NULL) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "clear all the events on %P ", ngx_pid);
+
+    has_cleared = 1;
+
+    peers = check_peers_ctx;
+
+    peer = peers->peers.elts;
+    for (i = 0; i < peers->peers.nelts; i++) {
+
+        if (peer[i].check_ev.timer_set) {
+            ngx_del_timer(&peer[i].check_ev);
+        }
+
+        /* Be careful, The shared memory may have been freed after reload */
+        if (peer[i].check_timeout_ev.timer_set) {
+            if (peer[i].pc.connection) {
+                ngx_http_check_close(&peer[i]);
+            }
+            ngx_del_timer(&peer[i].check_timeout_ev);
+        }
+
+        if (peer[i].pool != NULL) {
+            ngx_destroy_pool(peer[i].pool);
+            peer[i].pool = NULL;
+        }
+
+        if (peer[i].warmup) {
+            if (peer[i].warmup->step_ev.timer_set) {
+                ngx_del_timer(&peer[i].warmup->step_ev);
+            }
+
+            if (peer[i].warmup->timeout_ev.timer_set) {
+                ngx_del_timer(&peer[i].warmup->timeout_ev);
+            }
+
+            if (peer[i].warmup->pc.connection) {
+                ngx_close_connection(peer[i].warmup->pc.connection);
+                peer[i].warmup->pc.connection = NULL;
+            }
+        }
+
+        if (peer[i].agent == NULL) {
+            continue;
+        }
+
+        if (peer[i].agent->check_ev.timer_set) {
+            ngx_del_timer(&peer[i].agent->check_ev);
+        }
+
+        if (peer[i].agent->timeout_ev.timer_set) {
+            ngx_del_timer(&peer[i].agent->timeout_ev);
+        }
+
+        if (peer[i].agent->pc.connection) {
+            ngx_close_connection(peer[i].agent->pc.connection);
+            peer[i].agent->pc.connection = NULL;
+        }
+    }
+
+    if (ngx_http_check_notify.tick_ev.timer_set) {
+        ngx_del_timer(&ngx_http_check_notify.tick_ev);
+    }
+
+    if (ngx_http_check_notify.timeout_ev.timer_set) {
+        ngx_del_timer(&ngx_http_check_notify.timeout_ev);
+    }
+
+    if (ngx_http_check_notify.pc.connection) {
+        ngx_close_connection(ngx_http_check_notify.pc.connection);
+        ngx_http_check_notify.pc.connection = NULL;
+    }
+
+    if (ngx_http_check_statsd.tick_ev.timer_set) {
+        ngx_del_timer(&ngx_http_check_statsd.tick_ev);
+    }
+
+    if (check_peers_ctx->statsd && ngx_http_check_statsd.fd != -1) {
+        ngx_close_socket(ngx_http_check_statsd.fd);
+        ngx_http_check_statsd.fd = -1;
+    }
+
+    if (ngx_http_check_syslog.tick_ev.timer_set) {
+        ngx_del_timer(&ngx_http_check_syslog.tick_ev);
+    }
+
+    if (check_peers_ctx->syslog && ngx_http_check_syslog.fd != -1) {
+        ngx_close_socket(ngx_http_check_syslog.fd);
+        ngx_http_check_syslog.fd = -1;
+    }
+
+    if (ngx_http_check_gossip.tick_ev.timer_set) {
+        ngx_del_timer(&ngx_http_check_gossip.tick_ev);
+    }
+
+    if (ngx_http_check_gossip.connection) {
+        ngx_close_connection(ngx_http_check_gossip.connection);
+        ngx_http_check_gossip.connection = NULL;
+    }
+
+    if (ngx_http_check_resolve.tick_ev.timer_set) {
+        ngx_del_timer(&ngx_http_check_resolve.tick_ev);
+    }
+
+    if (ngx_http_check_schedule_ev.timer_set) {
+        ngx_del_timer(&ngx_http_check_schedule_ev);
+    }
+
+    for (i = 0; i < check_peers_ctx->resolves.nelts; i++) {
+        if (ngx_http_check_resolve.ctx[i]) {
+            ngx_resolve_name_done(ngx_http_check_resolve.ctx[i]);
+            ngx_http_check_resolve.ctx[i] = NULL;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_check_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    size_t                               size;
+    ngx_str_t                            oshm_name = ngx_null_string;
+    ngx_uint_t                           i, same, number, from, fresh;
+    ngx_shm_zone_t                      *oshm_zone;
+    ngx_slab_pool_t                     *shpool;
+    ngx_http_check_peer_t               *peer;
+    ngx_http_check_peers_t              *peers;
+    ngx_http_check_peer_shm_t           *peer_shm, *opeer_shm;
+    ngx_http_check_peers_shm_t          *peers_shm, *opeers_shm;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    opeers_shm = NULL;
+    peers_shm = NULL;
+
+    same = 0;
+    peers = check_peers_ctx;
+
+    number =  peers->peers.nelts;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (peers == NULL || number == 0) {
+        return NGX_OK;
+    }
+
+    if (data) {
+        opeers_shm = data;
+
+        if (opeers_shm->number == number
+            && opeers_shm->checksum == peers->checksum) {
+
+            peers_shm = data;
+            same = 1;
+        }
+    }
+
+    if (!same) {
+
+        if (ngx_http_check_shm_generation > 1) {
+
+            ngx_http_check_get_shm_name(&oshm_name, ngx_cycle->pool,
+                                        ngx_http_check_shm_generation - 1);
+
+            /* The global variable ngx_cycle still points to the old version */
+            oshm_zone = ngx_shared_memory_find((ngx_cycle_t *)ngx_cycle,
+                                               &oshm_name,
+                                               &ngx_http_upstream_check_module);
+
+            if (oshm_zone) {
+                opeers_shm = oshm_zone->data;
+
+                ngx_log_debug2(NGX_LOG_DEBUG_HTTP, shm_zone->shm.log, 0,
+                               "http upstream check, find oshm_zone:%p, "
+                               "opeers_shm: %p",
+                               oshm_zone, opeers_shm);
+            }
+        }
+
+        size = sizeof(*peers_shm) +
+               (number - 1) * sizeof(ngx_http_check_peer_shm_t);
+
+        peers_shm = ngx_slab_alloc(shpool, size);
+
+        if (peers_shm == NULL) {
+            goto failure;
+        }
+
+        ngx_memzero(peers_shm, size);
+
+        size = sizeof(ngx_http_check_journal_t)
+               + (peers->journal_size - 1)
+                 * sizeof(ngx_http_check_journal_entry_t);
+
+        peers_shm->journal = ngx_slab_alloc(shpool, size);
+        if (peers_shm->journal == NULL) {
+            goto failure;
+        }
+
+        ngx_memzero(peers_shm->journal, size);
+
+        peers_shm->verdicts = ngx_slab_alloc(shpool,
+                                             number * sizeof(ngx_atomic_t));
+        if (peers_shm->verdicts == NULL) {
+            goto failure;
+        }
+
+        peers_shm->journal->size = peers->journal_size;
+
+        /* keep the sequence numbers growing across reloads */
+        if (opeers_shm && opeers_shm->journal) {
+            peers_shm->journal->next = opeers_shm->journal->next;
+            peers_shm->notify = opeers_shm->notify;
+            peers_shm->notify.lock = 0;
+            peers_shm->statsd = opeers_shm->statsd;
+            peers_shm->statsd.lock = 0;
+            peers_shm->syslog = opeers_shm->syslog;
+            peers_shm->syslog.lock = 0;
+            peers_shm->gossip = opeers_shm->gossip;
+            peers_shm->gossip.lock = 0;
+            peers_shm->gossip_received = opeers_shm->gossip_received;
+            peers_shm->gossip_rejected = opeers_shm->gossip_rejected;
+
+        } else {
+            peers_shm->journal->next = 1;
+            peers_shm->notify.cursor = 1;
+            peers_shm->syslog.cursor = 1;
+        }
+    }
+
+    peers_shm->notify.owner = NGX_INVALID_PID;
+    peers_shm->statsd.owner = NGX_INVALID_PID;
+    peers_shm->syslog.owner = NGX_INVALID_PID;
+    peers_shm->gossip.owner = NGX_INVALID_PID;
+    peers_shm->resolve.owner = NGX_INVALID_PID;
+    peers_shm->schedule.owner = NGX_INVALID_PID;
+
+    if (peers->gossip && peers_shm->gossip_nodes != peers->gossip->nnodes) {
+
+        if (peers_shm->gossip_seen) {
+            ngx_slab_free(shpool, peers_shm->gossip_seen);
+        }
+
+        size = peers->gossip->nnodes * sizeof(uint64_t);
+
+        peers_shm->gossip_seen = ngx_slab_alloc(shpool, size);
+        if (peers_shm->gossip_seen == NULL) {
+            goto failure;
+        }
+
+        ngx_memzero(peers_shm->gossip_seen, size);
+        peers_shm->gossip_nodes = peers->gossip->nnodes;
+    }
+
+    if (peers->suspect && peers->nhosts
+        && (peers_shm->hosts == NULL || peers_shm->nhosts != peers->nhosts))
+    {
+        if (peers_shm->hosts) {
+            ngx_slab_free(shpool, peers_shm->hosts);
+        }
+
+        size = peers->nhosts * sizeof(ngx_http_check_host_shm_t);
+
+        peers_shm->hosts = ngx_slab_alloc(shpool, size);
+        if (peers_shm->hosts == NULL) {
+            goto failure;
+        }
+
+        ngx_memzero(peers_shm->hosts, size);
+        peers_shm->nhosts = peers->nhosts;
+    }
+
+    fresh = 0;
+
+    if (peers_shm->upstreams == NULL
+        || peers_shm->nupstreams != peers->upstreams.nelts)
+    {
+        if (peers_shm->upstreams) {
+            ngx_slab_free(shpool, peers_shm->upstreams);
+        }
+
+        size = peers->upstreams.nelts * sizeof(ngx_http_check_upstream_shm_t);
+
+        peers_shm->upstreams = ngx_slab_alloc(shpool, size);
+        if (peers_shm->upstreams == NULL) {
+            goto failure;
+        }
+
+        ngx_memzero(peers_shm->upstreams, size);
+        peers_shm->nupstreams = peers->upstreams.nelts;
+
+        fresh = 1;
+    }
+
+    if (peers_shm->zones
+        && (fresh || peers_shm->nzones != peers->nzones))
+    {
+        ngx_slab_free(shpool, peers_shm->zones);
+        peers_shm->zones = NULL;
+    }
+
+    peers_shm->nzones = peers->nzones;
+    peers_shm->local_zone = peers->local_zone;
+
+    if (peers->nzones && peers_shm->zones == NULL) {
+        size = peers->upstreams.nelts * peers->nzones
+               * sizeof(ngx_http_check_zone_shm_t);
+
+        peers_shm->zones = ngx_slab_alloc(shpool, size);
+        if (peers_shm->zones == NULL) {
+            goto failure;
+        }
+
+        ngx_memzero(peers_shm->zones, size);
+    }
+
+    /* start from the current transitions once check_notify is set */
+    if (peers->notify == NULL) {
+        peers_shm->notify.cursor = peers_shm->journal->next;
+    }
+
+    if (peers->syslog == NULL) {
+        peers_shm->syslog.cursor = peers_shm->journal->next;
+    }
+
+    peers_shm->generation = ngx_http_check_shm_generation;
+    peers_shm->checksum = peers->checksum;
+    peers_shm->number = number;
+
+    /* the probes of the old workers are abandoned */
+    peers_shm->counters.in_flight = 0;
+
+    peer = peers->peers.elts;
+    from = 0;
+
+    for (i = 0; i < number; i++) {
+
+        peer_shm = &peers_shm->peers[i];
+
+        /* This function may be triggered before the old stale
+         * work process exits. The owner may stick to the old
+         * pid. */
+        peer_shm->owner = NGX_INVALID_PID;
+        peer_shm->agent_owner = NGX_INVALID_PID;
+        peer_shm->warmup_owner = NGX_INVALID_PID;
+
+        peer_shm->upstream_index = peer[i].upstream_index;
+        peer_shm->backup = peer[i].backup;
+        peer_shm->zone = peer[i].zone;
+
+        if (same) {
+            continue;
+        }
+
+        if (peer[i].dynamic) {
+            if (ngx_http_check_init_slot(shpool, peer_shm, &peer[i],
+                                         opeers_shm, &from)
+                != NGX_OK)
+            {
+                goto failure;
+            }
+
+            continue;
+        }
+
+        peer_shm->socklen = peer[i].peer_addr->socklen;
+        peer_shm->sockaddr = ngx_slab_alloc(shpool, peer_shm->socklen);
+        if (peer_shm->sockaddr == NULL) {
+            goto failure;
+        }
+
+        ngx_memcpy(peer_shm->sockaddr, peer[i].peer_addr->sockaddr,
+                   peer_shm->socklen);
+
+        if (opeers_shm) {
+
+            opeer_shm = ngx_http_check_find_shm_peer(opeers_shm,
+                                                     peer[i].peer_addr);
+            if (opeer_shm) {
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, shm_zone->shm.log, 0,
+                               "http upstream check: inherit opeer:%V",
+                               &peer[i].peer_addr->name);
+
+                ngx_http_check_set_shm_peer(peer_shm, opeer_shm, 0);
+
+                /* the verdict keeps no state of an agent removed */
+                if (peer[i].conf->agent == NULL) {
+                    peer_shm->agent_down = 0;
+                    peer_shm->agent_drain = 0;
+                    peer_shm->agent_weight = 100;
+                }
+
+                continue;
+            }
+        }
+
+        ucscf = peer[i].conf;
+        ngx_http_check_set_shm_peer(peer_shm, NULL, ucscf->default_down);
+    }
+
+    for (i = 0; i < number; i++) {
+        ngx_http_check_verdict(peers_shm, i);
+    }
+
+    ngx_http_check_failover_init(peers, peers_shm, fresh);
+    ngx_http_check_zone_init(peers, peers_shm);
+
+    peers->peers_shm = peers_shm;
+    shm_zone->data = peers_shm;
+
+    return NGX_OK;
+
+failure:
+    ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                  "http upstream check_shm_size is too small, "
+                  "you should specify a larger size.");
+    return NGX_ERROR;
+}
+
 
-            state = sw_major_digit;
-            break;
+static ngx_http_check_peer_shm_t *
+ngx_http_check_find_shm_peer(ngx_http_check_peers_shm_t *peers_shm,
+                             ngx_addr_t *addr)
+{
+    ngx_uint_t                    i;
+    ngx_http_check_peer_shm_t    *peer_shm;
 
-        /* the major HTTP version or dot */
-        case sw_major_digit:
-            if (ch == '.') {
-                state = sw_first_minor_digit;
-                break;
-            }
+    for (i = 0; i < peers_shm->number; i++) {
 
-            if (ch < '0' || ch > '9') {
-                return NGX_ERROR;
-            }
+        peer_shm = &peers_shm->peers[i];
 
-            break;
+        if (peer_shm->slot == NGX_HTTP_CHECK_SLOT_FREE) {
+            continue;
+        }
 
-        /* the first digit of minor HTTP version */
-        case sw_first_minor_digit:
-            if (ch < '0' || ch > '9') {
-                return NGX_ERROR;
-            }
+        if (addr->socklen != peer_shm->socklen) {
+            continue;
+        }
 
-            state = sw_minor_digit;
-            break;
+        if (ngx_memcmp(addr->sockaddr, peer_shm->sockaddr, addr->socklen) == 0) {
+            return peer_shm;
+        }
+    }
 
-        /* the minor HTTP version or the end of the request line */
-        case sw_minor_digit:
-            if (ch == ' ') {
-                state = sw_status;
-                break;
-            }
+    return NULL;
+}
 
-            if (ch < '0' || ch > '9') {
-                return NGX_ERROR;
-            }
 
-            break;
+/*
+ * A dynamic slot takes over a server added at run time to the same
+ * upstream in the old zone, *from tells where the search goes on.
+ */
+static ngx_int_t
+ngx_http_check_init_slot(ngx_slab_pool_t *shpool,
+    ngx_http_check_peer_shm_t *peer_shm, ngx_http_check_peer_t *peer,
+    ngx_http_check_peers_shm_t *opeers_shm, ngx_uint_t *from)
+{
+    ngx_uint_t                    i;
+    ngx_http_check_peer_shm_t    *opeer_shm;
 
-        /* HTTP status code */
-        case sw_status:
-            if (ch == ' ') {
-                break;
-            }
+    peer_shm->sockaddr = ngx_slab_alloc(shpool, NGX_SOCKADDRLEN);
+    if (peer_shm->sockaddr == NULL) {
+        return NGX_ERROR;
+    }
 
-            if (ch < '0' || ch > '9') {
-                return NGX_ERROR;
-            }
+    peer_shm->name.data = ngx_slab_alloc(shpool, NGX_SOCKADDR_STRLEN);
+    if (peer_shm->name.data == NULL) {
+        return NGX_ERROR;
+    }
 
-            status->code = status->code * 10 + ch - '0';
+    peer_shm->socklen = 0;
+    peer_shm->name.len = 0;
+    peer_shm->slot = NGX_HTTP_CHECK_SLOT_FREE;
+    peer_shm->upstream_key = ngx_murmur_hash2(peer->upstream_name->data,
+                                              peer->upstream_name->len);
 
-            if (++status->count == 3) {
-                state = sw_space_after_status;
-                status->start = p - 2;
-            }
+    ngx_http_check_set_shm_peer(peer_shm, NULL, 1);
 
-            break;
+    if (opeers_shm == NULL) {
+        return NGX_OK;
+    }
 
-        /* space or end of line */
-        case sw_space_after_status:
-            switch (ch) {
-            case ' ':
-                state = sw_status_text;
-                break;
-            case '.':                    /* IIS may send 403.1, 403.2, etc */
-                state = sw_status_text;
-                break;
-            case CR:
-                state = sw_almost_done;
-                break;
-            case LF:
-                goto done;
-            default:
-                return NGX_ERROR;
-            }
-            break;
+    /* the slots of an upstream are next to each other in both zones */
+    if (*from > 0
+        && (*from > opeers_shm->number
+            || opeers_shm->peers[*from - 1].upstream_key
+               != peer_shm->upstream_key))
+    {
+        *from = 0;
+    }
 
-        /* any text until end of line */
-        case sw_status_text:
-            switch (ch) {
-            case CR:
-                state = sw_almost_done;
+    for (i = *from; i < opeers_shm->number; i++) {
 
-                break;
-            case LF:
-                goto done;
-            }
-            break;
+        opeer_shm = &opeers_shm->peers[i];
 
-        /* end of status line */
-        case sw_almost_done:
-            status->end = p - 1;
-            switch (ch) {
-            case LF:
-                goto done;
-            default:
-                return NGX_ERROR;
-            }
+        if (opeer_shm->slot != NGX_HTTP_CHECK_SLOT_USED
+            || opeer_shm->upstream_key != peer_shm->upstream_key)
+        {
+            continue;
         }
-    }
 
-    b->pos = p;
-    ctx->state = state;
+        ngx_memcpy(peer_shm->sockaddr, opeer_shm->sockaddr,
+                   opeer_shm->socklen);
+        peer_shm->socklen = opeer_shm->socklen;
 
-    return NGX_AGAIN;
+        ngx_memcpy(peer_shm->name.data, opeer_shm->name.data,
+                   opeer_shm->name.len);
+        peer_shm->name.len = opeer_shm->name.len;
 
-done:
+        ngx_http_check_set_shm_peer(peer_shm, opeer_shm, 0);
 
-    b->pos = p + 1;
+        peer_shm->slot_gen = opeer_shm->slot_gen;
+        peer_shm->slot = NGX_HTTP_CHECK_SLOT_USED;
 
-    if (status->end == NULL) {
-        status->end = p;
-    }
+        *from = i + 1;
 
-    ctx->state = sw_start;
+        break;
+    }
 
     return NGX_OK;
 }
 
 
 static void
-ngx_http_check_http_reinit(ngx_http_check_peer_t *peer)
+ngx_http_check_set_shm_peer(ngx_http_check_peer_shm_t *peer_shm,
+                            ngx_http_check_peer_shm_t *opeer_shm,
+                            ngx_uint_t init_down)
 {
-    ngx_http_check_ctx *ctx;
 
-    ctx = peer->check_data;
+    if (opeer_shm) {
+        peer_shm->access_time  = opeer_shm->access_time;
+        peer_shm->access_count = opeer_shm->access_count;
 
-    ctx->send.pos = ctx->send.start;
-    ctx->send.last = ctx->send.end;
+        peer_shm->interval     = opeer_shm->interval;
+        peer_shm->traffic      = opeer_shm->traffic;
+        peer_shm->traffic_count = opeer_shm->traffic_count;
 
-    ctx->recv.pos = ctx->recv.last = ctx->recv.start;
+        peer_shm->fall_count   = opeer_shm->fall_count;
+        peer_shm->rise_count   = opeer_shm->rise_count;
+        peer_shm->busyness     = opeer_shm->busyness;
 
-    ctx->state = 0;
+        peer_shm->down         = opeer_shm->down;
 
-    ngx_memzero(&ctx->status, sizeof(ngx_http_status_t));
-}
+        peer_shm->last_reason  = opeer_shm->last_reason;
+        peer_shm->last_code    = opeer_shm->last_code;
+        peer_shm->last_rtt     = opeer_shm->last_rtt;
+        peer_shm->last_change  = opeer_shm->last_change;
 
+        peer_shm->history      = opeer_shm->history;
+        peer_shm->history_len  = opeer_shm->history_len;
 
-static ngx_int_t
-ngx_http_check_ssl_hello_init(ngx_http_check_peer_t *peer)
-{
-    ngx_http_check_ctx                  *ctx;
-    ngx_http_upstream_check_srv_conf_t  *ucscf;
+        peer_shm->timing       = opeer_shm->timing;
 
-    ctx = peer->check_data;
-    ucscf = peer->conf;
+        peer_shm->agent_down   = opeer_shm->agent_down;
+        peer_shm->agent_drain  = opeer_shm->agent_drain;
+        peer_shm->agent_weight = opeer_shm->agent_weight;
+        peer_shm->agent_fails  = opeer_shm->agent_fails;
 
-    ctx->send.start = ctx->send.pos = (u_char *)ucscf->send.data;
-    ctx->send.end = ctx->send.last = ctx->send.start + ucscf->send.len;
+        peer_shm->drain        = opeer_shm->drain;
 
-    ctx->recv.start = ctx->recv.pos = NULL;
-    ctx->recv.end = ctx->recv.last = NULL;
+        peer_shm->warmup       = opeer_shm->warmup;
+        peer_shm->warmup_sent  = opeer_shm->warmup_sent;
+        peer_shm->warmup_access = opeer_shm->warmup_access;
 
-    return NGX_OK;
-}
+    } else{
+        peer_shm->access_time  = 0;
+        peer_shm->access_count = 0;
 
+        peer_shm->interval     = 0;
+        peer_shm->traffic      = 0;
+        peer_shm->traffic_count = 0;
 
-/* a rough check of server ssl_hello responses */
-static ngx_int_t
-ngx_http_check_ssl_hello_parse(ngx_http_check_peer_t *peer)
-{
-    size_t                        size;
-    server_ssl_hello_t           *resp;
-    ngx_http_check_ctx           *ctx;
+        peer_shm->fall_count   = 0;
+        peer_shm->rise_count   = 0;
+        peer_shm->busyness     = 0;
 
-    ctx = peer->check_data;
+        peer_shm->down         = init_down;
 
-    size = ctx->recv.last - ctx->recv.pos;
-    if (size < sizeof(server_ssl_hello_t)) {
-        return NGX_AGAIN;
-    }
+        peer_shm->last_reason  = 0;
+        peer_shm->last_code    = 0;
+        peer_shm->last_rtt     = 0;
+        peer_shm->last_change  = ngx_http_check_now();
 
-    resp = (server_ssl_hello_t *) ctx->recv.pos;
+        /* a dynamic slot may have served another server before */
+        peer_shm->history      = 0;
+        peer_shm->history_len  = 0;
 
-    ngx_log_debug7(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http check ssl_parse, type: %ud, version: %ud.%ud, "
-                   "length: %ud, handshanke_type: %ud, hello_version: %ud.%ud",
-                   resp->msg_type, resp->version.major, resp->version.minor,
-                   ntohs(resp->length), resp->handshake_type,
-                   resp->hello_version.major, resp->hello_version.minor);
+        ngx_memzero(&peer_shm->timing, sizeof(ngx_http_check_timing_t));
+        ngx_memzero((void *) peer_shm->rtt_hist, sizeof(peer_shm->rtt_hist));
 
-    if (resp->msg_type != HANDSHAKE) {
-        return NGX_ERROR;
+        peer_shm->agent_down   = 0;
+        peer_shm->agent_drain  = 0;
+        peer_shm->agent_weight = 100;
+        peer_shm->agent_fails  = 0;
+
+        peer_shm->drain        = 0;
+
+        peer_shm->warmup       = NGX_HTTP_CHECK_WARMUP_NONE;
+        peer_shm->warmup_sent  = 0;
+        peer_shm->warmup_access = 0;
     }
+}
 
-    if (resp->handshake_type != SERVER_HELLO) {
+
+static ngx_int_t
+ngx_http_check_get_shm_name(ngx_str_t *shm_name, ngx_pool_t *pool,
+                            ngx_uint_t generation)
+{
+    u_char    *last;
+
+    shm_name->data = ngx_palloc(pool, SHM_NAME_LEN);
+    if (shm_name->data == NULL) {
         return NGX_ERROR;
     }
 
+    last = ngx_snprintf(shm_name->data, SHM_NAME_LEN, "%s#%ui",
+                        "ngx_http_upstream_check", generation);
+
+    shm_name->len = last - shm_name->data;
+
     return NGX_OK;
 }
 
 
-static void
-ngx_http_check_ssl_hello_reinit(ngx_http_check_peer_t *peer)
+char *
+ngx_http_upstream_check_init_shm(ngx_conf_t *cf, void *conf)
 {
-    ngx_http_check_ctx *ctx;
+    ngx_str_t                            *shm_name;
+    ngx_uint_t                            shm_size;
+    ngx_shm_zone_t                       *shm_zone;
+    ngx_http_upstream_check_main_conf_t  *ucmcf = conf;
 
-    ctx = peer->check_data;
+    if (ucmcf->peers->peers.nelts > 0) {
 
-    ctx->send.pos = ctx->send.start;
-    ctx->send.last = ctx->send.end;
+        ngx_http_check_shm_generation++;
 
-    ctx->recv.pos = ctx->recv.last = ctx->recv.start;
+        shm_name = &ucmcf->peers->check_shm_name;
+
+        ngx_http_check_get_shm_name(shm_name, cf->pool,
+                                    ngx_http_check_shm_generation);
+
+        /* the default check share memory size, 1M */
+        shm_size = 1 * 1024 * 1024;
+
+        shm_size = shm_size < ucmcf->check_shm_size ?
+                   ucmcf->check_shm_size : shm_size;
+
+        shm_zone = ngx_shared_memory_add(cf, shm_name, shm_size,
+                                         &ngx_http_upstream_check_module);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                       "[http_upstream] upsteam:%V, shm_zone size:%ui",
+                       shm_name, shm_size);
+
+        shm_zone->data = NULL;
+        check_peers_ctx = ucmcf->peers;
+
+        shm_zone->init = ngx_http_upstream_check_init_shm_zone;
+    }
+    else {
+         check_peers_ctx = NULL;
+    }
+
+    return NGX_CONF_OK;
 }
 
 
-static ngx_int_t
-ngx_http_check_mysql_init(ngx_http_check_peer_t *peer)
+static ngx_shm_zone_t *
+ngx_shared_memory_find(ngx_cycle_t *cycle, ngx_str_t *name, void *tag)
 {
-    ngx_http_check_ctx                  *ctx;
-    ngx_http_upstream_check_srv_conf_t  *ucscf;
+    ngx_uint_t        i;
+    ngx_shm_zone_t   *shm_zone;
+    ngx_list_part_t  *part;
 
-    ctx = peer->check_data;
-    ucscf = peer->conf;
+    part = (ngx_list_part_t *) & (cycle->shared_memory.part);
+    shm_zone = part->elts;
 
-    ctx->send.start = ctx->send.pos = (u_char *)ucscf->send.data;
-    ctx->send.end = ctx->send.last = ctx->send.start + ucscf->send.len;
+    for (i = 0; /* void */ ; i++) {
 
-    ctx->recv.start = ctx->recv.pos = NULL;
-    ctx->recv.end = ctx->recv.last = NULL;
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
 
-    return NGX_OK;
+        if (name->len != shm_zone[i].shm.name.len) {
+            continue;
+        }
+
+        if (ngx_strncmp(name->data, shm_zone[i].shm.name.data, name->len)
+                != 0)
+        {
+            continue;
+        }
+
+        if (tag != shm_zone[i].tag) {
+            continue;
+        }
+
+        return &shm_zone[i];
+    }
+
+    return NULL;
 }
 
 
-/* a rough check of mysql greeting responses */
-static ngx_int_t
-ngx_http_check_mysql_parse(ngx_http_check_peer_t *peer)
+ngx_int_t
+ngx_http_upstream_check_status_handler(ngx_http_request_t *r)
 {
-    size_t                         size;
-    ngx_http_check_ctx            *ctx;
-    mysql_handshake_init_t        *handshake;
-
-    ctx = peer->check_data;
+    u_char                          agent[sizeof("down, drain, 1000%, "
+                                                 " failed") - 1
+                                          + NGX_ATOMIC_T_LEN];
+    size_t                          buffer_size, agent_len;
+    ngx_int_t                       rc;
+    ngx_buf_t                      *b;
+    uint64_t                        now;
+    ngx_str_t                       since;
+    ngx_uint_t                      i, j, n, suspect;
+    ngx_chain_t                     out;
+    check_conf_t                   *cf;
+    ngx_http_check_counters_t      *counters;
+    ngx_http_check_peer_t          *peer;
+    ngx_http_check_peers_t         *peers;
+    ngx_http_check_upstream_t      *upstream;
+    ngx_http_check_upstream_shm_t  *u;
+    ngx_http_check_zone_shm_t      *z;
+    ngx_http_check_peer_shm_t      *peer_shm;
+    ngx_http_check_usage_t         *usage;
+    ngx_http_check_peers_shm_t     *peers_shm;
 
-    size = ctx->recv.last - ctx->recv.pos;
-    if (size < sizeof(mysql_handshake_init_t)) {
-        return NGX_AGAIN;
+    if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
+        return NGX_HTTP_NOT_ALLOWED;
     }
 
-    handshake = (mysql_handshake_init_t *) ctx->recv.pos;
-
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "mysql_parse: packet_number=%ud, protocol=%ud",
-                   handshake->packet_number, handshake->protocol_version);
+    rc = ngx_http_discard_request_body(r);
 
-    /* The mysql greeting packet's serial number always begins with 0. */
-    if (handshake->packet_number != 0x00) {
-        return NGX_ERROR;
+    if (rc != NGX_OK) {
+        return rc;
     }
 
-    return NGX_OK;
-}
+    if (ngx_http_arg(r, (u_char *) "since", sizeof("since") - 1, &since)
+        == NGX_OK)
+    {
+        return ngx_http_check_journal_handler(r, &since);
+    }
 
+    r->headers_out.content_type.len = sizeof("text/html; charset=utf-8") - 1;
+    r->headers_out.content_type.data = (u_char *) "text/html; charset=utf-8";
 
-static void
-ngx_http_check_mysql_reinit(ngx_http_check_peer_t *peer)
-{
-    ngx_http_check_ctx *ctx;
+    if (r->method == NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
 
-    ctx = peer->check_data;
+        rc = ngx_http_send_header(r);
 
-    ctx->send.pos = ctx->send.start;
-    ctx->send.last = ctx->send.end;
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+    }
 
-    ctx->recv.pos = ctx->recv.last = ctx->recv.start;
-}
+    peers = check_peers_ctx;
+    if (peers == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "[http upstream check] can not find the check servers, "
+                      "have you added the check servers? ");
 
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-static ngx_int_t
-ngx_http_check_ajp_init(ngx_http_check_peer_t *peer)
-{
-    ngx_http_check_ctx                  *ctx;
-    ngx_http_upstream_check_srv_conf_t  *ucscf;
+    peers_shm = peers->peers_shm;
 
-    ctx = peer->check_data;
-    ucscf = peer->conf;
+    peer = peers->peers.elts;
+    peer_shm = peers_shm->peers;
 
-    ctx->send.start = ctx->send.pos = (u_char *)ucscf->send.data;
-    ctx->send.end = ctx->send.last = ctx->send.start + ucscf->send.len;
+    now = ngx_http_check_now();
 
-    ctx->recv.start = ctx->recv.pos = NULL;
-    ctx->recv.end = ctx->recv.last = NULL;
+    buffer_size = peers->peers.nelts * ngx_pagesize / 4;
+    buffer_size = ngx_align(buffer_size, ngx_pagesize) + 2 * ngx_pagesize;
 
-    return NGX_OK;
-}
+    b = ngx_create_temp_buf(r->pool, buffer_size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
+    out.buf = b;
+    out.next = NULL;
 
-static ngx_int_t
-ngx_http_check_ajp_parse(ngx_http_check_peer_t *peer)
-{
-    u_char                        *p;
-    ngx_http_check_ctx            *ctx;
+    b->last = ngx_snprintf(b->last, b->end - b->last,
+            "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML 1.0 Strict//EN\n"
+            "\"http://www.w3.org/TR/xhtml1/DTD/xhtml1-strict.dtd\">\n"
+            "<html xmlns=\"http://www.w3.org/1999/xhtml\">\n"
+            "<head>\n"
+            "  <title>Nginx http upstream check status</title>\n"
+            "</head>\n"
+            "<body>\n"
+            "<h1>Nginx http upstream check status</h1>\n"
+            "<h2>Check upstream server number: %ui, generation: %ui</h2>\n"
+            "<table style=\"background-color:white\" cellspacing=\"0\" "
+            "       cellpadding=\"3\" border=\"1\">\n"
+            "  <tr bgcolor=\"#C0C0C0\">\n"
+            "    <th>Index</th>\n"
+            "    <th>Upstream</th>\n"
+            "    <th>Name</th>\n"
+            "    <th>Status</th>\n"
+            "    <th>Rise counts</th>\n"
+            "    <th>Fall counts</th>\n"
+            "    <th>Last result</th>\n"
+            "    <th>Last code</th>\n"
+            "    <th>Last RTT (ms)</th>\n"
+            "    <th>In state for (s)</th>\n"
+            "    <th>History</th>\n"
+            "    <th>Flap score</th>\n"
+            "    <th>Shared</th>\n"
+            "    <th>Agent</th>\n"
+            "    <th>Check type</th>\n"
+            "    <th>Avg connect/send/first byte/total (ms)</th>\n"
+            "  </tr>\n",
+            peers->peers.nelts, ngx_http_check_shm_generation);
 
-    ctx = peer->check_data;
+    for (i = 0; i < peers->peers.nelts; i++) {
 
-    if ((size_t)(ctx->recv.last - ctx->recv.pos) < sizeof(ajp_cpong_packet)) {
-        return NGX_AGAIN;
-    }
+        if (peer_shm[i].slot == NGX_HTTP_CHECK_SLOT_FREE) {
+            continue;
+        }
 
-    p = ctx->recv.pos;
+        if (peer[i].agent == NULL) {
+            agent[0] = '-';
+            agent_len = 1;
 
-#if (NGX_DEBUG)
-    ajp_raw_packet_t              *ajp;
+        } else {
+            agent_len = ngx_snprintf(agent, sizeof(agent),
+                                     "%s%s%ui%%, %ui failed",
+                                     peer_shm[i].agent_down ? "down, " : "",
+                                     peer_shm[i].agent_drain ? "drain, " : "",
+                                     (ngx_uint_t) peer_shm[i].agent_weight,
+                                     (ngx_uint_t) peer_shm[i].agent_fails)
+                        - agent;
+        }
 
-    ajp = (ajp_raw_packet_t *)p;
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "ajp_parse: preamble=0x%xd, length=0x%xd, type=0x%xd",
-                   ntohs(ajp->preamble), ntohs(ajp->length), ajp->type);
-#endif
+        b->last = ngx_snprintf(b->last, b->end - b->last,
+                "  <tr%s>\n"
+                "    <td>%ui</td>\n"
+                "    <td>%V</td>\n"
+                "    <td>%V</td>\n"
+                "    <td>%s</td>\n"
+                "    <td>%ui</td>\n"
+                "    <td>%ui</td>\n"
+                "    <td>%s</td>\n"
+                "    <td>%ui</td>\n"
+                "    <td>%ui</td>\n"
+                "    <td>%uL</td>\n"
+                "    <td>%016xL</td>\n"
+                "    <td>%ui</td>\n"
+                "    <td>%s</td>\n"
+                "    <td>%*s</td>\n"
+                "    <td>%s</td>\n"
+                "    <td>",
+                peer_shm[i].down ? " bgcolor=\"#FF0000\"" : "",
+                i,
+                peer[i].upstream_name,
+                peer[i].dynamic ? &peer_shm[i].name : &peer[i].peer_addr->name,
+                peer_shm[i].down
+                    ? peer_shm[i].warmup == NGX_HTTP_CHECK_WARMUP_RUNNING
+                      ? "warmup" : "down"
+                    : peer_shm[i].drain || peer_shm[i].agent_drain ? "drain"
+                    : "up",
+                peer_shm[i].rise_count,
+                peer_shm[i].fall_count,
+                peer_shm[i].last_reason < NGX_HTTP_CHECK_ERR_N
+                    ? ngx_http_check_err_names[peer_shm[i].last_reason] : "",
+                (ngx_uint_t) peer_shm[i].last_code,
+                (ngx_uint_t) peer_shm[i].last_rtt,
+                (now - peer_shm[i].last_change) / 1000,
+                peer_shm[i].history,
+                ngx_http_check_flap_score(&peer_shm[i]),
+                peer[i].shared == NULL ? "-"
+                    : (ngx_pid_t) peer[i].shared->prober
+                      == ngx_http_check_instance ? "probe" : "follow",
+                agent_len, agent,
+                peer[i].conf->check_type_conf->name);
 
-    if (ngx_memcmp(ajp_cpong_packet, p, sizeof(ajp_cpong_packet)) == 0) {
-        return NGX_OK;
+        b->last = ngx_http_check_timing_status(b->last, b->end,
+                                               &peer_shm[i].timing, 0);
 
-    } else {
-        return NGX_ERROR;
+        b->last = ngx_snprintf(b->last, b->end - b->last,
+                "</td>\n"
+                "  </tr>\n");
     }
-}
 
+    counters = &peers_shm->counters;
 
-static void
-ngx_http_check_ajp_reinit(ngx_http_check_peer_t *peer)
-{
-    ngx_http_check_ctx *ctx;
+    suspect = 0;
 
-    ctx = peer->check_data;
+    for (i = 0; peers_shm->hosts && i < peers_shm->nhosts; i++) {
+        if (peers_shm->hosts[i].suspect_until > now) {
+            suspect++;
+        }
+    }
 
-    ctx->send.pos = ctx->send.start;
-    ctx->send.last = ctx->send.end;
+    b->last = ngx_snprintf(b->last, b->end - b->last,
+            "</table>\n"
+            "<h2>Check counters</h2>\n"
+            "<table style=\"background-color:white\" cellspacing=\"0\" "
+            "       cellpadding=\"3\" border=\"1\">\n"
+            "  <tr bgcolor=\"#C0C0C0\">\n"
+            "    <th>Started</th>\n"
+            "    <th>Succeeded</th>\n");
 
-    ctx->recv.pos = ctx->recv.last = ctx->recv.start;
-}
+    for (i = NGX_HTTP_CHECK_ERR_CONNECT; i < NGX_HTTP_CHECK_ERR_N; i++) {
+        b->last = ngx_snprintf(b->last, b->end - b->last,
+                "    <th>Failed (%s)</th>\n", ngx_http_check_err_names[i]);
+    }
 
+    b->last = ngx_snprintf(b->last, b->end - b->last,
+            "    <th>In flight</th>\n"
+            "    <th>Skipped (not owner)</th>\n"
+            "    <th>Transitions</th>\n"
+            "    <th>Locks taken/spins</th>\n"
+            "    <th>Timer lag last/max (ms)</th>\n"
+            "    <th>Deferred (lag)</th>\n"
+            "    <th>Timeouts ignored (lag)</th>\n"
+            "    <th>Notified sent/failed/dropped</th>\n"
+            "    <th>StatsD datagrams sent/failed</th>\n"
+            "    <th>Syslog messages sent/failed/dropped</th>\n"
+            "    <th>Gossip nodes live/all, digests sent/failed/received/rejected</th>\n"
+            "    <th>Hosts suspect now/ever, probes fast-failed</th>\n"
+            "    <th>Names resolved/failed, servers moved</th>\n"
+            "  </tr>\n"
+            "  <tr>\n"
+            "    <td>%ui</td>\n"
+            "    <td>%ui</td>\n",
+            counters->started, counters->succeeded);
+
+    for (i = NGX_HTTP_CHECK_ERR_CONNECT; i < NGX_HTTP_CHECK_ERR_N; i++) {
+        b->last = ngx_snprintf(b->last, b->end - b->last,
+                "    <td>%ui</td>\n", counters->failed[i]);
+    }
 
-static void
-ngx_http_check_status_update(ngx_http_check_peer_t *peer, ngx_int_t result)
-{
-    ngx_http_upstream_check_srv_conf_t   *ucscf;
+    b->last = ngx_snprintf(b->last, b->end - b->last,
+            "    <td>%ui</td>\n"
+            "    <td>%ui</td>\n"
+            "    <td>%ui</td>\n"
+            "    <td>%ui/%ui</td>\n"
+            "    <td>%ui/%ui</td>\n"
+            "    <td>%ui</td>\n"
+            "    <td>%ui</td>\n"
+            "    <td>%ui/%ui/%ui</td>\n"
+            "    <td>%ui/%ui</td>\n"
+            "    <td>%ui/%ui/%ui</td>\n"
+            "    <td>%ui/%ui, %ui/%ui/%ui/%ui</td>\n"
+            "    <td>%ui/%ui, %ui</td>\n"
+            "    <td>%ui/%ui, %ui</td>\n"
+            "  </tr>\n"
+            "</table>\n"
+            "<h2>Check timing by type</h2>\n"
+            "<table style=\"background-color:white\" cellspacing=\"0\" "
+            "       cellpadding=\"3\" border=\"1\">\n"
+            "  <tr bgcolor=\"#C0C0C0\">\n"
+            "    <th>Check type</th>\n"
+            "    <th>Probes</th>\n"
+            "    <th>Avg(max) connect/send/first byte/total (ms)</th>\n"
+            "    <th>CPU (ms)</th>\n"
+            "    <th>Syscalls</th>\n"
+            "  </tr>\n",
+            counters->in_flight, counters->skipped,
+            counters->transitions, counters->locks, counters->lock_spins,
+            counters->lag_last, counters->lag_max,
+            counters->deferred, counters->discounted,
+            peers_shm->notify.sent, peers_shm->notify.failed,
+            peers_shm->notify.dropped,
+            peers_shm->statsd.sent, peers_shm->statsd.failed,
+            peers_shm->syslog.sent, peers_shm->syslog.failed,
+            peers_shm->syslog.dropped,
+            peers->gossip ? ngx_http_check_gossip.nlive : 0,
+            peers->gossip ? peers->gossip->nnodes : 0,
+            peers_shm->gossip.sent, peers_shm->gossip.failed,
+            peers_shm->gossip_received, peers_shm->gossip_rejected,
+            suspect, counters->suspected, counters->fast_failed,
+            counters->resolved, counters->resolve_failed,
+            counters->readdressed);
+
+    for (cf = ngx_check_types; cf->type != 0; cf++) {
+        i = cf - ngx_check_types;
+
+        if (peers_shm->type_timing[i].phase[NGX_HTTP_CHECK_PHASE_VERDICT].count
+            == 0)
+        {
+            continue;
+        }
 
-    ucscf = peer->conf;
+        b->last = ngx_snprintf(b->last, b->end - b->last,
+                "  <tr>\n"
+                "    <td>%s</td>\n"
+                "    <td>%ui</td>\n"
+                "    <td>",
+                cf->name,
+                peers_shm->type_timing[i].phase[NGX_HTTP_CHECK_PHASE_VERDICT]
+                    .count);
 
-    if (result) {
-        peer->shm->rise_count++;
-        peer->shm->fall_count = 0;
-        if (peer->shm->down && peer->shm->rise_count >= ucscf->rise_count) {
-            peer->shm->down = 0;
-        }
+        b->last = ngx_http_check_timing_status(b->last, b->end,
+                                               &peers_shm->type_timing[i], 1);
 
-    } else {
-        peer->shm->rise_count = 0;
-        peer->shm->fall_count++;
-        if (!peer->shm->down && peer->shm->fall_count >= ucscf->fall_count) {
-            peer->shm->down = 1;
-        }
+        usage = &peers_shm->type_usage[i];
+
+        b->last = ngx_snprintf(b->last, b->end - b->last,
+                "</td>\n"
+                "    <td>%ui.%03ui</td>\n"
+                "    <td>%ui</td>\n"
+                "  </tr>\n",
+                (ngx_uint_t) usage->cpu / 1000,
+                (ngx_uint_t) usage->cpu % 1000,
+                (ngx_uint_t) usage->syscalls);
     }
 
-    peer->shm->access_time = ngx_current_msec;
-}
+    b->last = ngx_snprintf(b->last, b->end - b->last,
+            "</table>\n"
+            "<h2>Check usage by upstream</h2>\n"
+            "<table style=\"background-color:white\" cellspacing=\"0\" "
+            "       cellpadding=\"3\" border=\"1\">\n"
+            "  <tr bgcolor=\"#C0C0C0\">\n"
+            "    <th>Upstream</th>\n"
+            "    <th>Handler runs</th>\n"
+            "    <th>CPU (ms)</th>\n"
+            "    <th>Syscalls</th>\n"
+            "  </tr>\n");
+
+    upstream = peers->upstreams.elts;
 
+    for (i = 0; i < peers_shm->nupstreams; i++) {
+        usage = &peers_shm->upstreams[i].usage;
 
-static void
-ngx_http_check_clean_event(ngx_http_check_peer_t *peer)
-{
-    ngx_connection_t             *c;
+        b->last = ngx_snprintf(b->last, b->end - b->last,
+                "  <tr>\n"
+                "    <td>%V</td>\n"
+                "    <td>%ui</td>\n"
+                "    <td>%ui.%03ui</td>\n"
+                "    <td>%ui</td>\n"
+                "  </tr>\n",
+                upstream[i].name, (ngx_uint_t) usage->runs,
+                (ngx_uint_t) usage->cpu / 1000,
+                (ngx_uint_t) usage->cpu % 1000,
+                (ngx_uint_t) usage->syscalls);
+    }
 
-    c = peer->pc.connection;
+    b->last = ngx_snprintf(b->last, b->end - b->last, "</table>\n");
 
-    if (c) {
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                "http check clean event: index:%ui, fd: %d",
-                peer->index, c->fd);
+    if (peers->budget) {
+        b->last = ngx_snprintf(b->last, b->end - b->last,
+                "<h2>Schedule</h2>\n"
+                "<table style=\"background-color:white\" "
+                "cellspacing=\"0\" "
+                "       cellpadding=\"3\" border=\"1\">\n"
+                "  <tr bgcolor=\"#C0C0C0\">\n"
+                "    <th>Index</th>\n"
+                "    <th>Name</th>\n"
+                "    <th>Requests/s</th>\n"
+                "    <th>Interval (ms)</th>\n"
+                "  </tr>\n");
+
+        for (i = 0; i < peers->peers.nelts; i++) {
+
+            if (peer_shm[i].slot == NGX_HTTP_CHECK_SLOT_FREE) {
+                continue;
+            }
 
-        ngx_close_connection(c);
-        peer->pc.connection = NULL;
-    }
+            b->last = ngx_snprintf(b->last, b->end - b->last,
+                    "  <tr>\n"
+                    "    <td>%ui</td>\n"
+                    "    <td>%V</td>\n"
+                    "    <td>%ui.%03ui</td>\n"
+                    "    <td>%M</td>\n"
+                    "  </tr>\n",
+                    i,
+                    peer[i].dynamic ? &peer_shm[i].name
+                                    : &peer[i].peer_addr->name,
+                    peer_shm[i].traffic / 1000, peer_shm[i].traffic % 1000,
+                    ngx_http_check_peer_interval(&peer[i]));
+        }
 
-    if (peer->check_timeout_ev.timer_set) {
-        ngx_del_timer(&peer->check_timeout_ev);
+        b->last = ngx_snprintf(b->last, b->end - b->last, "</table>\n");
     }
 
-    peer->state = NGX_HTTP_CHECK_ALL_DONE;
-
-    if (peer->check_data != NULL && peer->reinit) {
-        peer->reinit(peer);
-    }
+    n = 0;
 
-    peer->shm->owner = NGX_INVALID_PID;
-}
+    for (i = 0; i < peers_shm->nupstreams; i++) {
+        u = &peers_shm->upstreams[i];
 
+        if (u->backups == 0) {
+            continue;
+        }
 
-static void
-ngx_http_check_timeout_handler(ngx_event_t *event)
-{
-    ngx_http_check_peer_t          *peer;
+        if (n++ == 0) {
+            b->last = ngx_snprintf(b->last, b->end - b->last,
+                    "<h2>Failover</h2>\n"
+                    "<table style=\"background-color:white\" "
+                    "cellspacing=\"0\" "
+                    "       cellpadding=\"3\" border=\"1\">\n"
+                    "  <tr bgcolor=\"#C0C0C0\">\n"
+                    "    <th>Upstream</th>\n"
+                    "    <th>Primary up</th>\n"
+                    "    <th>Backup</th>\n"
+                    "    <th>Serving</th>\n"
+                    "    <th>In state for (s)</th>\n"
+                    "  </tr>\n");
+        }
 
-    if (ngx_http_check_need_exit()) {
-        return;
+        b->last = ngx_snprintf(b->last, b->end - b->last,
+                "  <tr%s>\n"
+                "    <td>%V</td>\n"
+                "    <td>%ui</td>\n"
+                "    <td>%ui</td>\n"
+                "    <td>%s</td>\n"
+                "    <td>%uL</td>\n"
+                "  </tr>\n",
+                u->failover ? " bgcolor=\"#FF0000\"" : "",
+                upstream[i].name, u->up, u->backups,
+                !u->failover ? "primary"
+                    : u->recovered ? "backup, failing back" : "backup",
+                (now - u->last_change) / 1000);
     }
 
-    peer = event->data;
+    if (n) {
+        b->last = ngx_snprintf(b->last, b->end - b->last, "</table>\n");
+    }
 
-    ngx_log_error(NGX_LOG_ERR, event->log, 0,
-                  "check time out with peer: %V ", &peer->peer_addr->name);
+    n = 0;
 
-    ngx_http_check_status_update(peer, 0);
-    ngx_http_check_clean_event(peer);
-}
+    for (i = 0; peers_shm->zones && i < peers_shm->nupstreams; i++) {
 
+        for (j = 0; j < peers->nzones; j++) {
+            z = &peers_shm->zones[i * peers->nzones + j];
 
-static void
-ngx_http_check_finish_handler(ngx_event_t *event)
-{
-    if (ngx_http_check_need_exit()) {
-        return;
-    }
-}
+            if (z->total == 0) {
+                continue;
+            }
 
+            if (n++ == 0) {
+                b->last = ngx_snprintf(b->last, b->end - b->last,
+                        "<h2>Zones</h2>\n"
+                        "<table style=\"background-color:white\" "
+                        "cellspacing=\"0\" "
+                        "       cellpadding=\"3\" border=\"1\">\n"
+                        "  <tr bgcolor=\"#C0C0C0\">\n"
+                        "    <th>Upstream</th>\n"
+                        "    <th>Zone</th>\n"
+                        "    <th>Up/all</th>\n"
+                        "  </tr>\n");
+            }
 
-static ngx_int_t
-ngx_http_check_need_exit()
-{
-    if (ngx_terminate || ngx_exiting || ngx_quit) {
-        ngx_http_check_clear_all_events();
-        return 1;
+            b->last = ngx_snprintf(b->last, b->end - b->last,
+                    "  <tr>\n"
+                    "    <td>%V</td>\n"
+                    "    <td>%V%s</td>\n"
+                    "    <td>%ui/%ui</td>\n"
+                    "  </tr>\n",
+                    upstream[i].name, &peers->zones[j],
+                    j == peers->local_zone ? " (local)" : "",
+                    (ngx_uint_t) z->up, z->total);
+        }
     }
 
-    return 0;
-}
+    b->last = ngx_snprintf(b->last, b->end - b->last,
+            "%s"
+            "</body>\n"
+            "</html>\n",
+            n ? "</table>\n" : "");
 
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
 
-static ngx_flag_t has_cleared = 0;
+    b->last_buf = 1;
 
-static void
-ngx_http_check_clear_all_events()
-{
-    ngx_uint_t                      i;
-    ngx_connection_t               *c;
-    ngx_http_check_peer_t          *peer;
-    ngx_http_check_peers_t         *peers;
+    rc = ngx_http_send_header(r);
 
-    if (has_cleared || check_peers_ctx == NULL) {
-        return;
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
     }
 
-    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
-                  "clear all the events on %P ", ngx_pid);
+    return ngx_http_output_filter(r, &out);
+}
 
-    has_cleared = 1;
 
-    peers = check_peers_ctx;
+static u_char *
+ngx_http_check_timing_status(u_char *p, u_char *last,
+    ngx_http_check_timing_t *timing, ngx_uint_t with_max)
+{
+    ngx_uint_t                i, avg;
+    ngx_http_check_phase_t   *phase;
 
-    peer = peers->peers.elts;
-    for (i = 0; i < peers->peers.nelts; i++) {
+    for (i = 0; i < NGX_HTTP_CHECK_PHASE_N; i++) {
+        phase = &timing->phase[i];
 
-        if (peer[i].check_ev.timer_set) {
-            ngx_del_timer(&peer[i].check_ev);
-        }
+        avg = phase->count ? phase->total / phase->count : 0;
 
-        /* Be careful, The shared memory may have been freed after reload */
-        if (peer[i].check_timeout_ev.timer_set) {
-            c = peer[i].pc.connection;
-            if (c) {
-                ngx_close_connection(c);
-                peer[i].pc.connection = NULL;
-            }
-            ngx_del_timer(&peer[i].check_timeout_ev);
-        }
+        p = ngx_slprintf(p, last, "%s%ui", i ? "/" : "", avg);
 
-        if (peer[i].pool != NULL) {
-            ngx_destroy_pool(peer[i].pool);
-            peer[i].pool = NULL;
+        if (with_max) {
+            p = ngx_slprintf(p, last, "(%ui)", phase->max);
         }
     }
+
+    return p;
 }
 
 
-static ngx_int_t
-ngx_http_upstream_check_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data)
+/*
+ * GET /control?server=address[&upstream=name]&drain=on|off, or index=n
+ * instead of the server, sets the drain state of the matching peers and
+ * lists them.  See ngx_http_check_control_dynamic() for check_dynamic.
+ */
+ngx_int_t
+ngx_http_upstream_check_control_handler(ngx_http_request_t *r)
 {
-    size_t                               size;
-    ngx_str_t                            oshm_name = ngx_null_string;
-    ngx_uint_t                           i, same, number;
-    ngx_shm_zone_t                      *oshm_zone;
-    ngx_slab_pool_t                     *shpool;
-    ngx_http_check_peer_t               *peer;
-    ngx_http_check_peers_t              *peers;
-    ngx_http_check_peer_shm_t           *peer_shm, *opeer_shm;
-    ngx_http_check_peers_shm_t          *peers_shm, *opeers_shm;
-    ngx_http_upstream_check_srv_conf_t  *ucscf;
-
-    opeers_shm = NULL;
-    peers_shm = NULL;
+    size_t                     size;
+    ngx_int_t                  rc, index;
+    ngx_buf_t                 *b;
+    ngx_str_t                  server, upstream, value, *name;
+    ngx_uint_t                 i, drain, found;
+    ngx_http_check_peer_t     *peer;
+    ngx_http_check_peers_t    *peers;
 
-    same = 0;
-    peers = check_peers_ctx;
+    if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_POST) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
 
-    number =  peers->peers.nelts;
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    rc = ngx_http_discard_request_body(r);
 
-    if (peers == NULL || number == 0) {
-        return NGX_OK;
+    if (rc != NGX_OK) {
+        return rc;
     }
 
-    if (data) {
-        opeers_shm = data;
+    peers = check_peers_ctx;
+    if (peers == NULL || peers->peers_shm == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "[http upstream check] can not find the check servers, "
+                      "have you added the check servers? ");
 
-        if (opeers_shm->number == number
-            && opeers_shm->checksum == peers->checksum) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-            peers_shm = data;
-            same = 1;
-        }
+    if (ngx_http_arg(r, (u_char *) "add", sizeof("add") - 1, &value)
+        == NGX_OK
+        || ngx_http_arg(r, (u_char *) "address", sizeof("address") - 1,
+                        &value)
+           == NGX_OK
+        || ngx_http_arg(r, (u_char *) "remove", sizeof("remove") - 1, &value)
+           == NGX_OK)
+    {
+        return ngx_http_check_control_dynamic(r, peers);
     }
 
-    if (!same) {
+    if (ngx_http_arg(r, (u_char *) "drain", sizeof("drain") - 1, &value)
+        != NGX_OK)
+    {
+        return NGX_HTTP_BAD_REQUEST;
+    }
 
-        if (ngx_http_check_shm_generation > 1) {
+    if (value.len == 2 && ngx_strncmp(value.data, "on", 2) == 0) {
+        drain = 1;
 
-            ngx_http_check_get_shm_name(&oshm_name, ngx_cycle->pool,
-                                        ngx_http_check_shm_generation - 1);
+    } else if (value.len == 3 && ngx_strncmp(value.data, "off", 3) == 0) {
+        drain = 0;
 
-            /* The global variable ngx_cycle still points to the old version */
-            oshm_zone = ngx_shared_memory_find((ngx_cycle_t *)ngx_cycle,
-                                               &oshm_name,
-                                               &ngx_http_upstream_check_module);
+    } else {
+        return NGX_HTTP_BAD_REQUEST;
+    }
 
-            if (oshm_zone) {
-                opeers_shm = oshm_zone->data;
+    index = NGX_ERROR;
+    server.len = 0;
+    upstream.len = 0;
 
-                ngx_log_debug2(NGX_LOG_DEBUG_HTTP, shm_zone->shm.log, 0,
-                               "http upstream check, find oshm_zone:%p, "
-                               "opeers_shm: %p",
-                               oshm_zone, opeers_shm);
-            }
+    if (ngx_http_arg(r, (u_char *) "index", sizeof("index") - 1, &value)
+        == NGX_OK)
+    {
+        index = ngx_atoi(value.data, value.len);
+        if (index == NGX_ERROR) {
+            return NGX_HTTP_BAD_REQUEST;
         }
 
-        size = sizeof(*peers_shm) +
-               (number - 1) * sizeof(ngx_http_check_peer_shm_t);
-
-        peers_shm = ngx_slab_alloc(shpool, size);
-
-        if (peers_shm == NULL) {
-            goto failure;
+    } else if (ngx_http_arg(r, (u_char *) "server", sizeof("server") - 1,
+                            &value)
+               == NGX_OK)
+    {
+        if (ngx_http_check_arg_unescape(r->pool, &value, &server) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
 
-        ngx_memzero(peers_shm, size);
-    }
+        (void) ngx_http_arg(r, (u_char *) "upstream", sizeof("upstream") - 1,
+                            &upstream);
 
-    peers_shm->generation = ngx_http_check_shm_generation;
-    peers_shm->checksum = peers->checksum;
-    peers_shm->number = number;
+    } else {
+        return NGX_HTTP_BAD_REQUEST;
+    }
 
     peer = peers->peers.elts;
 
-    for (i = 0; i < number; i++) {
+    size = peers->peers.nelts * (sizeof("index= upstream= name= drain=off\n")
+                                 + NGX_INT_T_LEN + 256 + NGX_SOCKADDR_STRLEN);
 
-        peer_shm = &peers_shm->peers[i];
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-        /* This function may be triggered before the old stale
-         * work process exits. The owner may stick to the old
-         * pid. */
-        peer_shm->owner = NGX_INVALID_PID;
+    found = 0;
 
-        if (same) {
-            continue;
-        }
+    for (i = 0; i < peers->peers.nelts; i++) {
 
-        peer_shm->socklen = peer[i].peer_addr->socklen;
-        peer_shm->sockaddr = ngx_slab_alloc(shpool, peer_shm->socklen);
-        if (peer_shm->sockaddr == NULL) {
-            goto failure;
+        if (peer[i].shm->slot == NGX_HTTP_CHECK_SLOT_FREE) {
+            continue;
         }
 
-        ngx_memcpy(peer_shm->sockaddr, peer[i].peer_addr->sockaddr,
-                   peer_shm->socklen);
-
-        if (opeers_shm) {
+        name = peer[i].dynamic ? &peer[i].shm->name : &peer[i].peer_addr->name;
 
-            opeer_shm = ngx_http_check_find_shm_peer(opeers_shm,
-                                                     peer[i].peer_addr);
-            if (opeer_shm) {
-                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, shm_zone->shm.log, 0,
-                               "http upstream check: inherit opeer:%V",
-                               &peer[i].peer_addr->name);
+        if (index != NGX_ERROR) {
+            if ((ngx_uint_t) (index & NGX_HTTP_CHECK_SLOT_MASK) != i) {
+                continue;
+            }
 
-                ngx_http_check_set_shm_peer(peer_shm, opeer_shm, 0);
+        } else {
+            if (server.len != name->len
+                || ngx_strncmp(server.data, name->data, server.len) != 0)
+            {
+                continue;
+            }
 
+            if (upstream.len
+                && (upstream.len != peer[i].upstream_name->len
+                    || ngx_strncmp(upstream.data, peer[i].upstream_name->data,
+                                   upstream.len) != 0))
+            {
                 continue;
             }
         }
 
-        ucscf = peer[i].conf;
-        ngx_http_check_set_shm_peer(peer_shm, NULL, ucscf->default_down);
-    }
+        if (peer[i].shm->drain != drain) {
+            ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                          "check control: peer %V of upstream %V drain %s",
+                          name, peer[i].upstream_name, drain ? "on" : "off");
 
-    peers->peers_shm = peers_shm;
-    shm_zone->data = peers_shm;
+            peer[i].shm->drain = drain;
 
-    return NGX_OK;
+            ngx_http_check_verdict_update(&peer[i]);
+        }
 
-failure:
-    ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
-                  "http upstream check_shm_size is too small, "
-                  "you should specify a larger size.");
-    return NGX_ERROR;
+        b->last = ngx_slprintf(b->last, b->end,
+                               "index=%ui upstream=%V name=%V drain=%s\n",
+                               i, peer[i].upstream_name, name,
+                               drain ? "on" : "off");
+        found++;
+    }
+
+    if (found == 0) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    return ngx_http_check_control_reply(r, b);
 }
 
 
-static ngx_http_check_peer_shm_t *
-ngx_http_check_find_shm_peer(ngx_http_check_peers_shm_t *peers_shm,
-                             ngx_addr_t *addr)
-{
-    ngx_uint_t                    i;
-    ngx_http_check_peer_shm_t    *peer_shm;
+/*
+ * GET /control?add=address&upstream=name puts a server into a free slot
+ * of check_dynamic, index=n&address=address moves the slot to another
+ * server and remove=n frees it.  The reply tells the new check_index.
+ */
+static ngx_int_t
+ngx_http_check_control_dynamic(ngx_http_request_t *r,
+    ngx_http_check_peers_t *peers)
+{
+    ngx_int_t                  rc, index;
+    ngx_buf_t                 *b;
+    ngx_str_t                  upstream, value, text;
+    ngx_addr_t                 addr;
+    ngx_http_check_peer_t     *peer;
+
+    b = ngx_create_temp_buf(r->pool, sizeof("index= upstream= name=\n")
+                                     + NGX_INT_T_LEN + 256
+                                     + NGX_SOCKADDR_STRLEN);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    peer = peers->peers.elts;
+
+    if (ngx_http_arg(r, (u_char *) "remove", sizeof("remove") - 1, &value)
+        == NGX_OK)
+    {
+        index = ngx_http_check_control_index(peers, &value);
+        if (index == NGX_ERROR) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        if (ngx_http_check_remove_dynamic_peer(index) != NGX_OK) {
+            return NGX_HTTP_NOT_FOUND;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      "check control: slot %ui of upstream %V removed",
+                      index & NGX_HTTP_CHECK_SLOT_MASK,
+                      peer[index & NGX_HTTP_CHECK_SLOT_MASK].upstream_name);
 
-    for (i = 0; i < peers_shm->number; i++) {
+        b->last = ngx_slprintf(b->last, b->end, "index=%ui removed\n",
+                               (ngx_uint_t) index);
 
-        peer_shm = &peers_shm->peers[i];
+        return ngx_http_check_control_reply(r, b);
+    }
 
-        if (addr->socklen != peer_shm->socklen) {
-            continue;
-        }
+    if (ngx_http_arg(r, (u_char *) "add", sizeof("add") - 1, &value)
+        != NGX_OK
+        && ngx_http_arg(r, (u_char *) "address", sizeof("address") - 1,
+                        &value)
+           != NGX_OK)
+    {
+        return NGX_HTTP_BAD_REQUEST;
+    }
 
-        if (ngx_memcmp(addr->sockaddr, peer_shm->sockaddr, addr->socklen) == 0) {
-            return peer_shm;
-        }
+    if (ngx_http_check_arg_unescape(r->pool, &value, &text) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    return NULL;
-}
+    if (ngx_http_check_parse_addr(r->pool, &text, &addr) != NGX_OK) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
 
+    if (ngx_http_arg(r, (u_char *) "add", sizeof("add") - 1, &value)
+        == NGX_OK)
+    {
+        if (ngx_http_arg(r, (u_char *) "upstream", sizeof("upstream") - 1,
+                         &upstream)
+            != NGX_OK)
+        {
+            return NGX_HTTP_BAD_REQUEST;
+        }
 
-static void
-ngx_http_check_set_shm_peer(ngx_http_check_peer_shm_t *peer_shm,
-                            ngx_http_check_peer_shm_t *opeer_shm,
-                            ngx_uint_t init_down)
-{
+        rc = ngx_http_check_add_dynamic_peer(&upstream, &addr);
 
-    if (opeer_shm) {
-        peer_shm->access_time  = opeer_shm->access_time;
-        peer_shm->access_count = opeer_shm->access_count;
+        if (rc == NGX_DECLINED) {
+            /* no such upstream or all its slots are taken */
+            return NGX_HTTP_CONFLICT;
+        }
 
-        peer_shm->fall_count   = opeer_shm->fall_count;
-        peer_shm->rise_count   = opeer_shm->rise_count;
-        peer_shm->busyness     = opeer_shm->busyness;
+    } else {
+        if (ngx_http_arg(r, (u_char *) "index", sizeof("index") - 1, &value)
+            != NGX_OK)
+        {
+            return NGX_HTTP_BAD_REQUEST;
+        }
 
-        peer_shm->down         = opeer_shm->down;
+        index = ngx_http_check_control_index(peers, &value);
+        if (index == NGX_ERROR) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
 
-    } else{
-        peer_shm->access_time  = 0;
-        peer_shm->access_count = 0;
+        rc = ngx_http_check_update_dynamic_peer(index, &addr);
 
-        peer_shm->fall_count   = 0;
-        peer_shm->rise_count   = 0;
-        peer_shm->busyness     = 0;
+        if (rc == NGX_DECLINED) {
+            return NGX_HTTP_NOT_FOUND;
+        }
+    }
 
-        peer_shm->down         = init_down;
+    if (rc == NGX_ERROR) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
+
+    peer = &peer[rc & NGX_HTTP_CHECK_SLOT_MASK];
+
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "check control: slot %ui of upstream %V is %V",
+                  peer->index, peer->upstream_name, &addr.name);
+
+    b->last = ngx_slprintf(b->last, b->end, "index=%ui upstream=%V name=%V\n",
+                           (ngx_uint_t) rc, peer->upstream_name, &addr.name);
+
+    return ngx_http_check_control_reply(r, b);
 }
 
 
+/* the slot number of a dynamic slot stands for its current check_index */
 static ngx_int_t
-ngx_http_check_get_shm_name(ngx_str_t *shm_name, ngx_pool_t *pool,
-                            ngx_uint_t generation)
+ngx_http_check_control_index(ngx_http_check_peers_t *peers, ngx_str_t *value)
 {
-    u_char    *last;
+    ngx_int_t                  index;
+    ngx_http_check_peer_t     *peer;
 
-    shm_name->data = ngx_palloc(pool, SHM_NAME_LEN);
-    if (shm_name->data == NULL) {
+    index = ngx_atoi(value->data, value->len);
+    if (index == NGX_ERROR) {
         return NGX_ERROR;
     }
 
-    last = ngx_snprintf(shm_name->data, SHM_NAME_LEN, "%s#%ui",
-                        "ngx_http_upstream_check", generation);
+    peer = peers->peers.elts;
 
-    shm_name->len = last - shm_name->data;
+    if ((index >> NGX_HTTP_CHECK_SLOT_BITS) == 0
+        && (ngx_uint_t) index < peers->peers.nelts
+        && peer[index].dynamic)
+    {
+        index |= peer[index].shm->slot_gen << NGX_HTTP_CHECK_SLOT_BITS;
+    }
 
-    return NGX_OK;
+    return index;
 }
 
 
-char *
-ngx_http_upstream_check_init_shm(ngx_conf_t *cf, void *conf)
+/* "ip:port" or "[ipv6]:port", no name is resolved in a worker */
+static ngx_int_t
+ngx_http_check_parse_addr(ngx_pool_t *pool, ngx_str_t *text,
+    ngx_addr_t *addr)
 {
-    ngx_str_t                            *shm_name;
-    ngx_uint_t                            shm_size;
-    ngx_shm_zone_t                       *shm_zone;
-    ngx_http_upstream_check_main_conf_t  *ucmcf = conf;
+    u_char                    *p, *last;
+    ngx_int_t                  port;
+    ngx_str_t                  host;
 
-    if (ucmcf->peers->peers.nelts > 0) {
+    last = text->data + text->len;
 
-        ngx_http_check_shm_generation++;
+    for (p = last; p > text->data; p--) {
+        if (p[-1] == ':') {
+            break;
+        }
+    }
 
-        shm_name = &ucmcf->peers->check_shm_name;
+    if (p == text->data) {
+        return NGX_ERROR;
+    }
 
-        ngx_http_check_get_shm_name(shm_name, cf->pool,
-                                    ngx_http_check_shm_generation);
+    port = ngx_atoi(p, last - p);
+    if (port < 1 || port > 65535) {
+        return NGX_ERROR;
+    }
 
-        /* the default check share memory size, 1M */
-        shm_size = 1 * 1024 * 1024;
+    host.data = text->data;
+    host.len = p - 1 - text->data;
 
-        shm_size = shm_size < ucmcf->check_shm_size ?
-                   ucmcf->check_shm_size : shm_size;
+    if (host.len > 2 && host.data[0] == '[' && host.data[host.len - 1] == ']') {
+        host.data++;
+        host.len -= 2;
+    }
 
-        shm_zone = ngx_shared_memory_add(cf, shm_name, shm_size,
-                                         &ngx_http_upstream_check_module);
+    if (ngx_parse_addr(pool, addr, host.data, host.len) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->log, 0,
-                       "[http_upstream] upsteam:%V, shm_zone size:%ui",
-                       shm_name, shm_size);
+    switch (addr->sockaddr->sa_family) {
 
-        shm_zone->data = NULL;
-        check_peers_ctx = ucmcf->peers;
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        ((struct sockaddr_in6 *) addr->sockaddr)->sin6_port =
+                                                     htons((in_port_t) port);
+        break;
+#endif
 
-        shm_zone->init = ngx_http_upstream_check_init_shm_zone;
-    }
-    else {
-         check_peers_ctx = NULL;
+    default: /* AF_INET */
+        ((struct sockaddr_in *) addr->sockaddr)->sin_port =
+                                                     htons((in_port_t) port);
     }
 
-    return NGX_CONF_OK;
+    addr->name = *text;
+
+    return NGX_OK;
 }
 
 
-static ngx_shm_zone_t *
-ngx_shared_memory_find(ngx_cycle_t *cycle, ngx_str_t *name, void *tag)
+/* an IPv6 address may come escaped */
+static ngx_int_t
+ngx_http_check_arg_unescape(ngx_pool_t *pool, ngx_str_t *value,
+    ngx_str_t *dst)
 {
-    ngx_uint_t        i;
-    ngx_shm_zone_t   *shm_zone;
-    ngx_list_part_t  *part;
-
-    part = (ngx_list_part_t *) & (cycle->shared_memory.part);
-    shm_zone = part->elts;
+    u_char                    *d, *src;
 
-    for (i = 0; /* void */ ; i++) {
-
-        if (i >= part->nelts) {
-            if (part->next == NULL) {
-                break;
-            }
-            part = part->next;
-            shm_zone = part->elts;
-            i = 0;
-        }
+    dst->data = ngx_pnalloc(pool, value->len);
+    if (dst->data == NULL) {
+        return NGX_ERROR;
+    }
 
-        if (name->len != shm_zone[i].shm.name.len) {
-            continue;
-        }
+    src = value->data;
+    d = dst->data;
+    ngx_unescape_uri(&d, &src, value->len, 0);
+    dst->len = d - dst->data;
 
-        if (ngx_strncmp(name->data, shm_zone[i].shm.name.data, name->len)
-                != 0)
-        {
-            continue;
-        }
+    return NGX_OK;
+}
 
-        if (tag != shm_zone[i].tag) {
-            continue;
-        }
 
-        return &shm_zone[i];
-    }
+static ngx_int_t
+ngx_http_check_control_reply(ngx_http_request_t *r, ngx_buf_t *b)
+{
+    ngx_int_t                  rc;
+    ngx_chain_t                out;
 
-    return NULL;
-}
+    r->headers_out.content_type.len = sizeof("text/plain") - 1;
+    r->headers_out.content_type.data = (u_char *) "text/plain";
 
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
 
-ngx_int_t
-ngx_http_upstream_check_status_handler(ngx_http_request_t *r)
-{
-    size_t                          buffer_size;
-    ngx_int_t                       rc;
-    ngx_buf_t                      *b;
-    ngx_uint_t                      i;
-    ngx_chain_t                     out;
-    ngx_http_check_peer_t          *peer;
-    ngx_http_check_peers_t         *peers;
-    ngx_http_check_peer_shm_t      *peer_shm;
-    ngx_http_check_peers_shm_t     *peers_shm;
+    b->last_buf = 1;
 
-    if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
-        return NGX_HTTP_NOT_ALLOWED;
-    }
+    out.buf = b;
+    out.next = NULL;
 
-    rc = ngx_http_discard_request_body(r);
+    rc = ngx_http_send_header(r);
 
-    if (rc != NGX_OK) {
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
         return rc;
     }
 
-    r->headers_out.content_type.len = sizeof("text/html; charset=utf-8") - 1;
-    r->headers_out.content_type.data = (u_char *) "text/html; charset=utf-8";
-
-    if (r->method == NGX_HTTP_HEAD) {
-        r->headers_out.status = NGX_HTTP_OK;
+    return ngx_http_output_filter(r, &out);
+}
 
-        rc = ngx_http_send_header(r);
 
-        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-            return rc;
-        }
+/*
+ * Dump the journal entries newer than "since" as text, one transition
+ * a line. The first line tells the sequence number to ask for next.
+ */
+static ngx_int_t
+ngx_http_check_journal_handler(ngx_http_request_t *r, ngx_str_t *since)
+{
+    size_t                            size;
+    ngx_int_t                         rc, from;
+    ngx_buf_t                        *b;
+    ngx_str_t                        *upstream, *name;
+    ngx_uint_t                        seq, next, first;
+    ngx_chain_t                       out;
+    ngx_http_check_peer_t            *peer;
+    ngx_http_check_peers_t           *peers;
+    ngx_http_check_journal_t         *journal;
+    ngx_http_check_journal_entry_t   *e, entry;
+
+    from = ngx_atoi(since->data, since->len);
+    if (from == NGX_ERROR) {
+        return NGX_HTTP_BAD_REQUEST;
     }
 
     peers = check_peers_ctx;
-    if (peers == NULL) {
+    if (peers == NULL || peers->peers_shm == NULL
+        || peers->peers_shm->journal == NULL)
+    {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                       "[http upstream check] can not find the check servers, "
                       "have you added the check servers? ");
@@ -1676,15 +8098,28 @@ ngx_http_upstream_check_status_handler(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    peers_shm = peers->peers_shm;
-
+    journal = peers->peers_shm->journal;
     peer = peers->peers.elts;
-    peer_shm = peers_shm->peers;
 
-    buffer_size = peers->peers.nelts * ngx_pagesize / 4;
-    buffer_size = ngx_align(buffer_size, ngx_pagesize) + ngx_pagesize;
+    next = journal->next;
+    first = (ngx_uint_t) from + 1;
 
-    b = ngx_create_temp_buf(r->pool, buffer_size);
+    /* the older entries have been overwritten */
+    if (next > journal->size && first < next - journal->size) {
+        first = next - journal->size;
+    }
+
+    if (first > next) {
+        first = next;
+    }
+
+    r->headers_out.content_type.len = sizeof("text/plain") - 1;
+    r->headers_out.content_type.data = (u_char *) "text/plain";
+
+    size = sizeof("next=\n") + NGX_ATOMIC_T_LEN
+           + (next - first) * (256 + NGX_SOCKADDR_STRLEN);
+
+    b = ngx_create_temp_buf(r->pool, size);
     if (b == NULL) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
@@ -1692,54 +8127,44 @@ ngx_http_upstream_check_status_handler(ngx_http_request_t *r)
     out.buf = b;
     out.next = NULL;
 
-    b->last = ngx_snprintf(b->last, b->end - b->last,
-            "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML 1.0 Strict//EN\n"
-            "\"http://www.w3.org/TR/xhtml1/DTD/xhtml1-strict.dtd\">\n"
-            "<html xmlns=\"http://www.w3.org/1999/xhtml\">\n"
-            "<head>\n"
-            "  <title>Nginx http upstream check status</title>\n"
-            "</head>\n"
-            "<body>\n"
-            "<h1>Nginx http upstream check status</h1>\n"
-            "<h2>Check upstream server number: %ui, generation: %ui</h2>\n"
-            "<table style=\"background-color:white\" cellspacing=\"0\" "
-            "       cellpadding=\"3\" border=\"1\">\n"
-            "  <tr bgcolor=\"#C0C0C0\">\n"
-            "    <th>Index</th>\n"
-            "    <th>Upstream</th>\n"
-            "    <th>Name</th>\n"
-            "    <th>Status</th>\n"
-            "    <th>Rise counts</th>\n"
-            "    <th>Fall counts</th>\n"
-            "    <th>Check type</th>\n"
-            "  </tr>\n",
-            peers->peers.nelts, ngx_http_check_shm_generation);
+    b->last = ngx_slprintf(b->last, b->end, "next=%ui\n", next);
 
-    for (i = 0; i < peers->peers.nelts; i++) {
-        b->last = ngx_snprintf(b->last, b->end - b->last,
-                "  <tr%s>\n"
-                "    <td>%ui</td>\n"
-                "    <td>%V</td>\n"
-                "    <td>%V</td>\n"
-                "    <td>%s</td>\n"
-                "    <td>%ui</td>\n"
-                "    <td>%ui</td>\n"
-                "    <td>%s</td>\n"
-                "  </tr>\n",
-                peer_shm[i].down ? " bgcolor=\"#FF0000\"" : "",
-                i,
-                peer[i].upstream_name,
-                &peer[i].peer_addr->name,
-                peer_shm[i].down ? "down" : "up",
-                peer_shm[i].rise_count,
-                peer_shm[i].fall_count,
-                peer[i].conf->check_type_conf->name);
-    }
+    for (seq = first; seq < next; seq++) {
 
-    b->last = ngx_snprintf(b->last, b->end - b->last,
-            "</table>\n"
-            "</body>\n"
-            "</html>\n");
+        e = &journal->entries[seq % journal->size];
+        if (e->seq != seq) {
+            continue;
+        }
+
+        entry = *e;
+
+        /* the slot may have been reused while it was copied */
+        ngx_memory_barrier();
+        if (e->seq != seq) {
+            continue;
+        }
+
+        if (entry.index >= peers->peers.nelts
+            || entry.from > NGX_HTTP_CHECK_PEER_DOWN
+            || entry.to > NGX_HTTP_CHECK_PEER_DOWN
+            || entry.reason >= NGX_HTTP_CHECK_ERR_N)
+        {
+            continue;
+        }
+
+        upstream = peer[entry.index].upstream_name;
+        name = &peer[entry.index].peer_addr->name;
+
+        b->last = ngx_slprintf(b->last, b->end,
+                "seq=%ui time=%T.%03ui index=%ui upstream=%V name=%V "
+                "from=%s to=%s reason=%s latency=%M\n",
+                entry.seq, entry.sec, entry.msec, entry.index,
+                upstream, name,
+                ngx_http_check_peer_state_names[entry.from],
+                ngx_http_check_peer_state_names[entry.to],
+                ngx_http_check_err_names[entry.reason],
+                entry.latency);
+    }
 
     r->headers_out.status = NGX_HTTP_OK;
     r->headers_out.content_length_n = b->last - b->pos;
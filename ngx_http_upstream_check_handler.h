@@ -59,6 +59,299 @@ typedef struct {
 #define NGX_HTTP_CHECK_RECV_DONE        0x0004
 #define NGX_HTTP_CHECK_ALL_DONE         0x0008
 
+/* the verdict of a probe */
+#define NGX_HTTP_CHECK_OK               0
+#define NGX_HTTP_CHECK_ERR_CONNECT      1
+#define NGX_HTTP_CHECK_ERR_TIMEOUT      2
+#define NGX_HTTP_CHECK_ERR_PROTOCOL     3
+#define NGX_HTTP_CHECK_ERR_PARSE        4
+#define NGX_HTTP_CHECK_ERR_N            5
+
+/* the state of a peer as recorded in the journal */
+#define NGX_HTTP_CHECK_PEER_UP          0
+#define NGX_HTTP_CHECK_PEER_DOWN        1
+
+/* probe phases, all in milliseconds */
+#define NGX_HTTP_CHECK_PHASE_CONNECT    0
+#define NGX_HTTP_CHECK_PHASE_SEND       1
+#define NGX_HTTP_CHECK_PHASE_FIRST_BYTE 2
+#define NGX_HTTP_CHECK_PHASE_VERDICT    3
+#define NGX_HTTP_CHECK_PHASE_N          4
+
+/*
+ * The buckets of the probe latency, the bucket n holds the latencies
+ * from 2^(n-1) to 2^n - 1 milliseconds, the last one all the longer.
+ */
+#define NGX_HTTP_CHECK_RTT_BUCKETS      16
+
+/* the longest reply of an agent read, see check_agent */
+#define NGX_HTTP_CHECK_AGENT_LINE       128
+#define NGX_HTTP_CHECK_AGENT_MAX_WEIGHT 1000
+
+/* the replay of the requests of check_warmup to a peer */
+#define NGX_HTTP_CHECK_WARMUP_NONE      0
+#define NGX_HTTP_CHECK_WARMUP_RUNNING   1
+#define NGX_HTTP_CHECK_WARMUP_DONE      2
+
+/* the state of a slot in the shared memory, see check_dynamic */
+#define NGX_HTTP_CHECK_SLOT_STATIC      0
+#define NGX_HTTP_CHECK_SLOT_FREE        1
+#define NGX_HTTP_CHECK_SLOT_USED        2
+
+/*
+ * The check_index of a dynamic peer carries the generation of its slot
+ * above the slot number, so an index kept after the slot was given to
+ * another server is told apart.  The static peers are of generation 0.
+ */
+#define NGX_HTTP_CHECK_SLOT_BITS        24
+#define NGX_HTTP_CHECK_SLOT_MASK        ((1 << NGX_HTTP_CHECK_SLOT_BITS) - 1)
+#define NGX_HTTP_CHECK_GEN_MAX          255
+
+/*
+ * The verdict of a peer packs what the balancers ask for into one word
+ * with the generation of its slot, the verdicts of all the peers are a
+ * dense array in the shared memory.
+ */
+#define NGX_HTTP_CHECK_VERDICT_DOWN      0x0001
+#define NGX_HTTP_CHECK_VERDICT_DRAIN     0x0002
+#define NGX_HTTP_CHECK_VERDICT_FREE      0x0004
+/* in another zone than this nginx, see check_local_zone */
+#define NGX_HTTP_CHECK_VERDICT_REMOTE    0x0008
+/* the server takes no new requests */
+#define NGX_HTTP_CHECK_VERDICT_OUT                                            \
+    (NGX_HTTP_CHECK_VERDICT_DOWN|NGX_HTTP_CHECK_VERDICT_DRAIN                 \
+     |NGX_HTTP_CHECK_VERDICT_FREE)
+/* the percentage of the weight reported by the agent, up to 1000 */
+#define NGX_HTTP_CHECK_VERDICT_WEIGHT_SHIFT 4
+#define NGX_HTTP_CHECK_VERDICT_WEIGHT_MASK  0x7ff
+#define NGX_HTTP_CHECK_VERDICT_GEN_SHIFT 16
+
+/* how often the worker running check_resolve looks for a name to ask */
+#define NGX_HTTP_CHECK_RESOLVE_TICK     1000
+
+/* how often the intervals of check_probe_budget are computed again */
+#define NGX_HTTP_CHECK_SCHEDULE_TICK    1000
+
+/*
+ * The entries of ngx_check_types[], including the terminating one, which
+ * size the counters by check type.  The build fails if the array grows
+ * past it.
+ */
+#define NGX_HTTP_CHECK_TYPE_N           6
+
+typedef struct {
+    ngx_atomic_t count;
+    ngx_atomic_t total;
+    ngx_atomic_t max;
+} ngx_http_check_phase_t;
+
+typedef struct {
+    ngx_http_check_phase_t phase[NGX_HTTP_CHECK_PHASE_N];
+} ngx_http_check_timing_t;
+
+/* module-wide counters, shared by all the workers */
+typedef struct {
+    ngx_atomic_t started;
+    ngx_atomic_t succeeded;
+    /* indexed by NGX_HTTP_CHECK_ERR_*, the slot 0 is not used */
+    ngx_atomic_t failed[NGX_HTTP_CHECK_ERR_N];
+    ngx_atomic_t in_flight;
+    ngx_atomic_t skipped;
+    ngx_atomic_t transitions;
+    /* the shared locks taken, and the spins waiting for them */
+    ngx_atomic_t locks;
+    ngx_atomic_t lock_spins;
+
+    /* how late the check timers fire, in milliseconds */
+    ngx_atomic_t lag_last;
+    ngx_atomic_t lag_max;
+    /* probes put off and timeouts ignored because of the lag */
+    ngx_atomic_t deferred;
+    ngx_atomic_t discounted;
+
+    /* hosts found suspect, and probes failed without a connect for it */
+    ngx_atomic_t suspected;
+    ngx_atomic_t fast_failed;
+
+    /* the answers and failures of check_resolve, and the servers moved */
+    ngx_atomic_t resolved;
+    ngx_atomic_t resolve_failed;
+    ngx_atomic_t readdressed;
+} ngx_http_check_counters_t;
+
+/*
+ * The journal is a ring of the latest state transitions. Writers claim
+ * a sequence number with an atomic add and publish the entry by storing
+ * the number into its slot last; readers skip the slots whose number
+ * does not match, either overwritten or still being written.
+ */
+typedef struct {
+    ngx_atomic_t seq;
+
+    time_t       sec;
+    ngx_uint_t   msec;
+
+    ngx_uint_t   index;
+    ngx_uint_t   from;
+    ngx_uint_t   to;
+    ngx_uint_t   reason;
+    ngx_msec_t   latency;
+} ngx_http_check_journal_entry_t;
+
+typedef struct {
+    /* the sequence number of the next entry, starts from 1 */
+    ngx_atomic_t next;
+    ngx_uint_t   size;
+
+    ngx_http_check_journal_entry_t entries[1];
+} ngx_http_check_journal_t;
+
+/*
+ * A reader of the journal run by one worker at a time. The cursor is
+ * the sequence number of the next entry to deliver.
+ */
+typedef struct {
+    ngx_atomic_t lock;
+    ngx_pid_t    owner;
+    ngx_msec_t   access_time;
+
+    ngx_atomic_t cursor;
+
+    /* in journal entries, or in datagrams for check_statsd */
+    ngx_atomic_t sent;
+    ngx_atomic_t failed;
+    ngx_atomic_t dropped;
+} ngx_http_check_feed_shm_t;
+
+/*
+ * The file shared by the nginx instances of a host, see check_shared_file.
+ * A slot is written by the instance probing the peer only, bracketed by
+ * increments of seq, so the readers retry while seq is odd or changes.
+ * The slots are claimed and freed under the file lock only.
+ */
+#define NGX_HTTP_CHECK_SHARED_MAGIC     0x32636b6e  /* "nkc2" */
+
+/* the instances a file can have, one bit each in the users of a slot */
+#define NGX_HTTP_CHECK_SHARED_INSTANCES 32
+
+typedef struct {
+    ngx_atomic_t seq;
+
+    /*
+     * The key, the address and a hash of the check configuration.  A slot
+     * with an empty name and a hash has been freed and may be reused, but
+     * the search for a name goes on past it.
+     */
+    uint32_t     hash;
+    u_char       name[NGX_SOCKADDR_STRLEN];
+
+    /* the instances using the slot, by their index in the file */
+    uint32_t     users;
+
+    /* the master pid of the probing instance */
+    ngx_atomic_t prober;
+    /* the wall clock time of its last result in milliseconds */
+    uint64_t     heartbeat;
+
+    uint32_t     down;
+    uint16_t     last_reason;
+    uint16_t     last_code;
+    uint32_t     last_rtt;
+} ngx_http_check_shared_slot_t;
+
+typedef struct {
+    uint32_t     magic;
+    uint32_t     nslots;
+
+    /* the pids of the instances using the file, 0 if the entry is free */
+    ngx_atomic_t instances[NGX_HTTP_CHECK_SHARED_INSTANCES];
+
+    ngx_http_check_shared_slot_t slots[1];
+} ngx_http_check_shared_t;
+
+/*
+ * The digest a node sends to the others once an interval: the states of
+ * the peers it probes, all in network byte order, followed by the
+ * HMAC-MD5 of all that with the secret of check_gossip.
+ */
+#define NGX_HTTP_CHECK_GOSSIP_MAGIC     0x32676b6e  /* "nkg2" */
+#define NGX_HTTP_CHECK_GOSSIP_DOWN      0x8000
+#define NGX_HTTP_CHECK_GOSSIP_SIZE      1400
+#define NGX_HTTP_CHECK_GOSSIP_MAC_LEN   16
+
+typedef struct {
+    uint32_t     magic;
+    uint32_t     count;
+} ngx_http_check_gossip_header_t;
+
+typedef struct {
+    uint32_t     key;
+    /* NGX_HTTP_CHECK_GOSSIP_DOWN and the reason of the last probe */
+    uint16_t     state;
+    uint16_t     rtt;
+} ngx_http_check_gossip_entry_t;
+
+/*
+ * The peers on the same IP address, see check_host_suspect. The host is
+ * suspect until suspect_until, and then only one peer at a time, the
+ * canary, probes it.
+ */
+#define NGX_HTTP_CHECK_NO_HOST          ((ngx_uint_t) -1)
+#define NGX_HTTP_CHECK_NO_ZONE          ((ngx_uint_t) -1)
+
+typedef struct {
+    ngx_atomic_t lock;
+
+    /* the connect failures since window_start */
+    ngx_uint_t   failures;
+    uint64_t     window_start;
+
+    uint64_t     suspect_until;
+
+    /* the index of the canary plus 1, and when it started or finished */
+    ngx_uint_t   canary;
+    uint64_t     canary_time;
+} ngx_http_check_host_shm_t;
+
+/*
+ * The work of the probes: the CPU time of their handlers, in microseconds,
+ * the connects, sends, receives and closes they did, and the handler runs.
+ */
+typedef struct {
+    ngx_atomic_t cpu;
+    ngx_atomic_t syscalls;
+    ngx_atomic_t runs;
+} ngx_http_check_usage_t;
+
+/*
+ * The failover of an upstream to its backup servers, see check_failback,
+ * and the work of its probes.
+ */
+typedef struct {
+    ngx_atomic_t lock;
+
+    /* the primary servers neither down nor draining */
+    ngx_uint_t   up;
+    ngx_uint_t   backups;
+
+    ngx_atomic_t failover;
+    /* when enough primary servers came back while failed over, or 0 */
+    uint64_t     recovered;
+    uint64_t     last_change;
+
+    /* from the configuration */
+    ngx_uint_t   need;
+    ngx_msec_t   delay;
+
+    ngx_http_check_usage_t usage;
+} ngx_http_check_upstream_shm_t;
+
+/* the servers of an upstream in a zone, see check_zone */
+typedef struct {
+    ngx_atomic_t up;
+    ngx_uint_t   total;
+} ngx_http_check_zone_shm_t;
+
 typedef struct {
     ngx_pid_t    owner;
 
@@ -73,6 +366,71 @@ typedef struct {
 
     ngx_uint_t   access_count;
 
+    /* the last probe and state change, fixed width for the readers */
+    uint16_t     last_reason;
+    uint16_t     last_code;
+    uint32_t     last_rtt;
+    uint64_t     last_change;
+
+    /* the latest results, 1 for a success, the newest in bit 0 */
+    uint64_t     history;
+    uint32_t     history_len;
+
+    ngx_http_check_timing_t timing;
+
+    ngx_atomic_t rtt_hist[NGX_HTTP_CHECK_RTT_BUCKETS];
+
+    /* the state reported by the node probing the peer, see check_gossip */
+    uint16_t     remote_down;
+    uint16_t     remote_reason;
+    uint32_t     remote_rtt;
+    uint64_t     remote_time;
+    /* the last probe of this node failed to connect */
+    ngx_atomic_t override;
+
+    /* the state reported by the agent of the peer, see check_agent */
+    ngx_pid_t    agent_owner;
+    ngx_msec_t   agent_access;
+    ngx_atomic_t agent_down;
+    ngx_atomic_t agent_drain;
+    /* in percent of the configured weight */
+    ngx_atomic_t agent_weight;
+    ngx_atomic_t agent_fails;
+
+    /* set through check_control, no new sessions but still checked */
+    ngx_atomic_t drain;
+
+    /*
+     * the interval given by check_probe_budget, 0 for the one of check,
+     * and the requests per 1000 seconds it was given for
+     */
+    ngx_msec_t   interval;
+    ngx_uint_t   traffic;
+    ngx_uint_t   traffic_count;
+
+    /* NGX_HTTP_CHECK_WARMUP_*, replayed by one worker, see check_warmup */
+    ngx_atomic_t warmup;
+    ngx_pid_t    warmup_owner;
+    ngx_msec_t   warmup_access;
+    ngx_uint_t   warmup_sent;
+
+    /*
+     * NGX_HTTP_CHECK_SLOT_*, a dynamic slot keeps the address and the
+     * name of its server here, see check_dynamic
+     */
+    ngx_atomic_t slot;
+    ngx_atomic_t slot_gen;
+    uint32_t     upstream_key;
+    ngx_str_t    name;
+
+    /* changes whenever check_resolve moves the peer to another address */
+    ngx_atomic_t addr_gen;
+
+    /* set from the configuration on every start, see check_failback */
+    ngx_uint_t   upstream_index;
+    ngx_uint_t   backup;
+    ngx_uint_t   zone;
+
     struct sockaddr  *sockaddr;
     socklen_t         socklen;
 } ngx_http_check_peer_shm_t;
@@ -84,23 +442,110 @@ typedef struct {
     ngx_uint_t   state;
     ngx_atomic_t lock;
 
+    /* taken to fill or free a dynamic slot */
+    ngx_atomic_t dynamic_lock;
+
     ngx_uint_t   number;
 
+    ngx_http_check_counters_t counters;
+
+    ngx_http_check_journal_t *journal;
+
+    ngx_http_check_feed_shm_t notify;
+    ngx_http_check_feed_shm_t statsd;
+    ngx_http_check_feed_shm_t syslog;
+    ngx_http_check_feed_shm_t gossip;
+    ngx_http_check_feed_shm_t resolve;
+    ngx_http_check_feed_shm_t schedule;
+    ngx_msec_t   schedule_time;
+
+    ngx_atomic_t gossip_received;
+    /* the digests of a node which did not carry its HMAC */
+    ngx_atomic_t gossip_rejected;
+    /* the wall clock time a digest came from each node, in milliseconds */
+    uint64_t    *gossip_seen;
+    ngx_uint_t   gossip_nodes;
+
+    ngx_http_check_host_shm_t *hosts;
+    ngx_uint_t   nhosts;
+
+    /* NGX_HTTP_CHECK_VERDICT_*, indexed by the slot number */
+    ngx_atomic_t *verdicts;
+
+    /* indexed by peer->upstream_index */
+    ngx_http_check_upstream_shm_t *upstreams;
+    ngx_uint_t   nupstreams;
+
+    /* indexed by upstream_index * the number of zones + the zone */
+    ngx_http_check_zone_shm_t *zones;
+    ngx_uint_t   nzones;
+    ngx_uint_t   local_zone;
+
+    /* indexed by the position in ngx_check_types[] */
+    ngx_http_check_timing_t type_timing[NGX_HTTP_CHECK_TYPE_N];
+    ngx_http_check_usage_t  type_usage[NGX_HTTP_CHECK_TYPE_N];
+
     /* store ngx_http_check_status_peer_t */
     ngx_http_check_peer_shm_t peers[1];
 } ngx_http_check_peers_shm_t;
 
+/* the agent probe of a peer in this worker, see check_agent */
+typedef struct {
+    ngx_event_t                      check_ev;
+    ngx_event_t                      timeout_ev;
+    ngx_peer_connection_t            pc;
+
+    /* the address of the peer with the agent port */
+    struct sockaddr                 *sockaddr;
+    socklen_t                        socklen;
+
+    size_t                           sent;
+
+    u_char                           line[NGX_HTTP_CHECK_AGENT_LINE];
+    size_t                           len;
+} ngx_http_check_agent_t;
+
+/* the replay of check_warmup by this worker */
+typedef struct {
+    ngx_event_t                      step_ev;
+    ngx_event_t                      timeout_ev;
+    ngx_peer_connection_t            pc;
+
+    /* the requests sent, and the bytes of the current one */
+    ngx_uint_t                       sent;
+    size_t                           pos;
+} ngx_http_check_warmup_t;
+
 struct ngx_http_check_peer_s {
     ngx_flag_t                       state;
     ngx_pool_t                      *pool;
     ngx_uint_t                       index;
     ngx_uint_t                       max_busy;
     ngx_str_t                       *upstream_name;
+    ngx_uint_t                       upstream_index;
+    /* a backup server of the upstream */
+    ngx_flag_t                       backup;
+    /* NGX_HTTP_CHECK_NO_ZONE unless check_zone names its address */
+    ngx_uint_t                       zone;
+    /* NGX_HTTP_CHECK_NO_HOST for a unix socket */
+    ngx_uint_t                       host_index;
     ngx_peer_addr_t                 *peer_addr;
     ngx_event_t                      check_ev;
     ngx_event_t                      check_timeout_ev;
     ngx_peer_connection_t            pc;
 
+    /* the CPU time below a microsecond not counted yet, in nanoseconds */
+    ngx_uint_t                       cpu_ns;
+
+    /* timestamps of the current probe, 0 if the phase is not reached */
+    ngx_msec_t                       start_time;
+    ngx_msec_t                       connect_time;
+    ngx_msec_t                       send_time;
+    ngx_msec_t                       first_byte_time;
+
+    /* the HTTP status or the protocol specific code of the response */
+    ngx_uint_t                       code;
+
     void *                           check_data;
     ngx_event_handler_pt             send_handler;
     ngx_event_handler_pt             recv_handler;
@@ -111,20 +556,190 @@ struct ngx_http_check_peer_s {
 
     ngx_http_check_peer_shm_t            *shm;
     ngx_http_upstream_check_srv_conf_t   *conf;
+
+    /* NULL unless check_shared_file is set */
+    ngx_http_check_shared_slot_t         *shared;
+
+    /* the key in the gossip digests, the same on every node */
+    uint32_t                              gossip_key;
+    ngx_uint_t                            gossip_skips;
+
+    /* NULL unless check_agent is set */
+    ngx_http_check_agent_t               *agent;
+
+    /* NULL unless check_warmup is set */
+    ngx_http_check_warmup_t              *warmup;
+
+    /* a spare slot of check_dynamic and the generation this worker uses */
+    ngx_flag_t                            dynamic;
+    ngx_uint_t                            slot_gen;
+
+    /* NULL unless the peer follows the name of check_resolve */
+    ngx_http_check_resolve_conf_t        *resolve;
+    ngx_uint_t                            addr_gen;
 };
 
+/* the delivery of the transitions in this worker, see check_notify */
+typedef struct {
+    ngx_event_t                      tick_ev;
+    ngx_event_t                      timeout_ev;
+    ngx_peer_connection_t            pc;
+
+    /* the request header or the environment name, then the JSON body */
+    ngx_buf_t                        buf;
+    size_t                           prefix;
+    size_t                           entry_len;
+
+    /* the batch in flight or kept to be sent again, and its attempts */
+    u_char                          *body;
+    size_t                           body_len;
+    ngx_uint_t                       events;
+    ngx_uint_t                       tries;
+
+    u_char                           status[sizeof("HTTP/1.1 200") - 1];
+    size_t                           status_len;
+} ngx_http_check_notify_t;
+
+typedef struct {
+    ngx_str_t                       *name;
+} ngx_http_check_upstream_t;
+
+typedef struct {
+    /* the upstream name usable in a metric name */
+    ngx_str_t                        name;
+
+    ngx_uint_t                       up;
+    ngx_uint_t                       down;
+
+    /* the latency histogram now and at the last push */
+    ngx_atomic_uint_t                cur[NGX_HTTP_CHECK_RTT_BUCKETS];
+    ngx_atomic_uint_t                last[NGX_HTTP_CHECK_RTT_BUCKETS];
+
+    /* the work of the probes at the last push */
+    ngx_http_check_usage_t           usage;
+} ngx_http_check_statsd_upstream_t;
+
+/* the metric push of this worker, see check_statsd */
+typedef struct {
+    ngx_event_t                      tick_ev;
+    ngx_socket_t                     fd;
+
+    /* the datagram being filled */
+    u_char                          *start;
+    u_char                          *last;
+    u_char                          *end;
+
+    /* this worker pushed the last time, the snapshots are its own */
+    ngx_flag_t                       owner;
+
+    ngx_http_check_counters_t        counters;
+    ngx_http_check_statsd_upstream_t *upstreams;
+    ngx_http_check_usage_t           type_usage[NGX_HTTP_CHECK_TYPE_N];
+} ngx_http_check_statsd_t;
+
+typedef struct {
+    ngx_uint_t                       count;
+
+    /* the last transition of the group */
+    ngx_uint_t                       index;
+    ngx_uint_t                       reason;
+} ngx_http_check_syslog_group_t;
+
+/* the transition messages of this worker, see check_syslog */
+typedef struct {
+    ngx_event_t                      tick_ev;
+    ngx_socket_t                     fd;
+
+    u_char                          *start;
+    u_char                          *end;
+
+    /* indexed by upstream_index * 2 + the new state */
+    ngx_http_check_syslog_group_t   *groups;
+} ngx_http_check_syslog_t;
+
+/* the gossip of this worker, see check_gossip */
+typedef struct {
+    ngx_event_t                      tick_ev;
+    ngx_connection_t                *connection;
+
+    /* the indexes of the live nodes, in the order of the nodes */
+    ngx_uint_t                      *live;
+    ngx_uint_t                       nlive;
+
+    u_char                          *buf;
+
+    /* the peers sorted by the gossip key, for the digests received */
+    ngx_http_check_peer_t          **keys;
+} ngx_http_check_gossip_t;
+
+/* the names of check_resolve asked by this worker */
+typedef struct {
+    ngx_event_t                      tick_ev;
+
+    /* indexed like peers->resolves */
+    ngx_msec_t                      *last;
+    ngx_resolver_ctx_t             **ctx;
+} ngx_http_check_resolve_t;
+
 struct ngx_http_check_peers_s {
     ngx_str_t                        check_shm_name;
     ngx_uint_t                       checksum;
     ngx_array_t                      peers;
+    /* ngx_http_check_upstream_t, indexed by peer->upstream_index */
+    ngx_array_t                      upstreams;
+
+    /* 0 if the timer lag is only measured */
+    ngx_msec_t                       max_lag;
+    ngx_uint_t                       journal_size;
+    ngx_http_check_notify_conf_t    *notify;
+    ngx_http_check_statsd_conf_t    *statsd;
+    ngx_http_check_syslog_conf_t    *syslog;
+
+    ngx_http_check_gossip_conf_t    *gossip;
+    ngx_http_check_suspect_conf_t   *suspect;
+    ngx_http_check_budget_conf_t    *budget;
+    /* the number of IP addresses of the peers, if suspect is set */
+    ngx_uint_t                       nhosts;
+    ngx_str_t                        shared_file;
+    ngx_uint_t                       shared_slots;
+
+    /* ngx_http_check_resolve_conf_t *, empty unless check_resolve is set */
+    ngx_array_t                      resolves;
+    ngx_resolver_t                  *resolver;
+    ngx_msec_t                       resolver_timeout;
+
+    /* the names of check_zone, NGX_HTTP_CHECK_NO_ZONE if none is local */
+    ngx_str_t                       *zones;
+    ngx_uint_t                       nzones;
+    ngx_uint_t                       local_zone;
+    ngx_uint_t                       local_healthy;
+
+    /* the level of the messages about a failed probe */
+    ngx_uint_t                       probe_log_level;
+    ngx_uint_t                       probe_log_error;
 
     ngx_http_check_peers_shm_t      *peers_shm;
 };
 
 
 ngx_int_t ngx_http_upstream_check_status_handler(ngx_http_request_t *r);
+ngx_int_t ngx_http_upstream_check_control_handler(ngx_http_request_t *r);
+
+ngx_uint_t ngx_http_check_flap_score(ngx_http_check_peer_shm_t *peer_shm);
+ngx_uint_t ngx_http_check_rtt_bucket(ngx_msec_t ms);
 
 ngx_uint_t ngx_http_check_peer_down(ngx_uint_t index);
+ngx_uint_t ngx_http_check_peer_drain(ngx_uint_t index);
+ngx_int_t ngx_http_check_peer_weight(ngx_uint_t index, ngx_int_t weight);
+ngx_uint_t ngx_http_check_use_backup(ngx_uint_t index);
+ngx_uint_t ngx_http_check_zone_local(ngx_uint_t index);
+ngx_uint_t ngx_http_check_peer_remote(ngx_uint_t index);
+
+ngx_int_t ngx_http_check_add_dynamic_peer(ngx_str_t *upstream_name,
+    ngx_addr_t *addr);
+ngx_int_t ngx_http_check_update_dynamic_peer(ngx_uint_t index,
+    ngx_addr_t *addr);
+ngx_int_t ngx_http_check_remove_dynamic_peer(ngx_uint_t index);
 
 void ngx_http_check_get_peer(ngx_uint_t index);
 void ngx_http_check_free_peer(ngx_uint_t index);
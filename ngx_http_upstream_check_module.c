@@ -3,6 +3,7 @@
 #include <ngx_http.h>
 #include <ngx_config.h>
 #include <ngx_murmurhash.h>
+#include <ngx_md5.h>
 #include <ngx_http_upstream.h>
 #include "ngx_http_upstream_check_module.h"
 #include "ngx_http_upstream_check_handler.h"
@@ -12,13 +13,77 @@ static char *ngx_http_upstream_check(ngx_conf_t *cf,
         ngx_command_t *cmd, void *conf);
 static char * ngx_http_upstream_check_http_send(ngx_conf_t *cf,
         ngx_command_t *cmd, void *conf);
+static char * ngx_http_upstream_check_agent(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
+static char * ngx_http_upstream_check_resolve(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
+static char * ngx_http_upstream_check_failback(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
+static char * ngx_http_upstream_check_warmup(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_upstream_check_warmup_read(ngx_conf_t *cf,
+        ngx_http_check_warmup_conf_t *wc, ngx_str_t *file, ngx_str_t *host);
 static char * ngx_http_upstream_check_http_expect_alive(ngx_conf_t *cf,
         ngx_command_t *cmd, void *conf);
 
 static char * ngx_http_upstream_check_shm_size(ngx_conf_t *cf,
         ngx_command_t *cmd, void *conf);
+static char * ngx_http_upstream_check_notify(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
+static char * ngx_http_upstream_check_statsd(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
+static char * ngx_http_upstream_check_syslog(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
+static char * ngx_http_upstream_check_shared_file(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
+static char * ngx_http_upstream_check_gossip(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
+static int ngx_libc_cdecl ngx_http_upstream_check_cmp_nodes(const void *one,
+        const void *two);
+static char * ngx_http_upstream_check_host_suspect(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
+static char * ngx_http_upstream_check_zone(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
+static char * ngx_http_upstream_check_probe_budget(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
+static char * ngx_http_upstream_check_local_zone(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_upstream_check_assign_zones(ngx_conf_t *cf,
+        ngx_http_upstream_check_main_conf_t *ucmcf);
+static ngx_uint_t ngx_http_upstream_check_cidr_match(ngx_cidr_t *cidr,
+        struct sockaddr *sockaddr);
+static ngx_int_t ngx_http_upstream_check_wrap(ngx_conf_t *cf,
+        ngx_http_upstream_check_main_conf_t *ucmcf,
+        ngx_http_upstream_srv_conf_t *us);
+static int ngx_libc_cdecl ngx_http_upstream_check_cmp_wrap(const void *one,
+        const void *two);
+static ngx_int_t ngx_http_upstream_check_init_peer(ngx_http_request_t *r,
+        ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_check_get_peer(ngx_peer_connection_t *pc,
+        void *data);
+static void ngx_http_upstream_check_free_peer(ngx_peer_connection_t *pc,
+        void *data, ngx_uint_t state);
+#if (NGX_HTTP_SSL)
+static ngx_int_t ngx_http_upstream_check_set_session(ngx_peer_connection_t *pc,
+        void *data);
+static void ngx_http_upstream_check_save_session(ngx_peer_connection_t *pc,
+        void *data);
+#endif
+static ngx_http_check_wrap_peer_t *ngx_http_upstream_check_wrap_find(
+        ngx_http_upstream_check_srv_conf_t *ucscf, struct sockaddr *sockaddr,
+        socklen_t socklen);
+static ngx_int_t ngx_http_upstream_check_add_slots(ngx_conf_t *cf,
+        ngx_http_check_peers_t *peers, ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_check_follow_name(ngx_conf_t *cf,
+        ngx_http_check_peers_t *peers, ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_check_group_hosts(ngx_conf_t *cf,
+        ngx_http_check_peers_t *peers);
+static int ngx_libc_cdecl ngx_http_upstream_check_cmp_hosts(const void *one,
+        const void *two);
 static char * ngx_http_upstream_check_status(ngx_conf_t *cf,
         ngx_command_t *cmd, void *conf);
+static char * ngx_http_upstream_check_control(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
 
 static void *ngx_http_upstream_check_create_main_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_check_init_main_conf(ngx_conf_t *cf, void *conf);
@@ -29,6 +94,26 @@ static char * ngx_http_upstream_check_init_srv_conf(ngx_conf_t *cf, void *conf);
 static ngx_int_t ngx_http_check_init_process(ngx_cycle_t *cycle);
 
 
+typedef struct {
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    /* the check index of the peer in use or NGX_ERROR */
+    ngx_uint_t                           index;
+
+    /* the request keeps to the servers of the local zone */
+    ngx_uint_t                           local;
+
+    /* the peer data and the callbacks of the wrapped balancer */
+    void                                *data;
+    ngx_event_get_peer_pt                get;
+    ngx_event_free_peer_pt               free;
+#if (NGX_HTTP_SSL)
+    ngx_event_set_peer_session_pt        set_session;
+    ngx_event_save_peer_session_pt       save_session;
+#endif
+} ngx_http_upstream_check_peer_data_t;
+
+
 static ngx_conf_bitmask_t  ngx_check_http_expect_alive_masks[] = {
     { ngx_string("http_2xx"), NGX_CHECK_HTTP_2XX },
     { ngx_string("http_3xx"), NGX_CHECK_HTTP_3XX },
@@ -38,6 +123,22 @@ static ngx_conf_bitmask_t  ngx_check_http_expect_alive_masks[] = {
 };
 
 
+/* the syslog facilities, in the order of their codes */
+static char *ngx_check_syslog_facilities[] = {
+    "kern", "user", "mail", "daemon", "auth", "syslog", "lpr", "news",
+    "uucp", "cron", "authpriv", "ftp", "ntp", "audit", "alert", "clock",
+    "local0", "local1", "local2", "local3", "local4", "local5", "local6",
+    "local7", NULL
+};
+
+
+/* the syslog severities, named like the error_log levels */
+static char *ngx_check_syslog_severities[] = {
+    "emerg", "alert", "crit", "error", "warn", "notice", "info", "debug",
+    NULL
+};
+
+
 static ngx_command_t  ngx_http_upstream_check_commands[] = {
 
     { ngx_string("check"),
@@ -61,6 +162,41 @@ static ngx_command_t  ngx_http_upstream_check_commands[] = {
       0,
       NULL },
 
+    { ngx_string("check_agent"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_1MORE,
+      ngx_http_upstream_check_agent,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("check_dynamic"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_check_srv_conf_t, dynamic),
+      NULL },
+
+    { ngx_string("check_resolve"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      ngx_http_upstream_check_resolve,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("check_failback"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      ngx_http_upstream_check_failback,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("check_warmup"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_1MORE,
+      ngx_http_upstream_check_warmup,
+      0,
+      0,
+      NULL },
+
     { ngx_string("check_shm_size"),
       NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
       ngx_http_upstream_check_shm_size,
@@ -68,6 +204,83 @@ static ngx_command_t  ngx_http_upstream_check_commands[] = {
       0,
       NULL },
 
+    { ngx_string("check_max_lag"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_upstream_check_main_conf_t, check_max_lag),
+      NULL },
+
+    { ngx_string("check_journal_size"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_upstream_check_main_conf_t, check_journal_size),
+      NULL },
+
+    { ngx_string("check_notify"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_upstream_check_notify,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("check_statsd"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_upstream_check_statsd,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("check_syslog"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_upstream_check_syslog,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("check_shared_file"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_upstream_check_shared_file,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("check_gossip"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_http_upstream_check_gossip,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("check_host_suspect"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_ANY,
+      ngx_http_upstream_check_host_suspect,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("check_probe_budget"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE123,
+      ngx_http_upstream_check_probe_budget,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("check_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_http_upstream_check_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("check_local_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_upstream_check_local_zone,
+      0,
+      0,
+      NULL },
+
     { ngx_string("check_status"),
       NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
       ngx_http_upstream_check_status,
@@ -75,6 +288,13 @@ static ngx_command_t  ngx_http_upstream_check_commands[] = {
       0,
       NULL },
 
+    { ngx_string("check_control"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_upstream_check_control,
+      0,
+      0,
+      NULL },
+
     ngx_null_command
 };
 
@@ -135,8 +355,9 @@ ngx_uint_t
 ngx_http_check_add_peer(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us,
                         ngx_peer_addr_t *peer_addr)
 {
+    ngx_uint_t                            i, index;
     ngx_http_check_peer_t                *peer;
-    ngx_http_check_peers_t               *peers;
+    ngx_http_upstream_server_t           *server;
     ngx_http_upstream_check_srv_conf_t   *ucscf;
     ngx_http_upstream_check_main_conf_t  *ucmcf;
 
@@ -146,13 +367,71 @@ ngx_http_check_add_peer(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us,
 
     ucscf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_check_module);
 
-    if(ucscf->check_interval == 0) {
+    ucmcf = ngx_http_conf_get_module_main_conf(cf,
+                                               ngx_http_upstream_check_module);
+
+    index = ngx_http_check_register_peer(ucmcf->peers, ucscf, &us->host,
+                                         peer_addr);
+
+    if (index == (ngx_uint_t) NGX_ERROR || us->servers == NULL) {
+        return index;
+    }
+
+    /* the balancers pass the address from the server of the upstream */
+    server = us->servers->elts;
+    peer = ucmcf->peers->peers.elts;
+
+    for (i = 0; i < us->servers->nelts; i++) {
+        if (peer_addr >= server[i].addrs
+            && peer_addr < server[i].addrs + server[i].naddrs)
+        {
+            peer[index].backup = server[i].backup;
+            break;
+        }
+    }
+
+    return index;
+}
+
+
+/*
+ * The probes, the shared memory and the status page only need the check
+ * configuration, the name of the upstream and the address.  Besides the
+ * servers of the patched balancers, the ones of the wrapped balancers and
+ * the check_dynamic slots are registered here.
+ */
+ngx_uint_t
+ngx_http_check_register_peer(ngx_http_check_peers_t *peers,
+        ngx_http_upstream_check_srv_conf_t *ucscf, ngx_str_t *upstream_name,
+        ngx_peer_addr_t *peer_addr)
+{
+    ngx_uint_t                            i;
+    ngx_http_check_peer_t                *peer;
+    ngx_http_check_upstream_t            *upstream;
+
+    if (ucscf->check_interval == 0) {
         return NGX_ERROR;
     }
 
-    ucmcf = ngx_http_conf_get_module_main_conf(cf,
-                                               ngx_http_upstream_check_module);
-    peers = ucmcf->peers;
+    /* the servers of an upstream are usually added one after another */
+    upstream = peers->upstreams.elts;
+
+    for (i = peers->upstreams.nelts; i > 0; i--) {
+        if (upstream[i - 1].name == upstream_name) {
+            break;
+        }
+    }
+
+    if (i == 0) {
+        upstream = ngx_array_push(&peers->upstreams);
+        if (upstream == NULL) {
+            return NGX_ERROR;
+        }
+
+        upstream->name = upstream_name;
+
+        i = peers->upstreams.nelts;
+    }
 
     peer = ngx_array_push(&peers->peers);
     if (peer == NULL) {
@@ -163,8 +442,10 @@ ngx_http_check_add_peer(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us,
 
     peer->index = peers->peers.nelts - 1;
     peer->conf = ucscf;
-    peer->upstream_name = &us->host;
+    peer->upstream_name = upstream_name;
+    peer->upstream_index = i - 1;
     peer->peer_addr = peer_addr;
+    peer->zone = NGX_HTTP_CHECK_NO_ZONE;
 
     peers->checksum +=
         ngx_murmur_hash2(peer_addr->name.data, peer_addr->name.len);
@@ -177,13 +458,14 @@ static char *
 ngx_http_upstream_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_str_t                           *value, s;
-    ngx_uint_t                           i, rise, fall, default_down;
+    ngx_uint_t                           i, rise, fall, flap, default_down;
     ngx_msec_t                           interval, timeout;
     ngx_http_upstream_check_srv_conf_t  *ucscf;
 
     /* set default */
     rise = 2;
     fall = 5;
+    flap = 0;
     interval = 30000;
     timeout = 1000;
     default_down = 1;
@@ -267,6 +549,20 @@ ngx_http_upstream_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "flap=", 5) == 0) {
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            flap = ngx_atoi(s.data, s.len);
+            if (flap == (ngx_uint_t) NGX_ERROR) {
+                goto invalid_check_parameter;
+            } else if (flap > 63) {
+                goto invalid_check_parameter;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "default_down=", 13) == 0) {
             s.len = value[i].len - 13;
             s.data = value[i].data + 13;
@@ -293,6 +589,7 @@ ngx_http_upstream_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ucscf->check_timeout = timeout;
     ucscf->fall_count = fall;
     ucscf->rise_count = rise;
+    ucscf->flap_threshold = flap;
     ucscf->default_down = default_down;
 
     if (ucscf->check_type_conf == NGX_CONF_UNSET_PTR) {
@@ -330,135 +627,2308 @@ ngx_http_upstream_check_http_send(ngx_conf_t *cf, ngx_command_t *cmd, void *conf
 
 
 static char *
-ngx_http_upstream_check_http_expect_alive(ngx_conf_t *cf, ngx_command_t *cmd,
-                                          void *conf)
+ngx_http_upstream_check_agent(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_str_t                           *value;
-    ngx_uint_t                           bit, i, m;
-    ngx_conf_bitmask_t                  *mask;
+    ngx_int_t                            n;
+    ngx_str_t                           *value, s;
+    ngx_uint_t                           i;
+    ngx_http_check_agent_conf_t         *agent;
     ngx_http_upstream_check_srv_conf_t  *ucscf;
 
-    value = cf->args->elts;
-    mask = ngx_check_http_expect_alive_masks;
-
     ucscf = ngx_http_conf_get_module_srv_conf(cf,
                                               ngx_http_upstream_check_module);
-    bit = ucscf->code.status_alive;
 
-    for (i = 1; i < cf->args->nelts; i++) {
-        for (m = 0; mask[m].name.len != 0; m++) {
+    if (ucscf->agent) {
+        return "is duplicate";
+    }
 
-            if (mask[m].name.len != value[i].len
-                || ngx_strcasecmp(mask[m].name.data, value[i].data) != 0)
-            {
-                continue;
-            }
+    agent = ngx_pcalloc(cf->pool, sizeof(ngx_http_check_agent_conf_t));
+    if (agent == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
-            if (bit & mask[m].mask) {
-                ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
-                                   "duplicate value \"%s\"", value[i].data);
+    value = cf->args->elts;
 
-            } else {
-                bit |= mask[m].mask;
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n < 1 || n > 65535) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid check_agent port \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    agent->port = (in_port_t) n;
+    agent->interval = 5000;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid_agent_parameter;
             }
 
-            break;
+            agent->interval = n;
+
+            continue;
         }
 
-        if (mask[m].name.len == 0) {
-            ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
-                               "invalid value \"%s\"", value[i].data);
+        if (ngx_strncmp(value[i].data, "send=", 5) == 0) {
+            agent->send.len = value[i].len - 5;
+            agent->send.data = value[i].data + 5;
 
-            return NGX_CONF_ERROR;
+            continue;
         }
+
+        goto invalid_agent_parameter;
     }
 
-    ucscf->code.status_alive = bit;
+    ucscf->agent = agent;
 
     return NGX_CONF_OK;
+
+invalid_agent_parameter:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
 }
 
 
 static char *
-ngx_http_upstream_check_shm_size(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ngx_http_upstream_check_resolve(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_str_t                            *value;
-    ngx_http_upstream_check_main_conf_t  *ucmcf;
+    ngx_int_t                            n;
+    ngx_str_t                           *value, s;
+    ngx_uint_t                           i;
+    ngx_http_check_resolve_conf_t       *rc;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
 
-    ucmcf = ngx_http_conf_get_module_main_conf(cf,
-            ngx_http_upstream_check_module);
+    ucscf = ngx_http_conf_get_module_srv_conf(cf,
+                                              ngx_http_upstream_check_module);
 
-    if (ucmcf->check_shm_size) {
+    if (ucscf->resolve) {
         return "is duplicate";
     }
 
-    value = cf->args->elts;
-
-    ucmcf->check_shm_size = ngx_parse_size(&value[1]);
-    if (ucmcf->check_shm_size == (size_t) NGX_ERROR) {
-        return "invalid value";
+    rc = ngx_pcalloc(cf->pool, sizeof(ngx_http_check_resolve_conf_t));
+    if (rc == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    return NGX_CONF_OK;
-}
-
+    value = cf->args->elts;
 
-static char *
-ngx_http_upstream_check_status(ngx_conf_t *cf,
-        ngx_command_t *cmd, void *conf)
-{
-    ngx_http_core_loc_conf_t                *clcf;
+    rc->name = value[1];
+    rc->interval = 5000;
 
-    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    for (i = 2; i < cf->args->nelts; i++) {
 
-    clcf->handler = ngx_http_upstream_check_status_handler;
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
 
-    return NGX_CONF_OK;
-}
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n < 1000) {
+                goto invalid_resolve_parameter;
+            }
 
+            rc->interval = n;
 
-static void *
-ngx_http_upstream_check_create_main_conf(ngx_conf_t *cf)
-{
-    ngx_http_upstream_check_main_conf_t  *ucmcf;
+            continue;
+        }
 
-    ucmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_check_main_conf_t));
-    if (ucmcf == NULL) {
-        return NULL;
+        goto invalid_resolve_parameter;
     }
 
-    ucmcf->peers = ngx_pcalloc(cf->pool, sizeof(ngx_http_check_peers_t));
-    if (ucmcf->peers == NULL) {
-        return NULL;
-    }
+    ucscf->resolve = rc;
 
-    ucmcf->peers->checksum = 0;
+    return NGX_CONF_OK;
 
-    if (ngx_array_init(&ucmcf->peers->peers, cf->pool, 16,
-                sizeof(ngx_http_check_peer_t)) != NGX_OK)
-    {
-        return NULL;
-    }
+invalid_resolve_parameter:
 
-    return ucmcf;
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
 }
 
 
 static char *
-ngx_http_upstream_check_init_main_conf(ngx_conf_t *cf, void *conf)
+ngx_http_upstream_check_failback(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_uint_t                            i;
-    ngx_http_upstream_srv_conf_t        **uscfp;
-    ngx_http_upstream_main_conf_t        *umcf;
+    ngx_int_t                            n;
+    ngx_str_t                           *value, s;
+    ngx_uint_t                           i;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
 
-    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
-    uscfp = umcf->upstreams.elts;
+    ucscf = ngx_http_conf_get_module_srv_conf(cf,
+                                              ngx_http_upstream_check_module);
 
-    for (i = 0; i < umcf->upstreams.nelts; i++) {
+    if (ucscf->failback != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    ucscf->failback = 10000;
+    ucscf->failback_up = 1;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "delay=", 6) == 0) {
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR) {
+                goto invalid_failback_parameter;
+            }
+
+            ucscf->failback = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "up=", 3) == 0) {
+            s.len = value[i].len - 3;
+            s.data = value[i].data + 3;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid_failback_parameter;
+            }
+
+            ucscf->failback_up = n;
+
+            continue;
+        }
+
+        goto invalid_failback_parameter;
+    }
+
+    return NGX_CONF_OK;
+
+invalid_failback_parameter:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_upstream_check_warmup(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_int_t                            n;
+    ngx_str_t                           *value, s, file, host;
+    ngx_uint_t                           i;
+    ngx_http_check_warmup_conf_t        *wc;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    ucscf = ngx_http_conf_get_module_srv_conf(cf,
+                                              ngx_http_upstream_check_module);
+
+    if (ucscf->warmup) {
+        return "is duplicate";
+    }
+
+    wc = ngx_pcalloc(cf->pool, sizeof(ngx_http_check_warmup_conf_t));
+    if (wc == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    file = value[1];
+    ngx_str_null(&host);
+
+    wc->interval = 100;
+    wc->timeout = 10000;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "requests=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid_warmup_parameter;
+            }
+
+            wc->count = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR) {
+                goto invalid_warmup_parameter;
+            }
+
+            wc->interval = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid_warmup_parameter;
+            }
+
+            wc->timeout = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "host=", 5) == 0) {
+            host.len = value[i].len - 5;
+            host.data = value[i].data + 5;
+
+            if (host.len == 0) {
+                goto invalid_warmup_parameter;
+            }
+
+            continue;
+        }
+
+        goto invalid_warmup_parameter;
+    }
+
+    if (ngx_conf_full_name(cf->cycle, &file, 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_upstream_check_warmup_read(cf, wc, &file, &host) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* every request of the file once by default */
+    if (wc->count == 0) {
+        wc->count = wc->requests.nelts;
+    }
+
+    ucscf->warmup = wc;
+
+    return NGX_CONF_OK;
+
+invalid_warmup_parameter:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+/*
+ * A line of the file is a request target, such as "/index.html", or a
+ * method and a target, such as "POST /cache/prime".  The empty lines and
+ * the ones starting with "#" are skipped.
+ */
+static ngx_int_t
+ngx_http_upstream_check_warmup_read(ngx_conf_t *cf,
+        ngx_http_check_warmup_conf_t *wc, ngx_str_t *file, ngx_str_t *host)
+{
+    u_char           *buf, *p, *last, *line, *end;
+    size_t            size, len;
+    ssize_t           n;
+    ngx_fd_t          fd;
+    ngx_str_t        *request;
+    ngx_int_t         rc;
+    ngx_file_info_t   fi;
+
+    fd = ngx_open_file(file->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_open_file_n " \"%V\" failed", file);
+        return NGX_ERROR;
+    }
+
+    rc = NGX_ERROR;
+    buf = NULL;
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_fd_info_n " \"%V\" failed", file);
+        goto done;
+    }
+
+    size = (size_t) ngx_file_size(&fi);
+
+    buf = ngx_pnalloc(cf->temp_pool, size);
+    if (buf == NULL) {
+        goto done;
+    }
+
+    n = ngx_read_fd(fd, buf, size);
+
+    if (n == -1) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_read_fd_n " \"%V\" failed", file);
+        goto done;
+    }
+
+    if (ngx_array_init(&wc->requests, cf->pool, 8, sizeof(ngx_str_t))
+        != NGX_OK)
+    {
+        goto done;
+    }
+
+    p = buf;
+    last = buf + n;
+
+    while (p < last) {
+
+        line = p;
+
+        end = ngx_strlchr(p, last, LF);
+        if (end == NULL) {
+            end = last;
+        }
+
+        p = end + 1;
+
+        while (line < end && (*line == ' ' || *line == '\t')) {
+            line++;
+        }
+
+        while (end > line
+               && (end[-1] == CR || end[-1] == ' ' || end[-1] == '\t'))
+        {
+            end--;
+        }
+
+        if (line == end || *line == '#') {
+            continue;
+        }
+
+        len = end - line;
+
+        request = ngx_array_push(&wc->requests);
+        if (request == NULL) {
+            goto done;
+        }
+
+        request->data = ngx_pnalloc(cf->pool,
+                                    sizeof("GET ") - 1 + len
+                                    + sizeof(" HTTP/1.0" CRLF) - 1
+                                    + sizeof("Host: " CRLF) - 1 + host->len
+                                    + sizeof("Connection: close" CRLF CRLF)
+                                    - 1);
+        if (request->data == NULL) {
+            goto done;
+        }
+
+        request->len = ngx_sprintf(request->data, "%s%*s HTTP/1.0" CRLF,
+                                   ngx_strlchr(line, end, ' ') ? "" : "GET ",
+                                   len, line)
+                       - request->data;
+
+        if (host->len) {
+            request->len = ngx_sprintf(request->data + request->len,
+                                       "Host: %V" CRLF, host)
+                           - request->data;
+        }
+
+        request->len = ngx_cpymem(request->data + request->len,
+                                  "Connection: close" CRLF CRLF,
+                                  sizeof("Connection: close" CRLF CRLF) - 1)
+                       - request->data;
+    }
+
+    if (wc->requests.nelts == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no request in \"%V\"", file);
+        goto done;
+    }
+
+    rc = NGX_OK;
+
+done:
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno,
+                           ngx_close_file_n " \"%V\" failed", file);
+    }
+
+    return rc;
+}
+
+
+static char *
+ngx_http_upstream_check_http_expect_alive(ngx_conf_t *cf, ngx_command_t *cmd,
+                                          void *conf)
+{
+    ngx_str_t                           *value;
+    ngx_uint_t                           bit, i, m;
+    ngx_conf_bitmask_t                  *mask;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    value = cf->args->elts;
+    mask = ngx_check_http_expect_alive_masks;
+
+    ucscf = ngx_http_conf_get_module_srv_conf(cf,
+                                              ngx_http_upstream_check_module);
+    bit = ucscf->code.status_alive;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        for (m = 0; mask[m].name.len != 0; m++) {
+
+            if (mask[m].name.len != value[i].len
+                || ngx_strcasecmp(mask[m].name.data, value[i].data) != 0)
+            {
+                continue;
+            }
+
+            if (bit & mask[m].mask) {
+                ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                                   "duplicate value \"%s\"", value[i].data);
+
+            } else {
+                bit |= mask[m].mask;
+            }
+
+            break;
+        }
+
+        if (mask[m].name.len == 0) {
+            ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                               "invalid value \"%s\"", value[i].data);
+
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    ucscf->code.status_alive = bit;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_upstream_check_shm_size(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t                            *value;
+    ngx_http_upstream_check_main_conf_t  *ucmcf;
+
+    ucmcf = ngx_http_conf_get_module_main_conf(cf,
+            ngx_http_upstream_check_module);
+
+    if (ucmcf->check_shm_size) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    ucmcf->check_shm_size = ngx_parse_size(&value[1]);
+    if (ucmcf->check_shm_size == (size_t) NGX_ERROR) {
+        return "invalid value";
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_upstream_check_notify(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_int_t                             n;
+    ngx_str_t                            *value, s;
+    ngx_uint_t                            i;
+    ngx_http_check_notify_conf_t         *nc;
+    ngx_http_upstream_check_main_conf_t  *ucmcf;
+
+    ucmcf = ngx_http_conf_get_module_main_conf(cf,
+            ngx_http_upstream_check_module);
+
+    if (ucmcf->check_notify) {
+        return "is duplicate";
+    }
+
+    nc = ngx_pcalloc(cf->pool, sizeof(ngx_http_check_notify_conf_t));
+    if (nc == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    nc->interval = 1000;
+    nc->batch = 32;
+    nc->retries = 3;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "url=", 4) == 0) {
+            s.len = value[i].len - 4;
+            s.data = value[i].data + 4;
+
+            if (s.len <= 7
+                || ngx_strncasecmp(s.data, (u_char *) "http://", 7) != 0)
+            {
+                goto invalid_notify_parameter;
+            }
+
+            nc->url.url.len = s.len - 7;
+            nc->url.url.data = s.data + 7;
+            nc->url.default_port = 80;
+            nc->url.uri_part = 1;
+            nc->url.one_addr = 1;
+
+            if (ngx_parse_url(cf->pool, &nc->url) != NGX_OK) {
+                if (nc->url.err) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "%s in check_notify \"%V\"",
+                                       nc->url.err, &nc->url.url);
+                }
+
+                return NGX_CONF_ERROR;
+            }
+
+            if (nc->url.uri.len == 0) {
+                nc->url.uri.len = 1;
+                nc->url.uri.data = (u_char *) "/";
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "exec=", 5) == 0) {
+            nc->command.len = value[i].len - 5;
+            nc->command.data = value[i].data + 5;
+
+            if (nc->command.len == 0) {
+                goto invalid_notify_parameter;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid_notify_parameter;
+            }
+
+            nc->interval = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "batch=", 6) == 0) {
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid_notify_parameter;
+            }
+
+            nc->batch = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "retries=", 8) == 0) {
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR) {
+                goto invalid_notify_parameter;
+            }
+
+            nc->retries = n;
+
+            continue;
+        }
+
+        goto invalid_notify_parameter;
+    }
+
+    if ((nc->url.url.len == 0) == (nc->command.len == 0)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "check_notify needs either \"url\" or \"exec\"");
+        return NGX_CONF_ERROR;
+    }
+
+    ucmcf->check_notify = nc;
+
+    return NGX_CONF_OK;
+
+invalid_notify_parameter:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_upstream_check_statsd(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_int_t                             n;
+    ngx_str_t                            *value, s;
+    ngx_uint_t                            i;
+    ngx_http_check_statsd_conf_t         *sc;
+    ngx_http_upstream_check_main_conf_t  *ucmcf;
+
+    ucmcf = ngx_http_conf_get_module_main_conf(cf,
+            ngx_http_upstream_check_module);
+
+    if (ucmcf->check_statsd) {
+        return "is duplicate";
+    }
+
+    sc = ngx_pcalloc(cf->pool, sizeof(ngx_http_check_statsd_conf_t));
+    if (sc == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    sc->interval = 10000;
+    sc->size = 1432;
+    sc->prefix.len = sizeof("nginx.upstream_check") - 1;
+    sc->prefix.data = (u_char *) "nginx.upstream_check";
+
+    value = cf->args->elts;
+
+    sc->url.url = value[1];
+    sc->url.default_port = 8125;
+    sc->url.no_resolve = 0;
+    sc->url.one_addr = 1;
+
+    if (ngx_parse_url(cf->pool, &sc->url) != NGX_OK) {
+        if (sc->url.err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "%s in check_statsd \"%V\"",
+                               sc->url.err, &sc->url.url);
+        }
+
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid_statsd_parameter;
+            }
+
+            sc->interval = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "prefix=", 7) == 0) {
+            sc->prefix.len = value[i].len - 7;
+            sc->prefix.data = value[i].data + 7;
+
+            if (sc->prefix.len == 0) {
+                goto invalid_statsd_parameter;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "size=", 5) == 0) {
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n < 512 || n > 65507) {
+                goto invalid_statsd_parameter;
+            }
+
+            sc->size = n;
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "format=statsd") == 0) {
+            sc->dogstatsd = 0;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "format=dogstatsd") == 0) {
+            sc->dogstatsd = 1;
+            continue;
+        }
+
+        goto invalid_statsd_parameter;
+    }
+
+    ucmcf->check_statsd = sc;
+
+    return NGX_CONF_OK;
+
+invalid_statsd_parameter:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_upstream_check_syslog(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_int_t                             n;
+    ngx_str_t                            *value, s;
+    ngx_uint_t                            i, j;
+    ngx_http_check_syslog_conf_t         *sc;
+    ngx_http_upstream_check_main_conf_t  *ucmcf;
+
+    ucmcf = ngx_http_conf_get_module_main_conf(cf,
+            ngx_http_upstream_check_module);
+
+    if (ucmcf->check_syslog) {
+        return "is duplicate";
+    }
+
+    sc = ngx_pcalloc(cf->pool, sizeof(ngx_http_check_syslog_conf_t));
+    if (sc == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    sc->interval = 1000;
+    sc->facility = 16;
+    sc->severity = 4;
+    sc->tag.len = sizeof("nginx") - 1;
+    sc->tag.data = (u_char *) "nginx";
+
+    value = cf->args->elts;
+
+    sc->url.url = value[1];
+    sc->url.default_port = 514;
+    sc->url.one_addr = 1;
+
+    if (ngx_parse_url(cf->pool, &sc->url) != NGX_OK) {
+        if (sc->url.err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "%s in check_syslog \"%V\"",
+                               sc->url.err, &sc->url.url);
+        }
+
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "facility=", 9) == 0) {
+
+            for (j = 0; ngx_check_syslog_facilities[j]; j++) {
+                if (ngx_strcmp(value[i].data + 9,
+                               ngx_check_syslog_facilities[j]) == 0)
+                {
+                    break;
+                }
+            }
+
+            if (ngx_check_syslog_facilities[j] == NULL) {
+                goto invalid_syslog_parameter;
+            }
+
+            sc->facility = j;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "level=", 6) == 0) {
+
+            for (j = 0; ngx_check_syslog_severities[j]; j++) {
+                if (ngx_strcmp(value[i].data + 6,
+                               ngx_check_syslog_severities[j]) == 0)
+                {
+                    break;
+                }
+            }
+
+            if (ngx_check_syslog_severities[j] == NULL) {
+                goto invalid_syslog_parameter;
+            }
+
+            sc->severity = j;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid_syslog_parameter;
+            }
+
+            sc->interval = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "tag=", 4) == 0) {
+            sc->tag.len = value[i].len - 4;
+            sc->tag.data = value[i].data + 4;
+
+            if (sc->tag.len == 0 || sc->tag.len > 48) {
+                goto invalid_syslog_parameter;
+            }
+
+            continue;
+        }
+
+        goto invalid_syslog_parameter;
+    }
+
+    ucmcf->check_syslog = sc;
+
+    return NGX_CONF_OK;
+
+invalid_syslog_parameter:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_upstream_check_shared_file(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf)
+{
+    ngx_int_t                             n;
+    ngx_str_t                            *value;
+    ngx_http_upstream_check_main_conf_t  *ucmcf;
+
+    ucmcf = ngx_http_conf_get_module_main_conf(cf,
+            ngx_http_upstream_check_module);
+
+    if (ucmcf->check_shared_file.data) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    ucmcf->check_shared_file = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, &ucmcf->check_shared_file, 0)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    ucmcf->check_shared_slots = 4096;
+
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strncmp(value[2].data, "slots=", 6) != 0) {
+            goto invalid_shared_parameter;
+        }
+
+        n = ngx_atoi(value[2].data + 6, value[2].len - 6);
+        if (n == NGX_ERROR || n == 0) {
+            goto invalid_shared_parameter;
+        }
+
+        ucmcf->check_shared_slots = n;
+    }
+
+    return NGX_CONF_OK;
+
+invalid_shared_parameter:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[2]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_upstream_check_gossip(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_int_t                             n;
+    ngx_url_t                             u;
+    ngx_str_t                            *value, s, self, secret;
+    ngx_md5_t                             md5;
+    ngx_uint_t                            i;
+    ngx_addr_t                           *addr;
+    ngx_array_t                           nodes;
+    ngx_http_check_gossip_conf_t         *gc;
+    ngx_http_upstream_check_main_conf_t  *ucmcf;
+
+    ucmcf = ngx_http_conf_get_module_main_conf(cf,
+            ngx_http_upstream_check_module);
+
+    if (ucmcf->check_gossip) {
+        return "is duplicate";
+    }
+
+    gc = ngx_pcalloc(cf->pool, sizeof(ngx_http_check_gossip_conf_t));
+    if (gc == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    gc->interval = 1000;
+    gc->local = 10;
+
+    ngx_str_null(&secret);
+
+    if (ngx_array_init(&nodes, cf->pool, 8, sizeof(ngx_addr_t)) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (i == 1 || ngx_strncmp(value[i].data, "node=", 5) == 0) {
+            ngx_memzero(&u, sizeof(ngx_url_t));
+
+            u.url = value[i];
+
+            if (i > 1) {
+                u.url.len -= 5;
+                u.url.data += 5;
+            }
+
+            u.one_addr = 1;
+
+            if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+                if (u.err) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "%s in check_gossip \"%V\"",
+                                       u.err, &u.url);
+                }
+
+                return NGX_CONF_ERROR;
+            }
+
+            if (u.no_port) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "no port in check_gossip \"%V\"",
+                                   &u.url);
+                return NGX_CONF_ERROR;
+            }
+
+            addr = ngx_array_push(&nodes);
+            if (addr == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            *addr = u.addrs[0];
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid_gossip_parameter;
+            }
+
+            gc->interval = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "local=", 6) == 0) {
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid_gossip_parameter;
+            }
+
+            gc->local = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "secret=", 7) == 0) {
+            secret.len = value[i].len - 7;
+            secret.data = value[i].data + 7;
+
+            if (secret.len == 0) {
+                goto invalid_gossip_parameter;
+            }
+
+            continue;
+        }
+
+        goto invalid_gossip_parameter;
+    }
+
+    if (nodes.nelts < 2) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "check_gossip needs at least one \"node\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (secret.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "check_gossip needs a \"secret\"");
+        return NGX_CONF_ERROR;
+    }
+
+    /* a secret longer than a block is hashed first, as HMAC says */
+    if (secret.len > sizeof(gc->key)) {
+        ngx_md5_init(&md5);
+        ngx_md5_update(&md5, secret.data, secret.len);
+        ngx_md5_final(gc->key, &md5);
+
+    } else {
+        ngx_memcpy(gc->key, secret.data, secret.len);
+    }
+
+    addr = nodes.elts;
+    self = addr[0].name;
+
+    /* every node orders the nodes the same way */
+    ngx_qsort(addr, nodes.nelts, sizeof(ngx_addr_t),
+              ngx_http_upstream_check_cmp_nodes);
+
+    for (i = 0; i < nodes.nelts; i++) {
+        if (i > 0 && ngx_http_upstream_check_cmp_nodes(&addr[i - 1], &addr[i])
+                     == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate check_gossip node \"%V\"",
+                               &addr[i].name);
+            return NGX_CONF_ERROR;
+        }
+
+        if (addr[i].name.len == self.len
+            && ngx_strncmp(addr[i].name.data, self.data, self.len) == 0)
+        {
+            gc->self = i;
+        }
+    }
+
+    gc->nodes = addr;
+    gc->nnodes = nodes.nelts;
+
+    ucmcf->check_gossip = gc;
+
+    return NGX_CONF_OK;
+
+invalid_gossip_parameter:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_upstream_check_cmp_nodes(const void *one, const void *two)
+{
+    ngx_int_t    rc;
+    ngx_addr_t  *first, *second;
+
+    first = (ngx_addr_t *) one;
+    second = (ngx_addr_t *) two;
+
+    rc = ngx_strncmp(first->name.data, second->name.data,
+                     ngx_min(first->name.len, second->name.len));
+
+    if (rc == 0) {
+        rc = (ngx_int_t) first->name.len - (ngx_int_t) second->name.len;
+    }
+
+    return (int) rc;
+}
+
+
+static char *
+ngx_http_upstream_check_host_suspect(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf)
+{
+    ngx_int_t                             n;
+    ngx_str_t                            *value, s;
+    ngx_uint_t                            i;
+    ngx_http_check_suspect_conf_t        *sc;
+    ngx_http_upstream_check_main_conf_t  *ucmcf;
+
+    ucmcf = ngx_http_conf_get_module_main_conf(cf,
+            ngx_http_upstream_check_module);
+
+    if (ucmcf->check_host_suspect) {
+        return "is duplicate";
+    }
+
+    sc = ngx_pcalloc(cf->pool, sizeof(ngx_http_check_suspect_conf_t));
+    if (sc == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    sc->failures = 3;
+    sc->window = 2000;
+    sc->hold = 10000;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "failures=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n < 2) {
+                goto invalid_suspect_parameter;
+            }
+
+            sc->failures = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "window=", 7) == 0) {
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid_suspect_parameter;
+            }
+
+            sc->window = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "hold=", 5) == 0) {
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid_suspect_parameter;
+            }
+
+            sc->hold = n;
+
+            continue;
+        }
+
+        goto invalid_suspect_parameter;
+    }
+
+    ucmcf->check_host_suspect = sc;
+
+    return NGX_CONF_OK;
+
+invalid_suspect_parameter:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_upstream_check_probe_budget(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf)
+{
+    ngx_int_t                             n;
+    ngx_str_t                            *value, s;
+    ngx_uint_t                            i;
+    ngx_http_check_budget_conf_t         *bc;
+    ngx_http_upstream_check_main_conf_t  *ucmcf;
+
+    ucmcf = ngx_http_conf_get_module_main_conf(cf,
+            ngx_http_upstream_check_module);
+
+    if (ucmcf->check_probe_budget) {
+        return "is duplicate";
+    }
+
+    bc = ngx_pcalloc(cf->pool, sizeof(ngx_http_check_budget_conf_t));
+    if (bc == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    i = 1;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0) {
+        goto invalid_budget_parameter;
+    }
+
+    bc->rate = n;
+    bc->min = 1000;
+    bc->max = 60000;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "min=", 4) == 0) {
+            s.len = value[i].len - 4;
+            s.data = value[i].data + 4;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid_budget_parameter;
+            }
+
+            bc->min = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
+            s.len = value[i].len - 4;
+            s.data = value[i].data + 4;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid_budget_parameter;
+            }
+
+            bc->max = n;
+
+            continue;
+        }
+
+        goto invalid_budget_parameter;
+    }
+
+    if (bc->min > bc->max) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "min=%M is greater than max=%M", bc->min, bc->max);
+        return NGX_CONF_ERROR;
+    }
+
+    ucmcf->check_probe_budget = bc;
+
+    return NGX_CONF_OK;
+
+invalid_budget_parameter:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_upstream_check_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_int_t                             rc;
+    ngx_str_t                            *value;
+    ngx_uint_t                            i;
+    ngx_cidr_t                           *cidr;
+    ngx_http_check_zone_conf_t           *zone;
+    ngx_http_upstream_check_main_conf_t  *ucmcf;
+
+    ucmcf = ngx_http_conf_get_module_main_conf(cf,
+            ngx_http_upstream_check_module);
+
+    value = cf->args->elts;
+
+    if (ucmcf->check_zones == NULL) {
+        ucmcf->check_zones = ngx_array_create(cf->pool, 4,
+                                 sizeof(ngx_http_check_zone_conf_t));
+        if (ucmcf->check_zones == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    zone = ucmcf->check_zones->elts;
+
+    for (i = 0; i < ucmcf->check_zones->nelts; i++) {
+        if (zone[i].name.len == value[1].len
+            && ngx_strncmp(zone[i].name.data, value[1].data, value[1].len)
+               == 0)
+        {
+            return "is duplicate";
+        }
+    }
+
+    zone = ngx_array_push(ucmcf->check_zones);
+    if (zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    zone->name = value[1];
+
+    if (ngx_array_init(&zone->cidrs, cf->pool, cf->args->nelts - 2,
+                       sizeof(ngx_cidr_t))
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        cidr = ngx_array_push(&zone->cidrs);
+        if (cidr == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        rc = ngx_ptocidr(&value[i], cidr);
+
+        if (rc == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid network \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (rc == NGX_DONE) {
+            ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                               "low address bits of %V are meaningless",
+                               &value[i]);
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_upstream_check_local_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf)
+{
+    ngx_int_t                             n;
+    ngx_str_t                            *value, s;
+    ngx_uint_t                            i;
+    ngx_http_upstream_check_main_conf_t  *ucmcf;
+
+    ucmcf = ngx_http_conf_get_module_main_conf(cf,
+            ngx_http_upstream_check_module);
+
+    if (ucmcf->check_local_zone.len) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    ucmcf->check_local_zone = value[1];
+    ucmcf->check_local_healthy = 70;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "healthy=", 8) == 0) {
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            n = ngx_atoi(s.data, s.len);
+            if (n == NGX_ERROR || n == 0 || n > 100) {
+                goto invalid_local_zone_parameter;
+            }
+
+            ucmcf->check_local_healthy = n;
+
+            continue;
+        }
+
+        goto invalid_local_zone_parameter;
+    }
+
+    return NGX_CONF_OK;
+
+invalid_local_zone_parameter:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+/*
+ * The configured servers take the first zone with a network holding their
+ * address. A dynamic slot has no zone, nor has a server in none of them.
+ */
+static ngx_int_t
+ngx_http_upstream_check_assign_zones(ngx_conf_t *cf,
+        ngx_http_upstream_check_main_conf_t *ucmcf)
+{
+    ngx_uint_t                   i, j, k;
+    ngx_cidr_t                  *cidr;
+    ngx_http_check_peer_t       *peer;
+    ngx_http_check_peers_t      *peers;
+    ngx_http_check_zone_conf_t  *zone;
+
+    peers = ucmcf->peers;
+    peers->local_zone = NGX_HTTP_CHECK_NO_ZONE;
+
+    if (ucmcf->check_zones == NULL) {
+        if (ucmcf->check_local_zone.len) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "check_local_zone \"%V\" needs check_zone",
+                               &ucmcf->check_local_zone);
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    zone = ucmcf->check_zones->elts;
+    peers->nzones = ucmcf->check_zones->nelts;
+
+    peers->zones = ngx_palloc(cf->pool, peers->nzones * sizeof(ngx_str_t));
+    if (peers->zones == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < peers->nzones; i++) {
+        peers->zones[i] = zone[i].name;
+
+        if (zone[i].name.len == ucmcf->check_local_zone.len
+            && ngx_strncmp(zone[i].name.data, ucmcf->check_local_zone.data,
+                           zone[i].name.len)
+               == 0)
+        {
+            peers->local_zone = i;
+        }
+    }
+
+    if (ucmcf->check_local_zone.len
+        && peers->local_zone == NGX_HTTP_CHECK_NO_ZONE)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unknown zone \"%V\" in check_local_zone",
+                           &ucmcf->check_local_zone);
+        return NGX_ERROR;
+    }
+
+    peers->local_healthy = ucmcf->check_local_healthy;
+
+    peer = peers->peers.elts;
+
+    for (i = 0; i < peers->peers.nelts; i++) {
+
+        if (peer[i].dynamic) {
+            continue;
+        }
+
+        for (j = 0; j < peers->nzones; j++) {
+            cidr = zone[j].cidrs.elts;
+
+            for (k = 0; k < zone[j].cidrs.nelts; k++) {
+                if (ngx_http_upstream_check_cidr_match(&cidr[k],
+                        peer[i].peer_addr->sockaddr))
+                {
+                    break;
+                }
+            }
+
+            if (k < zone[j].cidrs.nelts) {
+                peer[i].zone = j;
+                break;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_check_cidr_match(ngx_cidr_t *cidr, struct sockaddr *sockaddr)
+{
+    struct sockaddr_in   *sin;
+#if (NGX_HAVE_INET6)
+    ngx_uint_t            i;
+    struct sockaddr_in6  *sin6;
+#endif
+
+    if (cidr->family != sockaddr->sa_family) {
+        return 0;
+    }
+
+    switch (sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) sockaddr;
+
+        for (i = 0; i < 16; i++) {
+            if ((sin6->sin6_addr.s6_addr[i] & cidr->u.in6.mask.s6_addr[i])
+                != cidr->u.in6.addr.s6_addr[i])
+            {
+                return 0;
+            }
+        }
+
+        return 1;
+#endif
+
+    case AF_INET:
+        sin = (struct sockaddr_in *) sockaddr;
+
+        return (sin->sin_addr.s_addr & cidr->u.in.mask) == cidr->u.in.addr;
+
+    default:
+        return 0;
+    }
+}
+
+
+/*
+ * The patched balancers register their servers while nginx initializes the
+ * upstreams. The servers of any other balancer are registered here and its
+ * per request callbacks are wrapped, so the module needs no patch for it.
+ */
+static ngx_int_t
+ngx_http_upstream_check_wrap(ngx_conf_t *cf,
+    ngx_http_upstream_check_main_conf_t *ucmcf,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                           i, j, n, index, patched;
+    ngx_http_check_peer_t               *peer;
+    ngx_http_check_peers_t              *peers;
+    ngx_http_check_upstream_t           *upstream;
+    ngx_http_upstream_server_t          *server;
+    ngx_http_check_wrap_peer_t          *wp;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    if (us->srv_conf == NULL || us->servers == NULL) {
+        return NGX_OK;
+    }
+
+    ucscf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_check_module);
+
+    if (ucscf->check_interval == 0 || us->peer.init == NULL) {
+        return NGX_OK;
+    }
+
+    peers = ucmcf->peers;
+    upstream = peers->upstreams.elts;
+    patched = 0;
+
+    for (i = 0; i < peers->upstreams.nelts; i++) {
+        if (upstream[i].name == &us->host) {
+            patched = 1;
+            break;
+        }
+    }
+
+    /* a patched balancer is only wrapped to keep to the local zone */
+    if (patched && ucmcf->check_local_zone.len == 0) {
+        return NGX_OK;
+    }
+
+    server = us->servers->elts;
+
+    for (i = 0; !patched && i < us->servers->nelts; i++) {
+
+        if (server[i].down) {
+            continue;
+        }
+
+        for (j = 0; j < server[i].naddrs; j++) {
+
+            index = ngx_http_check_register_peer(peers, ucscf, &us->host,
+                                                 &server[i].addrs[j]);
+            if (index == (ngx_uint_t) NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            peer = peers->peers.elts;
+            peer[index].backup = server[i].backup;
+        }
+    }
+
+    peer = peers->peers.elts;
+    n = 0;
+
+    for (i = 0; i < peers->peers.nelts; i++) {
+        if (peer[i].upstream_name == &us->host) {
+            n++;
+        }
+    }
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    wp = ngx_pcalloc(cf->pool, n * sizeof(ngx_http_check_wrap_peer_t));
+    if (wp == NULL) {
+        return NGX_ERROR;
+    }
+
+    n = 0;
+
+    for (i = 0; i < peers->peers.nelts; i++) {
+
+        if (peer[i].upstream_name != &us->host) {
+            continue;
+        }
+
+        wp[n].sockaddr = peer[i].peer_addr->sockaddr;
+        wp[n].socklen = peer[i].peer_addr->socklen;
+        wp[n].index = i;
+        wp[n].backup = peer[i].backup;
+        n++;
+    }
+
+    ngx_qsort(wp, n, sizeof(ngx_http_check_wrap_peer_t),
+              ngx_http_upstream_check_cmp_wrap);
+
+    ucscf->wrap_peers = wp;
+    ucscf->wrap_npeers = n;
+    ucscf->wrap_init = us->peer.init;
+
+    us->peer.init = ngx_http_upstream_check_init_peer;
+
+    return NGX_OK;
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_upstream_check_cmp_wrap(const void *one, const void *two)
+{
+    ngx_http_check_wrap_peer_t  *first, *second;
+
+    first = (ngx_http_check_wrap_peer_t *) one;
+    second = (ngx_http_check_wrap_peer_t *) two;
+
+    if ((uintptr_t) first->sockaddr < (uintptr_t) second->sockaddr) {
+        return -1;
+    }
+
+    if ((uintptr_t) first->sockaddr > (uintptr_t) second->sockaddr) {
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_check_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_peer_connection_t                *pc;
+    ngx_http_upstream_check_srv_conf_t   *ucscf;
+    ngx_http_upstream_check_peer_data_t  *cpd;
+
+    ucscf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_check_module);
+
+    if (ucscf->wrap_init(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    cpd = ngx_palloc(r->pool, sizeof(ngx_http_upstream_check_peer_data_t));
+    if (cpd == NULL) {
+        return NGX_ERROR;
+    }
+
+    pc = &r->upstream->peer;
+
+    cpd->ucscf = ucscf;
+    cpd->index = (ngx_uint_t) NGX_ERROR;
+    cpd->local = ngx_http_check_zone_local(ucscf->wrap_peers[0].index);
+    cpd->data = pc->data;
+    cpd->get = pc->get;
+    cpd->free = pc->free;
+
+    pc->data = cpd;
+    pc->get = ngx_http_upstream_check_get_peer;
+    pc->free = ngx_http_upstream_check_free_peer;
+
+#if (NGX_HTTP_SSL)
+    cpd->set_session = pc->set_session;
+    cpd->save_session = pc->save_session;
+
+    pc->set_session = ngx_http_upstream_check_set_session;
+    pc->save_session = ngx_http_upstream_check_save_session;
+#endif
+
+    return NGX_OK;
+}
+
+
+/*
+ * A peer which is down or drained is given back to the balancer with
+ * NGX_PEER_NEXT, the state of a peer left without a failure, as for a
+ * 404 with "proxy_next_upstream http_404".  The balancer counts no
+ * failure for it and remembers it, the try it took is given back, and
+ * another peer is asked for.  The balancer gives up by itself once it has
+ * tried all the servers.
+ */
+static ngx_int_t
+ngx_http_upstream_check_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_check_peer_data_t  *cpd = data;
+
+    ngx_int_t                    rc;
+    ngx_uint_t                   n, tries;
+    ngx_http_check_wrap_peer_t  *wp;
+
+    for (n = 0; n < cpd->ucscf->wrap_npeers; n++) {
+
+        rc = cpd->get(pc, cpd->data);
+
+        /* NGX_DONE is a cached connection, the keepalive module has it */
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        wp = ngx_http_upstream_check_wrap_find(cpd->ucscf, pc->sockaddr,
+                                               pc->socklen);
+        if (wp == NULL) {
+            return NGX_OK;
+        }
+
+        /*
+         * a failed over upstream keeps off its primary servers, a local
+         * request off the servers of the other zones
+         */
+        if (!ngx_http_check_peer_down(wp->index)
+            && !ngx_http_check_peer_drain(wp->index)
+            && (wp->backup || !ngx_http_check_use_backup(wp->index))
+            && !(cpd->local && ngx_http_check_peer_remote(wp->index)))
+        {
+            cpd->index = wp->index;
+            ngx_http_check_get_peer(wp->index);
+
+            return NGX_OK;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "check wrapped balancer skips peer, check_index: %ui",
+                       wp->index);
+
+        tries = pc->tries;
+        cpd->free(pc, cpd->data, NGX_PEER_NEXT);
+        pc->tries = tries;
+    }
+
+    return NGX_BUSY;
+}
+
+
+static void
+ngx_http_upstream_check_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_check_peer_data_t  *cpd = data;
+
+    /* the next try may go to another zone */
+    if (state & NGX_PEER_FAILED) {
+        cpd->local = 0;
+    }
+
+    if (cpd->index != (ngx_uint_t) NGX_ERROR) {
+        ngx_http_check_free_peer(cpd->index);
+        cpd->index = (ngx_uint_t) NGX_ERROR;
+    }
+
+    cpd->free(pc, cpd->data, state);
+}
+
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_upstream_check_set_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_check_peer_data_t  *cpd = data;
+
+    return cpd->set_session(pc, cpd->data);
+}
+
+
+static void
+ngx_http_upstream_check_save_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_check_peer_data_t  *cpd = data;
+
+    cpd->save_session(pc, cpd->data);
+}
+
+#endif
+
+
+/*
+ * The balancers hand out the sockaddr of the upstream server itself, a
+ * balancer which copies it is found by the address instead.
+ */
+static ngx_http_check_wrap_peer_t *
+ngx_http_upstream_check_wrap_find(ngx_http_upstream_check_srv_conf_t *ucscf,
+    struct sockaddr *sockaddr, socklen_t socklen)
+{
+    ngx_uint_t                   i, left, right, middle;
+    ngx_http_check_wrap_peer_t  *wp;
+
+    wp = ucscf->wrap_peers;
+    left = 0;
+    right = ucscf->wrap_npeers;
+
+    while (left < right) {
+        middle = left + (right - left) / 2;
+
+        if ((uintptr_t) wp[middle].sockaddr < (uintptr_t) sockaddr) {
+            left = middle + 1;
+
+        } else {
+            right = middle;
+        }
+    }
+
+    if (left < ucscf->wrap_npeers && wp[left].sockaddr == sockaddr) {
+        return &wp[left];
+    }
+
+    for (i = 0; i < ucscf->wrap_npeers; i++) {
+        if (wp[i].socklen == socklen
+            && ngx_memcmp(wp[i].sockaddr, sockaddr, socklen) == 0)
+        {
+            return &wp[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * The spare slots of check_dynamic follow the servers of all the upstreams.
+ * Their address is in the shared memory and empty until a server is added
+ * at run time.
+ */
+static ngx_int_t
+ngx_http_upstream_check_add_slots(ngx_conf_t *cf,
+        ngx_http_check_peers_t *peers, ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                           i, index;
+    ngx_peer_addr_t                     *addr;
+    ngx_http_check_peer_t               *peer;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    if (us->srv_conf == NULL) {
+        return NGX_OK;
+    }
+
+    ucscf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_check_module);
+
+    if (ucscf->dynamic == 0) {
+        return NGX_OK;
+    }
+
+    if (ucscf->check_interval == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "check_dynamic in upstream \"%V\" "
+                           "needs the check directive", &us->host);
+        return NGX_ERROR;
+    }
+
+    if (peers->peers.nelts + ucscf->dynamic > NGX_HTTP_CHECK_SLOT_MASK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "too many check_dynamic slots in upstream \"%V\"",
+                           &us->host);
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < ucscf->dynamic; i++) {
+
+        addr = ngx_pcalloc(cf->pool, sizeof(ngx_peer_addr_t));
+        if (addr == NULL) {
+            return NGX_ERROR;
+        }
+
+        /* an empty address, no inheritance and no host to group with */
+        addr->sockaddr = ngx_pcalloc(cf->pool, NGX_SOCKADDRLEN);
+        if (addr->sockaddr == NULL) {
+            return NGX_ERROR;
+        }
+
+        index = ngx_http_check_register_peer(peers, ucscf, &us->host, addr);
+        if (index == (ngx_uint_t) NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        peer = peers->peers.elts;
+        peer[index].dynamic = 1;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * The servers of the upstream which the name of check_resolve resolves
+ * to now follow the name when it is resolved again at run time.
+ */
+static ngx_int_t
+ngx_http_upstream_check_follow_name(ngx_conf_t *cf,
+        ngx_http_check_peers_t *peers, ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_url_t                            u;
+    ngx_uint_t                           i, j, found;
+    ngx_http_check_peer_t               *peer;
+    ngx_http_core_loc_conf_t            *clcf;
+    struct sockaddr_in                  *sin;
+    ngx_http_check_resolve_conf_t       *rc, **rcp;
+    ngx_http_upstream_check_srv_conf_t  *ucscf;
+
+    if (us->srv_conf == NULL) {
+        return NGX_OK;
+    }
+
+    ucscf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_check_module);
+
+    rc = ucscf->resolve;
+    if (rc == NULL) {
+        return NGX_OK;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    if (clcf->resolver == NULL || clcf->resolver == NGX_CONF_UNSET_PTR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "check_resolve in upstream \"%V\" needs "
+                           "a resolver in the http block", &us->host);
+        return NGX_ERROR;
+    }
+
+    peers->resolver = clcf->resolver;
+    peers->resolver_timeout = clcf->resolver_timeout == NGX_CONF_UNSET_MSEC
+                              ? 30000 : clcf->resolver_timeout;
+
+    /* what nginx took the name for when it read the upstream */
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = rc->name;
+    u.default_port = 80;
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "%s in check_resolve \"%V\"",
+                           u.err ? u.err : "invalid name", &rc->name);
+        return NGX_ERROR;
+    }
+
+    rc->name = u.host;
+
+    peer = peers->peers.elts;
+    found = 0;
+
+    for (i = 0; i < peers->peers.nelts; i++) {
+
+        if (peer[i].upstream_name != &us->host || peer[i].dynamic
+            || peer[i].peer_addr->sockaddr->sa_family != AF_INET)
+        {
+            continue;
+        }
+
+        sin = (struct sockaddr_in *) peer[i].peer_addr->sockaddr;
+
+        for (j = 0; j < u.naddrs; j++) {
+
+            if (u.addrs[j].sockaddr->sa_family == AF_INET
+                && ((struct sockaddr_in *) u.addrs[j].sockaddr)->sin_addr.s_addr
+                   == sin->sin_addr.s_addr)
+            {
+                peer[i].resolve = rc;
+                found++;
+                break;
+            }
+        }
+    }
+
+    if (found == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no server of upstream \"%V\" is at \"%V\"",
+                           &us->host, &rc->name);
+        return NGX_ERROR;
+    }
+
+    rc->index = peers->resolves.nelts;
+
+    rcp = ngx_array_push(&peers->resolves);
+    if (rcp == NULL) {
+        return NGX_ERROR;
+    }
+
+    *rcp = rc;
+
+    return NGX_OK;
+}
+
+
+/* the peers with the same IP address share a host_index */
+static ngx_int_t
+ngx_http_upstream_check_group_hosts(ngx_conf_t *cf,
+        ngx_http_check_peers_t *peers)
+{
+    ngx_uint_t               i, n;
+    ngx_http_check_peer_t   *peer, **sorted, *prev;
+
+    n = peers->peers.nelts;
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    sorted = ngx_palloc(cf->temp_pool, n * sizeof(ngx_http_check_peer_t *));
+    if (sorted == NULL) {
+        return NGX_ERROR;
+    }
+
+    peer = peers->peers.elts;
+
+    for (i = 0; i < n; i++) {
+        peer[i].host_index = NGX_HTTP_CHECK_NO_HOST;
+        sorted[i] = &peer[i];
+    }
+
+    ngx_qsort(sorted, n, sizeof(ngx_http_check_peer_t *),
+              ngx_http_upstream_check_cmp_hosts);
+
+    prev = NULL;
+    peers->nhosts = 0;
+
+    for (i = 0; i < n; i++) {
+
+        switch (sorted[i]->peer_addr->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+#endif
+        case AF_INET:
+            break;
+
+        default:
+            continue;
+        }
+
+        if (prev == NULL
+            || ngx_http_upstream_check_cmp_hosts(&prev, &sorted[i]) != 0)
+        {
+            peers->nhosts++;
+        }
+
+        sorted[i]->host_index = peers->nhosts - 1;
+        prev = sorted[i];
+    }
+
+    return NGX_OK;
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_upstream_check_cmp_hosts(const void *one, const void *two)
+{
+    struct sockaddr         *first, *second;
+    struct sockaddr_in      *sin1, *sin2;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6     *sin61, *sin62;
+#endif
+
+    first = (*(ngx_http_check_peer_t **) one)->peer_addr->sockaddr;
+    second = (*(ngx_http_check_peer_t **) two)->peer_addr->sockaddr;
+
+    if (first->sa_family != second->sa_family) {
+        return first->sa_family < second->sa_family ? -1 : 1;
+    }
+
+    switch (first->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin61 = (struct sockaddr_in6 *) first;
+        sin62 = (struct sockaddr_in6 *) second;
+
+        return ngx_memcmp(&sin61->sin6_addr, &sin62->sin6_addr, 16);
+#endif
+
+    case AF_INET:
+        sin1 = (struct sockaddr_in *) first;
+        sin2 = (struct sockaddr_in *) second;
+
+        return ngx_memcmp(&sin1->sin_addr, &sin2->sin_addr,
+                          sizeof(struct in_addr));
+
+    default:
+        return 0;
+    }
+}
+
+
+static char *
+ngx_http_upstream_check_status(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t                *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    clcf->handler = ngx_http_upstream_check_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_upstream_check_control(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t                *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    clcf->handler = ngx_http_upstream_check_control_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_upstream_check_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_check_main_conf_t  *ucmcf;
+
+    ucmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_check_main_conf_t));
+    if (ucmcf == NULL) {
+        return NULL;
+    }
+
+    ucmcf->peers = ngx_pcalloc(cf->pool, sizeof(ngx_http_check_peers_t));
+    if (ucmcf->peers == NULL) {
+        return NULL;
+    }
+
+    ucmcf->peers->checksum = 0;
+
+    ucmcf->check_max_lag = NGX_CONF_UNSET_MSEC;
+    ucmcf->check_journal_size = NGX_CONF_UNSET_UINT;
+
+    if (ngx_array_init(&ucmcf->peers->peers, cf->pool, 16,
+                sizeof(ngx_http_check_peer_t)) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&ucmcf->peers->upstreams, cf->pool, 4,
+                sizeof(ngx_http_check_upstream_t)) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&ucmcf->peers->resolves, cf->pool, 1,
+                sizeof(ngx_http_check_resolve_conf_t *)) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return ucmcf;
+}
+
+
+static char *
+ngx_http_upstream_check_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_uint_t                            i;
+    ngx_http_upstream_srv_conf_t        **uscfp;
+    ngx_http_upstream_main_conf_t        *umcf;
+    ngx_http_upstream_check_main_conf_t  *ucmcf = conf;
+
+    if (ucmcf->check_max_lag == NGX_CONF_UNSET_MSEC) {
+        ucmcf->check_max_lag = 0;
+    }
+
+    ucmcf->peers->max_lag = ucmcf->check_max_lag;
+
+    if (ucmcf->check_journal_size == NGX_CONF_UNSET_UINT) {
+        ucmcf->check_journal_size = 1024;
+    }
+
+    if (ucmcf->check_journal_size == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "check_journal_size must be greater than 0");
+        return NGX_CONF_ERROR;
+    }
+
+    ucmcf->peers->journal_size = ucmcf->check_journal_size;
+    ucmcf->peers->notify = ucmcf->check_notify;
+    ucmcf->peers->statsd = ucmcf->check_statsd;
+    ucmcf->peers->syslog = ucmcf->check_syslog;
+    ucmcf->peers->shared_file = ucmcf->check_shared_file;
+    ucmcf->peers->shared_slots = ucmcf->check_shared_slots;
+    ucmcf->peers->gossip = ucmcf->check_gossip;
+    ucmcf->peers->suspect = ucmcf->check_host_suspect;
+    ucmcf->peers->budget = ucmcf->check_probe_budget;
+
+    /* the transitions are reported to syslog, the failed probes are noise */
+    if (ucmcf->check_syslog) {
+        ucmcf->peers->probe_log_level = NGX_LOG_INFO;
+        ucmcf->peers->probe_log_error = NGX_ERROR_INFO;
+
+    } else {
+        ucmcf->peers->probe_log_level = NGX_LOG_ERR;
+        ucmcf->peers->probe_log_error = NGX_ERROR_ERR;
+    }
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
 
         if (ngx_http_upstream_check_init_srv_conf(cf, uscfp[i]) != NGX_OK) {
             return NGX_CONF_ERROR;
         }
+
+        if (ngx_http_upstream_check_wrap(cf, ucmcf, uscfp[i])
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_http_upstream_check_add_slots(cf, ucmcf->peers, uscfp[i])
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_http_upstream_check_follow_name(cf, ucmcf->peers, uscfp[i])
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (ngx_http_upstream_check_assign_zones(cf, ucmcf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ucmcf->check_host_suspect
+        && ngx_http_upstream_check_group_hosts(cf, ucmcf->peers) != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
     }
 
     return ngx_http_upstream_check_init_shm(cf, conf);
@@ -479,6 +2949,8 @@ ngx_http_upstream_check_create_srv_conf(ngx_conf_t *cf)
     ucscf->rise_count = NGX_CONF_UNSET_UINT;
     ucscf->check_timeout = NGX_CONF_UNSET_MSEC;
     ucscf->check_type_conf = NGX_CONF_UNSET_PTR;
+    ucscf->dynamic = NGX_CONF_UNSET_UINT;
+    ucscf->failback = NGX_CONF_UNSET_MSEC;
 
     return ucscf;
 }
@@ -517,6 +2989,15 @@ ngx_http_upstream_check_init_srv_conf(ngx_conf_t *cf, void *conf)
         ucscf->check_type_conf = NULL;
     }
 
+    if (ucscf->dynamic == NGX_CONF_UNSET_UINT) {
+        ucscf->dynamic = 0;
+    }
+
+    if (ucscf->failback == NGX_CONF_UNSET_MSEC) {
+        ucscf->failback = 10000;
+        ucscf->failback_up = 1;
+    }
+
     check = ucscf->check_type_conf;
     if (check) {
         if (ucscf->send.len == 0) {
@@ -67,14 +67,121 @@ struct check_conf_s {
     unsigned need_pool;
 };
 
+typedef struct {
+    /* either the url or the command is set */
+    ngx_url_t                        url;
+    ngx_str_t                        command;
+
+    ngx_msec_t                       interval;
+    ngx_uint_t                       batch;
+    /* the times a failed batch is sent again before it is dropped */
+    ngx_uint_t                       retries;
+} ngx_http_check_notify_conf_t;
+
+typedef struct {
+    ngx_url_t                        url;
+    ngx_str_t                        prefix;
+
+    ngx_msec_t                       interval;
+    size_t                           size;
+    ngx_flag_t                       dogstatsd;
+} ngx_http_check_statsd_conf_t;
+
+typedef struct {
+    ngx_url_t                        url;
+    ngx_str_t                        tag;
+
+    ngx_msec_t                       interval;
+    ngx_uint_t                       facility;
+    ngx_uint_t                       severity;
+} ngx_http_check_syslog_conf_t;
+
+typedef struct {
+    ngx_uint_t                       failures;
+    ngx_msec_t                       window;
+    ngx_msec_t                       hold;
+} ngx_http_check_suspect_conf_t;
+
+typedef struct {
+    /* the probes of all the peers, per second */
+    ngx_uint_t                       rate;
+    /* the bounds of the interval of a peer */
+    ngx_msec_t                       min;
+    ngx_msec_t                       max;
+} ngx_http_check_budget_conf_t;
+
+typedef struct {
+    in_port_t                        port;
+    ngx_msec_t                       interval;
+    ngx_str_t                        send;
+} ngx_http_check_agent_conf_t;
+
+typedef struct {
+    /* the host name only, the port is the one of each server */
+    ngx_str_t                        name;
+    ngx_msec_t                       interval;
+    /* the position in peers->resolves */
+    ngx_uint_t                       index;
+} ngx_http_check_resolve_conf_t;
+
+typedef struct {
+    /* ngx_str_t, the whole requests built from the lines of the file */
+    ngx_array_t                      requests;
+    /* the requests to send, in turn, before the peer is up */
+    ngx_uint_t                       count;
+    ngx_msec_t                       interval;
+    ngx_msec_t                       timeout;
+} ngx_http_check_warmup_conf_t;
+
+typedef struct {
+    /* all the nodes including this one, sorted by the address */
+    ngx_addr_t                      *nodes;
+    ngx_uint_t                       nnodes;
+    ngx_uint_t                       self;
+
+    ngx_msec_t                       interval;
+    ngx_uint_t                       local;
+
+    /* the secret of the digests, padded to a block for HMAC-MD5 */
+    u_char                           key[64];
+} ngx_http_check_gossip_conf_t;
+
+typedef struct {
+    ngx_str_t                        name;
+    /* ngx_cidr_t */
+    ngx_array_t                      cidrs;
+} ngx_http_check_zone_conf_t;
+
+typedef struct {
+    struct sockaddr                 *sockaddr;
+    socklen_t                        socklen;
+    ngx_uint_t                       index;
+    ngx_uint_t                       backup;
+} ngx_http_check_wrap_peer_t;
+
 typedef struct {
     ngx_uint_t                       check_shm_size;
+    ngx_msec_t                       check_max_lag;
+    ngx_uint_t                       check_journal_size;
+    ngx_http_check_notify_conf_t    *check_notify;
+    ngx_http_check_statsd_conf_t    *check_statsd;
+    ngx_http_check_syslog_conf_t    *check_syslog;
+    ngx_http_check_gossip_conf_t    *check_gossip;
+    ngx_http_check_suspect_conf_t   *check_host_suspect;
+    ngx_http_check_budget_conf_t    *check_probe_budget;
+    ngx_str_t                        check_shared_file;
+    ngx_uint_t                       check_shared_slots;
+    /* ngx_http_check_zone_conf_t, NULL unless check_zone is set */
+    ngx_array_t                     *check_zones;
+    ngx_str_t                        check_local_zone;
+    ngx_uint_t                       check_local_healthy;
     ngx_http_check_peers_t          *peers;
 } ngx_http_upstream_check_main_conf_t;
 
 typedef struct {
     ngx_uint_t                       fall_count;
     ngx_uint_t                       rise_count;
+    ngx_uint_t                       flap_threshold;
     ngx_msec_t                       check_interval;
     ngx_msec_t                       check_timeout;
 
@@ -87,11 +194,39 @@ typedef struct {
     } code;
 
     ngx_uint_t                       default_down;
+
+    /* NULL unless check_agent is set */
+    ngx_http_check_agent_conf_t     *agent;
+
+    /* the spare slots for the servers added at run time */
+    ngx_uint_t                       dynamic;
+
+    /* NULL unless check_resolve is set */
+    ngx_http_check_resolve_conf_t   *resolve;
+
+    /* NULL unless check_warmup is set */
+    ngx_http_check_warmup_conf_t    *warmup;
+
+    /* the primary servers up for this long fail the upstream back */
+    ngx_msec_t                       failback;
+    ngx_uint_t                       failback_up;
+
+    /*
+     * The balancer of the upstream did not register its servers, the
+     * module asks it for another peer while the one it picks is down.
+     * The servers are sorted by the address of their sockaddr.
+     */
+    ngx_http_upstream_init_peer_pt   wrap_init;
+    ngx_http_check_wrap_peer_t      *wrap_peers;
+    ngx_uint_t                       wrap_npeers;
 } ngx_http_upstream_check_srv_conf_t;
 
 
 ngx_uint_t ngx_http_check_add_peer(ngx_conf_t *cf,
         ngx_http_upstream_srv_conf_t *us, ngx_peer_addr_t *peer);
+ngx_uint_t ngx_http_check_register_peer(ngx_http_check_peers_t *peers,
+        ngx_http_upstream_check_srv_conf_t *ucscf, ngx_str_t *upstream_name,
+        ngx_peer_addr_t *peer_addr);
 
 check_conf_t *ngx_http_get_check_type_conf(ngx_str_t *str);
 
@@ -0,0 +1,478 @@
+
+/*
+ * A small TCP stand-in used to profile the error paths of the check
+ * module. It sits between nginx and a backend (or answers with a canned
+ * HTTP response when no backend is given) and damages the response on
+ * purpose:
+ *
+ *   pass       relay everything untouched
+ *   drop       never accept; the listen backlog is stuffed so that the
+ *              kernel drops new SYNs and the checker hits its timeout
+ *   partial    relay the first <bytes> bytes, then stall forever
+ *   drip       relay the response one byte every <delay> milliseconds
+ *   rst        relay the first <bytes> bytes, then reset the connection
+ *   halfclose  relay the first <bytes> bytes, then shutdown(SHUT_WR)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define BUFF_LEN 4096
+
+enum {
+    MODE_PASS = 0,
+    MODE_DROP,
+    MODE_PARTIAL,
+    MODE_DRIP,
+    MODE_RST,
+    MODE_HALFCLOSE
+};
+
+static const char *mode_names[] = {
+    "pass", "drop", "partial", "drip", "rst", "halfclose", NULL
+};
+
+static const char canned_response[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Server: fault_proxy\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 3\r\n"
+    "\r\n"
+    "ok\n";
+
+typedef struct {
+    int         mode;
+    int         listen_port;
+    const char *backend_host;
+    const char *backend_port;
+    size_t      bytes;
+    int         delay;
+    int         verbose;
+} fault_conf_t;
+
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s -l port [-b host:port] [-m mode] [-n bytes] "
+            "[-d delay_ms] [-v]\n"
+            "modes: pass drop partial drip rst halfclose\n", prog);
+    exit(1);
+}
+
+
+static int
+listen_on(int port, int backlog)
+{
+    int                 fd, on;
+    struct sockaddr_in  sin;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        exit(1);
+    }
+
+    on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+        perror("bind");
+        exit(1);
+    }
+
+    if (listen(fd, backlog) == -1) {
+        perror("listen");
+        exit(1);
+    }
+
+    return fd;
+}
+
+
+static int
+connect_to(const char *host, const char *port)
+{
+    int              fd;
+    struct addrinfo  hints, *res;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        return -1;
+    }
+
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd == -1) {
+        freeaddrinfo(res);
+        return -1;
+    }
+
+    if (connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+        close(fd);
+        freeaddrinfo(res);
+        return -1;
+    }
+
+    freeaddrinfo(res);
+
+    return fd;
+}
+
+
+/*
+ * Never accept(2). On Linux a listener with a full accept queue silently
+ * drops incoming SYNs, so fill the queue with our own connections first.
+ */
+static void
+drop_forever(fault_conf_t *conf)
+{
+    int    fd, i;
+    char   port[16];
+
+    fd = listen_on(conf->listen_port, 1);
+
+    snprintf(port, sizeof(port), "%d", conf->listen_port);
+
+    for (i = 0; i < 4; i++) {
+        if (fork() == 0) {
+            /* the connect() that overflows the queue blocks in SYN_SENT */
+            connect_to("127.0.0.1", port);
+            pause();
+            _exit(0);
+        }
+    }
+
+    for ( ;; ) {
+        pause();
+    }
+
+    close(fd);
+}
+
+
+static int
+write_all(int fd, const char *p, size_t n)
+{
+    ssize_t  size;
+
+    while (n > 0) {
+        size = write(fd, p, n);
+        if (size == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        p += size;
+        n -= size;
+    }
+
+    return 0;
+}
+
+
+static void
+reset_connection(int fd)
+{
+    struct linger  l;
+
+    l.l_onoff = 1;
+    l.l_linger = 0;
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+    close(fd);
+}
+
+
+/*
+ * Pass the backend response to the client through the configured fault.
+ * Returns 1 when the fault has consumed the connection.
+ */
+static int
+send_faulty(fault_conf_t *conf, int client, const char *p, size_t n,
+    size_t *sent)
+{
+    size_t  left;
+
+    switch (conf->mode) {
+
+    case MODE_DRIP:
+        while (n--) {
+            if (write_all(client, p++, 1) == -1) {
+                return 1;
+            }
+
+            (*sent)++;
+            usleep(conf->delay * 1000);
+        }
+
+        return 0;
+
+    case MODE_PARTIAL:
+    case MODE_RST:
+    case MODE_HALFCLOSE:
+        left = conf->bytes > *sent ? conf->bytes - *sent : 0;
+
+        if (n < left) {
+            *sent += n;
+            return write_all(client, p, n) == -1;
+        }
+
+        write_all(client, p, left);
+        *sent += left;
+
+        if (conf->mode == MODE_RST) {
+            reset_connection(client);
+            return 1;
+        }
+
+        if (conf->mode == MODE_HALFCLOSE) {
+            shutdown(client, SHUT_WR);
+            return 1;
+        }
+
+        /* partial: stall until the client gives up */
+        return 1;
+
+    default:
+        *sent += n;
+        return write_all(client, p, n) == -1;
+    }
+}
+
+
+static void
+linger_client(int client)
+{
+    char  buf[BUFF_LEN];
+
+    while (read(client, buf, sizeof(buf)) > 0) {
+        /* void */
+    }
+
+    close(client);
+}
+
+
+static void
+serve(fault_conf_t *conf, int client)
+{
+    int            backend, nfds;
+    char           buf[BUFF_LEN];
+    size_t         sent;
+    ssize_t        n;
+    struct pollfd  pfd[2];
+
+    sent = 0;
+    backend = -1;
+
+    if (conf->backend_host) {
+        backend = connect_to(conf->backend_host, conf->backend_port);
+        if (backend == -1) {
+            reset_connection(client);
+            return;
+        }
+    }
+
+    pfd[0].fd = client;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = backend;
+    pfd[1].events = POLLIN;
+    nfds = backend == -1 ? 1 : 2;
+
+    for ( ;; ) {
+        if (poll(pfd, nfds, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        if (pfd[0].revents) {
+            n = read(client, buf, sizeof(buf));
+            if (n <= 0) {
+                break;
+            }
+
+            if (backend != -1) {
+                if (write_all(backend, buf, n) == -1) {
+                    break;
+                }
+
+                continue;
+            }
+
+            if (conf->verbose) {
+                fprintf(stderr, "fault_proxy: %d request bytes\n", (int) n);
+            }
+
+            /* no backend: answer the first read with the canned response */
+            if (send_faulty(conf, client, canned_response,
+                            sizeof(canned_response) - 1, &sent))
+            {
+                goto faulted;
+            }
+
+            break;
+        }
+
+        if (nfds == 2 && pfd[1].revents) {
+            n = read(backend, buf, sizeof(buf));
+            if (n <= 0) {
+                break;
+            }
+
+            if (send_faulty(conf, client, buf, n, &sent)) {
+                goto faulted;
+            }
+        }
+    }
+
+    if (backend != -1) {
+        close(backend);
+    }
+
+    close(client);
+    return;
+
+faulted:
+
+    if (backend != -1) {
+        close(backend);
+    }
+
+    if (conf->mode == MODE_PARTIAL || conf->mode == MODE_HALFCLOSE) {
+        linger_client(client);
+    }
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int           c, i, fd, client, on;
+    char         *colon;
+    fault_conf_t  conf;
+
+    memset(&conf, 0, sizeof(conf));
+    conf.bytes = 8;
+    conf.delay = 100;
+
+    while ((c = getopt(argc, argv, "l:b:m:n:d:v")) != -1) {
+        switch (c) {
+
+        case 'l':
+            conf.listen_port = atoi(optarg);
+            break;
+
+        case 'b':
+            colon = strrchr(optarg, ':');
+            if (colon == NULL) {
+                usage(argv[0]);
+            }
+
+            *colon = '\0';
+            conf.backend_host = optarg;
+            conf.backend_port = colon + 1;
+            break;
+
+        case 'm':
+            for (i = 0; mode_names[i]; i++) {
+                if (strcmp(optarg, mode_names[i]) == 0) {
+                    break;
+                }
+            }
+
+            if (mode_names[i] == NULL) {
+                usage(argv[0]);
+            }
+
+            conf.mode = i;
+            break;
+
+        case 'n':
+            conf.bytes = atoi(optarg);
+            break;
+
+        case 'd':
+            conf.delay = atoi(optarg);
+            break;
+
+        case 'v':
+            conf.verbose = 1;
+            break;
+
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (conf.listen_port <= 0) {
+        usage(argv[0]);
+    }
+
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (conf.mode == MODE_DROP) {
+        drop_forever(&conf);
+        return 0;
+    }
+
+    fd = listen_on(conf.listen_port, 511);
+
+    for ( ;; ) {
+        client = accept(fd, NULL, NULL);
+        if (client == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("accept");
+            return 1;
+        }
+
+        on = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        switch (fork()) {
+
+        case -1:
+            perror("fork");
+            close(client);
+            break;
+
+        case 0:
+            close(fd);
+            serve(&conf, client);
+            _exit(0);
+
+        default:
+            close(client);
+        }
+    }
+
+    return 0;
+}
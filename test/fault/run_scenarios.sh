@@ -0,0 +1,119 @@
+#!/bin/sh
+#
+# Run nginx with the check module against a farm of fault_proxy instances
+# and report how much CPU the workers burn while every peer is failing.
+#
+#   PEERS      number of backend peers per scenario      (default 200)
+#   DURATION   seconds to run each scenario              (default 30)
+#   INTERVAL   check interval in milliseconds            (default 1000)
+#   TIMEOUT    check timeout in milliseconds             (default 500)
+#   TYPE       check type                                (default http)
+#   BASE_PORT  first port used by the proxies            (default 20000)
+#   PERF       if set, record a perf profile per scenario
+#
+# usage: ./run_scenarios.sh [scenario ...]
+# scenarios: pass drop partial drip rst halfclose (default: all of them)
+
+PEERS=${PEERS:-200}
+DURATION=${DURATION:-30}
+INTERVAL=${INTERVAL:-1000}
+TIMEOUT=${TIMEOUT:-500}
+TYPE=${TYPE:-http}
+BASE_PORT=${BASE_PORT:-20000}
+NGINX=${NGINX:-nginx}
+
+DIR=`cd \`dirname $0\` && pwd`
+WORK=$DIR/work
+
+SCENARIOS=${*:-"pass drop partial drip rst halfclose"}
+
+[ -x $DIR/fault_proxy ] || make -C $DIR fault_proxy || exit 1
+
+
+worker_ticks()
+{
+    # utime + stime of all the worker processes, in clock ticks
+    for pid in `pgrep -P \`cat $WORK/logs/nginx.pid\``; do
+        awk '{ print $14 + $15 }' /proc/$pid/stat
+    done | awk '{ s += $1 } END { print s + 0 }'
+}
+
+
+write_conf()
+{
+    mkdir -p $WORK/logs $WORK/conf
+
+    {
+        echo "worker_processes 4;"
+        echo "error_log logs/error.log info;"
+        echo "pid logs/nginx.pid;"
+        echo "events { worker_connections 4096; }"
+        echo "http {"
+        echo "    access_log off;"
+        echo "    upstream faulty {"
+
+        i=0
+        while [ $i -lt $PEERS ]; do
+            echo "        server 127.0.0.1:`expr $BASE_PORT + $i`;"
+            i=`expr $i + 1`
+        done
+
+        echo "        check interval=$INTERVAL rise=2 fall=3 timeout=$TIMEOUT type=$TYPE;"
+        echo "    }"
+        echo "    server {"
+        echo "        listen 127.0.0.1:`expr $BASE_PORT - 1`;"
+        echo "        location /status { check_status; }"
+        echo "        location / { proxy_pass http://faulty; }"
+        echo "    }"
+        echo "}"
+    } > $WORK/conf/nginx.conf
+}
+
+
+run_scenario()
+{
+    mode=$1
+
+    i=0
+    while [ $i -lt $PEERS ]; do
+        $DIR/fault_proxy -l `expr $BASE_PORT + $i` -m $mode -n 10 -d 50 &
+        i=`expr $i + 1`
+    done
+
+    sleep 1
+
+    : > $WORK/logs/error.log
+    $NGINX -p $WORK/ -c conf/nginx.conf || return 1
+    sleep 2
+
+    if [ -n "$PERF" ]; then
+        perf record -g -o $WORK/perf.$mode.data \
+            -p `pgrep -d, -P \`cat $WORK/logs/nginx.pid\`` \
+            -- sleep $DURATION > /dev/null 2>&1 &
+    fi
+
+    before=`worker_ticks`
+    sleep $DURATION
+    after=`worker_ticks`
+
+    $NGINX -p $WORK/ -c conf/nginx.conf -s stop
+    sleep 1
+
+    kill `pgrep -f "$DIR/fault_proxy"` 2> /dev/null
+    wait 2> /dev/null
+
+    timeouts=`grep -c "check time out" $WORK/logs/error.log`
+    errors=`grep -c "\[error\]" $WORK/logs/error.log`
+
+    printf "%-10s %8d %10d %10d\n" $mode `expr $after - $before` \
+           $timeouts $errors
+}
+
+
+write_conf
+
+printf "%-10s %8s %10s %10s\n" scenario cpu_ticks timeouts errors
+
+for s in $SCENARIOS; do
+    run_scenario $s
+done
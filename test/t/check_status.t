@@ -0,0 +1,1170 @@
+#
+#===============================================================================
+#
+#         FILE:  check_status.t
+#
+#  DESCRIPTION: test the check_status page
+#
+#        FILES:  ---
+#         BUGS:  ---
+#        NOTES:  ---
+#===============================================================================
+
+
+# vi:filetype=perl
+
+use lib 'lib';
+use Test::Nginx::Socket;
+use IO::Socket::INET;
+use IO::Select;
+use Digest::MD5 qw(md5);
+use Time::HiRes qw(sleep);
+
+# the status and the body of every request, the error_log and no_error_log
+# patterns, then the assertions of the init code, which runs once a block
+plan tests => repeat_each(2) * (2 * blocks() + 8) + 38;
+
+# 127.0.0.1:1970 and 127.0.0.1:1972 answer the probes from the nginx under
+# test, nothing listens on 127.0.0.1:1971 and 127.0.0.1:1973
+our $Backends = <<'_EOC_';
+    server {
+        listen 127.0.0.1:1970;
+
+        location / {
+            return 200 "1970\n";
+        }
+    }
+
+    server {
+        listen 127.0.0.1:1972;
+
+        location / {
+            return 200 "1972\n";
+        }
+    }
+_EOC_
+
+# the body of a GET request to the nginx under test, or on another port
+sub fetch ($;$) {
+    my ($uri, $port) = @_;
+
+    my $sock = IO::Socket::INET->new(
+        PeerAddr => '127.0.0.1',
+        PeerPort => $port || $Test::Nginx::Util::ServerPort,
+    ) or die "can not connect to nginx: $!\n";
+
+    print $sock "GET $uri HTTP/1.0\r\nHost: localhost\r\n\r\n";
+
+    my $res = do { local $/; <$sock> };
+    close $sock;
+
+    $res =~ s/^.*?\r\n\r\n//s;
+
+    return $res;
+}
+
+# a backend on the port answering the requests with the statuses in turn,
+# until the process returned is stopped; the request lines go to the file
+# read by requests()
+sub backend ($@) {
+    my ($port, @statuses) = @_;
+
+    my $listen = IO::Socket::INET->new(
+        Listen    => 8,
+        ReuseAddr => 1,
+        LocalAddr => "127.0.0.1:$port",
+    ) or die "can not listen on $port: $!\n";
+
+    my $pid = fork();
+    die "can not fork: $!\n" unless defined $pid;
+
+    if ($pid) {
+        close $listen;
+        return $pid;
+    }
+
+    for (my $n = 0; ; $n++) {
+        my $c = $listen->accept or next;
+
+        my $req = '';
+        while ($req !~ /\r\n\r\n/) {
+            last unless sysread $c, $req, 1024, length $req;
+        }
+
+        if (open my $log, ">>$Test::Nginx::Util::HtmlDir/backend-$port.log") {
+            print $log $req =~ /^(.*?)\r\n/ ? "$1\n" : "\n";
+            close $log;
+        }
+
+        my $status = $statuses[$n % @statuses];
+        print $c "HTTP/1.0 $status X\r\nContent-Length: 0\r\n\r\n";
+        close $c;
+    }
+}
+
+# the request lines the backend on the port has taken so far
+sub requests ($) {
+    my $port = shift;
+
+    open my $in, "$Test::Nginx::Util::HtmlDir/backend-$port.log"
+        or return ();
+
+    return <$in>;
+}
+
+# an agent on the port answering every connection with the line, see
+# check_agent, until the process returned is stopped
+sub agent ($$) {
+    my ($port, $line) = @_;
+
+    my $listen = IO::Socket::INET->new(
+        Listen    => 8,
+        ReuseAddr => 1,
+        LocalAddr => "127.0.0.1:$port",
+    ) or die "can not listen on $port: $!\n";
+
+    my $pid = fork();
+    die "can not fork: $!\n" unless defined $pid;
+
+    if ($pid) {
+        close $listen;
+        return $pid;
+    }
+
+    for ( ;; ) {
+        my $c = $listen->accept or next;
+
+        print $c "$line\n";
+        close $c;
+    }
+}
+
+# a DNS server on the port answering every question with the address in
+# the file, until the process returned is stopped
+sub dns ($$) {
+    my ($port, $file) = @_;
+
+    my $sock = IO::Socket::INET->new(
+        LocalAddr => "127.0.0.1:$port",
+        Proto     => 'udp',
+    ) or die "can not bind $port: $!\n";
+
+    my $pid = fork();
+    die "can not fork: $!\n" unless defined $pid;
+
+    if ($pid) {
+        close $sock;
+        return $pid;
+    }
+
+    for ( ;; ) {
+        my $query = '';
+        $sock->recv($query, 512) or next;
+        next if length $query < 12;
+
+        open my $in, $file or next;
+        my $addr = <$in>;
+        close $in;
+        chomp $addr;
+
+        # the question as asked, and one A record for it with a TTL of 0
+        $sock->send(pack('nnnnnn', unpack('n', $query), 0x8180, 1, 1, 0, 0)
+                    . substr($query, 12)
+                    . pack('nnnNn', 0xc00c, 1, 1, 0, 4)
+                    . Socket::inet_aton($addr));
+    }
+}
+
+sub stop ($) {
+    my $pid = shift;
+
+    kill KILL => $pid;
+    waitpid $pid, 0;
+}
+
+# another nginx instance on the port, checking the server with the file
+# shared with the nginx under test
+sub instance ($$) {
+    my ($port, $server) = @_;
+
+    my $html = $Test::Nginx::Util::HtmlDir;
+    my $prefix = "$html/$port";
+
+    mkdir $prefix;
+    mkdir "$prefix/logs";
+
+    open my $out, ">$prefix/nginx.conf"
+        or die "can not write $prefix/nginx.conf: $!\n";
+
+    print $out <<_EOC_;
+daemon on;
+master_process off;
+error_log logs/error.log info;
+pid logs/nginx.pid;
+
+events {
+    worker_connections 64;
+}
+
+http {
+    access_log off;
+
+    check_shared_file $html/check_shared slots=2;
+
+    upstream test{
+        server $server;
+
+        check interval=1000 rise=1 fall=1 timeout=1000 type=http;
+    }
+
+    server {
+        listen 127.0.0.1:$port;
+
+        location /status {
+            check_status;
+        }
+    }
+}
+_EOC_
+
+    close $out;
+
+    system("$Test::Nginx::Util::NginxBinary -p $prefix/ -c $prefix/nginx.conf"
+           . " > /dev/null") == 0
+        or die "can not start nginx on $port\n";
+
+    sleep 0.5;
+
+    open my $in, "$prefix/logs/nginx.pid"
+        or die "can not read the pid of nginx on $port: $!\n";
+
+    my $pid = <$in>;
+    chomp $pid;
+
+    return $pid;
+}
+
+# HMAC-MD5 of the data with the secret, as check_gossip signs a digest
+sub hmac ($$) {
+    my ($secret, $data) = @_;
+
+    my $key = $secret . ("\0" x (64 - length $secret));
+
+    return md5(($key ^ ("\x5c" x 64)) . md5(($key ^ ("\x36" x 64)) . $data));
+}
+
+# stop the nginx under test for a while, so its timers fire late, and
+# run the code given while it is stopped
+sub freeze ($;&) {
+    my ($seconds, $code) = @_;
+
+    my $pid = Test::Nginx::Util::get_pid_from_pidfile('freeze');
+
+    kill STOP => $pid;
+    $code->() if $code;
+    sleep $seconds;
+    kill CONT => $pid;
+}
+
+no_root_location();
+#no_diff;
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: the probes are timed by phase and the shared locks counted
+--- http_config eval
+$::Backends . q{
+    upstream test{
+        server 127.0.0.1:1970;
+        server 127.0.0.1:1971;
+
+        check interval=1000 rise=1 fall=1 timeout=1000 type=http;
+    }
+}
+--- config
+    location /status {
+        check_status;
+    }
+
+--- request
+GET /status
+--- response_body_like: <h2>Check counters</h2>.*?</tr>\s*<tr>\s*(?:<td>\d+</td>\s*){9}<td>[1-9]\d*/\d+</td>.*<td>http</td>\s*<td>[1-9]\d*</td>\s*<td>(?:/?\d+\(\d+\))+</td>
+
+=== TEST 2: the probes and the transitions are counted
+--- http_config eval
+$::Backends . q{
+    upstream test{
+        server 127.0.0.1:1970;
+        server 127.0.0.1:1971;
+
+        check interval=1000 rise=1 fall=1 timeout=1000 type=http;
+    }
+}
+--- config
+    location /status {
+        check_status;
+    }
+
+--- request
+GET /status
+--- response_body_like: <h2>Check counters</h2>.*?</tr>\s*<tr>\s*<td>[1-9]\d*</td>\s*<td>[1-9]\d*</td>\s*<td>[1-9]\d*</td>\s*(?:<td>\d+</td>\s*){5}<td>1</td>
+
+=== TEST 3: the timeouts of a frozen worker are ignored by check_max_lag
+--- http_config eval
+$::Backends . q{
+    check_max_lag 1000;
+
+    upstream test{
+        server 127.0.0.1:1970;
+        server 127.0.0.1:1973;
+
+        check interval=1000 rise=1 fall=1 timeout=3000 type=http;
+    }
+}
+--- config
+    location /status {
+        check_status;
+    }
+
+--- init
+# a backend which takes the probes and never answers
+my $hang = IO::Socket::INET->new(Listen => 8, ReuseAddr => 1,
+                                 LocalAddr => '127.0.0.1:1973')
+    or die "can not listen on 1973: $!\n";
+
+sleep 1;
+::freeze(4);
+sleep 0.5;
+
+# the status page then counts no timeout failure but the lag, the probes
+# deferred and the timeouts ignored (lag)
+--- request
+GET /status
+--- response_body_like: <h2>Check counters</h2>.*?</tr>\s*<tr>\s*(?:<td>\d+</td>\s*){3}<td>0</td>\s*(?:<td>[^<]*</td>\s*){6}<td>\d+/\d{4,}</td>\s*<td>[1-9]\d*</td>\s*<td>[1-9]\d*</td>
+
+=== TEST 4: the journal lists the transitions after the since number
+--- http_config eval
+$::Backends . q{
+    check_journal_size 16;
+
+    upstream test{
+        server 127.0.0.1:1970;
+        server 127.0.0.1:1971;
+        server 127.0.0.1:1973;
+
+        check interval=1000 rise=1 fall=1 timeout=1000 default_down=false type=http;
+    }
+}
+--- config
+    location /status {
+        check_status;
+    }
+
+--- request
+GET /status?since=1
+--- response_body_like: ^next=3\nseq=2 time=\d+\.\d{3} index=[12] upstream=test name=127\.0\.0\.1:197[13] from=up to=down reason=connect latency=\d+\n$
+
+=== TEST 5: the status page shows the last result of each server
+--- http_config eval
+$::Backends . q{
+    upstream test{
+        server 127.0.0.1:1970;
+        server 127.0.0.1:1971;
+
+        check interval=1000 rise=1 fall=1 timeout=1000 type=http;
+    }
+}
+--- config
+    location /status {
+        check_status;
+    }
+
+--- request
+GET /status
+--- response_body_like: <td>0</td>\s*<td>test</td>\s*<td>127\.0\.0\.1:1970</td>\s*<td>up</td>\s*<td>[1-9]\d*</td>\s*<td>0</td>\s*<td>ok</td>\s*<td>200</td>\s*<td>\d+</td>\s*<td>\d+</td>\s*<td>[0-9a-f]{16}</td>.*<td>1</td>\s*<td>test</td>\s*<td>127\.0\.0\.1:1971</td>\s*<td>down</td>\s*<td>0</td>\s*<td>[1-9]\d*</td>\s*<td>connect</td>\s*<td>0</td>\s*<td>\d+</td>\s*<td>\d+</td>\s*<td>[0-9a-f]{16}</td>
+
+=== TEST 6: the journal shows the transitions as lines of fields
+--- http_config eval
+$::Backends . q{
+    upstream test{
+        server 127.0.0.1:1970;
+        server 127.0.0.1:1971;
+
+        check interval=1000 rise=1 fall=1 timeout=1000 type=http;
+    }
+}
+--- config
+    location /status {
+        check_status;
+    }
+
+--- request
+GET /status?since=0
+--- response_body_like: ^next=2\nseq=1 time=\d+\.\d{3} index=0 upstream=test name=127\.0\.0\.1:1970 from=down to=up reason=ok latency=\d+\n$
+
+=== TEST 7: a flapping server is held down
+--- http_config eval
+$::Backends . q{
+    upstream test{
+        server 127.0.0.1:1973;
+
+        check interval=500 rise=1 fall=1 timeout=1000 flap=4 type=http;
+    }
+}
+--- config
+    location /status {
+        check_status;
+    }
+
+--- init
+# the server passes every other probe, it comes up and goes down twice
+# before the flap score of 4 holds it down
+my $backend = ::backend(1973, 200, 500);
+sleep 6;
+::stop($backend);
+--- request
+GET /status
+--- response_body_like: <td>127\.0\.0\.1:1973</td>\s*<td>down</td>\s*(?:<td>[^<]*</td>\s*){6}<td>[0-9a-f]{16}</td>\s*<td>(?:[4-9]|\d\d)</td>.*<h2>Check counters</h2>.*?</tr>\s*<tr>\s*(?:<td>\d+</td>\s*){8}<td>4</td>
+
+=== TEST 8: a batch which check_notify failed to deliver is sent again
+--- http_config eval
+my $dir = $Test::Nginx::Util::HtmlDir;
+
+$::Backends . qq{
+    check_notify 'exec=if test -e $dir/failed; then echo "\$NGX_CHECK_EVENTS" >> $dir/events.txt; else touch $dir/failed; exit 1; fi' interval=1000 retries=2;
+
+    upstream test{
+        server 127.0.0.1:1970;
+        server 127.0.0.1:1971;
+
+        check interval=1000 rise=1 fall=1 timeout=1000 type=http;
+    }
+}
+--- config
+    location / {
+    }
+
+--- request
+GET /events.txt
+--- response_body_like: ^\{"events":\[\{"seq":1,"time":\d+\.\d{3},"upstream":"test","server":"127\.0\.0\.1:1970","from":"down","to":"up","reason":"ok","latency":\d+\}\]\}\n$
+--- error_log
+exited with 1
+--- no_error_log eval
+["SIGCHLD", "unknown process"]
+
+=== TEST 9: check_statsd pushes the gauges and counters
+--- http_config eval
+$::Backends . q{
+    check_statsd 127.0.0.1:1974 interval=1000 prefix=test;
+
+    upstream test{
+        server 127.0.0.1:1970;
+        server 127.0.0.1:1971;
+
+        check interval=1000 rise=1 fall=1 timeout=1000 type=http;
+    }
+}
+--- config
+    location /status {
+        check_status;
+    }
+
+--- init
+my $agent = IO::Socket::INET->new(Proto => 'udp',
+                                  LocalAddr => '127.0.0.1:1974')
+    or die "can not bind 1974: $!\n";
+
+my $select = IO::Select->new($agent);
+my $got = '';
+
+while ($got !~ /^test\.started:/m && $select->can_read(3)) {
+    $agent->recv(my $datagram, 65536);
+    $got .= $datagram;
+}
+
+Test::More::like($got, qr/^test\.test\.up:1\|g\ntest\.test\.down:1\|g$/m,
+                 "statsd - the servers up and down");
+Test::More::like($got, qr/^test\.test\.probes:[1-9]\d*\|c$/m,
+                 "statsd - the probes of the interval");
+Test::More::like($got, qr/^test\.started:[1-9]\d*\|c$/m,
+                 "statsd - the probes started");
+--- request
+GET /status
+--- response_body_like: <h2>Check counters</h2>.*?</tr>\s*<tr>\s*(?:<td>[^<]*</td>\s*){14}<td>[1-9]\d*/\d+</td>
+
+=== TEST 10: check_syslog sends one message for the servers up together
+--- http_config eval
+$::Backends . q{
+    check_syslog 127.0.0.1:1974 facility=local1 level=notice interval=1000;
+
+    upstream test{
+        server 127.0.0.1:1970;
+        server 127.0.0.1:1971;
+        server 127.0.0.1:1973;
+
+        check interval=1000 rise=1 fall=1 timeout=1000 type=http;
+    }
+}
+--- config
+    location /status {
+        check_status;
+    }
+
+--- init
+my $syslogd = IO::Socket::INET->new(Proto => 'udp',
+                                    LocalAddr => '127.0.0.1:1974')
+    or die "can not bind 1974: $!\n";
+
+# both servers come up as soon as nginx runs again, in the same interval
+my @backends;
+::freeze(2, sub { @backends = (::backend(1971, 200), ::backend(1973, 200)) });
+
+my $select = IO::Select->new($syslogd);
+my $got = '';
+
+while ($got !~ /state="up"/ && $select->can_read(4)) {
+    $syslogd->recv(my $datagram, 65536);
+    $got .= "$datagram\n";
+}
+
+::stop($_) for @backends;
+
+Test::More::like($got, qr/^<141>1 \d{4}-\d\d-\d\dT\d\d:\d\d:\d\d\.\d{3}Z \S+ nginx \d+ check \[check\@32473 upstream="test" state="up" peers="2" reason="ok"\] 2 peers of upstream test up$/m,
+                 "syslog - one message for the two servers");
+--- request
+GET /status
+--- response_body_like: <h2>Check counters</h2>.*?</tr>\s*<tr>\s*(?:<td>[^<]*</td>\s*){15}<td>[1-9]\d*/\d+/\d+</td>
+
+=== TEST 11: the slots in the check file of an instance gone are reused
+--- http_config eval
+$::Backends . qq{
+    check_shared_file $Test::Nginx::Util::HtmlDir/check_shared slots=2;
+
+    upstream test{
+        server 127.0.0.1:1970;
+
+        check interval=1000 rise=1 fall=1 timeout=1000 type=http;
+    }
+}
+--- config
+    location /status {
+        check_status;
+    }
+
+--- init
+# the file of two slots is full with this instance and the one killed
+my $gone = ::instance(1985, '127.0.0.1:1972');
+kill KILL => $gone;
+
+# the next instance gets the slot of the one killed
+my $next = ::instance(1986, '127.0.0.1:1973');
+sleep 2;
+
+my $status = ::fetch('/status', 1986);
+kill QUIT => $next;
+
+Test::More::like($status, qr{<td>127\.0\.0\.1:1973</td>\s*(?:<td>[^<]*</td>\s*){9}<td>probe</td>},
+                 "shared - the slot of the instance killed is reused");
+--- request
+GET /status
+--- response_body_like: <td>127\.0\.0\.1:1970</td>\s*(?:<td>[^<]*</td>\s*){9}<td>probe</td>
+
+=== TEST 12: the gossip digests carry the HMAC of the secret
+--- http_config eval
+$::Backends . q{
+    check_gossip 127.0.0.1:1975 node=127.0.0.1:1976 interval=1000 local=100
+                 secret=s3cret;
+
+    upstream test{
+        server 127.0.0.1:1970;
+        server 127.0.0.1:1972;
+
+        check interval=500 rise=1 fall=1 timeout=1000 type=http;
+    }
+}
+--- config
+    location /status {
+        check_status;
+    }
+
+--- init
+# the other node is played here, it splits the peers by the parity of
+# their keys with the nginx under test
+my $node = IO::Socket::INET->new(LocalAddr => '127.0.0.1:1976',
+                                 Proto => 'udp')
+    or die "can not bind 127.0.0.1:1976: $!\n";
+my $to = Socket::pack_sockaddr_in(1975, Socket::inet_aton('127.0.0.1'));
+
+my $digest = '';
+$node->recv($digest, 1500) if IO::Select->new($node)->can_read(3);
+
+my $mac = substr($digest, -16, 16, '');
+Test::More::is(unpack('H*', $mac), unpack('H*', ::hmac('s3cret', $digest)),
+               "gossip - the digest carries its HMAC");
+
+my ($magic, $count) = unpack('NN', $digest);
+my @keys = map { unpack('N', substr($digest, 8 + 8 * $_, 4)) } 0 .. $count - 1;
+
+# a digest of the peers down without the secret is rejected
+my $forged = pack('NN', $magic, scalar @keys)
+             . join('', map { pack('Nnn', $_, 0x8001, 0) } @keys);
+$node->send($forged . ::hmac('guess', $forged), 0, $to);
+sleep 1;
+
+Test::More::unlike(::fetch('/status'), qr{<td>down</td>},
+                   "gossip - the digest forged is rejected");
+
+# the peers the other node probes take its word with the secret
+for (1 .. 4) {
+    $node->send($forged . ::hmac('s3cret', $forged), 0, $to);
+    sleep 0.5;
+}
+
+my $down = () = ::fetch('/status') =~ m{<td>down</td>}g;
+Test::More::is($down, scalar(grep { $_ % 2 } @keys),
+               "gossip - the peers of the other node follow its digests");
+--- request
+GET /status
+--- response_body_like: <td>2/2, \d+/\d+/[1-9]\d*/[1-9]\d*</td>
+
+=== TEST 13: the agent takes the servers out and scales their weight
+--- http_config eval
+$::Backends . q{
+    upstream test{
+        server 127.0.0.1:1970;
+        server 127.0.0.1:1972;
+
+        check interval=1000 rise=1 fall=1 timeout=1000 type=http;
+        check_agent 1977 interval=500;
+    }
+}
+--- config
+    location / {
+        proxy_pass http://test;
+    }
+
+    location /status {
+        check_status;
+    }
+
+--- init
+my $agent = ::agent(1977, 'down');
+sleep 1.5;
+
+Test::More::like(::fetch('/'), qr/502 Bad Gateway/,
+                 "agent - no server is taken while the agent says down");
+
+::stop($agent);
+$agent = ::agent(1977, 'up 50%');
+sleep 1.5;
+
+Test::More::like(::fetch('/status'),
+                 qr{<td>127\.0\.0\.1:1970</td>\s*(?:<td>[^<]*</td>\s*){10}<td>50%, 0 failed</td>},
+                 "agent - the weight is scaled as the agent says");
+
+::stop($agent);
+--- request
+GET /
+--- response_body_like: ^197[02]$
+
+=== TEST 14: the requests follow the weight the agent reports
+--- http_config eval
+$::Backends . q{
+    server {
+        listen 127.0.0.2:1972;
+
+        location / {
+            return 200 "other\n";
+        }
+    }
+
+    upstream test{
+        server 127.0.0.1:1970 weight=10;
+        server 127.0.0.2:1972 weight=10;
+
+        check interval=1000 rise=1 fall=1 timeout=1000 type=http;
+        check_agent 1977 interval=500;
+    }
+}
+--- config
+    location / {
+        proxy_pass http://test;
+    }
+
+--- init
+# only the agent of 127.0.0.1 answers, the other server keeps 100%
+my $agent = ::agent(1977, 'up 10%');
+sleep 1.5;
+
+my $n = () = join('', map { ::fetch('/') } 1 .. 22) =~ /^1970$/mg;
+
+Test::More::ok($n <= 4,
+               "agent weight - the server at 10% gets a tenth of the requests");
+
+::stop($agent);
+$agent = ::agent(1977, 'up 100%');
+sleep 1.5;
+
+$n = () = join('', map { ::fetch('/') } 1 .. 22) =~ /^1970$/mg;
+
+Test::More::ok($n >= 6,
+               "agent weight - the server gets its share again at 100%");
+
+::stop($agent);
+--- request
+GET /
+--- response_body_like: ^(?:1970|other)$
+
+=== TEST 15: a server drained through check_control gets no new requests
+--- http_config eval
+$::Backends . q{
+    upstream test{
+        server 127.0.0.1:1970;
+        server 127.0.0.1:1972;
+
+        check interval=1000 rise=1 fall=1 timeout=1000 type=http;
+    }
+
+    upstream lone {
+        server 127.0.0.1:1970;
+
+        check interval=1000 rise=1 fall=1 timeout=1000 type=http;
+    }
+}
+--- config
+    location / {
+        proxy_pass http://test;
+    }
+
+    location /lone {
+        proxy_pass http://lone;
+    }
+
+    location /control {
+        check_control;
+    }
+
+--- init
+my $drain = '/control?upstream=test&server=127.0.0.1:1970&drain=';
+
+Test::More::is(::fetch($drain . 'on'),
+               "index=0 upstream=test name=127.0.0.1:1970 drain=on\n",
+               "drain - the control tells the server drained");
+
+Test::More::is(join('', map { ::fetch('/') } 1 .. 4), "1972\n" x 4,
+               "drain - the server draining gets no new requests");
+
+::fetch($drain . 'off');
+
+Test::More::like(join('', map { ::fetch('/') } 1 .. 4), qr/^1970$/m,
+                 "drain - the server gets requests again once undrained");
+
+::fetch('/control?upstream=lone&server=127.0.0.1:1970&drain=on');
+
+Test::More::like(::fetch('/lone'), qr/502 Bad Gateway/,
+                 "drain - the only server drained gets no new requests");
+
+::fetch($drain . 'on');
+--- request
+GET /
+--- response_body_like: ^1972$
+
+=== TEST 16: the probes of a suspect host fail fast until one connects
+--- http_config
+    check_host_suspect failures=2 window=3000 hold=10000;
+
+    upstream test{
+        server 127.0.0.1:1971;
+        server 127.0.0.1:1973;
+
+        check interval=500 rise=1 fall=1 timeout=1000 type=http;
+    }
+
+--- config
+    location /status {
+        check_status;
+    }
+
+--- init
+Test::More::like(::fetch('/status'), qr{<td>1/1, [1-9]\d*</td>},
+                 "suspect - the host is suspect and its probes fail fast");
+
+# the next canary connects, whichever server it probes
+my @backends = (::backend(1971, 200), ::backend(1973, 200));
+sleep 5;
+
+Test::More::like(::fetch('/status'), qr{<td>0/1, [1-9]\d*</td>},
+                 "suspect - the host is cleared by the canary");
+
+::stop($_) for @backends;
+--- request
+GET /status
+--- response_body_like: <td>[01]/[12], [1-9]\d*</td>
+--- error_log eval
+[qr/check host of peer: 127\.0\.0\.1:197[13] is suspect after 2 failed connects in 3000 ms/,
+ qr/check host of peer: 127\.0\.0\.1:197[13] is no longer suspect/]
+
+=== TEST 17: a server in a check_dynamic slot is checked, moved and removed
+--- http_config eval
+$::Backends . q{
+    upstream test{
+        server 127.0.0.1:1970;
+
+        check interval=500 rise=1 fall=1 timeout=1000 type=http;
+        check_dynamic 2;
+    }
+}
+--- config
+    location /control {
+        check_control;
+    }
+
+    location /status {
+        check_status;
+    }
+
+--- init
+Test::More::is(::fetch('/control?upstream=test&add=127.0.0.1:1972'),
+               "index=16777217 upstream=test name=127.0.0.1:1972\n",
+               "dynamic - the server is added to the first slot");
+sleep 1.5;
+
+Test::More::like(::fetch('/status'),
+                 qr{<td>127\.0\.0\.1:1972</td>\s*<td>up</td>},
+                 "dynamic - the server added is checked");
+
+my $moved = ::fetch('/control?index=16777217&address=127.0.0.1:1973');
+my ($index) = $moved =~ /^index=(\d+) upstream=test name=127\.0\.0\.1:1973$/;
+
+Test::More::ok($index && $index != 16777217,
+               "dynamic - the slot moved has another check_index");
+sleep 1.5;
+
+my $status = ::fetch('/status');
+
+Test::More::ok($status =~ m{<td>127\.0\.0\.1:1973</td>\s*<td>down</td>}
+               && $status !~ /127\.0\.0\.1:1972/,
+               "dynamic - the slot moved checks its new server");
+
+Test::More::is(::fetch("/control?remove=$index"), "index=$index removed\n",
+               "dynamic - the slot is freed");
+--- request
+GET /status
+--- response_body_like: \A(?s)(?!.*127\.0\.0\.1:197[23]).*<td>127\.0\.0\.1:1970</td>
+
+=== TEST 18: check_resolve moves the server to the address of the answer
+--- http_config eval
+$::Backends . q{
+    resolver 127.0.0.1:1953 valid=1s;
+
+    upstream test{
+        server localhost:1970;
+
+        check interval=500 rise=1 fall=1 timeout=1000 type=http;
+        check_resolve localhost interval=1000;
+    }
+}
+--- config
+    location / {
+        proxy_pass http://test;
+    }
+
+    location /status {
+        check_status;
+    }
+
+--- init
+my $file = "$Test::Nginx::Util::HtmlDir/dns";
+
+my $answer = sub {
+    open my $out, ">$file" or die "can not write $file: $!\n";
+    print $out "$_[0]\n";
+    close $out;
+};
+
+# nothing listens on 127.0.0.2:1970
+$answer->('127.0.0.2');
+my $dns = ::dns(1953, $file);
+sleep 3;
+
+Test::More::like(::fetch('/status'), qr{:1970</td>\s*<td>down</td>},
+                 "resolve - the server moved away is checked at its new address");
+
+$answer->('127.0.0.1');
+sleep 3;
+::stop($dns);
+
+Test::More::like(::fetch('/status'), qr{:1970</td>\s*<td>up</td>},
+                 "resolve - the server moved back is up again");
+
+Test::More::is(::fetch('/'), "1970\n",
+               "resolve - the round robin follows the address");
+--- request
+GET /status
+--- response_body_like: <td>[1-9]\d*/\d+, 2</td>
+--- error_log eval
+[qr/check resolve: \S+:1970 of upstream test is now at 127\.0\.0\.2:1970/,
+ qr/check resolve: \S+:1970 of upstream test is now at 127\.0\.0\.1:1970/]
+
+=== TEST 19: a balancer not patched skips the servers down
+--- http_config eval
+$::Backends . q{
+    upstream test{
+        least_conn;
+
+        server 127.0.0.1:1970;
+        server 127.0.0.1:1971;
+        server 127.0.0.1:1973;
+
+        check interval=500 rise=1 fall=1 timeout=1000 type=http;
+    }
+}
+--- config
+    location / {
+        proxy_pass http://test;
+        proxy_next_upstream off;
+    }
+
+--- init
+# without the check the dead servers would take their turns and fail
+Test::More::is(join('', map { ::fetch('/') } 1 .. 6), "1970\n" x 6,
+               "wrap - every request goes to the server up");
+--- request
+GET /
+--- response_body_like: ^1970$
+
+=== TEST 20: the backup serves until the primary stayed up for the delay
+--- http_config eval
+$::Backends . q{
+    upstream test{
+        server 127.0.0.1:1973;
+        server 127.0.0.1:1970 backup;
+
+        check interval=500 rise=1 fall=1 timeout=1000 type=http;
+        check_failback delay=4000 up=1;
+    }
+}
+--- config
+    location / {
+        proxy_pass http://test;
+    }
+
+    location /status {
+        check_status;
+    }
+
+--- init
+Test::More::is(::fetch('/'), "1970\n",
+               "failback - the backup serves while the primary is down");
+
+# the primary answers with an empty body
+my $primary = ::backend(1973, 200);
+sleep 1.5;
+
+Test::More::is(::fetch('/'), "1970\n",
+               "failback - the primary up waits for the delay");
+
+Test::More::like(::fetch('/status'), qr{<td>backup, failing back</td>},
+                 "failback - the status page shows the upstream failing back");
+sleep 4;
+
+Test::More::is(::fetch('/'), '',
+               "failback - the primary serves again after the delay");
+
+::stop($primary);
+--- request
+GET /status
+--- response_body_like: <td>test</td>\s*<td>\d+</td>\s*<td>1</td>
+--- error_log
+upstream "test" fails back to its primary servers
+
+=== TEST 21: the requests keep to the servers of the local zone
+--- http_config eval
+$::Backends . q{
+    server {
+        listen 127.0.0.2:1972;
+
+        location / {
+            return 200 "remote\n";
+        }
+    }
+
+    check_zone local 127.0.0.1/32;
+    check_zone remote 127.0.0.2/32;
+    check_local_zone local healthy=50;
+
+    upstream test{
+        server 127.0.0.1:1970;
+        server 127.0.0.1:1971;
+        server 127.0.0.2:1972;
+
+        check interval=500 rise=1 fall=1 timeout=1000 type=http;
+    }
+}
+--- config
+    location / {
+        proxy_pass http://test;
+    }
+
+    location /status {
+        check_status;
+    }
+
+--- init
+# half of the local servers are up, as healthy as the zone needs to be
+Test::More::is(join('', map { ::fetch('/') } 1 .. 6), "1970\n" x 6,
+               "zone - the requests keep to the local server up");
+--- request
+GET /status
+--- response_body_like: <td>local \(local\)</td>\s*<td>1/2</td>.*<td>remote</td>\s*<td>1/1</td>
+
+=== TEST 22: the requests of check_warmup are replayed before the server is up
+--- user_files
+>>> warmup.txt
+# primed before the server takes traffic
+/index.html
+POST /cache/prime
+--- http_config
+    upstream test{
+        server 127.0.0.1:1973;
+
+        check interval=500 rise=1 fall=1 timeout=1000 type=http;
+        check_warmup ../html/warmup.txt requests=4 interval=500;
+    }
+
+--- config
+    location /status {
+        check_status;
+    }
+
+--- init
+my $backend = ::backend(1973, 200);
+sleep 1.5;
+
+Test::More::like(::fetch('/status'),
+                 qr{<td>127\.0\.0\.1:1973</td>\s*<td>warmup</td>},
+                 "warmup - the server is not up while it is warmed up");
+sleep 3;
+
+Test::More::like(::fetch('/status'),
+                 qr{<td>127\.0\.0\.1:1973</td>\s*<td>up</td>},
+                 "warmup - the server is up once warmed up");
+
+# the probes send "GET / HTTP/1.0"
+Test::More::is(join('', grep { !m{^GET / } } ::requests(1973)),
+               "GET /index.html HTTP/1.0\nPOST /cache/prime HTTP/1.0\n" x 2,
+               "warmup - the requests of the file are replayed in turn");
+
+::stop($backend);
+--- request
+GET /status
+--- response_body_like: <td>127\.0\.0\.1:1973</td>
+
+=== TEST 23: check_probe_budget probes the busy server more than the idle one
+--- http_config
+    check_probe_budget 5 min=500 max=10000;
+
+    upstream busy{
+        server 127.0.0.1:1971;
+
+        check interval=500 rise=1 fall=1 timeout=1000 type=http;
+    }
+
+    upstream idle{
+        server 127.0.0.1:1973;
+
+        check interval=500 rise=1 fall=1 timeout=1000 type=http;
+    }
+
+--- config
+    location /busy {
+        proxy_pass http://busy;
+    }
+
+    location /status {
+        check_status;
+    }
+
+--- init
+my @backends = (::backend(1971, 200), ::backend(1973, 200));
+sleep 1;
+
+for (1 .. 20) {
+    ::fetch('/busy');
+    sleep 0.1;
+}
+
+# the probes send "GET / HTTP/1.0", the requests "GET /busy HTTP/1.0"
+my $probes = sub { scalar grep { m{^GET / } } ::requests($_[0]) };
+my ($busy, $idle) = ($probes->(1971), $probes->(1973));
+sleep 4;
+
+Test::More::ok($probes->(1971) - $busy >= 5,
+               "budget - the busy server is probed in the min interval");
+Test::More::ok($probes->(1973) - $idle <= 1,
+               "budget - the idle server is probed in the max interval");
+
+::stop($_) for @backends;
+--- request
+GET /status
+--- response_body_like: <td>127\.0\.0\.1:1971</td>\s*<td>\d+\.\d+</td>\s*<td>500</td>.*<td>127\.0\.0\.1:1973</td>\s*<td>0\.000</td>\s*<td>10000</td>
+
+=== TEST 24: check_probe_budget shares a rate too small for the max interval
+--- http_config eval
+$::Backends . q{
+    check_probe_budget 1 max=2000;
+
+    upstream test{
+        server 127.0.0.1:1970;
+        server 127.0.0.1:1971;
+        server 127.0.0.1:1972;
+        server 127.0.0.1:1973;
+
+        check interval=500 rise=1 fall=1 timeout=1000 type=http;
+    }
+}
+--- config
+    location /status {
+        check_status;
+    }
+
+--- request
+GET /status
+--- response_body_like: <td>127\.0\.0\.1:1970</td>\s*<td>0\.000</td>\s*<td>4000</td>.*<td>127\.0\.0\.1:1973</td>\s*<td>0\.000</td>\s*<td>4000</td>
+
+=== TEST 25: the socket calls of the probes are counted
+--- http_config eval
+$::Backends . q{
+    upstream test{
+        server 127.0.0.1:1970;
+
+        check interval=500 rise=1 fall=1 timeout=1000 type=http;
+    }
+}
+--- config
+    location /status {
+        check_status;
+    }
+
+--- init
+my $usage = sub {
+    ::fetch('/status') =~ m{<td>http</td>\s*<td>(\d+)</td>\s*<td>[^<]*</td>\s*<td>[\d.]+</td>\s*<td>(\d+)</td>}
+        or return (0, 0);
+    return ($1, $2);
+};
+
+my ($probes, $syscalls) = $usage->();
+sleep 2;
+my ($more_probes, $more_syscalls) = $usage->();
+
+# a connect, a send, a read or two and a close, some of a probe in flight
+# may fall on either side
+Test::More::ok($more_probes > $probes
+               && $more_syscalls - $syscalls >= 4 * ($more_probes - $probes),
+               "usage - every probe counts its socket calls");
+--- request
+GET /status
+--- response_body_like: <td>test</td>\s*<td>[1-9]\d*</td>\s*<td>\d+\.\d{3}</td>\s*<td>[1-9]\d*</td>
+